@@ -0,0 +1,365 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "animate.h"
+#include "parser.h"
+#include "spec.h"
+#include "raycast.h"
+#include "workpool.h"
+#include "pixelbuf.h"
+#include "ppmwrite.h"
+#include "vecmath.h"
+#include "util.h"
+
+#define MAX_OUTPUT_PATH_LEN 4096
+
+struct Keyframe {
+  double time;
+  Vec position;
+  Vec facing;
+  Vec up;
+  double focal_length;
+};
+
+typedef struct Keyframe Keyframe;
+
+/* The keyframes for the camera (object NULL) or for one object, sorted by time. */
+struct Track {
+  ObjectRef object;
+  Keyframe *keys;
+  int key_count;
+};
+
+typedef struct Track Track;
+
+struct Animation {
+  Track *tracks;
+  int track_count;
+  double start_time;
+  double end_time;
+};
+
+typedef struct Animation Animation;
+typedef struct Animation* AnimationRef;
+
+static bool load_animation(char*, RenderSceneRef, AnimationRef);
+static bool add_camera_key(AnimationRef, SpecRef, CameraRef);
+static bool add_object_key(AnimationRef, SpecRef, ObjectRef*);
+static ObjectRef find_keyed_object(SpecRef, ObjectRef*);
+static Track* find_or_add_track(AnimationRef, ObjectRef);
+static bool append_key(Track*, Keyframe*);
+static int compare_keys(const void*, const void*);
+static void interpolate_track(Track*, double, Keyframe*);
+static bool pose_frame(AnimationRef, RenderSceneRef, int, int, bool*);
+static void report_reuse(HitBufferRef, int);
+static bool write_frame(AnimationRequest*, int, uint8_t*);
+static void destroy_animation(AnimationRef);
+
+/* Loads the scene once and renders every frame from it, posing the camera and objects in place
+ * between frames. Returns EXIT_FAILURE after reporting the first failure. */
+int run_animation(AnimationRequest *req) {
+  clear_error();
+  Animation animation = {0};
+  RenderSceneRef render_scene = NULL;
+  WorkPoolRef pool = NULL;
+  uint8_t *byte_buf = NULL;
+  PixelBufRef pixel_buf = NULL;
+  HitBufferRef hits = NULL;
+  HitBufferRef previous_hits = NULL;
+  HitBufferRef reprojected_hits = NULL;
+
+  Scene scene = parse_scene_from_file(req->scene_path);
+  if(NULL != scene) {
+    render_scene = new_render_scene(scene);
+    destroy_scene(scene);
+  }
+  bool ok = NULL != render_scene && load_animation(req->animation_path, render_scene, &animation);
+  if(ok && !path_has_frame_number(req->output_path) && NULL != strchr(req->output_path, '%')) {
+    set_error(RC_ERR_ARGUMENT, "The output path may hold only one frame number conversion, such as %%04d");
+    ok = false;
+  }
+  if(ok) {
+    pool = new_work_pool(req->thread_count);
+    byte_buf = checked_malloc((size_t) req->width * req->height * 3);
+    pixel_buf = NULL == byte_buf ? NULL : new_pixel_buf_over(byte_buf, req->width, req->height);
+    ok = NULL != pool && NULL != pixel_buf;
+  }
+  if(ok && req->temporal) {
+    hits = new_hit_buffer(req->width, req->height);
+    previous_hits = new_hit_buffer(req->width, req->height);
+    reprojected_hits = new_hit_buffer(req->width, req->height);
+    ok = NULL != hits && NULL != previous_hits && NULL != reprojected_hits;
+  }
+
+  for(int frame = 0; ok && frame < req->frame_count; frame++) {
+    bool objects_moved = false;
+    ok = pose_frame(&animation, render_scene, frame, req->frame_count, &objects_moved);
+    if(!ok) break;
+
+    RenderJob job = {.scene = render_scene, .width = req->width, .height = req->height, .rows = req->height,
+		     .hits_out = hits};
+    if(req->temporal && frame > 0 && !objects_moved) {
+      reproject_hits(previous_hits, &job, reprojected_hits);
+      job.reuse_from = reprojected_hits;
+    }
+    ok = raycast_job_into(&job, pool, pixel_buf) && write_frame(req, frame, byte_buf);
+    if(req->temporal) {
+      report_reuse(hits, frame);
+      HitBufferRef swap = previous_hits;
+      previous_hits = hits;
+      hits = swap;
+    }
+  }
+
+  if(!ok) fprintf(stderr, "Error: %s\n", last_error_message());
+  destroy_hit_buffer(hits);
+  destroy_hit_buffer(previous_hits);
+  destroy_hit_buffer(reprojected_hits);
+  destroy_pixel_buf(pixel_buf);
+  free(byte_buf);
+  destroy_work_pool(pool);
+  destroy_animation(&animation);
+  destroy_render_scene(render_scene);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+static bool load_animation(char *animation_path, RenderSceneRef render_scene, AnimationRef animation) {
+  Scene keys = parse_scene_from_file(animation_path);
+  if(NULL == keys) return false;
+
+  bool ok = true;
+  SpecRef spec = NULL;
+  while(ok && NULL != (spec = next_spec_declaring_kind(keys, "camera_key"))) {
+    ok = add_camera_key(animation, spec, render_scene->camera);
+    destroy_spec(spec);
+  }
+  while(ok && NULL != (spec = next_spec_declaring_kind(keys, "object_key"))) {
+    ok = add_object_key(animation, spec, render_scene->objects);
+    destroy_spec(spec);
+  }
+  destroy_scene(keys);
+  if(!ok) return false;
+
+  if(0 == animation->track_count) {
+    set_error(RC_ERR_SCENE, "The animation file has no keyframes");
+    return false;
+  }
+  animation->start_time = INFINITY;
+  animation->end_time = -INFINITY;
+  for(int i = 0; i < animation->track_count; i++) {
+    Track *track = &animation->tracks[i];
+    qsort(track->keys, track->key_count, sizeof(*(track->keys)), compare_keys);
+    animation->start_time = fmin(animation->start_time, track->keys[0].time);
+    animation->end_time = fmax(animation->end_time, track->keys[track->key_count - 1].time);
+  }
+  return true;
+}
+
+
+/* Fields the keyframe leaves out keep the scene camera's values. */
+static bool add_camera_key(AnimationRef animation, SpecRef spec, CameraRef c) {
+  Keyframe key = {0};
+  key.time = next_scalar_field_value_with_name(spec, "time");
+  if(NO_SCALAR == key.time) {
+    set_error(RC_ERR_SCENE, "Camera keyframe has no time");
+    return false;
+  }
+  char *names[] = {"position", "facing", "up"};
+  double *defaults[] = {c->position, c->facing, c->up};
+  double *values[] = {key.position, key.facing, key.up};
+  for(int i = 0; i < 3; i++) {
+    double *value = next_vector_field_value_with_name(spec, names[i]);
+    vec_copy(NULL == value ? defaults[i] : value, values[i]);
+    free(value);
+  }
+  key.focal_length = next_scalar_field_value_with_name(spec, "focal_length");
+  if(NO_SCALAR == key.focal_length) {
+    key.focal_length = c->focal_length;
+  } else if(0 >= key.focal_length) {
+    set_error(RC_ERR_SCENE, "The camera keyframe focal length must be a positive real value");
+    return false;
+  }
+
+  Track *track = find_or_add_track(animation, NULL);
+  return NULL != track && append_key(track, &key);
+}
+
+
+static bool add_object_key(AnimationRef animation, SpecRef spec, ObjectRef *objects) {
+  Keyframe key = {0};
+  key.time = next_scalar_field_value_with_name(spec, "time");
+  if(NO_SCALAR == key.time) {
+    set_error(RC_ERR_SCENE, "Object keyframe has no time");
+    return false;
+  }
+  double *position = next_vector_field_value_with_name(spec, "position");
+  if(NULL == position) {
+    set_error(RC_ERR_SCENE, "Object keyframe has no position");
+    return false;
+  }
+  vec_copy(position, key.position);
+  free(position);
+
+  ObjectRef object = find_keyed_object(spec, objects);
+  if(NULL == object) return false;
+  Track *track = find_or_add_track(animation, object);
+  return NULL != track && append_key(track, &key);
+}
+
+
+/* Objects of each kind appear in the object list in the order of the scene file. */
+static ObjectRef find_keyed_object(SpecRef spec, ObjectRef *objects) {
+  enum ObjectKind kind = Sphere;
+  double index = next_scalar_field_value_with_name(spec, "sphere");
+  if(NO_SCALAR == index) {
+    kind = Plane;
+    index = next_scalar_field_value_with_name(spec, "plane");
+  }
+  if(NO_SCALAR == index) {
+    set_error(RC_ERR_SCENE, "Object keyframe must name a sphere or a plane");
+    return NULL;
+  }
+
+  int remaining = (int) index;
+  for(int i = 0; remaining >= 0 && NULL != objects[i]; i++) {
+    if(objects[i]->kind == kind && 0 == remaining--) return objects[i];
+  }
+  set_error(RC_ERR_SCENE, "Object keyframe names %s %g, which is not in the scene",
+	    kind == Sphere ? "sphere" : "plane", index);
+  return NULL;
+}
+
+
+static Track* find_or_add_track(AnimationRef animation, ObjectRef object) {
+  for(int i = 0; i < animation->track_count; i++) {
+    if(animation->tracks[i].object == object) return &animation->tracks[i];
+  }
+  Track *tracks = realloc(animation->tracks, (animation->track_count + 1) * sizeof(*tracks));
+  if(NULL == tracks) {
+    set_error(RC_ERR_NO_MEMORY, "Could not allocate memory");
+    return NULL;
+  }
+  animation->tracks = tracks;
+  Track *track = &tracks[animation->track_count++];
+  Track zero_track = {0};
+  *track = zero_track;
+  track->object = object;
+  return track;
+}
+
+
+static bool append_key(Track *track, Keyframe *key) {
+  Keyframe *keys = realloc(track->keys, (track->key_count + 1) * sizeof(*keys));
+  if(NULL == keys) {
+    set_error(RC_ERR_NO_MEMORY, "Could not allocate memory");
+    return false;
+  }
+  track->keys = keys;
+  track->keys[track->key_count++] = *key;
+  return true;
+}
+
+
+static int compare_keys(const void *a, const void *b) {
+  double time_a = ((const Keyframe*) a)->time;
+  double time_b = ((const Keyframe*) b)->time;
+  return (time_a > time_b) - (time_a < time_b);
+}
+
+
+static void interpolate_track(Track *track, double time, Keyframe *out) {
+  Keyframe *keys = track->keys;
+  int last = track->key_count - 1;
+  if(time <= keys[0].time) {
+    *out = keys[0];
+    return;
+  }
+  if(time >= keys[last].time) {
+    *out = keys[last];
+    return;
+  }
+
+  int k = 0;
+  while(keys[k + 1].time < time) k++;
+  Keyframe *a = &keys[k];
+  Keyframe *b = &keys[k + 1];
+  double s = (time - a->time) / (b->time - a->time);
+  out->time = time;
+  for(int i = 0; i < 3; i++) {
+    out->position[i] = a->position[i] + s * (b->position[i] - a->position[i]);
+    out->facing[i] = a->facing[i] + s * (b->facing[i] - a->facing[i]);
+    out->up[i] = a->up[i] + s * (b->up[i] - a->up[i]);
+  }
+  out->focal_length = a->focal_length + s * (b->focal_length - a->focal_length);
+}
+
+
+/* Moves the camera and keyed objects to where they are at the given frame, noting whether any
+ * object has moved since the last frame. */
+static bool pose_frame(AnimationRef animation, RenderSceneRef render_scene, int frame, int frame_count,
+		       bool *objects_moved) {
+  double s = frame_count > 1 ? (double) frame / (frame_count - 1) : 0.0;
+  double time = animation->start_time + s * (animation->end_time - animation->start_time);
+  for(int i = 0; i < animation->track_count; i++) {
+    Track *track = &animation->tracks[i];
+    Keyframe key;
+    interpolate_track(track, time, &key);
+    if(NULL != track->object) {
+      double *position = Sphere == track->object->kind ?
+	track->object->sphere.position : track->object->plane.position;
+      if(0 != memcmp(position, key.position, sizeof(key.position))) *objects_moved = true;
+      vec_copy(key.position, position);
+      continue;
+    }
+
+    CameraRef c = render_scene->camera;
+    Vec across = {0.0};
+    vec_cross(key.facing, key.up, across);
+    if(0 == vec_magnitude(key.facing) || 0 == vec_magnitude(key.up) || 0 == vec_magnitude(across)) {
+      set_error(RC_ERR_SCENE, "The camera facing and up vectors are parallel at frame %d", frame);
+      return false;
+    }
+    vec_copy(key.position, c->position);
+    vec_normalize(key.facing, c->facing);
+    vec_normalize(key.up, c->up);
+    c->focal_length = key.focal_length;
+  }
+  return true;
+}
+
+
+static void report_reuse(HitBufferRef hits, int frame) {
+  int hit_count = 0;
+  int reused_count = 0;
+  for(int i = 0; i < hits->width * hits->rows; i++) {
+    if(NULL == hits->hits[i].object) continue;
+    hit_count++;
+    if(hits->hits[i].reused) reused_count++;
+  }
+  fprintf(stderr, "NOTICE: Frame %d reused the shading of %d of %d pixels (%.1f%%)\n", frame, reused_count,
+	  hit_count, 0 == hit_count ? 0.0 : 100.0 * reused_count / hit_count);
+}
+
+
+static bool write_frame(AnimationRequest *req, int frame, uint8_t *byte_buf) {
+  if(!path_has_frame_number(req->output_path)) {
+    return (0 == frame ? ppm_write : ppm_append)(req->output_path, '6', byte_buf, req->width, req->height);
+  }
+  char path[MAX_OUTPUT_PATH_LEN];
+  if((int) sizeof(path) <= snprintf(path, sizeof(path), req->output_path, frame)) {
+    set_error(RC_ERR_ARGUMENT, "The output path is too long");
+    return false;
+  }
+  return ppm_write(path, '3', byte_buf, req->width, req->height);
+}
+
+
+static void destroy_animation(AnimationRef animation) {
+  for(int i = 0; i < animation->track_count; i++) {
+    free(animation->tracks[i].keys);
+  }
+  free(animation->tracks);
+}
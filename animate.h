@@ -0,0 +1,39 @@
+#ifndef ANIMATE_HEADER
+#define ANIMATE_HEADER 1
+
+#include <stdbool.h>
+
+/* An animation file uses the scene file syntax and holds two kinds of keyframe:
+ *
+ *   {"type": "camera_key", "time": t, "position": [..], "facing": [..], "up": [..],
+ *    "focal_length": f}
+ *   {"type": "object_key", "time": t, "sphere": index, "position": [..]}
+ *
+ * Every camera_key field but "time" is optional and defaults to the scene camera's value. An
+ * object_key names its object by kind ("sphere" or "plane") and by its index, from 0, among the
+ * objects of that kind in the scene file. Values are interpolated linearly between keyframes, with
+ * facing and up renormalized; before the first and after the last keyframe they hold still.
+ *
+ * The frames are spaced evenly from the earliest keyframe to the latest. If the output path holds
+ * a frame number conversion such as %04d, each frame is written to its own numbered plain PPM;
+ * otherwise all of the frames are written, one after another, to that one file as binary PPMs.
+ *
+ * In temporal mode each frame reprojects the previous frame's primary hits into the new camera and
+ * reuses their shading wherever the same surface is hit from nearly the same direction, so the
+ * frames are an approximation. Frames in which an object moves are shaded in full. */
+struct AnimationRequest {
+  char *animation_path;
+  char *scene_path;
+  char *output_path;
+  int frame_count;
+  int width;
+  int height;
+  int thread_count;
+  bool temporal;
+};
+
+typedef struct AnimationRequest AnimationRequest;
+
+int run_animation(AnimationRequest*);
+
+#endif
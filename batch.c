@@ -0,0 +1,321 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include "batch.h"
+#include "parser.h"
+#include "object.h"
+#include "raycast.h"
+#include "workpool.h"
+#include "pixelbuf.h"
+#include "ppmwrite.h"
+#include "util.h"
+
+#define MAX_IMAGE_DIMENSION 65536
+#define MAX_FAILURE_LEN 512
+
+struct BatchScene {
+  char *path;
+  RenderSceneRef render_scene;
+  char *key;
+  size_t key_len;
+  char failure[MAX_FAILURE_LEN];
+};
+
+typedef struct BatchScene BatchScene;
+
+struct BatchJob {
+  int line_num;
+  int scene_index;
+  int width;
+  int height;
+  char *output_path;
+  bool failed;
+  bool cached;
+  char failure[MAX_FAILURE_LEN];
+  double ms;
+};
+
+typedef struct BatchJob BatchJob;
+
+struct Batch {
+  BatchScene *scenes;
+  int scene_count;
+  BatchJob *jobs;
+  int job_count;
+  int *small_jobs;
+  int small_job_count;
+  WorkPoolRef pool;
+  RenderCacheRef cache;
+};
+
+typedef struct Batch Batch;
+typedef struct Batch* BatchRef;
+
+static bool read_manifest(char*, BatchRef);
+static bool add_job(BatchRef, char*, int);
+static int find_or_add_scene(BatchRef, char*);
+static void load_scene_task(void*, int);
+static void render_small_job_task(void*, int);
+static void render_job(BatchRef, BatchJob*, WorkPoolRef);
+static void fail_job(BatchJob*, const char*);
+static void report(BatchRef);
+static void destroy_batch(BatchRef);
+
+/* Renders every job in the manifest, taking those already in the cache (which may be NULL) from
+ * there. A job that fails is reported and the batch carries on; the return value is EXIT_FAILURE if
+ * the manifest could not be read or any job failed. */
+int run_batch(char *manifest_path, int thread_count, RenderCacheRef cache) {
+  Batch batch = {0};
+  batch.cache = cache;
+  if(!read_manifest(manifest_path, &batch)) {
+    fprintf(stderr, "Error: %s\n", last_error_message());
+    destroy_batch(&batch);
+    return EXIT_FAILURE;
+  }
+  batch.pool = new_work_pool(thread_count);
+  if(NULL == batch.pool) {
+    fprintf(stderr, "Error: %s\n", last_error_message());
+    destroy_batch(&batch);
+    return EXIT_FAILURE;
+  }
+
+  work_pool_run(batch.pool, load_scene_task, &batch, batch.scene_count);
+
+  batch.small_jobs = checked_malloc((batch.job_count + 1) * sizeof(*(batch.small_jobs)));
+  if(NULL == batch.small_jobs) {
+    fprintf(stderr, "Error: %s\n", last_error_message());
+    destroy_batch(&batch);
+    return EXIT_FAILURE;
+  }
+  for(int i = 0; i < batch.job_count; i++) {
+    BatchJob *job = &batch.jobs[i];
+    if(job->failed) continue;
+    if((long) job->width * job->height <= BATCH_SMALL_JOB_PIXELS) {
+      batch.small_jobs[batch.small_job_count++] = i;
+    }
+  }
+  work_pool_run(batch.pool, render_small_job_task, &batch, batch.small_job_count);
+  for(int i = 0; i < batch.job_count; i++) {
+    BatchJob *job = &batch.jobs[i];
+    if(!job->failed && (long) job->width * job->height > BATCH_SMALL_JOB_PIXELS) {
+      render_job(&batch, job, batch.pool);
+    }
+  }
+
+  report(&batch);
+  int status = EXIT_SUCCESS;
+  for(int i = 0; i < batch.job_count; i++) {
+    if(batch.jobs[i].failed) status = EXIT_FAILURE;
+  }
+  destroy_batch(&batch);
+  return status;
+}
+
+
+/* Malformed lines become failed jobs rather than stopping the batch. */
+static bool read_manifest(char *manifest_path, BatchRef batch) {
+  clear_error();
+  FILE *manifest = fopen(manifest_path, "r");
+  if(NULL == manifest) {
+    set_error(RC_ERR_IO, "Could not open manifest \"%s\"", manifest_path);
+    return false;
+  }
+
+  bool ok = true;
+  char *line = NULL;
+  size_t line_cap = 0;
+  int line_num = 0;
+  while(ok && 0 < getline(&line, &line_cap, manifest)) {
+    line_num++;
+    char *start = line + strspn(line, " \t\r\n");
+    if('\0' == *start || '#' == *start) continue;
+    ok = add_job(batch, start, line_num);
+  }
+
+  free(line);
+  fclose(manifest);
+  return ok;
+}
+
+
+/* Returns false only when memory runs out. */
+static bool add_job(BatchRef batch, char *line, int line_num) {
+  if(0 == (batch->job_count & (batch->job_count - 1))) {
+    int capacity = 0 == batch->job_count ? 1 : batch->job_count * 2;
+    BatchJob *jobs = realloc(batch->jobs, capacity * sizeof(*jobs));
+    if(NULL == jobs) {
+      set_error(RC_ERR_NO_MEMORY, "Could not allocate memory");
+      return false;
+    }
+    batch->jobs = jobs;
+  }
+  BatchJob *job = &batch->jobs[batch->job_count++];
+  BatchJob zero_job = {0};
+  *job = zero_job;
+  job->line_num = line_num;
+  job->scene_index = -1;
+
+  char scene_path[BATCH_MAX_LINE_LEN];
+  char output_path[BATCH_MAX_LINE_LEN];
+  char extra[2];
+  if(4 != sscanf(line, "%8191s %d %d %8191s %1s", scene_path, &job->width, &job->height, output_path, extra)) {
+    fail_job(job, "Expected input_file.json width height output_file.ppm");
+    return true;
+  }
+  if(job->width <= 0 || job->height <= 0 || job->width > MAX_IMAGE_DIMENSION || job->height > MAX_IMAGE_DIMENSION) {
+    fail_job(job, "The dimensions must be positive integers no larger than 65536");
+    return true;
+  }
+  job->output_path = strdup(output_path);
+  job->scene_index = find_or_add_scene(batch, scene_path);
+  if(NULL == job->output_path || job->scene_index < 0) {
+    set_error(RC_ERR_NO_MEMORY, "Could not allocate memory");
+    return false;
+  }
+  return true;
+}
+
+
+/* Manifests tend to list the jobs for a scene together, so the search starts from the most recently
+ * added scene. */
+static int find_or_add_scene(BatchRef batch, char *path) {
+  for(int i = batch->scene_count - 1; i >= 0; i--) {
+    if(0 == strcmp(batch->scenes[i].path, path)) return i;
+  }
+  if(0 == (batch->scene_count & (batch->scene_count - 1))) {
+    int capacity = 0 == batch->scene_count ? 1 : batch->scene_count * 2;
+    BatchScene *scenes = realloc(batch->scenes, capacity * sizeof(*scenes));
+    if(NULL == scenes) return -1;
+    batch->scenes = scenes;
+  }
+  BatchScene *scene = &batch->scenes[batch->scene_count];
+  BatchScene zero_scene = {0};
+  *scene = zero_scene;
+  scene->path = strdup(path);
+  if(NULL == scene->path) return -1;
+  return batch->scene_count++;
+}
+
+
+static void load_scene_task(void *arg, int task) {
+  BatchRef batch = arg;
+  BatchScene *scene = &batch->scenes[task];
+  clear_error();
+  Scene parsed = parse_scene_from_file(scene->path);
+  if(NULL != parsed) {
+    // The key must be taken first: building the render scene consumes the specs
+    if(NULL != batch->cache) scene->key = scene_cache_key(parsed, &scene->key_len);
+    if(!error_occurred()) scene->render_scene = new_render_scene(parsed);
+    destroy_scene(parsed);
+  }
+  if(NULL == scene->render_scene) {
+    snprintf(scene->failure, sizeof(scene->failure), "%s", last_error_message());
+  }
+}
+
+
+static void render_small_job_task(void *arg, int task) {
+  BatchRef batch = arg;
+  render_job(batch, &batch->jobs[batch->small_jobs[task]], NULL);
+}
+
+
+static void render_job(BatchRef batch, BatchJob *job, WorkPoolRef pool) {
+  clear_error();
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  BatchScene *scene = &batch->scenes[job->scene_index];
+  if(NULL == scene->render_scene) {
+    fail_job(job, scene->failure);
+    return;
+  }
+  size_t key_len = 0;
+  char *key = NULL;
+  if(NULL != batch->cache) {
+    key = render_cache_key(scene->key, scene->key_len, job->width, job->height, 0, job->height, "P3", &key_len);
+    if(NULL == key) {
+      fail_job(job, last_error_message());
+      return;
+    }
+    if(render_cache_fetch(batch->cache, key, key_len, job->output_path)) {
+      free(key);
+      job->cached = true;
+      job->ms = elapsed_ms(&start);
+      return;
+    }
+  }
+
+  size_t byte_count = (size_t) job->width * job->height * 3;
+  uint8_t *byte_buf = checked_malloc(byte_count);
+  PixelBufRef pixel_buf = NULL == byte_buf ? NULL : new_pixel_buf_over(byte_buf, job->width, job->height);
+  if(NULL == pixel_buf) {
+    free(byte_buf);
+    free(key);
+    fail_job(job, last_error_message());
+    return;
+  }
+  RenderJob render_job = {.scene = scene->render_scene, .width = job->width, .height = job->height,
+			  .rows = job->height};
+  bool rendered = raycast_job_into(&render_job, pool, pixel_buf);
+  destroy_pixel_buf(pixel_buf);
+
+  if(rendered) {
+    ppm_write(job->output_path, '3', byte_buf, job->width, job->height);
+  }
+  free(byte_buf);
+  if(!rendered || error_occurred()) {
+    free(key);
+    fail_job(job, last_error_message());
+    return;
+  }
+  if(NULL != key) {
+    render_cache_store(batch->cache, key, key_len, job->output_path);
+    free(key);
+  }
+  job->ms = elapsed_ms(&start);
+}
+
+
+static void fail_job(BatchJob *job, const char *message) {
+  job->failed = true;
+  snprintf(job->failure, sizeof(job->failure), "%s", message);
+}
+
+
+/* One line per job in manifest order, then a summary. */
+static void report(BatchRef batch) {
+  int failed_count = 0;
+  for(int i = 0; i < batch->job_count; i++) {
+    BatchJob *job = &batch->jobs[i];
+    if(job->failed) {
+      failed_count++;
+      printf("FAILED line %d %s: %s\n", job->line_num,
+	     NULL == job->output_path ? "-" : job->output_path, job->failure);
+    } else {
+      printf("OK line %d %s %.3f%s\n", job->line_num, job->output_path, job->ms, job->cached ? " cached" : "");
+    }
+  }
+  printf("%d jobs, %d scenes, %d failed\n", batch->job_count, batch->scene_count, failed_count);
+  fflush(stdout);
+  if(NULL != batch->cache) report_render_cache(batch->cache);
+}
+
+
+static void destroy_batch(BatchRef batch) {
+  for(int i = 0; i < batch->scene_count; i++) {
+    free(batch->scenes[i].path);
+    free(batch->scenes[i].key);
+    destroy_render_scene(batch->scenes[i].render_scene);
+  }
+  for(int i = 0; i < batch->job_count; i++) {
+    free(batch->jobs[i].output_path);
+  }
+  free(batch->scenes);
+  free(batch->jobs);
+  free(batch->small_jobs);
+  destroy_work_pool(batch->pool);
+}
@@ -0,0 +1,20 @@
+#ifndef BATCH_HEADER
+#define BATCH_HEADER 1
+
+#include "rendercache.h"
+
+/* A batch manifest lists one render job per line:
+ *
+ *   input_file.json width height output_file.ppm
+ *
+ * Blank lines and lines starting with '#' are ignored, and paths may not contain whitespace. Each
+ * distinct scene file is parsed once however many jobs use it. */
+#define BATCH_MAX_LINE_LEN 8192
+
+/* Images with no more pixels than this are rendered whole by a single thread, many at once; larger
+ * ones are rendered one at a time with their rows spread over every thread. */
+#define BATCH_SMALL_JOB_PIXELS (256 * 256)
+
+int run_batch(char*, int, RenderCacheRef);
+
+#endif
@@ -0,0 +1,312 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "parser.h"
+#include "spec.h"
+#include "raycast.h"
+#include "workpool.h"
+#include "pixelbuf.h"
+#include "ppmwrite.h"
+#include "util.h"
+
+#define MAX_SIZES 16
+#define DEFAULT_RUNS 5
+#define PHASE_COUNT 6
+
+/* Times every scene named on the command line at each image size, and prints the results as JSON on
+ * stdout. Each scene and size is measured in a process of its own, so that its peak resident set
+ * size is its own; the scene is loaded and rendered from scratch on every run. Progress goes to
+ * stderr. */
+
+enum Phase { Parse, Build, Render, Encode, Write, Total };
+
+/* One run's timings, in milliseconds, indexed by Phase. */
+struct RunTimes {
+  double ms[PHASE_COUNT];
+};
+
+typedef struct RunTimes RunTimes;
+
+static void parse_args(int, char**);
+static void usage_error(char*);
+static int parse_positive_option(char*, char*);
+static void parse_sizes_option(char*);
+static bool bench_scene(char*);
+static bool measure_scene(char*, int);
+static bool time_run(char*, int, WorkPoolRef, RunTimes*, RenderStatsRef);
+static void print_phase_stats(RunTimes*, int);
+static double percentile(double*, int, double);
+static int compare_doubles(const void*, const void*);
+static void print_json_string(const char*);
+static double now_ms(void);
+
+static const char *phase_names[PHASE_COUNT] = {"parse", "build", "render", "encode", "write", "total"};
+
+static int run_count = DEFAULT_RUNS;
+static int thread_count = 0;
+static int sizes[MAX_SIZES] = {128, 256, 512};
+static int size_count = 3;
+static char *label = "";
+static char *output_path = "bench_output.ppm";
+static char **scene_paths = NULL;
+static int scene_count = 0;
+
+int main(int argc, char *argv[]) {
+  parse_args(argc, argv);
+  printf("{\n\"label\": ");
+  print_json_string(label);
+  printf(",\n\"runs\": %d,\n\"results\": [", run_count);
+  bool ok = true;
+  for(int s = 0; s < scene_count; s++) {
+    ok = bench_scene(scene_paths[s]) && ok;
+  }
+  printf("\n]\n}\n");
+  unlink(output_path);
+  free(scene_paths);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+static void parse_args(int argc, char *argv[]) {
+  scene_paths = malloc(sizeof(*scene_paths) * argc);
+  if(NULL == scene_paths) usage_error("Could not allocate memory.");
+  for(int i = 1; i < argc; i++) {
+    if(0 == strncmp(argv[i], "--", 2) && i + 1 >= argc) usage_error("This option requires a value.");
+    if(0 == strcmp(argv[i], "--runs")) {
+      run_count = parse_positive_option(argv[++i], "The --runs option takes a positive integer.");
+    } else if(0 == strcmp(argv[i], "--threads")) {
+      thread_count = parse_positive_option(argv[++i], "The --threads option takes a positive integer.");
+    } else if(0 == strcmp(argv[i], "--sizes")) {
+      parse_sizes_option(argv[++i]);
+    } else if(0 == strcmp(argv[i], "--label")) {
+      label = argv[++i];
+    } else if(0 == strcmp(argv[i], "--output")) {
+      output_path = argv[++i];
+    } else if(0 == strncmp(argv[i], "--", 2)) {
+      usage_error("You supplied an unknown option.");
+    } else {
+      scene_paths[scene_count++] = argv[i];
+    }
+  }
+  if(0 == scene_count) usage_error("There is nothing to measure.");
+}
+
+
+static void usage_error(char *message) {
+  fprintf(stderr, "ERROR: %s\n", message);
+  fprintf(stderr, "ERROR: Correct usage is:\n");
+  fprintf(stderr, "ERROR: \traycast-bench [options] [input_file.json ...]\n");
+  fprintf(stderr, "ERROR: Options:\n");
+  fprintf(stderr, "ERROR: \t--runs count         render each scene and size count times (default: %d)\n",
+	  DEFAULT_RUNS);
+  fprintf(stderr, "ERROR: \t--threads count      render with count threads (default: one per processor)\n");
+  fprintf(stderr, "ERROR: \t--sizes a,b,...      render square images of these widths (default: 128,256,512)\n");
+  fprintf(stderr, "ERROR: \t--label text         name the version measured in the report\n");
+  fprintf(stderr, "ERROR: \t--output file.ppm    where to write each image (default: bench_output.ppm)\n");
+  exit(EXIT_FAILURE);
+}
+
+
+static int parse_positive_option(char *value, char *message) {
+  char *end = NULL;
+  long n = strtol(value, &end, 10);
+  if(end == value || '\0' != *end || n <= 0 || n > INT32_MAX) usage_error(message);
+  return (int) n;
+}
+
+
+static void parse_sizes_option(char *value) {
+  size_count = 0;
+  char *start = value;
+  while(size_count < MAX_SIZES) {
+    char *end = NULL;
+    long size = strtol(start, &end, 10);
+    if(end == start || size <= 0 || size > 65536 || (',' != *end && '\0' != *end)) {
+      usage_error("The --sizes option takes a comma separated list of positive integers.");
+    }
+    sizes[size_count++] = (int) size;
+    if('\0' == *end) return;
+    start = end + 1;
+  }
+  usage_error("The --sizes option takes at most 16 sizes.");
+}
+
+
+/* Measures the scene at every size, each in a child process that prints its own result, or whose
+ * failure is printed for it if it dies. Returns false if any of them failed. */
+static bool bench_scene(char *path) {
+  static bool first_result = true;
+  bool ok = true;
+  for(int s = 0; s < size_count; s++) {
+    fprintf(stderr, "NOTICE: Measuring %s at %dx%d\n", path, sizes[s], sizes[s]);
+    printf("%s\n", first_result ? "" : ",");
+    first_result = false;
+    fflush(stdout);
+    pid_t child = fork();
+    if(0 == child) {
+      bool measured = measure_scene(path, sizes[s]);
+      fflush(stdout);
+      _exit(measured ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    int status = 0;
+    bool exited = child > 0 && child == waitpid(child, &status, 0) && WIFEXITED(status);
+    if(exited) {
+      ok = EXIT_SUCCESS == WEXITSTATUS(status) && ok;
+    } else {
+      printf("{\"scene\": ");
+      print_json_string(path);
+      printf(", \"width\": %d, \"height\": %d, \"error\": \"The measuring process failed\"}", sizes[s], sizes[s]);
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+
+/* Prints the scene's result, or why it could not be measured, as one JSON object. Rays per second
+ * are worked out from the median render time. */
+static bool measure_scene(char *path, int size) {
+  clear_error();
+  RunTimes *runs = checked_malloc(sizeof(*runs) * run_count);
+  WorkPoolRef pool = NULL == runs ? NULL : new_work_pool(thread_count);
+  RenderStats stats = {0};
+  bool ok = NULL != pool;
+  for(int r = 0; ok && r < run_count; r++) {
+    ok = time_run(path, size, pool, &runs[r], 0 == r ? &stats : NULL);
+  }
+
+  printf("{\"scene\": ");
+  print_json_string(path);
+  printf(", \"width\": %d, \"height\": %d, \"threads\": %d", size, size, NULL == pool ? 0 : work_pool_size(pool));
+  if(!ok) {
+    printf(", \"error\": ");
+    print_json_string(last_error_message());
+    printf("}");
+    fprintf(stderr, "Error: %s: %s\n", path, last_error_message());
+  } else {
+    printf(",\n  \"phases_ms\": {");
+    print_phase_stats(runs, run_count);
+    double render_ms[run_count];
+    for(int r = 0; r < run_count; r++) {
+      render_ms[r] = runs[r].ms[Render];
+    }
+    double seconds = percentile(render_ms, run_count, 50) / 1000.0;
+    long rays[4] = {stats.primary_rays_traced, stats.shadow_rays_traced, stats.reflected_rays_traced,
+		    stats.refracted_rays_traced};
+    const char *ray_names[4] = {"primary", "shadow", "reflected", "refracted"};
+    long all_rays = 0;
+    printf("},\n  \"rays\": {");
+    for(int t = 0; t < 4; t++) {
+      printf("%s\"%s\": %ld", 0 == t ? "" : ", ", ray_names[t], rays[t]);
+      all_rays += rays[t];
+    }
+    printf(", \"all\": %ld},\n  \"rays_per_second\": {", all_rays);
+    for(int t = 0; t < 4; t++) {
+      printf("%s\"%s\": %.0f", 0 == t ? "" : ", ", ray_names[t], seconds > 0 ? rays[t] / seconds : 0.0);
+    }
+    printf(", \"all\": %.0f}", seconds > 0 ? all_rays / seconds : 0.0);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf(",\n  \"peak_rss_kb\": %ld}", usage.ru_maxrss);
+  }
+  destroy_work_pool(pool);
+  free(runs);
+  return ok;
+}
+
+
+/* Loads, renders and writes the scene once. stats may be NULL. */
+static bool time_run(char *path, int size, WorkPoolRef pool, RunTimes *times, RenderStatsRef stats) {
+  double start = now_ms();
+  Scene scene = parse_scene_from_file(path);
+  double parsed = now_ms();
+  RenderSceneRef render_scene = NULL == scene ? NULL : new_render_scene(scene);
+  if(NULL != scene) destroy_scene(scene);
+  double built = now_ms();
+  if(NULL == render_scene) return false;
+
+  RenderJob job = {.scene = render_scene, .width = size, .height = size, .rows = size, .stats = stats};
+  PixelBufRef pb = raycast_job(&job, pool);
+  double rendered = now_ms();
+  size_t len = 0;
+  char *text = NULL == pb || error_occurred() ? NULL : ppm_encode('3', get_byte_array(pb), size, size, &len);
+  double encoded = now_ms();
+  FILE *file = NULL == text ? NULL : fopen(output_path, "w");
+  bool ok = NULL != file && len == fwrite(text, 1, len, file);
+  if(NULL != file) ok = 0 == fclose(file) && ok;
+  if(NULL != text && !ok) set_error(RC_ERR_IO, "Could not write \"%s\"", output_path);
+  double written = now_ms();
+
+  times->ms[Parse] = parsed - start;
+  times->ms[Build] = built - parsed;
+  times->ms[Render] = rendered - built;
+  times->ms[Encode] = encoded - rendered;
+  times->ms[Write] = written - encoded;
+  times->ms[Total] = written - start;
+  free(text);
+  destroy_pixel_buf(pb);
+  destroy_render_scene(render_scene);
+  return ok;
+}
+
+
+static void print_phase_stats(RunTimes *runs, int count) {
+  double ms[count];
+  for(int p = 0; p < PHASE_COUNT; p++) {
+    for(int r = 0; r < count; r++) {
+      ms[r] = runs[r].ms[p];
+    }
+    double median = percentile(ms, count, 50);
+    double p10 = percentile(ms, count, 10);
+    double p90 = percentile(ms, count, 90);
+    printf("%s\n    \"%s\": {\"min\": %.3f, \"median\": %.3f, \"p10\": %.3f, \"p90\": %.3f, \"max\": %.3f}",
+	   0 == p ? "" : ",", phase_names[p], ms[0], median, p10, p90, ms[count - 1]);
+  }
+  printf("\n  ");
+}
+
+
+/* Interpolates linearly between the closest ranks, so the 50th percentile is the median. Sorts
+ * values. */
+static double percentile(double *values, int count, double p) {
+  qsort(values, count, sizeof(*values), compare_doubles);
+  double rank = p / 100.0 * (count - 1);
+  int below = (int) rank;
+  if(below >= count - 1) return values[count - 1];
+  return values[below] + (rank - below) * (values[below + 1] - values[below]);
+}
+
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double*) a;
+  double y = *(const double*) b;
+  return (x > y) - (x < y);
+}
+
+
+static void print_json_string(const char *s) {
+  putchar('"');
+  for(; '\0' != *s; s++) {
+    if('"' == *s || '\\' == *s) {
+      printf("\\%c", *s);
+    } else if((unsigned char) *s < 0x20) {
+      printf("\\u%04x", (unsigned char) *s);
+    } else {
+      putchar(*s);
+    }
+  }
+  putchar('"');
+}
+
+
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "vecmath.h"
+#include "vec4.h"
+
+#define COUNT 4096
+#define ROUNDS 2000
+
+/* Times the shading arithmetic of a reflected ray, done once with the out-parameter functions in
+ * vecmath.c and once with vec4.h, over the same inputs. The results must match bit for bit. */
+
+static double origins[COUNT][3];
+static double dirs[COUNT][3];
+static double normals[COUNT][3];
+static double lights[COUNT][3];
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static void fill(double v[3]) {
+  for(int i = 0; i < 3; i++) {
+    v[i] = 2.0 * rand() / RAND_MAX - 1.0;
+  }
+}
+
+
+static void bench_vecmath(double *out) {
+  for(int i = 0; i < COUNT; i++) {
+    Ray r;
+    vec_copy(origins[i], r.origin);
+    vec_normalize(dirs[i], r.dir);
+    Point p = {0.0};
+    point_on_ray_at_t(&r, 2.5, p);
+    Vec n = {0.0};
+    vec_normalize(normals[i], n);
+    Vec refl = {0.0};
+    vec_reflect(r.dir, n, refl);
+    Vec to_light = {0.0};
+    get_inter_point_normal_vector(p, lights[i], to_light);
+    Vec side = {0.0};
+    vec_cross(refl, to_light, side);
+    out[i] = vec_dot(refl, to_light) + vec_magnitude(side) + point_distance(p, lights[i]);
+  }
+}
+
+
+static void bench_vec4(double *out) {
+  for(int i = 0; i < COUNT; i++) {
+    Vec4 dir = v4_normalize(v4_load(dirs[i]));
+    Vec4 p = v4_ray_point(v4_load(origins[i]), dir, 2.5);
+    Vec4 n = v4_normalize(v4_load(normals[i]));
+    Vec4 refl = v4_reflect(dir, n);
+    Vec4 light = v4_load(lights[i]);
+    Vec4 to_light = v4_normalize(v4_sub(light, p));
+    Vec4 side = v4_cross(refl, to_light);
+    out[i] = v4_dot(refl, to_light) + v4_length(side) + v4_distance(p, light);
+  }
+}
+
+
+int main(void) {
+  static double expected[COUNT];
+  static double actual[COUNT];
+  srand(1);
+  for(int i = 0; i < COUNT; i++) {
+    fill(origins[i]);
+    fill(dirs[i]);
+    fill(normals[i]);
+    fill(lights[i]);
+  }
+
+  double start = now();
+  for(int round = 0; round < ROUNDS; round++) {
+    bench_vecmath(expected);
+  }
+  double vecmath_time = now() - start;
+  start = now();
+  for(int round = 0; round < ROUNDS; round++) {
+    bench_vec4(actual);
+  }
+  double vec4_time = now() - start;
+
+  printf("vecmath.c: %.3f s\n", vecmath_time);
+  printf("vec4.h:    %.3f s (%.2fx, %s)\n", vec4_time, vecmath_time / vec4_time, V4_INSTRUCTION_SET);
+  if(0 != memcmp(expected, actual, sizeof(expected))) {
+    printf("Results differ\n");
+    exit(EXIT_FAILURE);
+  }
+  printf("Results match\n");
+  exit(EXIT_SUCCESS);
+}
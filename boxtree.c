@@ -0,0 +1,372 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "boxtree.h"
+#include "object.h"
+#include "vecmath.h"
+#include "util.h"
+
+// Most items a leaf holds
+#define LEAF_SIZE 4
+// Bits given to each coordinate in the order the entries are sorted into
+#define CURVE_BITS 10
+// Deepest the tree can go: each split either uses up one of the 3 * CURVE_BITS bits of the codes or
+// halves the items
+#define MAX_DEPTH 64
+
+/* A leaf holds count items starting at first; any other node has a count of 0, its left child
+ * straight after it and its right child at first. */
+struct BoxTreeNode {
+  float lo[3];
+  float hi[3];
+  int first;
+  int count;
+};
+
+typedef struct BoxTreeNode BoxTreeNode;
+
+struct BoxTree {
+  int node_count;
+  BoxTreeNode *nodes;
+};
+
+typedef struct BoxTree BoxTree;
+
+/* An entry's place along the Morton curve, for sorting. */
+struct CurveKey {
+  uint32_t code;
+  int entry;
+};
+
+typedef struct CurveKey CurveKey;
+
+static int build_node(BoxTreeRef, BoxEntry*, uint32_t*, int, int);
+static int split_point(uint32_t*, int, int);
+static bool sort_along_curve(BoxEntry*, uint32_t*, int);
+static uint32_t spread_bits(uint32_t);
+static float entry_center(BoxEntry*, int);
+static float round_down(double);
+static float round_up(double);
+static inline double lesser(double, double);
+static inline double greater(double, double);
+static double box_entry(BoxTreeNode*, double*, double*);
+static bool box_contains(BoxTreeNode*, double*);
+
+
+void set_box_entry(BoxEntry *entry, double *lo, double *hi, int item) {
+  for(int a = 0; a < 3; a++) {
+    entry->lo[a] = round_down(lo[a]);
+    entry->hi[a] = round_up(hi[a]);
+  }
+  entry->item = item;
+}
+
+
+/* Builds the tree over count entries, at least one, and reorders the entries into the order its
+ * leaves refer to them by. Returns NULL if memory runs out. */
+BoxTreeRef new_box_tree(BoxEntry *entries, int count) {
+  BoxTreeRef tree = checked_malloc(sizeof(*tree));
+  // A tree of count leaves has fewer than 2 * count nodes
+  BoxTreeNode *nodes = checked_malloc(sizeof(*nodes) * 2 * count);
+  uint32_t *codes = checked_malloc(sizeof(*codes) * count);
+  if(NULL == tree || NULL == nodes || NULL == codes || !sort_along_curve(entries, codes, count)) {
+    free(tree);
+    free(nodes);
+    free(codes);
+    return NULL;
+  }
+  tree->node_count = 0;
+  tree->nodes = nodes;
+  build_node(tree, entries, codes, 0, count);
+  free(codes);
+  BoxTreeNode *fitted = realloc(tree->nodes, sizeof(*fitted) * tree->node_count);
+  if(NULL != fitted) tree->nodes = fitted;
+  return tree;
+}
+
+
+void box_tree_bounds(BoxTreeRef tree, double *lo, double *hi) {
+  for(int a = 0; a < 3; a++) {
+    lo[a] = tree->nodes[0].lo[a];
+    hi[a] = tree->nodes[0].hi[a];
+  }
+}
+
+
+/* The nearest of the distances test returns for the items in the leaves whose boxes the ray meets,
+ * or MISS. Nearer boxes are visited first, and boxes beyond the nearest distance found are skipped. */
+double box_tree_nearest(BoxTreeRef tree, RayRef ray, double (*test)(void*, int, RayRef), void *data) {
+  double inverse_dir[3];
+  for(int a = 0; a < 3; a++) {
+    inverse_dir[a] = 1.0 / ray->dir[a];
+  }
+  // Nodes waiting to be visited, with the distance at which the ray enters each
+  int stack[MAX_DEPTH];
+  double stack_t[MAX_DEPTH];
+  int depth = 0;
+  double best_t = MISS;
+  double root_t = box_entry(&tree->nodes[0], ray->origin, inverse_dir);
+  if(MISS == root_t) return MISS;
+  stack[depth] = 0;
+  stack_t[depth++] = root_t;
+  while(depth > 0) {
+    depth--;
+    if(stack_t[depth] >= best_t) continue;
+    int index = stack[depth];
+    BoxTreeNode *node = &tree->nodes[index];
+    if(node->count > 0) {
+      for(int i = node->first; i < node->first + node->count; i++) {
+	best_t = lesser(best_t, test(data, i, ray));
+      }
+      continue;
+    }
+
+    // The nearer child goes on top so that it is visited first
+    int near = index + 1;
+    int far = node->first;
+    double near_t = box_entry(&tree->nodes[near], ray->origin, inverse_dir);
+    double far_t = box_entry(&tree->nodes[far], ray->origin, inverse_dir);
+    if(far_t < near_t) {
+      int swap = near;
+      near = far;
+      far = swap;
+      double swap_t = near_t;
+      near_t = far_t;
+      far_t = swap_t;
+    }
+    if(far_t < best_t) {
+      stack[depth] = far;
+      stack_t[depth++] = far_t;
+    }
+    if(near_t < best_t) {
+      stack[depth] = near;
+      stack_t[depth++] = near_t;
+    }
+  }
+  return best_t;
+}
+
+
+/* Calls visit for each item in the leaves whose boxes hold the point. */
+void box_tree_visit_containing(BoxTreeRef tree, double *point, void (*visit)(void*, int, double*), void *data) {
+  int stack[MAX_DEPTH];
+  int depth = 0;
+  stack[depth++] = 0;
+  while(depth > 0) {
+    int index = stack[--depth];
+    BoxTreeNode *node = &tree->nodes[index];
+    if(!box_contains(node, point)) continue;
+    if(node->count > 0) {
+      for(int i = node->first; i < node->first + node->count; i++) {
+	visit(data, i, point);
+      }
+      continue;
+    }
+    stack[depth++] = node->first;
+    stack[depth++] = index + 1;
+  }
+}
+
+
+void destroy_box_tree(BoxTreeRef tree) {
+  if(NULL == tree) return;
+  free(tree->nodes);
+  free(tree);
+}
+
+
+/* Builds the node for entries[first..first+count-1], which lie along the curve in order, splitting
+ * them where their codes first differ: the space they fill is cut in half along one axis, and the
+ * two halves hold the two runs. Returns the node's index. */
+static int build_node(BoxTreeRef tree, BoxEntry *entries, uint32_t *codes, int first, int count) {
+  int index = tree->node_count++;
+  BoxTreeNode *node = &tree->nodes[index];
+  if(count <= LEAF_SIZE) {
+    for(int a = 0; a < 3; a++) {
+      node->lo[a] = INFINITY;
+      node->hi[a] = -INFINITY;
+    }
+    for(int i = first; i < first + count; i++) {
+      for(int a = 0; a < 3; a++) {
+	if(entries[i].lo[a] < node->lo[a]) node->lo[a] = entries[i].lo[a];
+	if(entries[i].hi[a] > node->hi[a]) node->hi[a] = entries[i].hi[a];
+      }
+    }
+    node->first = first;
+    node->count = count;
+    return index;
+  }
+
+  int split = split_point(codes, first, count);
+  int left = build_node(tree, entries, codes, first, split - first);
+  int right = build_node(tree, entries, codes, split, first + count - split);
+  node = &tree->nodes[index];
+  for(int a = 0; a < 3; a++) {
+    node->lo[a] = fminf(tree->nodes[left].lo[a], tree->nodes[right].lo[a]);
+    node->hi[a] = fmaxf(tree->nodes[left].hi[a], tree->nodes[right].hi[a]);
+  }
+  node->first = right;
+  node->count = 0;
+  return index;
+}
+
+
+/* The first of the entries whose code has the highest bit set in which the codes of the first and
+ * last entries differ. If all the codes are the same, the entries are cut in half instead. */
+static int split_point(uint32_t *codes, int first, int count) {
+  int last = first + count - 1;
+  uint32_t differ = codes[first] ^ codes[last];
+  if(0 == differ) return first + count / 2;
+  uint32_t bit = 1;
+  while(differ >>= 1) bit <<= 1;
+  // Codes are sorted, so those with the bit set come after those without
+  int lo = first;
+  int hi = last;
+  while(lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if(codes[mid] & bit) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return lo;
+}
+
+
+/* Sorts the entries by where their centers fall along a Morton curve through the cube around them,
+ * which visits each half, quarter, eighth and so on of the cube in turn, and stores their places
+ * along it in codes. The cube is the same size along every axis so that a flat scene is not split
+ * across its thickness as often as along its length. A radix sort does it in a few passes over the
+ * entries. Returns false if memory runs out. */
+static bool sort_along_curve(BoxEntry *entries, uint32_t *codes, int count) {
+  float lo[3] = {INFINITY, INFINITY, INFINITY};
+  float hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+  for(int i = 0; i < count; i++) {
+    for(int a = 0; a < 3; a++) {
+      float center = entry_center(&entries[i], a);
+      if(center < lo[a]) lo[a] = center;
+      if(center > hi[a]) hi[a] = center;
+    }
+  }
+  CurveKey *keys = checked_malloc(sizeof(*keys) * count);
+  CurveKey *sorted = checked_malloc(sizeof(*sorted) * count);
+  BoxEntry *copy = checked_malloc(sizeof(*copy) * count);
+  if(NULL == keys || NULL == sorted || NULL == copy) {
+    free(keys);
+    free(sorted);
+    free(copy);
+    return false;
+  }
+
+  double size = 0.0;
+  for(int a = 0; a < 3; a++) {
+    size = fmax(size, (double) hi[a] - lo[a]);
+  }
+  double scale = size > 0.0 ? ((1 << CURVE_BITS) - 1) / size : 0.0;
+  for(int i = 0; i < count; i++) {
+    uint32_t code = 0;
+    for(int a = 0; a < 3; a++) {
+      uint32_t cell = (uint32_t) (((double) entry_center(&entries[i], a) - lo[a]) * scale);
+      code |= spread_bits(cell) << a;
+    }
+    keys[i].code = code;
+    keys[i].entry = i;
+  }
+
+  // Least significant byte first, each pass keeping the order of the one before among equal bytes
+  for(int shift = 0; shift < 3 * CURVE_BITS; shift += 8) {
+    int offsets[256] = {0};
+    for(int i = 0; i < count; i++) {
+      offsets[(keys[i].code >> shift) & 255]++;
+    }
+    int total = 0;
+    for(int b = 0; b < 256; b++) {
+      int bucket = offsets[b];
+      offsets[b] = total;
+      total += bucket;
+    }
+    for(int i = 0; i < count; i++) {
+      sorted[offsets[(keys[i].code >> shift) & 255]++] = keys[i];
+    }
+    CurveKey *swap = keys;
+    keys = sorted;
+    sorted = swap;
+  }
+
+  memcpy(copy, entries, sizeof(*copy) * count);
+  for(int i = 0; i < count; i++) {
+    entries[i] = copy[keys[i].entry];
+    codes[i] = keys[i].code;
+  }
+  free(keys);
+  free(sorted);
+  free(copy);
+  return true;
+}
+
+
+/* The low CURVE_BITS bits of x moved apart to every third bit. */
+static uint32_t spread_bits(uint32_t x) {
+  x &= 0x3ff;
+  x = (x | (x << 16)) & 0x030000ff;
+  x = (x | (x << 8)) & 0x0300f00f;
+  x = (x | (x << 4)) & 0x030c30c3;
+  x = (x | (x << 2)) & 0x09249249;
+  return x;
+}
+
+
+/* Twice the center, which orders entries just as the center would. */
+static float entry_center(BoxEntry *entry, int axis) {
+  return entry->lo[axis] + entry->hi[axis];
+}
+
+
+static float round_down(double x) {
+  float f = (float) x;
+  return f > x ? nextafterf(f, -INFINITY) : f;
+}
+
+
+static float round_up(double x) {
+  float f = (float) x;
+  return f < x ? nextafterf(f, INFINITY) : f;
+}
+
+
+/* fmin() and fmax(), which ignore a NaN argument, but inlined: the library calls are most of the
+ * cost of a box test. */
+static inline double lesser(double a, double b) {
+  return a < b || b != b ? a : b;
+}
+
+
+static inline double greater(double a, double b) {
+  return a > b || b != b ? a : b;
+}
+
+
+/* The distance along the ray at which it enters the node's box, 0 if it starts inside, or MISS. */
+static double box_entry(BoxTreeNode *node, double *origin, double *inverse_dir) {
+  double t_near = 0.0;
+  double t_far = INFINITY;
+  for(int a = 0; a < 3; a++) {
+    double t_lo = (node->lo[a] - origin[a]) * inverse_dir[a];
+    double t_hi = (node->hi[a] - origin[a]) * inverse_dir[a];
+    t_near = greater(t_near, lesser(t_lo, t_hi));
+    t_far = lesser(t_far, greater(t_lo, t_hi));
+  }
+  return t_near <= t_far ? t_near : MISS;
+}
+
+
+static bool box_contains(BoxTreeNode *node, double *point) {
+  for(int a = 0; a < 3; a++) {
+    if(point[a] < node->lo[a] || point[a] > node->hi[a]) return false;
+  }
+  return true;
+}
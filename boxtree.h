@@ -0,0 +1,28 @@
+#ifndef BOXTREE_HEADER
+#define BOXTREE_HEADER 1
+
+#include <stdbool.h>
+#include "vecmath.h"
+
+/* A bounding volume hierarchy over items that each fit in a box, such as the copies in a set of
+ * instances or the triangles of a mesh. Its owner keeps the items, stored in the order the tree
+ * leaves them in, and is called back for the items in the leaves a query reaches. */
+typedef struct BoxTree* BoxTreeRef;
+
+/* An item's box, rounded outwards to float, and the item's index among its owner's items. */
+struct BoxEntry {
+  float lo[3];
+  float hi[3];
+  int item;
+};
+
+typedef struct BoxEntry BoxEntry;
+
+void set_box_entry(BoxEntry*, double*, double*, int);
+BoxTreeRef new_box_tree(BoxEntry*, int);
+void box_tree_bounds(BoxTreeRef, double*, double*);
+double box_tree_nearest(BoxTreeRef, RayRef, double (*)(void*, int, RayRef), void*);
+void box_tree_visit_containing(BoxTreeRef, double*, void (*)(void*, int, double*), void*);
+void destroy_box_tree(BoxTreeRef);
+
+#endif
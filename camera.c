@@ -1,23 +1,39 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "camera.h"
 #include "spec.h"
 #include "vecmath.h"
+#include "vec4.h"
 #include "util.h"
 
+#define CUBEMAP_FACES 6
+
 //////////////////// Forward Declarations ////////////////////
 static CameraRef new_camera_from_spec(SpecRef);
 static CameraRef new_camera(void);
-static void validate_camera(CameraRef);
+static CameraRef copy_camera(CameraRef);
+static bool validate_camera(CameraRef);
+static int get_views_from_spec(SpecRef, CameraRef*);
+static int get_stereo_views(CameraRef, double, CameraRef*);
+static int get_cubemap_views(CameraRef, CameraRef*);
 //////////////////////////////////////////////////////////////
 
+// The faces of a cubemap, in the order they are rendered, and the up vector of each
+static const double cube_facings[CUBEMAP_FACES][3] = {
+  {1.0, 0.0, 0.0}, {-1.0, 0.0, 0.0}, {0.0, 1.0, 0.0}, {0.0, -1.0, 0.0}, {0.0, 0.0, 1.0}, {0.0, 0.0, -1.0}
+};
+static const double cube_ups[CUBEMAP_FACES][3] = {
+  {0.0, 1.0, 0.0}, {0.0, 1.0, 0.0}, {0.0, 0.0, -1.0}, {0.0, 0.0, 1.0}, {0.0, 1.0, 0.0}, {0.0, 1.0, 0.0}
+};
+
 /* Assumed to be at position (0, 0, 0), with facing normal (0, 0, 1), and that the view plane is
- * forward of the camera by one unit */
+ * forward of the camera by one unit. Returns NULL if the scene has no valid camera. */
 CameraRef get_camera_from_scene(Scene scene) {
   SpecRef camera_spec = next_spec_declaring_kind(scene, "camera");
   if(NULL == camera_spec) {
-    fprintf(stderr, "Error: There was no camera in the scene file\n");
-    exit(EXIT_FAILURE);
+    set_error(RC_ERR_SCENE, "There was no camera in the scene file");
+    return NULL;
   }
 
   CameraRef c = new_camera_from_spec(camera_spec);
@@ -26,6 +42,48 @@ CameraRef get_camera_from_scene(Scene scene) {
 }
 
 
+/* Every view the scene's cameras call for, in the order the cameras appear, as a NULL-terminated
+ * array. A camera with "rig": "stereo" stands for two views, its left eye and then its right, each
+ * moved half its "eye_separation" sideways and looking the same way. One with "rig": "cubemap"
+ * stands for the six faces of a cube around its position, looking along +x, -x, +y, -y, +z and -z
+ * in turn and each seeing 90 degrees across, in place of its own facing, up, width and height. Returns
+ * NULL if the scene has no valid camera or any camera is invalid. */
+CameraRef* get_cameras_from_scene(Scene scene) {
+  int capacity = 16;
+  int count = 0;
+  CameraRef *cameras = checked_malloc(sizeof(*cameras) * (capacity + 1));
+  if(NULL == cameras) return NULL;
+  cameras[count] = NULL;
+  for(SpecRef spec = next_spec_declaring_kind(scene, "camera"); NULL != spec;
+      spec = next_spec_declaring_kind(scene, "camera")) {
+    if(count + CUBEMAP_FACES > capacity) {
+      capacity *= 2;
+      CameraRef *grown = realloc(cameras, sizeof(*cameras) * (capacity + 1));
+      if(NULL == grown) {
+	set_error(RC_ERR_NO_MEMORY, "Could not allocate memory");
+	destroy_spec(spec);
+	destroy_cameras(cameras);
+	return NULL;
+      }
+      cameras = grown;
+    }
+    int view_count = get_views_from_spec(spec, &cameras[count]);
+    if(0 == view_count) {
+      destroy_cameras(cameras);
+      return NULL;
+    }
+    count += view_count;
+    cameras[count] = NULL;
+  }
+  if(0 == count) {
+    set_error(RC_ERR_SCENE, "There was no camera in the scene file");
+    destroy_cameras(cameras);
+    return NULL;
+  }
+  return cameras;
+}
+
+
 double get_camera_width(CameraRef c) {
   return c->width;
 }
@@ -51,22 +109,42 @@ void get_camera_facing(CameraRef c, Point out) {
 
 
 void get_viewplane_center(CameraRef c, Vec out) {
-  double *vpc = checked_malloc(sizeof(*vpc));
-  Vec focal_length_scaled_facing_vector = {0.0, 0.0, 0.0};
-  vec_scale(c->facing, c->focal_length, focal_length_scaled_facing_vector);
-  vec_add(c->position, focal_length_scaled_facing_vector, out);
+  v4_store(v4_ray_point(v4_load(c->position), v4_load(c->facing), c->focal_length), out);
 }
 
 
+/* The facing and up vectors are known not to be parallel; validate_camera() rejects such cameras. */
 void get_viewplane_unit_vectors(CameraRef c, Vec x, Vec y, Vec z) {
-  Vec intermediate = {0.0};
-  vec_cross(c->facing, c->up, intermediate);
-  if(0 == intermediate[0] && 0 == intermediate[1] && 0 == intermediate[2]) {
-    report_error_and_exit("Theta between the camera facing and up vectors must be 0 < theta < 90");
+  Vec4 x_v = v4_normalize(v4_cross(v4_load(c->facing), v4_load(c->up)));
+  Vec4 z_v = v4_scale(v4_load(c->facing), -1.0);
+  v4_store(x_v, x);
+  v4_store(v4_cross(z_v, x_v), y);
+  v4_store(z_v, z);
+}
+
+
+/* True if the two cameras see the scene identically. */
+bool camera_equals(CameraRef a, CameraRef b) {
+  return a->width == b->width && a->height == b->height && a->focal_length == b->focal_length &&
+    0 == memcmp(a->position, b->position, sizeof(Vec)) && 0 == memcmp(a->facing, b->facing, sizeof(Vec)) &&
+    0 == memcmp(a->up, b->up, sizeof(Vec));
+}
+
+
+void destroy_camera(CameraRef c) {
+  if(NULL == c) return;
+  free(c->position);
+  free(c->facing);
+  free(c->up);
+  free(c);
+}
+
+
+void destroy_cameras(CameraRef *cameras) {
+  for(CameraRef *iter = cameras; NULL != *iter; iter++) {
+    destroy_camera(*iter);
   }
-  vec_normalize(intermediate, x);
-  vec_scale(c->facing, -1.0, z);
-  vec_cross(z, x, y);
+  free(cameras);
 }
 
 
@@ -83,6 +161,10 @@ void print_camera(CameraRef c) {
 //////////////////// Static Functions ////////////////////
 static CameraRef new_camera_from_spec(SpecRef camera_spec) {
   CameraRef c = new_camera();
+  if(NULL == c) {
+    destroy_spec(camera_spec);
+    return NULL;
+  }
   c->width = next_scalar_field_value_with_name(camera_spec, "width");
   c->height = next_scalar_field_value_with_name(camera_spec, "height");
   c->position = next_vector_field_value_with_name(camera_spec, "position");
@@ -90,8 +172,11 @@ static CameraRef new_camera_from_spec(SpecRef camera_spec) {
   c->up = next_vector_field_value_with_name(camera_spec, "up");
   c->focal_length = next_scalar_field_value_with_name(camera_spec, "focal_length");
 
-  validate_camera(c);
   destroy_spec(camera_spec);
+  if(!validate_camera(c)) {
+    destroy_camera(c);
+    return NULL;
+  }
 
   return c;
 }
@@ -100,26 +185,45 @@ static CameraRef new_camera_from_spec(SpecRef camera_spec) {
 static CameraRef new_camera() {
   Camera zero_camera = {0};
   CameraRef c = checked_malloc(sizeof(*c));
-  *c = zero_camera;
+  if(NULL != c) *c = zero_camera;
   return c;
 }
 
 
-static void validate_camera(CameraRef c) {
-  Vec intermediate = {0.0};
+static CameraRef copy_camera(CameraRef c) {
+  CameraRef copy = new_camera();
+  if(NULL == copy) return NULL;
+  copy->width = c->width;
+  copy->height = c->height;
+  copy->focal_length = c->focal_length;
+  copy->position = checked_malloc(sizeof(Vec));
+  copy->facing = checked_malloc(sizeof(Vec));
+  copy->up = checked_malloc(sizeof(Vec));
+  if(NULL == copy->position || NULL == copy->facing || NULL == copy->up) {
+    destroy_camera(copy);
+    return NULL;
+  }
+  memcpy(copy->position, c->position, sizeof(Vec));
+  memcpy(copy->facing, c->facing, sizeof(Vec));
+  memcpy(copy->up, c->up, sizeof(Vec));
+  return copy;
+}
+
 
+static bool validate_camera(CameraRef c) {
   if(0 >= c->width) {
-    fprintf(stderr, "Error: Camera has width <= 0\n");
-    exit(EXIT_FAILURE);
+    set_error(RC_ERR_SCENE, "Camera has width <= 0");
+    return false;
   }
 
   if(0 >= c->height) {
-    fprintf(stderr, "Error: Camera has height <= 0\n");
-    exit(EXIT_FAILURE);
+    set_error(RC_ERR_SCENE, "Camera has height <= 0");
+    return false;
   }
 
   if(NULL == c->position) {
-    c->position = malloc(sizeof(double) * 3);
+    c->position = checked_malloc(sizeof(double) * 3);
+    if(NULL == c->position) return false;
     c->position[0] = 0.0;
     c->position[1] = 0.0;
     c->position[2] = 0.0;
@@ -130,7 +234,8 @@ static void validate_camera(CameraRef c) {
   }
 
   if(NULL == c->facing) {
-    c->facing = malloc(sizeof(double) * 3);
+    c->facing = checked_malloc(sizeof(double) * 3);
+    if(NULL == c->facing) return false;
     c->facing[0] = 0.0;
     c->facing[1] = 0.0;
     c->facing[2] = 1.0;
@@ -139,12 +244,12 @@ static void validate_camera(CameraRef c) {
     fprintf(stderr, "NOTICE: Defaulting to (0, 0, 1)\n");
 #endif
   } else {
-    vec_normalize(c->facing, intermediate);
-    vec_copy(intermediate, c->facing);
+    v4_store(v4_normalize(v4_load(c->facing)), c->facing);
   }
 
   if(NULL == c->up) {
-    c->up = malloc(sizeof(double) * 3);
+    c->up = checked_malloc(sizeof(double) * 3);
+    if(NULL == c->up) return false;
     c->up[0] = 0.0;
     c->up[1] = 1.0;
     c->up[2] = 0.0;
@@ -153,8 +258,7 @@ static void validate_camera(CameraRef c) {
     fprintf(stderr, "NOTICE: Defaulting to (0, 1, 0)\n");
 #endif
   } else {
-    vec_normalize(c->up, intermediate);
-    vec_copy(intermediate, c->up);
+    v4_store(v4_normalize(v4_load(c->up)), c->up);
   }
 
   if(NO_SCALAR == c->focal_length) {
@@ -164,7 +268,78 @@ static void validate_camera(CameraRef c) {
     fprintf(stderr, "NOTICE: Defaulting to 1.0\n");
 #endif
   } else if(0 >= c->focal_length) {
-    fprintf(stderr, "ERROR: The camera focal length must be a positive real value\n");
-    exit(EXIT_FAILURE);
+    set_error(RC_ERR_SCENE, "The camera focal length must be a positive real value");
+    return false;
+  }
+
+  Vec4 side = v4_cross(v4_load(c->facing), v4_load(c->up));
+  if(0 == v4_x(side) && 0 == v4_y(side) && 0 == v4_z(side)) {
+    set_error(RC_ERR_SCENE, "Theta between the camera facing and up vectors must be 0 < theta < 90");
+    return false;
+  }
+  return true;
+}
+
+
+/* Stores the views the camera spec calls for at out, which has room for CUBEMAP_FACES of them, and
+ * returns how many there are, or 0 if the camera is invalid. Takes ownership of the spec. */
+static int get_views_from_spec(SpecRef camera_spec, CameraRef *out) {
+  char *rig = next_string_field_value_with_name(camera_spec, "rig");
+  double separation = next_scalar_field_value_with_name(camera_spec, "eye_separation");
+  CameraRef c = new_camera_from_spec(camera_spec);
+  int count = 0;
+  if(NULL == c) {
+    // new_camera_from_spec() has reported why
+  } else if(NULL == rig && NO_SCALAR != separation) {
+    set_error(RC_ERR_SCENE, "Only a stereo camera rig has an eye separation");
+  } else if(NULL == rig) {
+    out[count++] = c;
+    c = NULL;
+  } else if(0 == strcmp(rig, "stereo")) {
+    count = get_stereo_views(c, separation, out);
+  } else if(0 == strcmp(rig, "cubemap")) {
+    count = get_cubemap_views(c, out);
+  } else {
+    set_error(RC_ERR_SCENE, "A camera rig must be \"stereo\" or \"cubemap\"");
+  }
+  free(rig);
+  destroy_camera(c);
+  return count;
+}
+
+
+/* The eyes look the same way, so that a point at infinity is in the same place in both views. */
+static int get_stereo_views(CameraRef c, double separation, CameraRef *out) {
+  if(!(separation > 0)) {
+    set_error(RC_ERR_SCENE, "A stereo camera rig needs an eye_separation > 0");
+    return 0;
+  }
+  Vec x, y, z;
+  get_viewplane_unit_vectors(c, x, y, z);
+  for(int eye = 0; eye < 2; eye++) {
+    out[eye] = copy_camera(c);
+    if(NULL == out[eye]) {
+      if(1 == eye) destroy_camera(out[0]);
+      return 0;
+    }
+    double side = 0 == eye ? -0.5 : 0.5;
+    v4_store(v4_ray_point(v4_load(c->position), v4_load(x), side * separation), out[eye]->position);
+  }
+  return 2;
+}
+
+
+static int get_cubemap_views(CameraRef c, CameraRef *out) {
+  for(int face = 0; face < CUBEMAP_FACES; face++) {
+    out[face] = copy_camera(c);
+    if(NULL == out[face]) {
+      while(face > 0) destroy_camera(out[--face]);
+      return 0;
+    }
+    out[face]->width = 2.0 * c->focal_length;
+    out[face]->height = 2.0 * c->focal_length;
+    memcpy(out[face]->facing, cube_facings[face], sizeof(Vec));
+    memcpy(out[face]->up, cube_ups[face], sizeof(Vec));
   }
+  return CUBEMAP_FACES;
 }
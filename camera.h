@@ -1,6 +1,7 @@
 #ifndef CAMERA_HEADER
 #define CAMERA_HEADER 1
 
+#include <stdbool.h>
 
 #include "spec.h"
 #include "vecmath.h"
@@ -18,11 +19,15 @@ typedef struct Camera Camera;
 typedef struct Camera* CameraRef;
 
 CameraRef get_camera_from_scene(Scene);
+CameraRef* get_cameras_from_scene(Scene);
 double get_camera_width(CameraRef);
 double get_camera_height(CameraRef);
 void get_camera_position(CameraRef, Point);
 void get_camera_facing(CameraRef, Point);
 void get_viewplane_center(CameraRef, Vec);
 void get_viewplane_unit_vectors(CameraRef, Vec, Vec, Vec);
+bool camera_equals(CameraRef, CameraRef);
 void print_camera(CameraRef);
+void destroy_camera(CameraRef);
+void destroy_cameras(CameraRef*);
 #endif
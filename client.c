@@ -0,0 +1,169 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "daemon.h"
+#include "ppmwrite.h"
+#include "util.h"
+
+static void usage_error(char*);
+static void parse_args(int, char**);
+static int connect_to_daemon(char*);
+static bool send_render_request(FILE*, FILE*);
+static void copy_shm_result_to_ppm(void);
+
+static bool send_inline = false;
+static bool use_shm = false;
+static bool shutdown_daemon = false;
+static char *socket_path;
+static int width;
+static int height;
+static char *input_file_name;
+static char *output_file_name;
+static char shm_name[64];
+
+/* A small client for the render daemon. It submits one job, or a shutdown request, prints the
+ * daemon's reply and exits non-zero if the daemon reported an error. */
+int main(int argc, char *argv[]) {
+  parse_args(argc, argv);
+  int fd = connect_to_daemon(socket_path);
+  FILE *in = fdopen(fd, "r");
+  FILE *out = fdopen(dup(fd), "w");
+  if(NULL == in || NULL == out) {
+    report_error_and_exit("Could not open the daemon connection");
+  }
+
+  bool ok;
+  if(shutdown_daemon) {
+    fprintf(out, "SHUTDOWN\n");
+    fflush(out);
+    char reply[DAEMON_MAX_LINE_LEN];
+    ok = NULL != fgets(reply, sizeof(reply), in) && 0 == strncmp(reply, "OK", 2);
+  } else {
+    ok = send_render_request(in, out);
+    if(ok && use_shm) copy_shm_result_to_ppm();
+  }
+
+  fclose(in);
+  fclose(out);
+  exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+
+static void usage_error(char *message) {
+  fprintf(stderr, "ERROR: %s\n", message);
+  fprintf(stderr, "ERROR: Correct usage is:\n");
+  fprintf(stderr, "ERROR: \traycast-client [--inline] [--shm] socket width height input_file.json output_file.ppm\n");
+  fprintf(stderr, "ERROR: \traycast-client --shutdown socket\n");
+  exit(EXIT_FAILURE);
+}
+
+
+static void parse_args(int argc, char *argv[]) {
+  char *positional[5];
+  int positional_count = 0;
+  for(int i = 1; i < argc; i++) {
+    if(0 == strcmp(argv[i], "--inline")) {
+      send_inline = true;
+    } else if(0 == strcmp(argv[i], "--shm")) {
+      use_shm = true;
+    } else if(0 == strcmp(argv[i], "--shutdown")) {
+      shutdown_daemon = true;
+    } else if(0 == strncmp(argv[i], "--", 2)) {
+      usage_error("You supplied an unknown option.");
+    } else if(positional_count < 5) {
+      positional[positional_count++] = argv[i];
+    } else {
+      usage_error("You supplied an incorrect number of arguments.");
+    }
+  }
+
+  if(shutdown_daemon) {
+    if(positional_count != 1) usage_error("You supplied an incorrect number of arguments.");
+    socket_path = positional[0];
+    return;
+  }
+  if(positional_count != 5) usage_error("You supplied an incorrect number of arguments.");
+  socket_path = positional[0];
+  width = (int) strtol(positional[1], NULL, 10);
+  height = (int) strtol(positional[2], NULL, 10);
+  input_file_name = positional[3];
+  output_file_name = positional[4];
+  if(width <= 0 || height <= 0) usage_error("The supplied dimensions must be positive integers.");
+  snprintf(shm_name, sizeof(shm_name), "/raycast-client-%ld", (long) getpid());
+}
+
+
+static int connect_to_daemon(char *path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(strlen(path) >= sizeof(addr.sun_path)) {
+    report_error_and_exit("The daemon socket path is too long");
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd < 0 || 0 != connect(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+    fprintf(stderr, "Error: Could not connect to the daemon at \"%s\"\n", path);
+    exit(EXIT_FAILURE);
+  }
+  return fd;
+}
+
+
+static bool send_render_request(FILE *in, FILE *out) {
+  char *target = use_shm ? shm_name : output_file_name;
+  if(send_inline) {
+    size_t len = 0;
+    char *scene_json = read_whole_file(input_file_name, &len);
+    if(NULL == scene_json) {
+      report_error_and_exit(last_error_message());
+    }
+    fprintf(out, "RENDER %d %d %s %s inline %zu\n", width, height, use_shm ? "shm" : "file", target, len);
+    fwrite(scene_json, 1, len, out);
+    free(scene_json);
+  } else {
+    // The daemon may be running in another directory
+    char cwd[DAEMON_MAX_LINE_LEN] = "";
+    if('/' != input_file_name[0] && NULL == getcwd(cwd, sizeof(cwd))) {
+      report_error_and_exit("Could not find the working directory");
+    }
+    fprintf(out, "RENDER %d %d %s %s path %s%s%s\n", width, height, use_shm ? "shm" : "file", target, cwd,
+	    '\0' == cwd[0] ? "" : "/", input_file_name);
+  }
+  fflush(out);
+
+  char reply[DAEMON_MAX_LINE_LEN];
+  if(NULL == fgets(reply, sizeof(reply), in)) {
+    fprintf(stderr, "Error: The daemon closed the connection without replying\n");
+    return false;
+  }
+  printf("%s", reply);
+  return 0 == strncmp(reply, "OK", 2);
+}
+
+
+static void copy_shm_result_to_ppm() {
+  size_t len = (size_t) width * height * 3;
+  int fd = shm_open(shm_name, O_RDONLY, 0);
+  if(fd < 0) {
+    report_error_and_exit("Could not open the shared memory result");
+  }
+  uint8_t *pixels = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  shm_unlink(shm_name);
+  if(MAP_FAILED == pixels) {
+    report_error_and_exit("Could not map the shared memory result");
+  }
+  if(!ppm_write(output_file_name, '3', pixels, width, height)) {
+    report_error_and_exit(last_error_message());
+  }
+  munmap(pixels, len);
+}
@@ -0,0 +1,276 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "daemon.h"
+#include "parser.h"
+#include "raycast.h"
+#include "scenecache.h"
+#include "workpool.h"
+#include "pixelbuf.h"
+#include "ppmwrite.h"
+#include "util.h"
+
+#define SCENE_CACHE_CAPACITY 32
+#define MAX_IMAGE_DIMENSION 65536
+
+struct RenderRequest {
+  int width;
+  int height;
+  char output_kind[8];
+  char target[DAEMON_MAX_LINE_LEN];
+  char source_kind[8];
+  char source[DAEMON_MAX_LINE_LEN];
+};
+
+typedef struct RenderRequest RenderRequest;
+
+static int listen_on_socket(char*);
+static bool serve_connection(int);
+static void set_receive_timeout(int);
+static bool handle_render_request(char*, FILE*, FILE*);
+static char* read_request_scene(RenderRequest*, FILE*, size_t*, bool*, FILE*);
+static bool write_shm_target(char*, uint8_t*, size_t);
+
+static WorkPoolRef pool;
+static SceneCacheRef scene_cache;
+
+/* Serves render jobs on a Unix domain socket until a client sends SHUTDOWN. Connections are served
+ * one at a time, each until it hangs up or falls idle; each job is spread over a thread pool that is
+ * kept warm between jobs. */
+void run_render_daemon(char *socket_path, int thread_count) {
+  signal(SIGPIPE, SIG_IGN);
+  pool = new_work_pool(thread_count);
+  scene_cache = new_scene_cache(SCENE_CACHE_CAPACITY);
+  if(NULL == pool || NULL == scene_cache) {
+    fprintf(stderr, "Error: %s\n", last_error_message());
+    exit(EXIT_FAILURE);
+  }
+  int listen_fd = listen_on_socket(socket_path);
+  fprintf(stderr, "NOTICE: Listening on %s with %d render threads\n", socket_path, work_pool_size(pool));
+
+  bool shutting_down = false;
+  while(!shutting_down) {
+    int client_fd = accept(listen_fd, NULL, NULL);
+    if(client_fd < 0) {
+      perror("Error: accept");
+      continue;
+    }
+    set_receive_timeout(client_fd);
+    shutting_down = serve_connection(client_fd);
+  }
+
+  close(listen_fd);
+  unlink(socket_path);
+  destroy_scene_cache(scene_cache);
+  destroy_work_pool(pool);
+}
+
+
+static int listen_on_socket(char *socket_path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(strlen(socket_path) >= sizeof(addr.sun_path)) {
+    report_error_and_exit("The daemon socket path is too long");
+  }
+  strcpy(addr.sun_path, socket_path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd < 0) {
+    report_error_and_exit("Could not create the daemon socket");
+  }
+  unlink(socket_path);
+  if(0 != bind(fd, (struct sockaddr*) &addr, sizeof(addr)) || 0 != listen(fd, 16)) {
+    fprintf(stderr, "Error: Could not listen on \"%s\"\n", socket_path);
+    exit(EXIT_FAILURE);
+  }
+  return fd;
+}
+
+
+/* Bounds how long a read from the client may wait, so that a client that stops sending cannot keep
+ * the daemon from the next connection. */
+static void set_receive_timeout(int client_fd) {
+  struct timeval timeout = {.tv_sec = DAEMON_RECEIVE_TIMEOUT_SECONDS};
+  if(0 != setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout))) {
+    perror("Error: setsockopt");
+  }
+}
+
+
+/* Answers requests on the connection until the client hangs up or times out. Returns true if the
+ * client asked the daemon to shut down. */
+static bool serve_connection(int client_fd) {
+  FILE *in = fdopen(client_fd, "r");
+  FILE *out = fdopen(dup(client_fd), "w");
+  if(NULL == in || NULL == out) {
+    report_error_and_exit("Could not open the client connection");
+  }
+
+  bool shutting_down = false;
+  bool in_sync = true;
+  char *line = NULL;
+  size_t line_cap = 0;
+  while(!shutting_down && in_sync && 0 < getline(&line, &line_cap, in)) {
+    if(0 == strncmp(line, "RENDER ", 7)) {
+      in_sync = handle_render_request(line, in, out);
+    } else if(0 == strcmp(line, "SHUTDOWN\n")) {
+      fprintf(out, "OK 0 parsed 0\n");
+      shutting_down = true;
+    } else {
+      fprintf(out, "ERROR Unknown request\n");
+    }
+    fflush(out);
+  }
+
+  free(line);
+  fclose(in);
+  fclose(out);
+  return shutting_down;
+}
+
+
+/* Scene and rendering failures are reported to the client; the daemon carries on serving. Returns
+ * false if the connection can no longer be read as requests. */
+static bool handle_render_request(char *line, FILE *in, FILE *out) {
+  clear_error();
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  RenderRequest req;
+  if(6 != sscanf(line, "RENDER %d %d %7s %8191s %7s %8191s", &req.width, &req.height,
+		 req.output_kind, req.target, req.source_kind, req.source)) {
+    fprintf(out, "ERROR Malformed RENDER request\n");
+    return true;
+  }
+  if(req.width <= 0 || req.height <= 0 || req.width > MAX_IMAGE_DIMENSION || req.height > MAX_IMAGE_DIMENSION) {
+    fprintf(out, "ERROR The dimensions must be positive integers no larger than %d\n", MAX_IMAGE_DIMENSION);
+    return true;
+  }
+  if(0 != strcmp(req.output_kind, "file") && 0 != strcmp(req.output_kind, "shm")) {
+    fprintf(out, "ERROR The output kind must be file or shm\n");
+    return true;
+  }
+
+  size_t scene_len = 0;
+  bool in_sync = true;
+  char *scene_json = read_request_scene(&req, in, &scene_len, &in_sync, out);
+  if(NULL == scene_json) return in_sync;
+
+  // An inline scene has no directory of its own, so its mesh files must be named by absolute paths
+  char *base_dir = 0 == strcmp(req.source_kind, "path") ? scene_directory(req.source) : NULL;
+  bool was_cached = false;
+  RenderSceneRef scene = NULL;
+  if(NULL != base_dir || 0 != strcmp(req.source_kind, "path")) {
+    scene = scene_cache_get(scene_cache, scene_json, scene_len, base_dir, &was_cached);
+  }
+  free(base_dir);
+  free(scene_json);
+  if(NULL == scene) {
+    fprintf(out, "ERROR %s\n", last_error_message());
+    return true;
+  }
+
+  size_t byte_count = (size_t) req.width * req.height * 3;
+  uint8_t *byte_buf = checked_malloc(byte_count);
+  PixelBufRef pixel_buf = NULL == byte_buf ? NULL : new_pixel_buf_over(byte_buf, req.width, req.height);
+  if(NULL == pixel_buf) {
+    free(byte_buf);
+    fprintf(out, "ERROR %s\n", last_error_message());
+    return true;
+  }
+  RenderJob job = {.scene = scene, .width = req.width, .height = req.height, .rows = req.height};
+  bool rendered = raycast_job_into(&job, pool, pixel_buf);
+  destroy_pixel_buf(pixel_buf);
+  if(!rendered) {
+    free(byte_buf);
+    fprintf(out, "ERROR %s\n", last_error_message());
+    return true;
+  }
+
+  if(0 == strcmp(req.output_kind, "file")) {
+    if(!ppm_write(req.target, '3', byte_buf, req.width, req.height)) {
+      free(byte_buf);
+      fprintf(out, "ERROR %s\n", last_error_message());
+      return true;
+    }
+  } else if(!write_shm_target(req.target, byte_buf, byte_count)) {
+    free(byte_buf);
+    fprintf(out, "ERROR Could not write shared memory object %s\n", req.target);
+    return true;
+  }
+  free(byte_buf);
+
+  fprintf(out, "OK %zu %s %.3f\n", byte_count, was_cached ? "cached" : "parsed", elapsed_ms(&start));
+  return true;
+}
+
+
+/* Returns the scene JSON named by the request, or NULL after replying with an error. Clears in_sync
+ * if an inline scene was not read in full, leaving the connection's next bytes part of the scene. */
+static char* read_request_scene(RenderRequest *req, FILE *in, size_t *len_out, bool *in_sync, FILE *out) {
+  if(0 == strcmp(req->source_kind, "path")) {
+    char *scene_json = read_whole_file(req->source, len_out);
+    if(NULL == scene_json) {
+      fprintf(out, "ERROR %s\n", last_error_message());
+    }
+    return scene_json;
+  }
+
+  if(0 == strcmp(req->source_kind, "inline")) {
+    char *end = NULL;
+    long long len = strtoll(req->source, &end, 10);
+    if(end == req->source || '\0' != *end || len <= 0) {
+      fprintf(out, "ERROR An inline scene needs a positive byte count\n");
+      return NULL;
+    }
+    if(len > DAEMON_MAX_SCENE_BYTES) {
+      *in_sync = false;
+      fprintf(out, "ERROR An inline scene may be at most %lld bytes\n", DAEMON_MAX_SCENE_BYTES);
+      return NULL;
+    }
+    char *buf = checked_malloc((size_t) len);
+    if(NULL == buf) {
+      *in_sync = false;
+      fprintf(out, "ERROR %s\n", last_error_message());
+      return NULL;
+    }
+    if((size_t) len != fread(buf, 1, (size_t) len, in)) {
+      free(buf);
+      *in_sync = false;
+      fprintf(out, "ERROR The connection closed or timed out before the inline scene was complete\n");
+      return NULL;
+    }
+    *len_out = (size_t) len;
+    return buf;
+  }
+
+  fprintf(out, "ERROR The scene source must be path or inline\n");
+  return NULL;
+}
+
+
+static bool write_shm_target(char *name, uint8_t *buf, size_t len) {
+  int fd = shm_open(name, O_CREAT | O_RDWR, 0600);
+  if(fd < 0) return false;
+  if(0 != ftruncate(fd, (off_t) len)) {
+    close(fd);
+    return false;
+  }
+  void *mapped = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(MAP_FAILED == mapped) return false;
+  memcpy(mapped, buf, len);
+  munmap(mapped, len);
+  return true;
+}
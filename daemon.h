@@ -0,0 +1,31 @@
+#ifndef DAEMON_HEADER
+#define DAEMON_HEADER 1
+
+/* The job protocol spoken over the daemon's Unix domain socket. Every request is one line:
+ *
+ *   RENDER width height (file|shm) target (path|inline) source
+ *   SHUTDOWN
+ *
+ * For a `path` source, `source` is the path of a scene file, relative to the daemon's working
+ * directory unless absolute. For an `inline` source it is the number of bytes of scene JSON that
+ * immediately follow the request line; such a scene must name its mesh files by absolute paths. A
+ * `file` target is the path of the PPM to write. A `shm` target is the name of a POSIX shared
+ * memory object that the daemon creates (or replaces) and fills with width * height * 3 RGB bytes,
+ * top row first; the client unlinks it once read. Paths and names may not contain whitespace.
+ *
+ * Every request gets a one line reply, either
+ *
+ *   OK byte_count (cached|parsed) milliseconds
+ *   ERROR message
+ *
+ * A connection may carry any number of requests, but is closed once it has been idle for
+ * DAEMON_RECEIVE_TIMEOUT_SECONDS, so that a stalled client cannot hold up the others. */
+#define DAEMON_MAX_LINE_LEN 8192
+// Largest inline scene the daemon accepts, in bytes
+#define DAEMON_MAX_SCENE_BYTES (64LL * 1024 * 1024)
+// A connection that sends nothing for this long is closed
+#define DAEMON_RECEIVE_TIMEOUT_SECONDS 10
+
+void run_render_daemon(char*, int);
+
+#endif
@@ -0,0 +1,335 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <math.h>
+#include "floatgeom.h"
+#include "object.h"
+#include "vecmath.h"
+#include "util.h"
+
+// Hits on a quadric this close to where a ray leaves it, relative to the size of the ray's origin
+// coordinates, are taken to be the point the ray starts from. Wider than object.c's margin because
+// float keeps only about seven digits
+#define FLOAT_SELF_HIT_EPSILON 1e-6f
+
+#define A 0
+#define B 1
+#define C 2
+#define D 3
+#define E 4
+#define F 5
+#define G 6
+#define H 7
+#define I 8
+#define J 9
+
+/* position is a sphere's center. A plane is stored as its normal and the normal's dot product with
+ * a point on it, which is all that intersecting it needs. */
+struct FloatObject {
+  float position[3];
+  float normal[3];
+  float plane_offset;
+  float radius;
+  float parts[10];
+};
+
+typedef struct FloatObject FloatObject;
+
+struct FloatScene {
+  Point origin;
+  FloatObject *objects;
+};
+
+typedef struct FloatScene FloatScene;
+
+static void rebase_object(ObjectRef, double*, FloatObject*);
+static void rebase_quadric(double*, double*, float*);
+static void widen_lanes(float*, int, double*);
+static double float_plane_intersection(FloatObject*, FloatRayRef);
+static double float_sphere_intersection(FloatObject*, FloatRayRef);
+static double float_quadric_intersection(FloatObject*, FloatRayRef);
+static void get_float_quadric_coefficients(FloatObject*, FloatRayRef, float*);
+static double float_quadric_intersection_leaving(FloatObject*, FloatRayRef);
+
+/* Returns NULL if memory runs out. The copies are made relative to origin and are not updated if
+ * the objects change. */
+FloatSceneRef new_float_scene(ObjectRef *objects, double *origin) {
+  int object_count = 0;
+  while(NULL != objects[object_count]) object_count++;
+  FloatSceneRef fs = checked_malloc(sizeof(*fs));
+  FloatObject *copies = checked_malloc(sizeof(*copies) * (object_count + 1));
+  if(NULL == fs || NULL == copies) {
+    free(fs);
+    free(copies);
+    return NULL;
+  }
+  vec_copy(origin, fs->origin);
+  fs->objects = copies;
+  for(int o = 0; o < object_count; o++) {
+    rebase_object(objects[o], origin, &copies[o]);
+  }
+  return fs;
+}
+
+
+/* The ray's origin is moved into the scene's frame in double before it is rounded to float, so a
+ * ray starting near the camera keeps its precision however far the camera is from the world origin. */
+void get_float_ray(FloatSceneRef fs, RayRef r, FloatRayRef out) {
+  for(int a = 0; a < 3; a++) {
+    out->origin[a] = (float) (r->origin[a] - fs->origin[a]);
+    out->dir[a] = (float) r->dir[a];
+  }
+}
+
+
+/* get_float_ray() for the first lane_count lanes. */
+void get_float_lanes(FloatSceneRef fs, RayLanesRef lanes, int lane_count, FloatRayLanesRef out) {
+  for(int a = 0; a < 3; a++) {
+    for(int i = 0; i < lane_count; i++) {
+      out->origin[a][i] = (float) (lanes->origin[a][i] - fs->origin[a]);
+      out->dir[a][i] = (float) lanes->dir[a][i];
+    }
+  }
+}
+
+
+/* has_intersection() worked out in single precision. */
+double float_intersection(FloatSceneRef fs, FloatRayRef r, ObjectRef o) {
+  FloatObject *fo = &fs->objects[o->id];
+  switch(o->kind) {
+  case Plane:
+    return float_plane_intersection(fo, r);
+  case Sphere:
+    return float_sphere_intersection(fo, r);
+  case Quadric:
+    return float_quadric_intersection(fo, r);
+  case Instances:
+  case Mesh:
+    set_error(RC_ERR_INTERNAL, "Tried to check for intersection with instances or a mesh in single precision");
+    break;
+  case NoObjKind:
+    set_error(RC_ERR_INTERNAL, "Tried to check for intersection with unknown object type");
+    break;
+  }
+  return MISS;
+}
+
+
+/* has_intersection_leaving() worked out in single precision. */
+double float_intersection_leaving(FloatSceneRef fs, FloatRayRef r, ObjectRef o) {
+  FloatObject *fo = &fs->objects[o->id];
+  switch(o->kind) {
+  case Plane:
+    return MISS;
+  case Sphere: {
+    float to_center[3] = {fo->position[X] - r->origin[X], fo->position[Y] - r->origin[Y],
+			  fo->position[Z] - r->origin[Z]};
+    float d_dot_d = (r->dir[X]*r->dir[X]) + (r->dir[Y]*r->dir[Y]) + (r->dir[Z]*r->dir[Z]);
+    float t = 2 * ((r->dir[X]*to_center[X]) + (r->dir[Y]*to_center[Y]) + (r->dir[Z]*to_center[Z])) / d_dot_d;
+    return t > 0 ? t : MISS;
+  }
+  case Quadric:
+    return float_quadric_intersection_leaving(fo, r);
+  case Instances:
+  case Mesh:
+  case NoObjKind:
+    break;
+  }
+  return float_intersection(fs, r, o);
+}
+
+
+/* float_intersection() for the rays in the first lane_count lanes, storing the results in t_out.
+ * Planes and spheres are done for all the lanes together in loops the compiler can vectorize. */
+void float_lanes_intersection(FloatSceneRef fs, FloatRayLanesRef lanes, int lane_count, ObjectRef o, double *t_out) {
+  FloatObject *fo = &fs->objects[o->id];
+  float t_lanes[RAY_LANES];
+  if(Plane == o->kind) {
+    float *n = fo->normal;
+    for(int i = 0; i < lane_count; i++) {
+      float n_dot_dir = (n[X]*lanes->dir[X][i]) + (n[Y]*lanes->dir[Y][i]) + (n[Z]*lanes->dir[Z][i]);
+      float n_dot_origin = (n[X]*lanes->origin[X][i]) + (n[Y]*lanes->origin[Y][i]) + (n[Z]*lanes->origin[Z][i]);
+      float t = (fo->plane_offset - n_dot_origin) / n_dot_dir;
+      t_lanes[i] = 0 != n_dot_dir && t > 0 ? t : MISS;
+    }
+    widen_lanes(t_lanes, lane_count, t_out);
+    return;
+  }
+  if(Sphere == o->kind) {
+    float *c = fo->position;
+    float radius_sq = fo->radius * fo->radius;
+    for(int i = 0; i < lane_count; i++) {
+      float to_center[3] = {c[X] - lanes->origin[X][i], c[Y] - lanes->origin[Y][i], c[Z] - lanes->origin[Z][i]};
+      float closest_t = (lanes->dir[X][i]*to_center[X]) + (lanes->dir[Y][i]*to_center[Y]) +
+	(lanes->dir[Z][i]*to_center[Z]);
+      float offset_sq = 0.0f;
+      float center_sq = 0.0f;
+      for(int a = 0; a < 3; a++) {
+	float offset = to_center[a] - closest_t * lanes->dir[a][i];
+	offset_sq += offset * offset;
+	center_sq += to_center[a] * to_center[a];
+      }
+      // Lanes that miss take the root of a negative number, whose NaN the last select discards
+      float half_chord = sqrtf(radius_sq - offset_sq);
+      float t = center_sq < radius_sq ? closest_t + half_chord : closest_t - half_chord;
+      t_lanes[i] = closest_t <= 0 || offset_sq > radius_sq ? MISS : t;
+    }
+    widen_lanes(t_lanes, lane_count, t_out);
+    return;
+  }
+  for(int i = 0; i < lane_count; i++) {
+    FloatRay r = {{lanes->origin[X][i], lanes->origin[Y][i], lanes->origin[Z][i]},
+		  {lanes->dir[X][i], lanes->dir[Y][i], lanes->dir[Z][i]}};
+    t_out[i] = float_intersection(fs, &r, o);
+  }
+}
+
+
+void destroy_float_scene(FloatSceneRef fs) {
+  if(NULL == fs) return;
+  free(fs->objects);
+  free(fs);
+}
+
+
+/* Positions are rebased in double and only then rounded, so nothing near the origin loses more than
+ * float's rounding of its own offset. */
+static void rebase_object(ObjectRef o, double *origin, FloatObject *out) {
+  for(int a = 0; a < 3; a++) {
+    out->position[a] = 0.0f;
+    out->normal[a] = 0.0f;
+  }
+  out->plane_offset = 0.0f;
+  out->radius = 0.0f;
+  for(int p = 0; p < 10; p++) {
+    out->parts[p] = 0.0f;
+  }
+  switch(o->kind) {
+  case Plane: {
+    double offset[3] = {0.0};
+    vec_subtract(o->plane.position, origin, offset);
+    out->plane_offset = (float) vec_dot(o->plane.normal, offset);
+    for(int a = 0; a < 3; a++) {
+      out->normal[a] = (float) o->plane.normal[a];
+    }
+    break;
+  }
+  case Sphere:
+    for(int a = 0; a < 3; a++) {
+      out->position[a] = (float) (o->sphere.position[a] - origin[a]);
+    }
+    out->radius = (float) o->sphere.radius;
+    break;
+  case Quadric:
+    rebase_quadric(o->quadric.parts, origin, out->parts);
+    break;
+  case Instances:
+  case Mesh:
+  case NoObjKind:
+    break;
+  }
+}
+
+
+/* The quadric's coefficients in coordinates p - c: the quadratic terms are unchanged, the linear
+ * terms pick up the gradient of the quadratic part at c, and the constant becomes the quadric's
+ * value at c. */
+static void rebase_quadric(double *q, double *c, float *out) {
+  double value_at_c = q[A]*c[X]*c[X] + q[B]*c[Y]*c[Y] + q[C]*c[Z]*c[Z] + q[D]*c[X]*c[Y] + q[E]*c[X]*c[Z] +
+    q[F]*c[Y]*c[Z] + q[G]*c[X] + q[H]*c[Y] + q[I]*c[Z] + q[J];
+  for(int p = A; p <= F; p++) {
+    out[p] = (float) q[p];
+  }
+  out[G] = (float) (q[G] + 2*q[A]*c[X] + q[D]*c[Y] + q[E]*c[Z]);
+  out[H] = (float) (q[H] + 2*q[B]*c[Y] + q[D]*c[X] + q[F]*c[Z]);
+  out[I] = (float) (q[I] + 2*q[C]*c[Z] + q[E]*c[X] + q[F]*c[Y]);
+  out[J] = (float) value_at_c;
+}
+
+
+/* Kept apart from the loops that work out the distances so that those deal only in floats. */
+static void widen_lanes(float *t_lanes, int lane_count, double *t_out) {
+  for(int i = 0; i < lane_count; i++) {
+    t_out[i] = t_lanes[i];
+  }
+}
+
+
+static double float_plane_intersection(FloatObject *p, FloatRayRef r) {
+  float n_dot_dir = (p->normal[X]*r->dir[X]) + (p->normal[Y]*r->dir[Y]) + (p->normal[Z]*r->dir[Z]);
+  if(0 == n_dot_dir) return MISS;
+  float n_dot_origin = (p->normal[X]*r->origin[X]) + (p->normal[Y]*r->origin[Y]) + (p->normal[Z]*r->origin[Z]);
+  float t = (p->plane_offset - n_dot_origin) / n_dot_dir;
+  return t > 0 ? t : MISS;
+}
+
+
+/* Finds the point of the ray nearest the center as sphere_intersection() does, and measures the
+ * half chord from there, which keeps the cancellation in float small for rays that graze the sphere. */
+static double float_sphere_intersection(FloatObject *s, FloatRayRef r) {
+  float to_center[3] = {s->position[X] - r->origin[X], s->position[Y] - r->origin[Y], s->position[Z] - r->origin[Z]};
+  float closest_t = (r->dir[X]*to_center[X]) + (r->dir[Y]*to_center[Y]) + (r->dir[Z]*to_center[Z]);
+  if(closest_t <= 0) return MISS;
+  float radius_sq = s->radius * s->radius;
+  float offset_sq = 0.0f;
+  float center_sq = 0.0f;
+  for(int a = 0; a < 3; a++) {
+    float offset = to_center[a] - closest_t * r->dir[a];
+    offset_sq += offset * offset;
+    center_sq += to_center[a] * to_center[a];
+  }
+  if(offset_sq > radius_sq) return MISS;
+  float half_chord = sqrtf(radius_sq - offset_sq);
+  return center_sq < radius_sq ? closest_t + half_chord : closest_t - half_chord;
+}
+
+
+static double float_quadric_intersection(FloatObject *fo, FloatRayRef r) {
+  float coefficients[3];
+  get_float_quadric_coefficients(fo, r, coefficients);
+  float Aq = coefficients[0];
+  float Bq = coefficients[1];
+  float Cq = coefficients[2];
+
+  if(0 == Aq) {
+    if(0 == Bq) return MISS;
+    return -Cq / Bq;
+  }
+  float discriminant = Bq * Bq - 4 * Aq * Cq;
+  if(discriminant < 0.0f) return MISS;
+  float sqrt_discriminant = sqrtf(discriminant);
+  float t0 = (-Bq - sqrt_discriminant) / (2 * Aq);
+  if(t0 > 0.0f) return t0;
+  float t1 = (-Bq + sqrt_discriminant) / (2 * Aq);
+  if(t1 > 0.0f) return t1;
+  return MISS;
+}
+
+
+/* The coefficients of t^2, t and 1 in the quadric's equation along the ray. */
+static void get_float_quadric_coefficients(FloatObject *fo, FloatRayRef r, float *out) {
+  float *q = fo->parts;
+  float *o = r->origin;
+  float *d = r->dir;
+  out[0] = q[A]*d[X]*d[X] + q[B]*d[Y]*d[Y] + q[C]*d[Z]*d[Z] + q[D]*d[X]*d[Y] + q[E]*d[X]*d[Z] + q[F]*d[Y]*d[Z];
+  out[1] = 2*q[A]*o[X]*d[X] + 2*q[B]*o[Y]*d[Y] + 2*q[C]*o[Z]*d[Z] +
+    q[D]*(o[X]*d[Y] + o[Y]*d[X]) + q[E]*(o[X]*d[Z] + o[Z]*d[X]) + q[F]*(o[Y]*d[Z] + o[Z]*d[Y]) +
+    q[G]*d[X] + q[H]*d[Y] + q[I]*d[Z];
+  out[2] = q[A]*o[X]*o[X] + q[B]*o[Y]*o[Y] + q[C]*o[Z]*o[Z] + q[D]*o[X]*o[Y] + q[E]*o[X]*o[Z] + q[F]*o[Y]*o[Z] +
+    q[G]*o[X] + q[H]*o[Y] + q[I]*o[Z] + q[J];
+}
+
+
+/* The ray starts on the quadric, so one root is 0. The constant term is taken to be exactly 0 rather
+ * than the quadric's value at the origin rounded in float, which for a ray grazing the surface would
+ * move the root at 0 further than the nearest real hit; the other root is then -Bq / Aq. */
+static double float_quadric_intersection_leaving(FloatObject *fo, FloatRayRef r) {
+  float coefficients[3];
+  get_float_quadric_coefficients(fo, r, coefficients);
+  float Aq = coefficients[0];
+  float Bq = coefficients[1];
+  float epsilon = FLOAT_SELF_HIT_EPSILON *
+    (1.0f + fmaxf(fabsf(r->origin[X]), fmaxf(fabsf(r->origin[Y]), fabsf(r->origin[Z]))));
+  if(0 == Aq) return MISS;
+  float t = -Bq / Aq;
+  return t > epsilon ? t : MISS;
+}
@@ -0,0 +1,40 @@
+#ifndef FLOATGEOM_HEADER
+#define FLOATGEOM_HEADER 1
+
+#include "object.h"
+#include "vecmath.h"
+
+/* Single precision copies of a scene's objects for finding where rays meet them. Every position is
+ * stored relative to an origin near where the rays start, usually the camera, so that float's
+ * precision is spent on the part of the scene that is seen rather than on its distance from the
+ * world origin. Distances along rays are the same in both frames and are returned as doubles. Sets
+ * of instances and meshes are not copied; callers test them with the double functions in object.h. */
+typedef struct FloatScene* FloatSceneRef;
+
+/* A ray in the frame of a FloatScene. */
+struct FloatRay {
+  float origin[3];
+  float dir[3];
+};
+
+typedef struct FloatRay FloatRay;
+typedef struct FloatRay* FloatRayRef;
+
+/* RayLanes in the frame of a FloatScene. Twice as many float lanes fit in a vector register. */
+struct FloatRayLanes {
+  float origin[3][RAY_LANES];
+  float dir[3][RAY_LANES];
+};
+
+typedef struct FloatRayLanes FloatRayLanes;
+typedef struct FloatRayLanes* FloatRayLanesRef;
+
+FloatSceneRef new_float_scene(ObjectRef*, double*);
+void get_float_ray(FloatSceneRef, RayRef, FloatRayRef);
+void get_float_lanes(FloatSceneRef, RayLanesRef, int, FloatRayLanesRef);
+double float_intersection(FloatSceneRef, FloatRayRef, ObjectRef);
+double float_intersection_leaving(FloatSceneRef, FloatRayRef, ObjectRef);
+void float_lanes_intersection(FloatSceneRef, FloatRayLanesRef, int, ObjectRef, double*);
+void destroy_float_scene(FloatSceneRef);
+
+#endif
@@ -0,0 +1,418 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include "object.h"
+#include "util.h"
+
+#define PI 3.14159265358979323846
+// Objects are this far apart on average, whatever their number
+#define SPACING 3.0
+// With --instances, spheres and quadrics are copies of this many prototypes of each, one per material
+#define PALETTE_SIZE 8
+// Clustered objects gather around one center per this many objects
+#define CLUSTER_SIZE 1000
+
+/* Writes a scene of as many spheres, planes, quadrics, lights and spotlights as asked for, placed and
+ * given materials by a pseudo-random sequence that depends only on the seed, so that the same
+ * options always write the same file. Objects fill a cube around the origin whose size grows with
+ * their number, keeping their density the same, and the camera looks into the cube from outside
+ * one face. Planes face the center from beyond the camera, and lights are spread through a slightly
+ * larger cube, each dimmed so that the total light stays about the same whatever their number. */
+
+enum Layout { Uniform, Clustered };
+
+/* The parts of an object's material that vary. */
+struct Material {
+  double diffuse[3];
+  double specular;
+  double ns;
+  double reflectivity;
+  double refractivity;
+  double ior;
+};
+
+typedef struct Material Material;
+
+static void parse_args(int, char**);
+static void usage_error(char*);
+static long parse_count_option(char*, char*);
+static double parse_fraction_option(char*, char*);
+static void write_scene(FILE*);
+static void begin_spec(FILE*);
+static void write_camera(FILE*);
+static void write_lights(FILE*);
+static void write_planes(FILE*);
+static void write_prototypes(FILE*);
+static void write_spheres(FILE*);
+static void write_quadrics(FILE*);
+static void random_position(double*);
+static void random_direction(double*);
+static void random_material(Material*);
+static void write_material(FILE*, Material*);
+static double uniform(double, double);
+static double gaussian(void);
+static uint64_t next_random(void);
+
+static uint64_t seed = 1;
+static uint64_t random_state;
+static long sphere_count = 0;
+static long plane_count = 0;
+static long quadric_count = 0;
+static long light_count = 1;
+static long spotlight_count = 0;
+static double reflective_share = 0.2;
+static double refractive_share = 0.1;
+static double mixed_share = 0.05;
+static enum Layout layout = Uniform;
+static bool instanced = false;
+static char *output_path = NULL;
+static double extent;
+static double *cluster_centers = NULL;
+static long cluster_count = 0;
+static bool first_spec = true;
+
+int main(int argc, char *argv[]) {
+  parse_args(argc, argv);
+  random_state = seed * 0x9E3779B97F4A7C15ULL;
+  long object_count = sphere_count + quadric_count;
+  extent = SPACING * cbrt((double) (object_count > 1 ? object_count : 1));
+  if(Clustered == layout) {
+    cluster_count = 1 + object_count / CLUSTER_SIZE;
+    cluster_centers = checked_malloc(sizeof(*cluster_centers) * 3 * cluster_count);
+    if(NULL == cluster_centers) report_error_and_exit(last_error_message());
+    for(long c = 0; c < cluster_count; c++) {
+      for(int i = 0; i < 3; i++) {
+	cluster_centers[3 * c + i] = uniform(-0.4, 0.4) * extent;
+      }
+    }
+  }
+
+  FILE *file = NULL == output_path ? stdout : fopen(output_path, "w");
+  if(NULL == file) {
+    fprintf(stderr, "Error: Output file \"%s\" could not be opened for writing\n", output_path);
+    exit(EXIT_FAILURE);
+  }
+  write_scene(file);
+  if(ferror(file) || (file != stdout && 0 != fclose(file)) || (file == stdout && 0 != fflush(file))) {
+    fprintf(stderr, "Error: An error occurred while writing the scene\n");
+    exit(EXIT_FAILURE);
+  }
+  free(cluster_centers);
+  exit(EXIT_SUCCESS);
+}
+
+
+static void parse_args(int argc, char *argv[]) {
+  for(int i = 1; i < argc; i++) {
+    if(0 == strcmp(argv[i], "--instances")) {
+      instanced = true;
+      continue;
+    }
+    if(0 != strncmp(argv[i], "--", 2)) usage_error("You supplied an incorrect number of arguments.");
+    if(i + 1 >= argc) usage_error("This option requires a value.");
+    char *value = argv[++i];
+    if(0 == strcmp(argv[i - 1], "--seed")) {
+      seed = (uint64_t) parse_count_option(value, "The --seed option takes a non-negative integer.");
+    } else if(0 == strcmp(argv[i - 1], "--spheres")) {
+      sphere_count = parse_count_option(value, "The --spheres option takes a non-negative integer.");
+    } else if(0 == strcmp(argv[i - 1], "--planes")) {
+      plane_count = parse_count_option(value, "The --planes option takes a non-negative integer.");
+    } else if(0 == strcmp(argv[i - 1], "--quadrics")) {
+      quadric_count = parse_count_option(value, "The --quadrics option takes a non-negative integer.");
+    } else if(0 == strcmp(argv[i - 1], "--lights")) {
+      light_count = parse_count_option(value, "The --lights option takes a non-negative integer.");
+    } else if(0 == strcmp(argv[i - 1], "--spotlights")) {
+      spotlight_count = parse_count_option(value, "The --spotlights option takes a non-negative integer.");
+    } else if(0 == strcmp(argv[i - 1], "--reflective")) {
+      reflective_share = parse_fraction_option(value, "The --reflective option takes a fraction from 0 to 1.");
+    } else if(0 == strcmp(argv[i - 1], "--refractive")) {
+      refractive_share = parse_fraction_option(value, "The --refractive option takes a fraction from 0 to 1.");
+    } else if(0 == strcmp(argv[i - 1], "--mixed")) {
+      mixed_share = parse_fraction_option(value, "The --mixed option takes a fraction from 0 to 1.");
+    } else if(0 == strcmp(argv[i - 1], "--layout")) {
+      if(0 == strcmp(value, "uniform")) {
+	layout = Uniform;
+      } else if(0 == strcmp(value, "clustered")) {
+	layout = Clustered;
+      } else {
+	usage_error("The --layout option takes uniform or clustered.");
+      }
+    } else if(0 == strcmp(argv[i - 1], "--output")) {
+      output_path = value;
+    } else {
+      usage_error("You supplied an unknown option.");
+    }
+  }
+  if(reflective_share + refractive_share + mixed_share > 1.0) {
+    usage_error("The reflective, refractive and mixed shares add up to more than 1.");
+  }
+  if(light_count + spotlight_count > 65536) usage_error("A scene may have at most 65536 lights.");
+  // The renderer refuses a scene with too many objects, so there is no point writing one
+  static char message[128];
+  if(!instanced && sphere_count + plane_count + quadric_count > MAX_OBJECTS) {
+    snprintf(message, sizeof(message), "A scene may have at most %d objects; use --instances for more.",
+	     MAX_OBJECTS);
+    usage_error(message);
+  }
+  if(instanced && plane_count + 2 * PALETTE_SIZE > MAX_OBJECTS) {
+    snprintf(message, sizeof(message), "With --instances a scene may have at most %d planes.",
+	     MAX_OBJECTS - 2 * PALETTE_SIZE);
+    usage_error(message);
+  }
+}
+
+
+static void usage_error(char *message) {
+  fprintf(stderr, "ERROR: %s\n", message);
+  fprintf(stderr, "ERROR: Correct usage is:\n");
+  fprintf(stderr, "ERROR: \traycast-gen [options] > scene.json\n");
+  fprintf(stderr, "ERROR: Options:\n");
+  fprintf(stderr, "ERROR: \t--seed n             pick placements and materials with seed n (default: 1)\n");
+  fprintf(stderr, "ERROR: \t--spheres count      write count spheres (default: 0)\n");
+  fprintf(stderr, "ERROR: \t--planes count       write count planes (default: 0)\n");
+  fprintf(stderr, "ERROR: \t--quadrics count     write count ellipsoids (default: 0)\n");
+  fprintf(stderr, "ERROR: \t--lights count       write count point lights (default: 1)\n");
+  fprintf(stderr, "ERROR: \t--spotlights count   write count spotlights aimed into the scene (default: 0)\n");
+  fprintf(stderr, "ERROR: \t--reflective share   make this share of objects mirrors (default: 0.2)\n");
+  fprintf(stderr, "ERROR: \t--refractive share   make this share of objects glass (default: 0.1)\n");
+  fprintf(stderr, "ERROR: \t--mixed share        make this share both reflect and refract (default: 0.05)\n");
+  fprintf(stderr, "ERROR: \t--layout kind        uniform, or clustered around one center per %d objects\n",
+	  CLUSTER_SIZE);
+  fprintf(stderr, "ERROR: \t--instances          write spheres and quadrics as instances of %d prototypes each\n",
+	  PALETTE_SIZE);
+  fprintf(stderr, "ERROR: \t--output file.json   write the scene to a file instead of stdout\n");
+  exit(EXIT_FAILURE);
+}
+
+
+static long parse_count_option(char *value, char *message) {
+  char *end = NULL;
+  long n = strtol(value, &end, 10);
+  if(end == value || '\0' != *end || n < 0) usage_error(message);
+  return n;
+}
+
+
+static double parse_fraction_option(char *value, char *message) {
+  char *end = NULL;
+  double share = strtod(value, &end);
+  if(end == value || '\0' != *end || !(share >= 0 && share <= 1)) usage_error(message);
+  return share;
+}
+
+
+/* Every part of the scene draws from the one sequence, in the order written. */
+static void write_scene(FILE *file) {
+  fprintf(file, "[\n");
+  write_camera(file);
+  write_lights(file);
+  write_planes(file);
+  if(instanced) write_prototypes(file);
+  write_spheres(file);
+  write_quadrics(file);
+  fprintf(file, "\n]\n");
+}
+
+
+static void begin_spec(FILE *file) {
+  fprintf(file, "%s", first_spec ? "" : ",\n");
+  first_spec = false;
+}
+
+
+static void write_camera(FILE *file) {
+  begin_spec(file);
+  fprintf(file, "{\"type\": \"camera\", \"width\": 1.6, \"height\": 1.6, \"position\": [0, 0, %.6g]}",
+	  -0.6 * extent);
+}
+
+
+/* Point lights fade to half their brightness over half the cube; spotlights, aimed at random points
+ * near the center, do not fade with distance. */
+static void write_lights(FILE *file) {
+  long total = light_count + spotlight_count;
+  for(long l = 0; l < total; l++) {
+    double position[3];
+    for(int i = 0; i < 3; i++) {
+      position[i] = uniform(-0.6, 0.6) * extent;
+    }
+    double brightness = 3.0 / total;
+    double color[3] = {brightness * uniform(0.5, 1.0), brightness * uniform(0.5, 1.0), brightness * uniform(0.5, 1.0)};
+    begin_spec(file);
+    fprintf(file, "{\"type\": \"light\", \"color\": [%.6g, %.6g, %.6g], \"position\": [%.6g, %.6g, %.6g], ",
+	    color[0], color[1], color[2], position[0], position[1], position[2]);
+    if(l < light_count) {
+      fprintf(file, "\"radial-a0\": 1, \"radial-a1\": 0, \"radial-a2\": %.6g}", 4.0 / (extent * extent));
+      continue;
+    }
+    double direction[3];
+    double length = 0;
+    for(int i = 0; i < 3; i++) {
+      direction[i] = uniform(-0.1, 0.1) * extent - position[i];
+      length += direction[i] * direction[i];
+    }
+    length = sqrt(length);
+    fprintf(file, "\"radial-a0\": 1, \"radial-a1\": 0, \"radial-a2\": 0, \"direction\": [%.6g, %.6g, %.6g], "
+	    "\"theta\": %.6g, \"angular_a0\": %.6g}", direction[0] / length, direction[1] / length,
+	    direction[2] / length, uniform(20.0, 60.0), uniform(1.0, 10.0));
+  }
+}
+
+
+/* Each plane faces the center from between 0.75 and 1.5 times the cube's size away, so the camera is
+ * always on the same side of it as the objects. */
+static void write_planes(FILE *file) {
+  for(long p = 0; p < plane_count; p++) {
+    double normal[3];
+    random_direction(normal);
+    double distance = uniform(0.75, 1.5) * extent;
+    Material material;
+    random_material(&material);
+    begin_spec(file);
+    fprintf(file, "{\"type\": \"plane\", \"normal\": [%.6g, %.6g, %.6g], \"position\": [%.6g, %.6g, %.6g], ",
+	    normal[0], normal[1], normal[2], -distance * normal[0], -distance * normal[1], -distance * normal[2]);
+    write_material(file, &material);
+  }
+}
+
+
+/* A unit sphere and a unit ellipsoid for each material; instances scale them to size. */
+static void write_prototypes(FILE *file) {
+  for(int p = 0; p < 2 * PALETTE_SIZE; p++) {
+    Material material;
+    random_material(&material);
+    begin_spec(file);
+    if(p < PALETTE_SIZE) {
+      fprintf(file, "{\"type\": \"sphere\", \"prototype\": %d, \"position\": [0, 0, 0], \"radius\": 1, ", p);
+    } else {
+      fprintf(file, "{\"type\": \"quadric\", \"prototype\": %d, \"A\": 1, \"B\": 1, \"C\": 1, \"J\": -1, ", p);
+    }
+    write_material(file, &material);
+  }
+}
+
+
+static void write_spheres(FILE *file) {
+  for(long s = 0; s < sphere_count; s++) {
+    double position[3];
+    random_position(position);
+    double radius = uniform(0.2, 0.8);
+    begin_spec(file);
+    if(instanced) {
+      fprintf(file, "{\"type\": \"instance\", \"prototype\": %d, \"position\": [%.6g, %.6g, %.6g], "
+	      "\"scale\": [%.6g, %.6g, %.6g]}", (int) (next_random() % PALETTE_SIZE), position[0], position[1],
+	      position[2], radius, radius, radius);
+      continue;
+    }
+    Material material;
+    random_material(&material);
+    fprintf(file, "{\"type\": \"sphere\", \"position\": [%.6g, %.6g, %.6g], \"radius\": %.6g, ",
+	    position[0], position[1], position[2], radius);
+    write_material(file, &material);
+  }
+}
+
+
+/* Ellipsoids with their axes along the world's, or turned at random when instanced. A quadric has no
+ * position of its own, so the center is folded into its coefficients. */
+static void write_quadrics(FILE *file) {
+  for(long q = 0; q < quadric_count; q++) {
+    double center[3];
+    random_position(center);
+    double axes[3] = {uniform(0.2, 0.9), uniform(0.2, 0.9), uniform(0.2, 0.9)};
+    begin_spec(file);
+    if(instanced) {
+      fprintf(file, "{\"type\": \"instance\", \"prototype\": %d, \"position\": [%.6g, %.6g, %.6g], "
+	      "\"scale\": [%.6g, %.6g, %.6g], \"rotation\": [%.6g, %.6g, %.6g]}",
+	      PALETTE_SIZE + (int) (next_random() % PALETTE_SIZE), center[0], center[1], center[2],
+	      axes[0], axes[1], axes[2], uniform(0, PI), uniform(0, PI), uniform(0, PI));
+      continue;
+    }
+    double a = 1.0 / (axes[0] * axes[0]);
+    double b = 1.0 / (axes[1] * axes[1]);
+    double c = 1.0 / (axes[2] * axes[2]);
+    Material material;
+    random_material(&material);
+    fprintf(file, "{\"type\": \"quadric\", \"A\": %.17g, \"B\": %.17g, \"C\": %.17g, \"G\": %.17g, "
+	    "\"H\": %.17g, \"I\": %.17g, \"J\": %.17g, ", a, b, c, -2 * a * center[0], -2 * b * center[1],
+	    -2 * c * center[2], a * center[0] * center[0] + b * center[1] * center[1] + c * center[2] * center[2] - 1);
+    write_material(file, &material);
+  }
+}
+
+
+static void random_position(double *out) {
+  long cluster = Clustered == layout ? (long) (next_random() % cluster_count) : -1;
+  for(int i = 0; i < 3; i++) {
+    out[i] = cluster < 0 ? uniform(-0.5, 0.5) * extent :
+      cluster_centers[3 * cluster + i] + gaussian() * SPACING * cbrt((double) CLUSTER_SIZE) / 4.0;
+  }
+}
+
+
+static void random_direction(double *out) {
+  double z = uniform(-1.0, 1.0);
+  double angle = uniform(0.0, 2.0 * PI);
+  double r = sqrt(1.0 - z * z);
+  out[0] = r * cos(angle);
+  out[1] = r * sin(angle);
+  out[2] = z;
+}
+
+
+/* Mirrors, glass and objects that are both are handed out by share; the rest are diffuse, with a
+ * highlight of random size. */
+static void random_material(Material *out) {
+  for(int i = 0; i < 3; i++) {
+    out->diffuse[i] = uniform(0.1, 0.9);
+  }
+  out->specular = uniform(0.2, 1.0);
+  out->ns = uniform(5.0, 100.0);
+  out->reflectivity = 0.0;
+  out->refractivity = 0.0;
+  out->ior = 1.0;
+  double pick = uniform(0.0, 1.0);
+  if(pick < reflective_share) {
+    out->reflectivity = uniform(0.3, 0.9);
+  } else if(pick < reflective_share + refractive_share) {
+    out->refractivity = uniform(0.5, 0.95);
+    out->ior = uniform(1.1, 2.0);
+  } else if(pick < reflective_share + refractive_share + mixed_share) {
+    out->reflectivity = uniform(0.1, 0.4);
+    out->refractivity = uniform(0.3, 0.5);
+    out->ior = uniform(1.1, 2.0);
+  }
+}
+
+
+/* Ends the object's spec. */
+static void write_material(FILE *file, Material *material) {
+  fprintf(file, "\"diffuse_color\": [%.6g, %.6g, %.6g], \"specular_color\": [%.6g, %.6g, %.6g], \"ns\": %.6g, "
+	  "\"reflectivity\": %.6g, \"refractivity\": %.6g, \"ior\": %.6g}", material->diffuse[0],
+	  material->diffuse[1], material->diffuse[2], material->specular, material->specular, material->specular,
+	  material->ns, material->reflectivity, material->refractivity, material->ior);
+}
+
+
+static double uniform(double lo, double hi) {
+  return lo + (hi - lo) * ((next_random() >> 11) * 0x1.0p-53);
+}
+
+
+/* A standard normal deviate, by the Box-Muller transform. */
+static double gaussian(void) {
+  double u = 1.0 - uniform(0.0, 1.0);
+  return sqrt(-2.0 * log(u)) * cos(2.0 * PI * uniform(0.0, 1.0));
+}
+
+
+/* The splitmix64 generator. */
+static uint64_t next_random(void) {
+  uint64_t z = (random_state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
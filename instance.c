@@ -0,0 +1,360 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include "instance.h"
+#include "boxtree.h"
+#include "object.h"
+#include "vecmath.h"
+#include "vec4.h"
+#include "util.h"
+
+// Slack, relative to the size of the coordinates involved, given to each copy's bounds so that
+// rounding in its transform can never leave part of it outside them
+#define BOUNDS_MARGIN 1e-6
+
+/* The copy's prototype, moved to position after to_object's inverse is applied. to_object is kept
+ * in float to save space; the copy is defined by the float values, and everything worked out from
+ * them is done in double, so the copy's surface, normals and bounds all agree with each other. */
+struct Instance {
+  double position[3];
+  float to_object[3][3];
+};
+
+typedef struct Instance Instance;
+
+/* Copies of an unbounded prototype are unbounded too and have no hierarchy; every ray tests them all. */
+struct InstanceSet {
+  int prototype_number;
+  ObjectRef prototype;
+  int count;
+  int capacity;
+  Instance *instances;
+  BoxTreeRef tree;
+};
+
+typedef struct InstanceSet InstanceSet;
+
+/* What is passed to the callbacks for the copies the tree visits: the copy the ray starts on, or
+ * while looking for it, the best so far and how far its surface is from the point. */
+struct InstanceSearch {
+  InstanceSetRef set;
+  int self;
+  double best_offset;
+};
+
+typedef struct InstanceSearch InstanceSearch;
+
+static void get_rotation(double*, double (*)[3]);
+static void bound_instance(Instance*, double*, double*, BoxEntry*);
+static double instance_intersection(InstanceSetRef, int, RayRef, bool);
+static double tree_instance_intersection(void*, int, RayRef);
+static int instance_at(InstanceSetRef, double*);
+static void visit_instance(void*, int, double*);
+static void to_object_frame(Instance*, double*, double*);
+static void apply_to_object(Instance*, double*, double*);
+
+
+/* Returns NULL if memory runs out. Copies are added with add_instance(), and the prototype is given
+ * to build_instance_set() once they all have been. number is what the scene calls the prototype. */
+InstanceSetRef new_instance_set(int number) {
+  InstanceSetRef set = checked_malloc(sizeof(*set));
+  if(NULL == set) return NULL;
+  set->prototype_number = number;
+  set->prototype = NULL;
+  set->count = 0;
+  set->capacity = 0;
+  set->instances = NULL;
+  set->tree = NULL;
+  return set;
+}
+
+
+int instance_set_prototype_number(InstanceSetRef set) {
+  return set->prototype_number;
+}
+
+
+int instance_count(InstanceSetRef set) {
+  return set->count;
+}
+
+
+/* Adds a copy of the prototype scaled along its own axes by scale, then turned by rotation radians
+ * about the x, y and z axes in that order, then moved to position. rotation and scale may be NULL,
+ * for none. Returns false if the scale would flatten the copy or memory runs out. */
+bool add_instance(InstanceSetRef set, double *position, double *rotation, double *scale) {
+  double no_rotation[3] = {0.0, 0.0, 0.0};
+  double unit_scale[3] = {1.0, 1.0, 1.0};
+  if(NULL == rotation) rotation = no_rotation;
+  if(NULL == scale) scale = unit_scale;
+  for(int a = 0; a < 3; a++) {
+    if(0 == scale[a] || !isfinite(scale[a])) {
+      set_error(RC_ERR_SCENE, "Instance scale must be finite and not 0");
+      return false;
+    }
+  }
+  if(set->count == set->capacity) {
+    int capacity = 0 == set->capacity ? 64 : 2 * set->capacity;
+    Instance *grown = realloc(set->instances, sizeof(*grown) * capacity);
+    if(NULL == grown) {
+      set_error(RC_ERR_NO_MEMORY, "Could not allocate memory for %d instances", capacity);
+      return false;
+    }
+    set->instances = grown;
+    set->capacity = capacity;
+  }
+
+  // The inverse of rotating after scaling is scaling by the reciprocals after the reverse rotation
+  double rotate[3][3];
+  get_rotation(rotation, rotate);
+  Instance *instance = &set->instances[set->count++];
+  vec_copy(position, instance->position);
+  for(int r = 0; r < 3; r++) {
+    for(int c = 0; c < 3; c++) {
+      instance->to_object[r][c] = (float) (rotate[c][r] / scale[r]);
+    }
+  }
+  return true;
+}
+
+
+/* Hands the set its prototype, which the set then owns, and builds the hierarchy over the copies.
+ * Returns false if memory runs out. */
+bool build_instance_set(InstanceSetRef set, ObjectRef prototype) {
+  set->prototype = prototype;
+  Point lo = {0.0};
+  Point hi = {0.0};
+  if(!object_bounds(prototype, lo, hi) || 0 == set->count) return true;
+
+  BoxEntry *entries = checked_malloc(sizeof(*entries) * set->count);
+  Instance *ordered = checked_malloc(sizeof(*ordered) * set->count);
+  if(NULL == entries || NULL == ordered) {
+    free(entries);
+    free(ordered);
+    return false;
+  }
+  for(int i = 0; i < set->count; i++) {
+    bound_instance(&set->instances[i], lo, hi, &entries[i]);
+    entries[i].item = i;
+  }
+  set->tree = new_box_tree(entries, set->count);
+  if(NULL == set->tree) {
+    free(entries);
+    free(ordered);
+    return false;
+  }
+
+  // Copies are stored in the order the leaves refer to them
+  for(int i = 0; i < set->count; i++) {
+    ordered[i] = set->instances[entries[i].item];
+  }
+  free(entries);
+  free(set->instances);
+  set->instances = ordered;
+  set->capacity = set->count;
+  return true;
+}
+
+
+ObjectRef instance_set_prototype(InstanceSetRef set) {
+  return set->prototype;
+}
+
+
+/* The nearest distance along the ray at which it meets any copy, or MISS. If leaving is true the
+ * ray starts on the surface of a copy, and that copy is tested with has_intersection_leaving(). */
+double instance_set_intersection(InstanceSetRef set, RayRef ray, bool leaving) {
+  int self = leaving ? instance_at(set, ray->origin) : -1;
+  if(NULL != set->tree) {
+    InstanceSearch search = {set, self, INFINITY};
+    return box_tree_nearest(set->tree, ray, tree_instance_intersection, &search);
+  }
+  double best_t = MISS;
+  for(int i = 0; i < set->count; i++) {
+    best_t = fmin(best_t, instance_intersection(set, i, ray, i == self));
+  }
+  return best_t;
+}
+
+
+/* The normal of the copy whose surface the point is on, in the scene's frame. */
+void get_instance_surface_normal(InstanceSetRef set, double *point, double *out) {
+  int i = instance_at(set, point);
+  if(i < 0) {
+    out[X] = 0.0;
+    out[Y] = 0.0;
+    out[Z] = 0.0;
+    return;
+  }
+  Instance *instance = &set->instances[i];
+  Point local = {0.0};
+  to_object_frame(instance, point, local);
+  Vec local_normal = {0.0};
+  get_surface_normal(set->prototype, local, local_normal);
+
+  // Normals go back with the transpose of the map points come in by
+  double normal[3];
+  for(int c = 0; c < 3; c++) {
+    normal[c] = (double) instance->to_object[0][c] * local_normal[X] +
+      (double) instance->to_object[1][c] * local_normal[Y] + (double) instance->to_object[2][c] * local_normal[Z];
+  }
+  v4_store(v4_normalize(v4_load(normal)), out);
+}
+
+
+/* Stores a box around all the copies and returns true, or returns false if they are unbounded. */
+bool instance_set_bounds(InstanceSetRef set, double *lo, double *hi) {
+  if(NULL == set->tree) return false;
+  box_tree_bounds(set->tree, lo, hi);
+  return true;
+}
+
+
+/* True if the sets place the same copies of the same geometry in the same order. */
+bool instance_sets_equal(InstanceSetRef a, InstanceSetRef b) {
+  if(a->count != b->count || !object_geometry_equals(a->prototype, b->prototype)) return false;
+  for(int i = 0; i < a->count; i++) {
+    Instance *ia = &a->instances[i];
+    Instance *ib = &b->instances[i];
+    if(0 != memcmp(ia->position, ib->position, sizeof(ia->position)) ||
+       0 != memcmp(ia->to_object, ib->to_object, sizeof(ia->to_object))) return false;
+  }
+  return true;
+}
+
+
+/* Also destroys the prototype, if the set has been given one. */
+void destroy_instance_set(InstanceSetRef set) {
+  if(NULL == set) return;
+  if(NULL != set->prototype) destroy_object(set->prototype);
+  free(set->instances);
+  destroy_box_tree(set->tree);
+  free(set);
+}
+
+
+/* The rotation by angles[X] about x, then angles[Y] about y, then angles[Z] about z. */
+static void get_rotation(double *angles, double (*out)[3]) {
+  double s[3];
+  double c[3];
+  for(int a = 0; a < 3; a++) {
+    s[a] = sin(angles[a]);
+    c[a] = cos(angles[a]);
+  }
+  out[0][0] = c[Y] * c[Z];
+  out[0][1] = s[X] * s[Y] * c[Z] - c[X] * s[Z];
+  out[0][2] = c[X] * s[Y] * c[Z] + s[X] * s[Z];
+  out[1][0] = c[Y] * s[Z];
+  out[1][1] = s[X] * s[Y] * s[Z] + c[X] * c[Z];
+  out[1][2] = c[X] * s[Y] * s[Z] - s[X] * c[Z];
+  out[2][0] = -s[Y];
+  out[2][1] = s[X] * c[Y];
+  out[2][2] = c[X] * c[Y];
+}
+
+
+/* The box around the copy of the prototype bounded by lo and hi: the box's center is carried over
+ * by the copy's transform, and each of its half widths is spread over the axes in proportion to the
+ * transform's entries. The transform is the inverse of to_object, worked out in double. */
+static void bound_instance(Instance *instance, double *lo, double *hi, BoxEntry *out) {
+  double m[3][3];
+  for(int r = 0; r < 3; r++) {
+    for(int c = 0; c < 3; c++) {
+      m[r][c] = instance->to_object[r][c];
+    }
+  }
+  double cofactor[3][3];
+  for(int r = 0; r < 3; r++) {
+    for(int c = 0; c < 3; c++) {
+      int r1 = (r + 1) % 3;
+      int r2 = (r + 2) % 3;
+      int c1 = (c + 1) % 3;
+      int c2 = (c + 2) % 3;
+      cofactor[r][c] = m[r1][c1] * m[r2][c2] - m[r1][c2] * m[r2][c1];
+    }
+  }
+  double det = m[0][0] * cofactor[0][0] + m[0][1] * cofactor[0][1] + m[0][2] * cofactor[0][2];
+  Point box_lo = {0.0};
+  Point box_hi = {0.0};
+  for(int r = 0; r < 3; r++) {
+    double center = 0.0;
+    double reach = 0.0;
+    for(int c = 0; c < 3; c++) {
+      // The inverse is the transposed cofactors over the determinant
+      double entry = cofactor[c][r] / det;
+      center += entry * (lo[c] + hi[c]) / 2.0;
+      reach += fabs(entry) * (hi[c] - lo[c]) / 2.0;
+    }
+    center += instance->position[r];
+    double margin = BOUNDS_MARGIN * (1.0 + fabs(center) + reach);
+    box_lo[r] = center - reach - margin;
+    box_hi[r] = center + reach + margin;
+  }
+  set_box_entry(out, box_lo, box_hi, 0);
+}
+
+
+/* The ray is moved into the copy's frame, where its direction is scaled back to unit length for the
+ * prototype's tests, and the distance found is scaled the same way on the way out. */
+static double instance_intersection(InstanceSetRef set, int i, RayRef ray, bool leaving) {
+  Instance *instance = &set->instances[i];
+  Ray local;
+  to_object_frame(instance, ray->origin, local.origin);
+  Vec local_dir = {0.0};
+  apply_to_object(instance, ray->dir, local_dir);
+  Vec4 dir = v4_load(local_dir);
+  double length = v4_length(dir);
+  v4_store(v4_scale(dir, 1.0 / length), local.dir);
+  double t = leaving ? has_intersection_leaving(&local, set->prototype) : has_intersection(&local, set->prototype);
+  return t > 0 && MISS != t ? t / length : MISS;
+}
+
+
+static double tree_instance_intersection(void *data, int i, RayRef ray) {
+  InstanceSearch *search = data;
+  return instance_intersection(search->set, i, ray, i == search->self);
+}
+
+
+/* The copy whose surface is nearest the point, going by the prototype's frame, among those whose
+ * bounds hold it; -1 if there are none. */
+static int instance_at(InstanceSetRef set, double *point) {
+  InstanceSearch search = {set, -1, INFINITY};
+  if(NULL != set->tree) {
+    box_tree_visit_containing(set->tree, point, visit_instance, &search);
+    return search.self;
+  }
+  for(int i = 0; i < set->count; i++) {
+    visit_instance(&search, i, point);
+  }
+  return search.self;
+}
+
+
+static void visit_instance(void *data, int i, double *point) {
+  InstanceSearch *search = data;
+  Point local = {0.0};
+  to_object_frame(&search->set->instances[i], point, local);
+  double offset = surface_offset(search->set->prototype, local);
+  if(offset < search->best_offset) {
+    search->best_offset = offset;
+    search->self = i;
+  }
+}
+
+
+static void to_object_frame(Instance *instance, double *point, double *out) {
+  Vec offset = {0.0};
+  vec_subtract(point, instance->position, offset);
+  apply_to_object(instance, offset, out);
+}
+
+
+static void apply_to_object(Instance *instance, double *v, double *out) {
+  for(int r = 0; r < 3; r++) {
+    out[r] = (double) instance->to_object[r][X] * v[X] + (double) instance->to_object[r][Y] * v[Y] +
+      (double) instance->to_object[r][Z] * v[Z];
+  }
+}
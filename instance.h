@@ -0,0 +1,26 @@
+#ifndef INSTANCE_HEADER
+#define INSTANCE_HEADER 1
+
+#include <stdbool.h>
+#include "object.h"
+#include "vecmath.h"
+
+/* Copies of one prototype object, each placed by its own affine transform. The prototype's geometry
+ * and material are stored once; each copy keeps only its position and the linear map into the
+ * prototype's frame, and rays are moved into that frame to be tested. A bounding volume hierarchy
+ * over the copies keeps the cost of a ray roughly logarithmic in their number. */
+typedef struct InstanceSet* InstanceSetRef;
+
+InstanceSetRef new_instance_set(int);
+int instance_set_prototype_number(InstanceSetRef);
+int instance_count(InstanceSetRef);
+bool add_instance(InstanceSetRef, double*, double*, double*);
+bool build_instance_set(InstanceSetRef, ObjectRef);
+ObjectRef instance_set_prototype(InstanceSetRef);
+double instance_set_intersection(InstanceSetRef, RayRef, bool);
+void get_instance_surface_normal(InstanceSetRef, double*, double*);
+bool instance_set_bounds(InstanceSetRef, double*, double*);
+bool instance_sets_equal(InstanceSetRef, InstanceSetRef);
+void destroy_instance_set(InstanceSetRef);
+
+#endif
@@ -0,0 +1,281 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "libraycast.h"
+#include "parser.h"
+#include "object.h"
+#include "spec.h"
+#include "raycast.h"
+#include "pixelbuf.h"
+#include "ppmwrite.h"
+#include "workpool.h"
+#include "util.h"
+
+struct RcScene {
+  RenderSceneRef render_scene;
+  char *key;
+  size_t key_len;
+};
+
+/* The lock makes calls on the same renderer take turns: the pool runs one job at a time, and the
+ * settings and statistics belong to whichever render holds it. */
+struct RcRenderer {
+  pthread_mutex_t lock;
+  WorkPoolRef pool;
+  double light_cutoff;
+  int light_budget;
+  bool single_precision;
+  RenderStats stats;
+};
+
+static int load_scene(Scene, RcScene**);
+static int status_of_last_error(void);
+static int failure_status(void);
+
+int rc_scene_load_file(const char *path, RcScene **scene_out) {
+  clear_error();
+  if(NULL == path || NULL == scene_out) {
+    return set_error(RC_ERR_ARGUMENT, "NULL argument passed to rc_scene_load_file");
+  }
+  *scene_out = NULL;
+  return load_scene(parse_scene_from_file((char*) path), scene_out);
+}
+
+
+int rc_scene_load_buffer(const char *json, size_t len, RcScene **scene_out) {
+  clear_error();
+  if(NULL == json || NULL == scene_out) {
+    return set_error(RC_ERR_ARGUMENT, "NULL argument passed to rc_scene_load_buffer");
+  }
+  *scene_out = NULL;
+  return load_scene(parse_scene_from_buffer((char*) json, len, NULL), scene_out);
+}
+
+
+void rc_scene_free(RcScene *scene) {
+  if(NULL == scene) return;
+  destroy_render_scene(scene->render_scene);
+  free(scene->key);
+  free(scene);
+}
+
+
+const char* rc_scene_key(const RcScene *scene, size_t *len_out) {
+  if(NULL != len_out) *len_out = NULL == scene ? 0 : scene->key_len;
+  return NULL == scene ? NULL : scene->key;
+}
+
+
+int rc_scene_shadow_candidates(const RcScene *scene, int *counts_out, int max_counts, int *light_count_out) {
+  clear_error();
+  if(NULL == scene || NULL == light_count_out || (NULL == counts_out && max_counts > 0)) {
+    return set_error(RC_ERR_ARGUMENT, "NULL argument passed to rc_scene_shadow_candidates");
+  }
+  int *counts = count_shadow_candidates(scene->render_scene);
+  if(NULL == counts) return failure_status();
+  int light_count = 0;
+  for(; NULL != scene->render_scene->lights[light_count]; light_count++) {
+    if(light_count < max_counts) counts_out[light_count] = counts[light_count];
+  }
+  free(counts);
+  *light_count_out = light_count;
+  return RC_OK;
+}
+
+
+int rc_renderer_new(int thread_count, RcRenderer **renderer_out) {
+  clear_error();
+  if(NULL == renderer_out) {
+    return set_error(RC_ERR_ARGUMENT, "NULL argument passed to rc_renderer_new");
+  }
+  *renderer_out = NULL;
+  RcRenderer *renderer = checked_malloc(sizeof(*renderer));
+  if(NULL == renderer) return RC_ERR_NO_MEMORY;
+  RenderStats zero_stats = {0};
+  renderer->light_cutoff = 0.0;
+  renderer->light_budget = 0;
+  renderer->single_precision = false;
+  renderer->stats = zero_stats;
+  renderer->pool = new_work_pool(thread_count);
+  if(NULL == renderer->pool) {
+    free(renderer);
+    return failure_status();
+  }
+  pthread_mutex_init(&renderer->lock, NULL);
+  *renderer_out = renderer;
+  return RC_OK;
+}
+
+
+void rc_renderer_free(RcRenderer *renderer) {
+  if(NULL == renderer) return;
+  destroy_work_pool(renderer->pool);
+  pthread_mutex_destroy(&renderer->lock);
+  free(renderer);
+}
+
+
+int rc_renderer_set_light_cutoff(RcRenderer *renderer, double cutoff) {
+  clear_error();
+  if(NULL == renderer) {
+    return set_error(RC_ERR_ARGUMENT, "NULL argument passed to rc_renderer_set_light_cutoff");
+  }
+  if(!(cutoff >= 0)) {
+    return set_error(RC_ERR_ARGUMENT, "The light cutoff must not be negative");
+  }
+  pthread_mutex_lock(&renderer->lock);
+  renderer->light_cutoff = cutoff;
+  pthread_mutex_unlock(&renderer->lock);
+  return RC_OK;
+}
+
+
+int rc_renderer_set_light_budget(RcRenderer *renderer, int budget) {
+  clear_error();
+  if(NULL == renderer) {
+    return set_error(RC_ERR_ARGUMENT, "NULL argument passed to rc_renderer_set_light_budget");
+  }
+  if(budget < 0) {
+    return set_error(RC_ERR_ARGUMENT, "The light budget must not be negative");
+  }
+  pthread_mutex_lock(&renderer->lock);
+  renderer->light_budget = budget;
+  pthread_mutex_unlock(&renderer->lock);
+  return RC_OK;
+}
+
+
+int rc_renderer_set_single_precision(RcRenderer *renderer, int enabled) {
+  clear_error();
+  if(NULL == renderer) {
+    return set_error(RC_ERR_ARGUMENT, "NULL argument passed to rc_renderer_set_single_precision");
+  }
+  pthread_mutex_lock(&renderer->lock);
+  renderer->single_precision = 0 != enabled;
+  pthread_mutex_unlock(&renderer->lock);
+  return RC_OK;
+}
+
+
+int rc_renderer_stats(const RcRenderer *renderer, RcRenderStats *stats_out) {
+  clear_error();
+  if(NULL == renderer || NULL == stats_out) {
+    return set_error(RC_ERR_ARGUMENT, "NULL argument passed to rc_renderer_stats");
+  }
+  // Only the lock is written, which the caller cannot see
+  pthread_mutex_t *lock = (pthread_mutex_t*) &renderer->lock;
+  pthread_mutex_lock(lock);
+  stats_out->shadow_rays_traced = renderer->stats.shadow_rays_traced;
+  stats_out->culled_by_distance = renderer->stats.culled_by_distance;
+  stats_out->culled_by_cone = renderer->stats.culled_by_cone;
+  stats_out->culled_by_facing = renderer->stats.culled_by_facing;
+  pthread_mutex_unlock(lock);
+  return RC_OK;
+}
+
+
+int rc_render(RcRenderer *renderer, const RcScene *scene, int width, int height, uint8_t *rgb_out,
+	      size_t rgb_len) {
+  return rc_render_rows(renderer, scene, width, height, 0, height, rgb_out, rgb_len);
+}
+
+
+int rc_render_rows(RcRenderer *renderer, const RcScene *scene, int width, int height, int first_row,
+		   int rows, uint8_t *rgb_out, size_t rgb_len) {
+  clear_error();
+  if(NULL == scene || NULL == rgb_out) {
+    return set_error(RC_ERR_ARGUMENT, "NULL argument passed to rc_render");
+  }
+  if(width <= 0 || height <= 0) {
+    return set_error(RC_ERR_ARGUMENT, "The image dimensions must be positive integers");
+  }
+  if(rows <= 0 || first_row < 0 || first_row + rows > height) {
+    return set_error(RC_ERR_ARGUMENT, "The requested rows must lie within the image and be non-empty");
+  }
+  if(rgb_len / 3 / (size_t) width < (size_t) rows) {
+    return set_error(RC_ERR_ARGUMENT, "The output buffer is smaller than width * rows * 3 bytes");
+  }
+
+  PixelBufRef pb = new_pixel_buf_over(rgb_out, width, rows);
+  if(NULL == pb) return RC_ERR_NO_MEMORY;
+  RenderJob job = {.scene = scene->render_scene, .width = width, .height = height, .first_row = first_row,
+		   .rows = rows};
+  if(NULL != renderer) {
+    pthread_mutex_lock(&renderer->lock);
+    RenderStats zero_stats = {0};
+    renderer->stats = zero_stats;
+    job.light_cutoff = renderer->light_cutoff;
+    job.light_budget = renderer->light_budget;
+    job.single_precision = renderer->single_precision;
+    job.stats = &renderer->stats;
+  }
+  bool rendered = raycast_job_into(&job, NULL == renderer ? NULL : renderer->pool, pb);
+  if(NULL != renderer) pthread_mutex_unlock(&renderer->lock);
+  destroy_pixel_buf(pb);
+  return rendered ? status_of_last_error() : failure_status();
+}
+
+
+int rc_write_ppm(const char *path, const uint8_t *rgb, int width, int height) {
+  clear_error();
+  if(NULL == path || NULL == rgb || width <= 0 || height <= 0) {
+    return set_error(RC_ERR_ARGUMENT, "Invalid argument passed to rc_write_ppm");
+  }
+  ppm_write((char*) path, '3', (uint8_t*) rgb, width, height);
+  return status_of_last_error();
+}
+
+
+const char* rc_last_error() {
+  return last_error_message();
+}
+
+
+const char* rc_status_string(int status) {
+  switch(status) {
+  case RC_OK: return "success";
+  case RC_ERR_ARGUMENT: return "invalid argument";
+  case RC_ERR_IO: return "input/output error";
+  case RC_ERR_PARSE: return "scene parse error";
+  case RC_ERR_SCENE: return "invalid scene";
+  case RC_ERR_NO_MEMORY: return "out of memory";
+  case RC_ERR_INTERNAL: return "internal error";
+  }
+  return "unknown status";
+}
+
+
+static int load_scene(Scene scene, RcScene **scene_out) {
+  if(NULL == scene) return failure_status();
+
+  RcScene *rc_scene = checked_malloc(sizeof(*rc_scene));
+  size_t key_len = 0;
+  // The key must be taken first: building the render scene consumes the specs
+  char *key = NULL == rc_scene ? NULL : scene_cache_key(scene, &key_len);
+  RenderSceneRef render_scene = NULL == key ? NULL : new_render_scene(scene);
+  destroy_scene(scene);
+  if(NULL == render_scene) {
+    free(key);
+    free(rc_scene);
+    return failure_status();
+  }
+
+  rc_scene->render_scene = render_scene;
+  rc_scene->key = key;
+  rc_scene->key_len = key_len;
+  *scene_out = rc_scene;
+  return RC_OK;
+}
+
+
+static int status_of_last_error() {
+  return last_error_status();
+}
+
+
+/* For paths that have already failed: never report success, even if no error was recorded. */
+static int failure_status() {
+  return error_occurred() ? last_error_status() : set_error(RC_ERR_INTERNAL, "Unknown failure");
+}
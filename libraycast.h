@@ -0,0 +1,96 @@
+#ifndef LIBRAYCAST_HEADER
+#define LIBRAYCAST_HEADER 1
+
+/* Public interface to the renderer for embedding it in other programs. No function here exits the
+ * process: failures are reported by returning a status other than RC_OK (or NULL), and a message
+ * describing the most recent failure on the calling thread is available from rc_last_error(). */
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum RcStatus {
+  RC_OK = 0,
+  RC_ERR_ARGUMENT,
+  RC_ERR_IO,
+  RC_ERR_PARSE,
+  RC_ERR_SCENE,
+  RC_ERR_NO_MEMORY,
+  RC_ERR_INTERNAL
+};
+
+typedef struct RcScene RcScene;
+typedef struct RcRenderer RcRenderer;
+
+/* Shadow rays traced by a render, and those skipped because the point was beyond the light's reach
+ * (see rc_renderer_set_light_cutoff()), outside a spotlight's cone, or on the far side of a sphere
+ * from the light. */
+typedef struct RcRenderStats {
+  long shadow_rays_traced;
+  long culled_by_distance;
+  long culled_by_cone;
+  long culled_by_facing;
+} RcRenderStats;
+
+/* Scenes are immutable once loaded and may be rendered by several threads at once. Mesh files named
+ * by relative paths are found in the scene file's directory; a scene loaded from a buffer has none,
+ * so its mesh files must be named by absolute paths. */
+int rc_scene_load_file(const char *path, RcScene **scene_out);
+int rc_scene_load_buffer(const char *json, size_t len, RcScene **scene_out);
+void rc_scene_free(RcScene *scene);
+
+/* A description of the scene as parsed that is identical for scene files differing only in
+ * whitespace, number formatting or the order of fields within an object, for use as a cache key.
+ * It includes the device, inode, size and times of each mesh file as they were when the scene was
+ * loaded, but not the meshes' bytes. It is not NUL terminated and lives as long as the scene. */
+const char* rc_scene_key(const RcScene *scene, size_t *len_out);
+
+/* Fills counts_out with up to max_counts entries, one per light in scene order: how many of the
+ * scene's objects can cast a shadow from that light and so are tested by its shadow rays. The
+ * number of lights is stored in light_count_out. */
+int rc_scene_shadow_candidates(const RcScene *scene, int *counts_out, int max_counts, int *light_count_out);
+
+/* A renderer owns a pool of threads kept warm between renders. A thread_count of 0 or less uses
+ * one thread per online processor. A renderer may be shared by several threads, but its pool runs
+ * one render at a time: calls on the same renderer are serialized, each render waiting for the one
+ * before it to finish, so threads that should render in parallel each need a renderer of their
+ * own. Settings changed while a render runs apply from the next one. */
+int rc_renderer_new(int thread_count, RcRenderer **renderer_out);
+void rc_renderer_free(RcRenderer *renderer);
+
+/* Lights are skipped wherever radial attenuation leaves their brightest channel below cutoff. The
+ * default of 0 never skips a light; any other value trades accuracy for speed. */
+int rc_renderer_set_light_cutoff(RcRenderer *renderer, double cutoff);
+
+/* In scenes with more lights than budget, each shading point traces only budget shadow rays, toward
+ * lights chosen at random by their likely contribution there and weighted to make up for the rest.
+ * Shading then costs about the same however many lights there are, at the price of some noise. The
+ * default of 0 always shades with every light. */
+int rc_renderer_set_light_budget(RcRenderer *renderer, int budget);
+
+/* If enabled is nonzero, rays are tested against the scene's objects in single precision, with
+ * positions taken relative to the camera so that scenes far from the origin lose no more than those
+ * near it; shading stays in double. Images may differ slightly from the default double precision
+ * renders, mostly along silhouettes and shadow edges. */
+int rc_renderer_set_single_precision(RcRenderer *renderer, int enabled);
+
+/* Fills stats_out with the counts for the renderer's most recent render. */
+int rc_renderer_stats(const RcRenderer *renderer, RcRenderStats *stats_out);
+
+/* Renders the scene into rgb_out, which must hold at least width * height * 3 bytes. Pixels are
+ * stored row by row starting with the top row, as in a PPM. The renderer may be NULL, in which case
+ * the calling thread does all of the work. */
+int rc_render(RcRenderer *renderer, const RcScene *scene, int width, int height, uint8_t *rgb_out,
+	      size_t rgb_len);
+
+/* Renders only the rows first_row..first_row+rows-1 of the width by height image. rgb_out must hold
+ * at least width * rows * 3 bytes. */
+int rc_render_rows(RcRenderer *renderer, const RcScene *scene, int width, int height, int first_row,
+		   int rows, uint8_t *rgb_out, size_t rgb_len);
+
+/* Writes a width by height RGB buffer as a plain (P3) PPM file. */
+int rc_write_ppm(const char *path, const uint8_t *rgb, int width, int height);
+
+const char* rc_last_error(void);
+const char* rc_status_string(int status);
+
+#endif
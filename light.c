@@ -6,90 +6,167 @@
 #include "light.h"
 #include "spec.h"
 #include "vecmath.h"
+#include "vec4.h"
 #include "util.h"
 
 
 #define DEG_TO_RAD_CONV_FACTOR (3.14159265358979323846 / 180.0)
-#define MAX_LIGHTS 128
+#define MAX_LIGHTS 65536
 
-static LightRef get_next_light_from_scene(Scene);
-static void validate_light(LightRef);
-static bool is_spotlight(LightRef);
-void get_common_contrib(LightRef, double*, double*);
+static bool get_next_light_from_scene(Scene, LightRef*);
+static void destroy_light(LightRef);
+static bool validate_light(LightRef);
+static bool vectors_equal(double*, double*);
+static double* copy_vector(double*);
+static Vec4 get_common_contrib(LightRef, Vec4);
 
+/* Returns a NULL terminated array of the scene's lights, or NULL if any light is invalid. */
 LightRef* get_lights_from_scene(Scene scene) {
-  LightRef* lights = checked_malloc(sizeof(*lights) * (MAX_LIGHTS + 1));
+  int capacity = 16;
+  LightRef* lights = checked_malloc(sizeof(*lights) * (capacity + 1));
+  if(NULL == lights) return NULL;
   int i = 0;
-  LightRef last_got_light = get_next_light_from_scene(scene);
-  while(NULL != last_got_light && i < MAX_LIGHTS) {
+  lights[i] = NULL;
+  LightRef last_got_light;
+  bool ok = get_next_light_from_scene(scene, &last_got_light);
+  while(ok && NULL != last_got_light && i < MAX_LIGHTS) {
+    if(i == capacity) {
+      capacity *= 2;
+      LightRef *grown = realloc(lights, sizeof(*lights) * (capacity + 1));
+      if(NULL == grown) {
+	set_error(RC_ERR_NO_MEMORY, "Could not allocate memory");
+	destroy_light(last_got_light);
+	ok = false;
+	break;
+      }
+      lights = grown;
+    }
     lights[i] = last_got_light;
-    last_got_light = get_next_light_from_scene(scene);
-    i++;
+    lights[++i] = NULL;
+    ok = get_next_light_from_scene(scene, &last_got_light);
   }
-  lights[i] = NULL;
+  if(!ok) {
+    destroy_lights(lights);
+    return NULL;
+  }
+  if(NULL != last_got_light) destroy_light(last_got_light);
 
   return lights;
 }
 
 
+/* False if the point lies outside a spotlight's cone, theta being the cone's full angle. */
 bool light_is_contributing(LightRef light, double *intersectward_n) {
-  return true;
-  if(!is_spotlight(light)) {
+  if(!light->spotlight) {
     return true;
   } else {
-    return !(acos(vec_dot(intersectward_n, light->direction)) > light->theta / 2.0);
+    Vec4 direction = v4_load(light->direction);
+    double cos_angle = v4_dot(v4_load(intersectward_n), direction) / v4_length(direction);
+    return !(acos(fmax(-1.0, fmin(1.0, cos_angle))) > light->theta / 2.0);
+  }
+}
+
+
+/* The distance beyond which radial attenuation leaves the light's brightest channel below cutoff,
+ * or INFINITY if there is none. Material colors and the angle of incidence only dim it further. */
+double light_influence_radius(LightRef light, double cutoff) {
+  if(cutoff <= 0 || light->radial_a1 < 0 || light->radial_a2 < 0) return INFINITY;
+  double brightest = fmax(light->color[0], fmax(light->color[1], light->color[2]));
+  // Solve radial_a2 * d^2 + radial_a1 * d + radial_a0 = brightest / cutoff for d
+  double excess = light->radial_a0 - brightest / cutoff;
+  if(excess >= 0) return 0.0;
+  if(0 == light->radial_a2) {
+    return 0 == light->radial_a1 ? INFINITY : -excess / light->radial_a1;
   }
+  double a1 = light->radial_a1;
+  double a2 = light->radial_a2;
+  return (-a1 + sqrt(a1 * a1 - 4.0 * a2 * excess)) / (2.0 * a2);
 }
 
 
 void get_diffuse_contrib(LightRef light, double *intersectward_n, double *surface_n, double *out) {
-  get_common_contrib(light, intersectward_n, out);
-  vec_scale(out, -vec_dot(intersectward_n, surface_n), out);
+  Vec4 intersectward = v4_load(intersectward_n);
+  Vec4 contrib = get_common_contrib(light, intersectward);
+  v4_store(v4_scale(contrib, -v4_dot(intersectward, v4_load(surface_n))), out);
 }
 
 
 void get_specular_contrib(LightRef light, double *intersectward_n, double *surface_n, double *view_n,
 			  double ns, double *out) {
-  get_common_contrib(light, intersectward_n, out);
-  double reflection_n[3] = {0.0};
-  vec_reflect(intersectward_n, surface_n, reflection_n);
-  double intermediate_dot = vec_dot(reflection_n, view_n);
+  Vec4 intersectward = v4_load(intersectward_n);
+  Vec4 contrib = get_common_contrib(light, intersectward);
+  double intermediate_dot = v4_dot(v4_reflect(intersectward, v4_load(surface_n)), v4_load(view_n));
   intermediate_dot = intermediate_dot < 0 ? 0 : intermediate_dot;
-  vec_scale(out, pow(intermediate_dot, ns), out);
+  v4_store(v4_scale(contrib, pow(intermediate_dot, ns)), out);
 }
 
 
-void get_common_contrib(LightRef light, double *intersectward_n, double *out) {
-  vec_copy(light->color, out);
-  if(is_spotlight(light)) {
-    vec_scale(out, pow(vec_dot(intersectward_n, light->direction), light->angular_a0), out);
+void attenuate_radially(LightRef light, double dist, double *diffuse_contrib, double *specular_contrib) {
+  double radial_s = 1.0 / (dist * dist * light->radial_a2 + dist * light->radial_a1 + light->radial_a0);
+  v4_store(v4_scale(v4_load(diffuse_contrib), radial_s), diffuse_contrib);
+  v4_store(v4_scale(v4_load(specular_contrib), radial_s), specular_contrib);
+}
+
+
+void destroy_lights(LightRef* lights) {
+  for(LightRef *iter = lights; NULL != *iter; iter++) {
+    destroy_light(*iter);
   }
+  free(lights);
 }
 
 
-void attenuate_radially(LightRef light, double dist, double *diffuse_contrib, double *specular_contrib) {
-  double radial_s = 1.0 / (pow(dist, 2) * light->radial_a2 + dist * light->radial_a1 + light->radial_a0);
-  vec_scale(diffuse_contrib, radial_s, diffuse_contrib);
-  vec_scale(specular_contrib, radial_s, specular_contrib);
+/* Returns a deep copy of the NULL terminated array of lights, or NULL if memory runs out. */
+LightRef* copy_lights(LightRef* lights) {
+  int count = 0;
+  while(NULL != lights[count]) count++;
+  LightRef* copies = checked_malloc(sizeof(*copies) * (count + 1));
+  if(NULL == copies) return NULL;
+  copies[0] = NULL;
+  for(int i = 0; i < count; i++) {
+    LightRef l = checked_malloc(sizeof(*l));
+    if(NULL == l) {
+      destroy_lights(copies);
+      return NULL;
+    }
+    *l = *lights[i];
+    l->position = copy_vector(lights[i]->position);
+    l->color = copy_vector(lights[i]->color);
+    l->direction = copy_vector(lights[i]->direction);
+    copies[i] = l;
+    copies[i + 1] = NULL;
+    if(NULL == l->position || NULL == l->color || (NULL != lights[i]->direction && NULL == l->direction)) {
+      destroy_lights(copies);
+      return NULL;
+    }
+  }
+  return copies;
+}
+
+
+/* True if the two lights would light a scene identically. */
+bool light_equals(LightRef a, LightRef b) {
+  return vectors_equal(a->position, b->position) && vectors_equal(a->color, b->color) &&
+    vectors_equal(a->direction, b->direction) && a->radial_a0 == b->radial_a0 &&
+    a->radial_a1 == b->radial_a1 && a->radial_a2 == b->radial_a2 && a->theta == b->theta &&
+    a->angular_a0 == b->angular_a0;
 }
 
 
 void print_lights(LightRef* lights) {
   LightRef l;
-  bool l_is_spotlight = false;
   while(NULL != (l = *lights)) {
-    l_is_spotlight = is_spotlight(l);
     printf("\n");
     printf("Light:\n");
     printf("\tPosition: [%f, %f, %f]\n", l->position[0], l->position[1], l->position[2]);
-    if(l_is_spotlight) {
+    if(l->spotlight) {
       printf("\tDirection: [%f, %f, %f]\n", l->direction[0], l->direction[1], l->direction[2]);
     }
     printf("\tColor: [%f, %f, %f]\n", l->color[0], l->color[1], l->color[2]);
     printf("\tRadial-a0: %f\n", l->radial_a0);
     printf("\tRadial-a1: %f\n", l->radial_a1);
     printf("\tRadial-a2: %f\n", l->radial_a2);
-    if(l_is_spotlight) {
+    if(l->spotlight) {
       printf("\tTheta: %f\n", l->theta);
       printf("\tAngular-a0: %f\n", l->angular_a0);
     }
@@ -98,12 +175,19 @@ void print_lights(LightRef* lights) {
 }
 
 
-static LightRef get_next_light_from_scene(Scene scene) {
+/* Stores the next light in out, or NULL if there are no more, and returns false if the light's spec
+ * is invalid. */
+static bool get_next_light_from_scene(Scene scene, LightRef *out) {
+  *out = NULL;
   SpecRef light_spec = next_spec_declaring_kind(scene, "light");
-  if(NULL == light_spec) return NULL;
+  if(NULL == light_spec) return true;
 
   Light zero_light = {0};
   LightRef l = checked_malloc(sizeof(*l));
+  if(NULL == l) {
+    destroy_spec(light_spec);
+    return false;
+  }
   *l = zero_light;
   l->position = next_vector_field_value_with_name(light_spec, "position");
   l->color = next_vector_field_value_with_name(light_spec, "color");
@@ -114,55 +198,87 @@ static LightRef get_next_light_from_scene(Scene scene) {
   l->theta = next_scalar_field_value_with_name(light_spec, "theta");
   l->angular_a0 = next_scalar_field_value_with_name(light_spec, "angular_a0");
 
-  validate_light(l);
   destroy_spec(light_spec);
+  if(!validate_light(l)) {
+    destroy_light(l);
+    return false;
+  }
+  l->spotlight = (NO_SCALAR != l->theta) && (0 != l->theta);
+
+  *out = l;
+  return true;
+}
+
 
-  return l;
+static void destroy_light(LightRef l) {
+  free(l->position);
+  free(l->color);
+  free(l->direction);
+  free(l);
 }
 
 
-static bool is_spotlight(LightRef l) {
-  return (NO_SCALAR != l->theta) && (0 != l->theta);
+static bool vectors_equal(double *a, double *b) {
+  if(NULL == a || NULL == b) return a == b;
+  return a[0] == b[0] && a[1] == b[1] && a[2] == b[2];
 }
 
 
-static void validate_light(LightRef l) {
+static double* copy_vector(double *v) {
+  if(NULL == v) return NULL;
+  double *copy = checked_malloc(sizeof(double) * 3);
+  if(NULL != copy) v4_store(v4_load(v), copy);
+  return copy;
+}
+
+
+static Vec4 get_common_contrib(LightRef light, Vec4 intersectward) {
+  Vec4 contrib = v4_load(light->color);
+  if(light->spotlight) {
+    contrib = v4_scale(contrib, pow(v4_dot(intersectward, v4_load(light->direction)), light->angular_a0));
+  }
+  return contrib;
+}
+
+
+static bool validate_light(LightRef l) {
   if(NULL == l->position) {
-    fprintf(stderr, "Error: No position specified for light\n");
-    exit(EXIT_FAILURE);
+    set_error(RC_ERR_SCENE, "No position specified for light");
+    return false;
   }
   if(NULL == l->color) {
-    fprintf(stderr, "Error: No color specified for light\n");
-    exit(EXIT_FAILURE);
+    set_error(RC_ERR_SCENE, "No color specified for light");
+    return false;
   }
   if(NO_SCALAR == l->radial_a0) {
-    fprintf(stderr, "Error: No radial-a0 specified for light\n");
-    exit(EXIT_FAILURE);
+    set_error(RC_ERR_SCENE, "No radial-a0 specified for light");
+    return false;
   }
   if(NO_SCALAR == l->radial_a1) {
-    fprintf(stderr, "Error: No radial-a1 specified for light\n");
-    exit(EXIT_FAILURE);
+    set_error(RC_ERR_SCENE, "No radial-a1 specified for light");
+    return false;
   }
   if(NO_SCALAR == l->radial_a2) {
-    fprintf(stderr, "Error: No radial-a2 specified for light\n");
-    exit(EXIT_FAILURE);
+    set_error(RC_ERR_SCENE, "No radial-a2 specified for light");
+    return false;
   }
   if((l->theta != NO_SCALAR && l->theta != 0) || l->direction != NULL || l->angular_a0 != NO_SCALAR) {
     if(NO_SCALAR == l->theta) {
-      fprintf(stderr, "Error: No theta specified for spot-light\n");
-      exit(EXIT_FAILURE);
+      set_error(RC_ERR_SCENE, "No theta specified for spot-light");
+      return false;
     } else {
       l->theta = DEG_TO_RAD_CONV_FACTOR * l->theta;
     }
 
     if(NULL == l->direction) {
-      fprintf(stderr, "Error: No direction vector specified for spot-light\n");
-      exit(EXIT_FAILURE);
+      set_error(RC_ERR_SCENE, "No direction vector specified for spot-light");
+      return false;
     }
 
     if(NO_SCALAR == l->angular_a0) {
-      fprintf(stderr, "Error: No angular-a0 specified for spot-light\n");
-      exit(EXIT_FAILURE);
+      set_error(RC_ERR_SCENE, "No angular-a0 specified for spot-light");
+      return false;
     }
   }
+  return true;
 }
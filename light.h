@@ -11,6 +11,7 @@ struct Light {
   double radial_a0;
   double radial_a1;
   double radial_a2;
+  bool spotlight;  // Set when the light is loaded
   // Spotlights only
   double *direction;
   double theta;
@@ -23,9 +24,13 @@ typedef struct Light * LightRef;
 LightRef* get_lights_from_scene(Scene);
 void illumination_for_light(LightRef, double, double*, double*, double*, double*, double*);
 bool light_is_contributing(LightRef, double*);
+double light_influence_radius(LightRef, double);
 void get_diffuse_contrib(LightRef, double*, double*, double*);
 void get_specular_contrib(LightRef, double*, double*, double*, double, double*);
 void attenuate_radially(LightRef, double, double*, double*);
+LightRef* copy_lights(LightRef*);
+bool light_equals(LightRef, LightRef);
+void destroy_lights(LightRef*);
 void print_lights(LightRef*);
 
 #endif
@@ -0,0 +1,182 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <math.h>
+#include "lighttree.h"
+#include "light.h"
+#include "vecmath.h"
+#include "util.h"
+
+/* Each node bounds the positions of its lights and sums their brightest channels. min_a0, min_a1 and
+ * min_a2 are the smallest radial attenuation terms among them, so a node falls off no faster than its
+ * slowest-fading light. Leaves hold a single light. */
+struct LightTreeNode {
+  Point lo;
+  Point hi;
+  double power;
+  double min_a0;
+  double min_a1;
+  double min_a2;
+  int left;
+  int right;
+  int light;
+};
+
+typedef struct LightTreeNode LightTreeNode;
+
+struct LightTree {
+  int node_count;
+  LightTreeNode *nodes;
+  LightRef *lights;
+};
+
+typedef struct LightTree LightTree;
+
+struct SortEntry {
+  double key;
+  int light;
+};
+
+typedef struct SortEntry SortEntry;
+
+static int build_node(LightTreeRef, SortEntry*, int, int);
+static void bound_lights(LightTreeRef, LightTreeNode*, SortEntry*, int, int);
+static double node_importance(LightTreeNode*, double*);
+static int compare_sort_entries(const void*, const void*);
+
+/* Returns NULL if the scene has no lights or memory runs out. The tree refers to the lights, which
+ * must outlive it. */
+LightTreeRef new_light_tree(LightRef *lights) {
+  int light_count = 0;
+  while(NULL != lights[light_count]) light_count++;
+  if(0 == light_count) return NULL;
+
+  LightTreeRef tree = checked_malloc(sizeof(*tree));
+  SortEntry *entries = checked_malloc(sizeof(*entries) * light_count);
+  LightTreeNode *nodes = checked_malloc(sizeof(*nodes) * (2 * light_count - 1));
+  if(NULL == tree || NULL == entries || NULL == nodes) {
+    free(tree);
+    free(entries);
+    free(nodes);
+    return NULL;
+  }
+  tree->node_count = 0;
+  tree->nodes = nodes;
+  tree->lights = lights;
+  for(int i = 0; i < light_count; i++) {
+    entries[i].light = i;
+  }
+  build_node(tree, entries, 0, light_count);
+  free(entries);
+  return tree;
+}
+
+
+/* Picks a light for the point by walking down from the root, taking each child with probability in
+ * proportion to its importance there. u must lie in [0, 1); nearby values of u pick lights that are
+ * near each other in the tree, so stratified values of u spread the picks over the lights. Stores
+ * the probability of the pick in pdf_out and returns the light's index. */
+int sample_light_tree(LightTreeRef tree, double *point, double u, double *pdf_out) {
+  double pdf = 1.0;
+  LightTreeNode *node = &tree->nodes[0];
+  while(node->light < 0) {
+    LightTreeNode *left = &tree->nodes[node->left];
+    LightTreeNode *right = &tree->nodes[node->right];
+    double left_importance = node_importance(left, point);
+    double right_importance = node_importance(right, point);
+    double total = left_importance + right_importance;
+    double p_left = total > 0 ? left_importance / total : 0.5;
+    if(u < p_left) {
+      u /= p_left;
+      pdf *= p_left;
+      node = left;
+    } else {
+      u = (u - p_left) / (1.0 - p_left);
+      pdf *= 1.0 - p_left;
+      node = right;
+    }
+    // Rounding can push u to 1
+    if(u >= 1.0) u = nextafter(1.0, 0.0);
+  }
+  *pdf_out = pdf;
+  return node->light;
+}
+
+
+void destroy_light_tree(LightTreeRef tree) {
+  if(NULL == tree) return;
+  free(tree->nodes);
+  free(tree);
+}
+
+
+/* Builds the node for entries[first..first+count-1], splitting at the median of the widest axis of
+ * their bounds. Returns the node's index. */
+static int build_node(LightTreeRef tree, SortEntry *entries, int first, int count) {
+  int index = tree->node_count++;
+  LightTreeNode *node = &tree->nodes[index];
+  bound_lights(tree, node, entries, first, count);
+  node->left = -1;
+  node->right = -1;
+  node->light = -1;
+  if(1 == count) {
+    node->light = entries[first].light;
+    return index;
+  }
+
+  int axis = 0;
+  for(int a = 1; a < 3; a++) {
+    if(node->hi[a] - node->lo[a] > node->hi[axis] - node->lo[axis]) axis = a;
+  }
+  for(int i = first; i < first + count; i++) {
+    entries[i].key = tree->lights[entries[i].light]->position[axis];
+  }
+  qsort(&entries[first], count, sizeof(*entries), compare_sort_entries);
+  node->left = build_node(tree, entries, first, count / 2);
+  node->right = build_node(tree, entries, first + count / 2, count - count / 2);
+  return index;
+}
+
+
+static void bound_lights(LightTreeRef tree, LightTreeNode *node, SortEntry *entries, int first, int count) {
+  LightRef light = tree->lights[entries[first].light];
+  vec_copy(light->position, node->lo);
+  vec_copy(light->position, node->hi);
+  node->power = 0.0;
+  node->min_a0 = INFINITY;
+  node->min_a1 = INFINITY;
+  node->min_a2 = INFINITY;
+  for(int i = first; i < first + count; i++) {
+    light = tree->lights[entries[i].light];
+    for(int a = 0; a < 3; a++) {
+      node->lo[a] = fmin(node->lo[a], light->position[a]);
+      node->hi[a] = fmax(node->hi[a], light->position[a]);
+    }
+    node->power += fmax(0.0, fmax(light->color[0], fmax(light->color[1], light->color[2])));
+    node->min_a0 = fmin(node->min_a0, light->radial_a0);
+    node->min_a1 = fmin(node->min_a1, light->radial_a1);
+    node->min_a2 = fmin(node->min_a2, light->radial_a2);
+  }
+}
+
+
+/* The node's power attenuated over the distance to the center of its bounds, taken as no less than
+ * half their diagonal so that a point among the lights does not make one node swamp the other. */
+static double node_importance(LightTreeNode *node, double *point) {
+  Point center = {0.0};
+  Vec diagonal = {0.0};
+  vec_add(node->lo, node->hi, center);
+  vec_scale(center, 0.5, center);
+  vec_subtract(node->hi, node->lo, diagonal);
+  double dist = fmax(point_distance(point, center), vec_magnitude(diagonal) / 2.0);
+  double falloff = node->min_a2 * dist * dist + node->min_a1 * dist + node->min_a0;
+  return falloff > 0 ? node->power / falloff : node->power;
+}
+
+
+static int compare_sort_entries(const void *a, const void *b) {
+  const SortEntry *ea = a;
+  const SortEntry *eb = b;
+  if(ea->key != eb->key) return ea->key < eb->key ? -1 : 1;
+  return ea->light - eb->light;
+}
@@ -0,0 +1,14 @@
+#ifndef LIGHTTREE_HEADER
+#define LIGHTTREE_HEADER 1
+
+#include "light.h"
+
+/* A bounding volume hierarchy over a scene's lights, for picking the lights that matter most at a
+ * point without looking at every one of them. */
+typedef struct LightTree* LightTreeRef;
+
+LightTreeRef new_light_tree(LightRef*);
+int sample_light_tree(LightTreeRef, double*, double, double*);
+void destroy_light_tree(LightTreeRef);
+
+#endif
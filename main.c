@@ -1,55 +1,469 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
-#include "parser.h"
-#include "spec.h"
-#include "camera.h"
-#include "object.h"
-#include "light.h"
-#include "pixelbuf.h"
-#include "raycast.h"
-#include "ppmwrite.h"
-
-static void validate_argc(int);
+#include <stdbool.h>
+#include <string.h>
+#include "libraycast.h"
+#include "shard.h"
+#include "daemon.h"
+#include "batch.h"
+#include "animate.h"
+#include "relight.h"
+#include "watch.h"
+#include "views.h"
+#include "rendercache.h"
+
+static void parse_args(int, char**);
+static void usage_error(char*);
+static void parse_shard_option(char*);
+static void parse_rows_option(char*);
+static void parse_threads_option(char*);
+static void parse_frames_option(char*);
+static void parse_cache_size_option(char*);
 static void initializes_static_vars(char**);
+static void validate_shard(void);
+static void exit_on_failure(int);
+static RenderCacheRef open_cache_or_exit(void);
+static void report_shadow_candidates(RcScene*);
+static void report_render_stats(RcRenderer*);
+static void parse_light_cutoff_option(char*);
+static void parse_light_budget_option(char*);
+static char* render_settings(void);
+static void report_float_validation(const uint8_t*, const uint8_t*, size_t);
 
 static int width;
 static int height;
 static char* input_file_name;
 static char* output_file_name;
+static bool sharded = false;
+static int shard_index = -1;
+static int shard_count = 0;
+static ShardInfo shard = {0};
+static int thread_count = 0;
+static char* daemon_socket_path = NULL;
+static char* batch_manifest_path = NULL;
+static char* animation_path = NULL;
+static int frame_count = 0;
+static bool temporal = false;
+static char** light_paths = NULL;
+static int light_path_count = 0;
+static bool relighting = false;
+static bool watching = false;
+static bool viewing = false;
+static bool show_stats = false;
+static double light_cutoff = 0.0;
+static int light_budget = 0;
+static bool single_precision = false;
+static bool validate_float = false;
+static char* cache_dir = NULL;
+static long long cache_megabytes = RENDER_CACHE_DEFAULT_MB;
 
 int main(int argc, char* argv[]) {
-  validate_argc(argc);
-  initializes_static_vars(argv);
-  Scene scene = parse_scene_from_file(input_file_name);
-  CameraRef camera = get_camera_from_scene(scene);
-  ObjectRef *objects = get_objects_from_scene(scene);
-  LightRef *lights = get_lights_from_scene(scene);
-  PixelBufRef pixel_buf = raycast(camera, objects, lights, width, height); //REFACTOR: Too many params!
-  uint8_t *byte_buf = get_byte_array(pixel_buf);
-  ppm_write(output_file_name, '3', byte_buf, width, height);
+  parse_args(argc, argv);
+  if(NULL != daemon_socket_path) {
+    run_render_daemon(daemon_socket_path, thread_count);
+    exit(EXIT_SUCCESS);
+  }
+  if(NULL != batch_manifest_path) {
+    RenderCacheRef cache = open_cache_or_exit();
+    int status = run_batch(batch_manifest_path, thread_count, cache);
+    close_render_cache(cache);
+    exit(status);
+  }
+  if(NULL != animation_path) {
+    AnimationRequest req = {animation_path, input_file_name, output_file_name, frame_count, width, height,
+			    thread_count, temporal};
+    exit(run_animation(&req));
+  }
+  if(relighting) {
+    RelightRequest req = {input_file_name, output_file_name, light_paths, light_path_count, width, height,
+			  thread_count};
+    exit(run_relight(&req));
+  }
+  if(watching) {
+    WatchRequest req = {input_file_name, output_file_name, width, height, thread_count};
+    exit(run_watch(&req));
+  }
+  if(viewing) {
+    ViewsRequest req = {input_file_name, output_file_name, width, height, thread_count};
+    exit(run_views(&req));
+  }
+
+  RcScene *scene = NULL;
+  exit_on_failure(rc_scene_load_file(input_file_name, &scene));
+  if(show_stats) report_shadow_candidates(scene);
+  RenderCacheRef cache = open_cache_or_exit();
+  char *cache_key = NULL;
+  size_t cache_key_len = 0;
+  if(NULL != cache) {
+    size_t scene_key_len = 0;
+    const char *scene_key = rc_scene_key(scene, &scene_key_len);
+    cache_key = render_cache_key(scene_key, scene_key_len, width, height, shard.first_row, shard.rows,
+				 render_settings(), &cache_key_len);
+    if(NULL == cache_key) exit_on_failure(RC_ERR_NO_MEMORY);
+    if(render_cache_fetch(cache, cache_key, cache_key_len, output_file_name)) {
+      report_render_cache(cache);
+      free(cache_key);
+      close_render_cache(cache);
+      rc_scene_free(scene);
+      exit(EXIT_SUCCESS);
+    }
+  }
+  RcRenderer *renderer = NULL;
+  exit_on_failure(rc_renderer_new(thread_count, &renderer));
+  exit_on_failure(rc_renderer_set_light_cutoff(renderer, light_cutoff));
+  exit_on_failure(rc_renderer_set_light_budget(renderer, light_budget));
+  exit_on_failure(rc_renderer_set_single_precision(renderer, single_precision));
+
+  size_t byte_count = (size_t) shard.width * shard.rows * 3;
+  uint8_t *byte_buf = malloc(byte_count);
+  if(NULL == byte_buf) {
+    fprintf(stderr, "Error: Could not allocate the image buffer\n");
+    exit(EXIT_FAILURE);
+  }
+  exit_on_failure(rc_render_rows(renderer, scene, width, height, shard.first_row, shard.rows,
+				 byte_buf, byte_count));
+  if(show_stats) report_render_stats(renderer);
+  if(validate_float) {
+    uint8_t *reference_buf = malloc(byte_count);
+    if(NULL == reference_buf) {
+      fprintf(stderr, "Error: Could not allocate the image buffer\n");
+      exit(EXIT_FAILURE);
+    }
+    exit_on_failure(rc_renderer_set_single_precision(renderer, 0));
+    exit_on_failure(rc_render_rows(renderer, scene, width, height, shard.first_row, shard.rows,
+				   reference_buf, byte_count));
+    report_float_validation(reference_buf, byte_buf, byte_count / 3);
+    free(reference_buf);
+  }
+  if(sharded) {
+    shard_write(output_file_name, &shard, byte_buf);
+  } else {
+    exit_on_failure(rc_write_ppm(output_file_name, byte_buf, width, height));
+  }
+  if(NULL != cache) {
+    render_cache_store(cache, cache_key, cache_key_len, output_file_name);
+    report_render_cache(cache);
+  }
+
+  free(byte_buf);
+  rc_renderer_free(renderer);
+  rc_scene_free(scene);
+  free(cache_key);
+  close_render_cache(cache);
 
   exit(EXIT_SUCCESS);
 }
 
 
-static void validate_argc(int argc) {
-  if(argc != 5) {
-    fprintf(stderr, "ERROR: You supplied an incorrect number of arguments.\n");
-    fprintf(stderr, "ERROR: Correct usage is:\n");
-    fprintf(stderr, "ERROR: \traycast width height input_file.json output_file.ppm\n");
-    exit(EXIT_FAILURE);
+/* Options may appear anywhere on the command line; whatever remains must be the four positional
+ * arguments. */
+static void parse_args(int argc, char *argv[]) {
+  char *positional[4];
+  int positional_count = 0;
+  light_paths = malloc(sizeof(*light_paths) * argc);
+  if(NULL == light_paths) usage_error("Could not allocate memory.");
+  for(int i = 1; i < argc; i++) {
+    if(0 == strcmp(argv[i], "--shard") || 0 == strcmp(argv[i], "--rows") ||
+       0 == strcmp(argv[i], "--threads") || 0 == strcmp(argv[i], "--daemon") ||
+       0 == strcmp(argv[i], "--batch") || 0 == strcmp(argv[i], "--animate") ||
+       0 == strcmp(argv[i], "--frames") || 0 == strcmp(argv[i], "--relight") ||
+       0 == strcmp(argv[i], "--cache") || 0 == strcmp(argv[i], "--cache-size") ||
+       0 == strcmp(argv[i], "--light-cutoff") || 0 == strcmp(argv[i], "--light-budget")) {
+      if(i + 1 >= argc) usage_error("This option requires a value.");
+      if(0 == strcmp(argv[i], "--shard")) {
+	parse_shard_option(argv[++i]);
+      } else if(0 == strcmp(argv[i], "--rows")) {
+	parse_rows_option(argv[++i]);
+      } else if(0 == strcmp(argv[i], "--threads")) {
+	parse_threads_option(argv[++i]);
+      } else if(0 == strcmp(argv[i], "--daemon")) {
+	daemon_socket_path = argv[++i];
+      } else if(0 == strcmp(argv[i], "--batch")) {
+	batch_manifest_path = argv[++i];
+      } else if(0 == strcmp(argv[i], "--animate")) {
+	animation_path = argv[++i];
+      } else if(0 == strcmp(argv[i], "--relight")) {
+	relighting = true;
+	light_paths[light_path_count++] = argv[++i];
+      } else if(0 == strcmp(argv[i], "--cache")) {
+	cache_dir = argv[++i];
+      } else if(0 == strcmp(argv[i], "--cache-size")) {
+	parse_cache_size_option(argv[++i]);
+      } else if(0 == strcmp(argv[i], "--light-cutoff")) {
+	parse_light_cutoff_option(argv[++i]);
+      } else if(0 == strcmp(argv[i], "--light-budget")) {
+	parse_light_budget_option(argv[++i]);
+      } else {
+	parse_frames_option(argv[++i]);
+      }
+    } else if(0 == strcmp(argv[i], "--watch")) {
+      watching = true;
+    } else if(0 == strcmp(argv[i], "--views")) {
+      viewing = true;
+    } else if(0 == strcmp(argv[i], "--temporal")) {
+      temporal = true;
+    } else if(0 == strcmp(argv[i], "--stats")) {
+      show_stats = true;
+    } else if(0 == strcmp(argv[i], "--float")) {
+      single_precision = true;
+    } else if(0 == strcmp(argv[i], "--validate-float")) {
+      single_precision = true;
+      validate_float = true;
+    } else if(0 == strncmp(argv[i], "--", 2)) {
+      usage_error("You supplied an unknown option.");
+    } else if(positional_count < 4) {
+      positional[positional_count++] = argv[i];
+    } else {
+      usage_error("You supplied an incorrect number of arguments.");
+    }
+  }
+  bool tuning_render = show_stats || 0 != light_cutoff || 0 != light_budget || single_precision;
+  if(tuning_render && (NULL != daemon_socket_path || NULL != batch_manifest_path)) {
+    usage_error("The --stats, --light-cutoff, --light-budget and --float options apply only to single renders.");
+  }
+  if(NULL != daemon_socket_path) {
+    if(positional_count != 0 || sharded || NULL != batch_manifest_path) {
+      usage_error("The --daemon option takes its jobs from the socket.");
+    }
+    if(NULL != cache_dir) usage_error("The --cache option applies only to single renders and batches.");
+    return;
+  }
+  if(NULL != batch_manifest_path) {
+    if(positional_count != 0 || sharded) usage_error("The --batch option takes its jobs from the manifest.");
+    return;
+  }
+  if(positional_count != 4) usage_error("You supplied an incorrect number of arguments.");
+  if((NULL == animation_path) != (0 == frame_count)) {
+    usage_error("The --animate and --frames options must be used together.");
+  }
+  if(NULL != animation_path && sharded) usage_error("An animation cannot be sharded.");
+  if(relighting && (sharded || NULL != animation_path)) {
+    usage_error("The --relight option cannot be combined with sharding or animation.");
+  }
+  if(watching && (sharded || NULL != animation_path || relighting)) {
+    usage_error("The --watch option cannot be combined with sharding, animation or relighting.");
+  }
+  if(viewing && (sharded || NULL != animation_path || relighting || watching)) {
+    usage_error("The --views option cannot be combined with sharding, animation, relighting or watching.");
+  }
+  if(temporal && NULL == animation_path) usage_error("The --temporal option applies only to animations.");
+  if(tuning_render && (NULL != animation_path || relighting || watching || viewing)) {
+    usage_error("The --stats, --light-cutoff, --light-budget and --float options apply only to single renders.");
+  }
+  if(NULL != cache_dir && (NULL != animation_path || relighting || watching || viewing)) {
+    usage_error("The --cache option applies only to single renders and batches.");
+  }
+  if(NULL != cache_dir && validate_float) usage_error("The --validate-float option renders without the cache.");
+
+  initializes_static_vars(positional);
+  validate_shard();
+}
+
+
+static void usage_error(char *message) {
+  fprintf(stderr, "ERROR: %s\n", message);
+  fprintf(stderr, "ERROR: Correct usage is:\n");
+  fprintf(stderr, "ERROR: \traycast [options] width height input_file.json output_file.ppm\n");
+  fprintf(stderr, "ERROR: Options:\n");
+  fprintf(stderr, "ERROR: \t--threads count        render with count threads (default: one per processor)\n");
+  fprintf(stderr, "ERROR: \t--stats                report how the render was traced\n");
+  fprintf(stderr, "ERROR: \t--light-cutoff level   skip lights dimmer than level after attenuation (default: 0)\n");
+  fprintf(stderr, "ERROR: \t--light-budget count   with more lights than count, sample count per point (default: 0)\n");
+  fprintf(stderr, "ERROR: \t--float                find ray hits in single precision, relative to the camera\n");
+  fprintf(stderr, "ERROR: \t--validate-float       render with --float and report how far it is from double\n");
+  fprintf(stderr, "ERROR: \t--watch                re-render whenever the input file changes\n");
+  fprintf(stderr, "ERROR: \t--views                render every camera in the scene, to output_file_%%02d.ppm\n");
+  fprintf(stderr, "ERROR: \t--cache dir            reuse earlier renders of the same scene kept in dir\n");
+  fprintf(stderr, "ERROR: \t--cache-size megabytes evict the least recently used renders beyond this size\n");
+  fprintf(stderr, "ERROR: \t                       (default: %d)\n", RENDER_CACHE_DEFAULT_MB);
+  fprintf(stderr, "ERROR: \t--shard index/count    render only band index (from 0) of count equal bands\n");
+  fprintf(stderr, "ERROR: \t--rows first:count     render only count rows starting at row first\n");
+  fprintf(stderr, "ERROR: With either option the output is a shard file for raycast-merge.\n");
+  fprintf(stderr, "ERROR: \traycast [--threads count] --daemon socket_path\n");
+  fprintf(stderr, "ERROR: \t                       serve render jobs on a Unix domain socket\n");
+  fprintf(stderr, "ERROR: \traycast [--threads count] --batch manifest_file\n");
+  fprintf(stderr, "ERROR: \t                       render every job listed in the manifest\n");
+  fprintf(stderr, "ERROR: \traycast [--threads count] --animate animation.json --frames count\n");
+  fprintf(stderr, "ERROR: \t        width height input_file.json output_file_%%04d.ppm\n");
+  fprintf(stderr, "ERROR: \t                       render count frames along the keyframed path\n");
+  fprintf(stderr, "ERROR: \t--temporal             reuse shading from the previous frame where possible\n");
+  fprintf(stderr, "ERROR: \traycast [--threads count] --relight lights.json [--relight lights.json ...]\n");
+  fprintf(stderr, "ERROR: \t        width height input_file.json output_file_%%02d.ppm\n");
+  fprintf(stderr, "ERROR: \t                       render again with each file's lights, reusing the geometry\n");
+  exit(EXIT_FAILURE);
+}
+
+
+static void parse_shard_option(char *value) {
+  char *end = NULL;
+  shard_index = (int) strtol(value, &end, 10);
+  if(end == value || '/' != *end) usage_error("The --shard option takes the form index/count.");
+  char *count_str = end + 1;
+  shard_count = (int) strtol(count_str, &end, 10);
+  if(end == count_str || '\0' != *end) usage_error("The --shard option takes the form index/count.");
+  if(shard_count <= 0 || shard_index < 0 || shard_index >= shard_count) {
+    usage_error("The --shard index must be at least 0 and less than the count.");
+  }
+  sharded = true;
+}
+
+
+static void parse_rows_option(char *value) {
+  char *end = NULL;
+  shard.first_row = (int) strtol(value, &end, 10);
+  if(end == value || ':' != *end) usage_error("The --rows option takes the form first:count.");
+  char *count_str = end + 1;
+  shard.rows = (int) strtol(count_str, &end, 10);
+  if(end == count_str || '\0' != *end) usage_error("The --rows option takes the form first:count.");
+  shard_count = 0;
+  sharded = true;
+}
+
+
+static void parse_threads_option(char *value) {
+  char *end = NULL;
+  thread_count = (int) strtol(value, &end, 10);
+  if(end == value || '\0' != *end || thread_count <= 0) {
+    usage_error("The --threads option takes a positive integer.");
+  }
+}
+
+
+static void parse_frames_option(char *value) {
+  char *end = NULL;
+  frame_count = (int) strtol(value, &end, 10);
+  if(end == value || '\0' != *end || frame_count <= 0) {
+    usage_error("The --frames option takes a positive integer.");
+  }
+}
+
+
+static void parse_light_cutoff_option(char *value) {
+  char *end = NULL;
+  light_cutoff = strtod(value, &end);
+  if(end == value || '\0' != *end || !(light_cutoff >= 0)) {
+    usage_error("The --light-cutoff option takes a non-negative number.");
+  }
+}
+
+
+static void parse_light_budget_option(char *value) {
+  char *end = NULL;
+  light_budget = (int) strtol(value, &end, 10);
+  if(end == value || '\0' != *end || light_budget <= 0) {
+    usage_error("The --light-budget option takes a positive integer.");
+  }
+}
+
+
+static void parse_cache_size_option(char *value) {
+  char *end = NULL;
+  cache_megabytes = strtoll(value, &end, 10);
+  if(end == value || '\0' != *end || cache_megabytes <= 0) {
+    usage_error("The --cache-size option takes a positive number of megabytes.");
   }
 }
 
+
 static void initializes_static_vars(char *argv[]) {
-  width = (int) strtol(argv[1], NULL, 10);
-  height = (int) strtol(argv[2], NULL, 10);
+  width = (int) strtol(argv[0], NULL, 10);
+  height = (int) strtol(argv[1], NULL, 10);
   if(width <= 0 || height <= 0) {
     fprintf(stderr, "ERROR: The supplied dimensions must be positive integers\n");
     exit(EXIT_FAILURE);
   }
 
-  input_file_name = argv[3];
-  output_file_name = argv[4];
+  input_file_name = argv[2];
+  output_file_name = argv[3];
+}
+
+
+/* An unsharded render is treated as one shard covering the whole image. */
+static void validate_shard() {
+  if(!sharded) {
+    shard.first_row = 0;
+    shard.rows = height;
+  } else if(shard_count > 0) {
+    shard_rows_for_index(shard_index, shard_count, height, &shard);
+  }
+  shard.width = width;
+  shard.height = height;
+  if(shard.rows <= 0 || shard.first_row < 0 || shard.first_row + shard.rows > height) {
+    fprintf(stderr, "ERROR: The requested rows must lie within the image and be non-empty\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+
+static void exit_on_failure(int status) {
+  if(RC_OK != status) {
+    fprintf(stderr, "Error: %s\n", rc_last_error());
+    exit(EXIT_FAILURE);
+  }
+}
+
+
+/* Returns NULL if no cache was requested. */
+static RenderCacheRef open_cache_or_exit() {
+  if(NULL == cache_dir) return NULL;
+  RenderCacheRef cache = open_render_cache(cache_dir, cache_megabytes * 1024 * 1024);
+  if(NULL == cache) exit_on_failure(RC_ERR_IO);
+  return cache;
+}
+
+
+static void report_shadow_candidates(RcScene *scene) {
+  int light_count = 0;
+  exit_on_failure(rc_scene_shadow_candidates(scene, NULL, 0, &light_count));
+  int *counts = malloc(sizeof(*counts) * (light_count + 1));
+  if(NULL == counts) {
+    fprintf(stderr, "Error: Could not allocate memory\n");
+    exit(EXIT_FAILURE);
+  }
+  exit_on_failure(rc_scene_shadow_candidates(scene, counts, light_count, &light_count));
+  for(int l = 0; l < light_count; l++) {
+    fprintf(stderr, "NOTICE: Light %d has %d shadow candidates\n", l, counts[l]);
+  }
+  free(counts);
+}
+
+
+static void report_render_stats(RcRenderer *renderer) {
+  RcRenderStats stats;
+  exit_on_failure(rc_renderer_stats(renderer, &stats));
+  long culled = stats.culled_by_distance + stats.culled_by_cone + stats.culled_by_facing;
+  fprintf(stderr, "NOTICE: Traced %ld shadow rays and culled %ld (%ld out of reach, %ld outside a cone, "
+	  "%ld facing away)\n", stats.shadow_rays_traced, culled, stats.culled_by_distance, stats.culled_by_cone,
+	  stats.culled_by_facing);
+}
+
+
+/* The output format and any options that change the image, for the render cache key. A render with
+ * the default options has the same key as a batch job for the same scene. */
+static char* render_settings() {
+  static char settings[128];
+  char *format = sharded ? "shard" : "P3";
+  if(0 == light_cutoff && 0 == light_budget && !single_precision) return format;
+  snprintf(settings, sizeof(settings), "%s cutoff %.17g budget %d%s", format, light_cutoff, light_budget,
+	   single_precision ? " float" : "");
+  return settings;
+}
+
+
+/* Compares a single precision render with the double precision reference of the same pixels. */
+static void report_float_validation(const uint8_t *reference, const uint8_t *rgb, size_t pixel_count) {
+  size_t differing = 0;
+  int max_difference = 0;
+  for(size_t p = 0; p < pixel_count; p++) {
+    int pixel_difference = 0;
+    for(int c = 0; c < 3; c++) {
+      int difference = abs((int) rgb[p * 3 + c] - (int) reference[p * 3 + c]);
+      if(difference > pixel_difference) pixel_difference = difference;
+    }
+    if(pixel_difference > 0) differing++;
+    if(pixel_difference > max_difference) max_difference = pixel_difference;
+  }
+  fprintf(stderr, "NOTICE: Single precision differs from double in %zu of %zu pixels, by at most %d of 255\n",
+	  differing, pixel_count, max_difference);
 }
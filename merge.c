@@ -0,0 +1,114 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include "shard.h"
+#include "ppmwrite.h"
+#include "util.h"
+
+struct ShardEntry {
+  char *filename;
+  ShardInfo info;
+};
+
+typedef struct ShardEntry ShardEntry;
+
+static void validate_argc(int);
+static ShardEntry* read_shard_headers(int, char**);
+static int compare_shard_entries(const void*, const void*);
+static void validate_coverage(ShardEntry*, int);
+static void stream_shards(char*, ShardEntry*, int);
+
+/* Stitches shard files written by `raycast --shard` into one PPM. Only the headers are read up
+ * front; the pixel rows are then streamed through a single row buffer one shard at a time. */
+int main(int argc, char* argv[]) {
+  validate_argc(argc);
+  int shard_count = argc - 2;
+  ShardEntry *shards = read_shard_headers(shard_count, argv + 2);
+  qsort(shards, shard_count, sizeof(*shards), compare_shard_entries);
+  validate_coverage(shards, shard_count);
+  stream_shards(argv[1], shards, shard_count);
+  free(shards);
+
+  exit(EXIT_SUCCESS);
+}
+
+
+static void validate_argc(int argc) {
+  if(argc < 3) {
+    fprintf(stderr, "ERROR: You supplied an incorrect number of arguments.\n");
+    fprintf(stderr, "ERROR: Correct usage is:\n");
+    fprintf(stderr, "ERROR: \traycast-merge output_file.ppm shard_file...\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+
+static ShardEntry* read_shard_headers(int shard_count, char *filenames[]) {
+  ShardEntry *shards = checked_malloc(shard_count * sizeof(*shards));
+  if(NULL == shards) {
+    report_error_and_exit(last_error_message());
+  }
+  for(int i = 0; i < shard_count; i++) {
+    shards[i].filename = filenames[i];
+    fclose(shard_open(filenames[i], &shards[i].info));
+  }
+  return shards;
+}
+
+
+static int compare_shard_entries(const void *a, const void *b) {
+  const ShardEntry *sa = a;
+  const ShardEntry *sb = b;
+  return (sa->info.first_row > sb->info.first_row) - (sa->info.first_row < sb->info.first_row);
+}
+
+
+/* Requires that the sorted shards tile the whole image exactly: same dimensions, no gaps and no
+ * overlapping rows. */
+static void validate_coverage(ShardEntry *shards, int shard_count) {
+  int next_row = 0;
+  for(int i = 0; i < shard_count; i++) {
+    ShardInfo *info = &shards[i].info;
+    if(info->width != shards[0].info.width || info->height != shards[0].info.height) {
+      fprintf(stderr, "Error: Shard \"%s\" has different image dimensions than \"%s\"\n",
+	      shards[i].filename, shards[0].filename);
+      exit(EXIT_FAILURE);
+    }
+    if(info->first_row != next_row) {
+      fprintf(stderr, "Error: Shards %s rows starting at row %d\n",
+	      info->first_row > next_row ? "are missing" : "overlap in", next_row);
+      exit(EXIT_FAILURE);
+    }
+    next_row += info->rows;
+  }
+  if(next_row != shards[0].info.height) {
+    fprintf(stderr, "Error: Shards are missing rows starting at row %d\n", next_row);
+    exit(EXIT_FAILURE);
+  }
+}
+
+
+static void stream_shards(char *output_file_name, ShardEntry *shards, int shard_count) {
+  int width = shards[0].info.width;
+  int height = shards[0].info.height;
+  uint8_t *row_buf = checked_malloc((size_t) width * 3);
+  PpmWriterRef writer = ppm_open(output_file_name, '3', width, height);
+  if(NULL == row_buf || NULL == writer) {
+    report_error_and_exit(last_error_message());
+  }
+  for(int i = 0; i < shard_count; i++) {
+    ShardInfo info;
+    FILE *shard_file = shard_open(shards[i].filename, &info);
+    for(int row = 0; row < info.rows; row++) {
+      shard_read_row(shard_file, &info, row_buf);
+      if(!ppm_write_bytes(writer, row_buf, (size_t) width * 3)) {
+	report_error_and_exit(last_error_message());
+      }
+    }
+    fclose(shard_file);
+  }
+  if(!ppm_close(writer)) {
+    report_error_and_exit(last_error_message());
+  }
+  free(row_buf);
+}
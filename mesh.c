@@ -0,0 +1,581 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mesh.h"
+#include "boxtree.h"
+#include "object.h"
+#include "vecmath.h"
+#include "vec4.h"
+#include "util.h"
+
+// Slack, relative to the size of the coordinates involved, given to each triangle's bounds so that
+// rounding in the box tests can never pass by a ray that meets it
+#define BOUNDS_MARGIN 1e-6
+// How near, relative to the size of its coordinates, a ray leaving the surface may meet it again and
+// still be taken to be meeting the point it starts from
+#define SELF_HIT_EPSILON 1e-9
+// Longest token read from an OBJ file, which no number comes near
+#define MAX_TOKEN_LEN 63
+
+/* Triangles are stored in the order the tree's leaves refer to them. The vertices are either
+ * owned_vertices, read from an OBJ file, or the vertices of a raw file, which stays mapped. */
+struct Mesh {
+  char *path;
+  int vertex_count;
+  int triangle_count;
+  const float (*vertices)[3];
+  uint32_t (*triangles)[3];
+  float (*owned_vertices)[3];
+  void *map;
+  size_t map_length;
+  BoxTreeRef tree;
+};
+
+/* Where an OBJ file is being read and what has been read of it so far. */
+struct ObjReader {
+  const char *path;
+  const char *at;
+  const char *end;
+  int line;
+  int vertex_count;
+  int vertex_capacity;
+  float (*vertices)[3];
+  int triangle_count;
+  int triangle_capacity;
+  uint32_t (*triangles)[3];
+};
+
+typedef struct ObjReader ObjReader;
+
+/* What is passed to the callbacks for the triangles the tree visits. A ray is sheared and scaled so
+ * that it runs from the origin along z, with axis kz of the scene becoming z; only hits further
+ * along it than min_t count. While looking for the triangle nearest a point, it keeps the best so
+ * far and its distance. */
+struct MeshSearch {
+  MeshRef mesh;
+  int kx;
+  int ky;
+  int kz;
+  double shear[3];
+  double min_t;
+  int nearest;
+  double distance;
+};
+
+typedef struct MeshSearch MeshSearch;
+
+static bool map_file(const char*, void**, size_t*);
+static bool read_raw_mesh(MeshRef, const char*, size_t);
+static bool read_obj_mesh(MeshRef, const char*, size_t);
+static bool read_obj_vertex(ObjReader*);
+static bool read_obj_face(ObjReader*);
+static int next_obj_token(ObjReader*, char*);
+static void skip_obj_line(ObjReader*);
+static bool add_obj_triangle(ObjReader*, uint32_t, uint32_t, uint32_t);
+static bool build_mesh(MeshRef, uint32_t (*)[3]);
+static double triangle_intersection(void*, int, RayRef);
+static void visit_triangle(void*, int, double*);
+static int triangle_at(MeshRef, double*, double*);
+static double triangle_distance(MeshRef, int, double*);
+static void triangle_corners(MeshRef, int, Vec4*);
+
+
+/* Reads the mesh in the file at path, which is a raw mesh if it starts with RAW_MESH_MAGIC and an
+ * OBJ file otherwise. Of an OBJ file, only vertex positions and faces are read; faces of more than
+ * three vertices are split into fans of triangles. Returns NULL if the file cannot be read, is not a
+ * valid mesh or has no triangles. */
+MeshRef load_mesh(const char *path) {
+  struct Mesh zero_mesh = {0};
+  MeshRef mesh = checked_malloc(sizeof(*mesh));
+  if(NULL == mesh) return NULL;
+  *mesh = zero_mesh;
+  mesh->path = strdup(path);
+  if(NULL == mesh->path) {
+    set_error(RC_ERR_NO_MEMORY, "NULL result from strdup");
+    free(mesh);
+    return NULL;
+  }
+
+  void *map = NULL;
+  size_t length = 0;
+  if(!map_file(path, &map, &length)) {
+    destroy_mesh(mesh);
+    return NULL;
+  }
+  bool ok;
+  if(length >= sizeof(RawMeshHeader) && 0 == memcmp(map, RAW_MESH_MAGIC, strlen(RAW_MESH_MAGIC))) {
+    // The mesh keeps the mapping for the vertices it holds
+    mesh->map = map;
+    mesh->map_length = length;
+    ok = read_raw_mesh(mesh, map, length);
+  } else {
+    ok = read_obj_mesh(mesh, map, length);
+    munmap(map, length);
+  }
+  if(!ok) {
+    destroy_mesh(mesh);
+    return NULL;
+  }
+  return mesh;
+}
+
+
+const char* mesh_path(MeshRef mesh) {
+  return mesh->path;
+}
+
+
+int mesh_triangle_count(MeshRef mesh) {
+  return mesh->triangle_count;
+}
+
+
+/* The nearest distance along the ray at which it meets a triangle, or MISS. If leaving is true the
+ * ray starts on the mesh, and hits too near its origin to be told from it are left out. */
+double mesh_intersection(MeshRef mesh, RayRef ray, bool leaving) {
+  MeshSearch search = {0};
+  search.mesh = mesh;
+  // The axis the ray runs furthest along becomes z, and x and y follow on from it so that the
+  // triangles keep their winding, swapped if the ray runs backwards along it
+  search.kz = 0;
+  for(int a = 1; a < 3; a++) {
+    if(fabs(ray->dir[a]) > fabs(ray->dir[search.kz])) search.kz = a;
+  }
+  search.kx = (search.kz + 1) % 3;
+  search.ky = (search.kx + 1) % 3;
+  if(ray->dir[search.kz] < 0) {
+    int swap = search.kx;
+    search.kx = search.ky;
+    search.ky = swap;
+  }
+  search.shear[X] = ray->dir[search.kx] / ray->dir[search.kz];
+  search.shear[Y] = ray->dir[search.ky] / ray->dir[search.kz];
+  search.shear[Z] = 1.0 / ray->dir[search.kz];
+  search.min_t = 0.0;
+  if(leaving) {
+    double size = fmax(fabs(ray->origin[X]), fmax(fabs(ray->origin[Y]), fabs(ray->origin[Z])));
+    search.min_t = SELF_HIT_EPSILON * (1.0 + size) / v4_length(v4_load(ray->dir));
+  }
+  return box_tree_nearest(mesh->tree, ray, triangle_intersection, &search);
+}
+
+
+/* The normal of the triangle nearest the point, on the side its vertices run anticlockwise around. */
+void get_mesh_surface_normal(MeshRef mesh, double *point, double *out) {
+  double distance;
+  int i = triangle_at(mesh, point, &distance);
+  if(i < 0) {
+    out[X] = 0.0;
+    out[Y] = 0.0;
+    out[Z] = 0.0;
+    return;
+  }
+  Vec4 corners[3];
+  triangle_corners(mesh, i, corners);
+  Vec4 normal = v4_cross(v4_sub(corners[1], corners[0]), v4_sub(corners[2], corners[0]));
+  v4_store(v4_normalize(normal), out);
+}
+
+
+/* How far the point is from the nearest triangle whose bounds hold it, or infinity if none do. */
+double mesh_surface_offset(MeshRef mesh, double *point) {
+  double distance;
+  triangle_at(mesh, point, &distance);
+  return distance;
+}
+
+
+void mesh_bounds(MeshRef mesh, double *lo, double *hi) {
+  box_tree_bounds(mesh->tree, lo, hi);
+}
+
+
+/* Stores in stamp_out a hash of the file's device, inode, size and modification and status change
+ * times, which changes whenever the file is written or replaced. The file's bytes are not read, so
+ * it costs the same for any size of mesh. Returns false if the file cannot be found. */
+bool mesh_file_stamp(const char *path, uint64_t *stamp_out) {
+  struct stat info;
+  if(0 != stat(path, &info)) {
+    set_error(RC_ERR_IO, "Could not find mesh file \"%s\"", path);
+    return false;
+  }
+  uint64_t fields[7] = {(uint64_t) info.st_dev, (uint64_t) info.st_ino, (uint64_t) info.st_size,
+			(uint64_t) info.st_mtim.tv_sec, (uint64_t) info.st_mtim.tv_nsec,
+			(uint64_t) info.st_ctim.tv_sec, (uint64_t) info.st_ctim.tv_nsec};
+  *stamp_out = hash_bytes(fields, sizeof(fields));
+  return true;
+}
+
+
+/* True if the meshes have the same vertices and triangles, whatever files they came from. */
+bool meshes_equal(MeshRef a, MeshRef b) {
+  return a->vertex_count == b->vertex_count && a->triangle_count == b->triangle_count &&
+    0 == memcmp(a->vertices, b->vertices, sizeof(*a->vertices) * a->vertex_count) &&
+    0 == memcmp(a->triangles, b->triangles, sizeof(*a->triangles) * a->triangle_count);
+}
+
+
+void destroy_mesh(MeshRef mesh) {
+  if(NULL == mesh) return;
+  if(NULL != mesh->map) munmap(mesh->map, mesh->map_length);
+  free(mesh->owned_vertices);
+  free(mesh->triangles);
+  destroy_box_tree(mesh->tree);
+  free(mesh->path);
+  free(mesh);
+}
+
+
+/* Maps the whole file at path read only, storing where and its length. */
+static bool map_file(const char *path, void **map, size_t *length) {
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) {
+    set_error(RC_ERR_IO, "Could not open mesh file \"%s\"", path);
+    return false;
+  }
+  struct stat info;
+  if(0 != fstat(fd, &info)) {
+    set_error(RC_ERR_IO, "Could not read mesh file \"%s\"", path);
+    close(fd);
+    return false;
+  }
+  if(0 == info.st_size) {
+    set_error(RC_ERR_SCENE, "Mesh file \"%s\" is empty", path);
+    close(fd);
+    return false;
+  }
+  *length = info.st_size;
+  *map = mmap(NULL, *length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(MAP_FAILED == *map) {
+    set_error(RC_ERR_IO, "Could not map mesh file \"%s\"", path);
+    return false;
+  }
+  return true;
+}
+
+
+static bool read_raw_mesh(MeshRef mesh, const char *data, size_t length) {
+  RawMeshHeader header;
+  memcpy(&header, data, sizeof(header));
+  uint64_t expected = sizeof(header) + (uint64_t) header.vertex_count * sizeof(*mesh->vertices) +
+    (uint64_t) header.triangle_count * sizeof(*mesh->triangles);
+  if(header.vertex_count > INT_MAX || header.triangle_count > INT_MAX || expected != length) {
+    set_error(RC_ERR_SCENE, "Mesh file \"%s\" is not the size its header gives", mesh->path);
+    return false;
+  }
+  mesh->vertex_count = header.vertex_count;
+  mesh->triangle_count = header.triangle_count;
+  mesh->vertices = (const float (*)[3]) (data + sizeof(header));
+  uint32_t (*triangles)[3] = (void*) (data + sizeof(header) + sizeof(*mesh->vertices) * mesh->vertex_count);
+  return build_mesh(mesh, triangles);
+}
+
+
+/* Reads the file a line at a time, never past its end: the mapping need not end in a newline or a
+ * '\0'. */
+static bool read_obj_mesh(MeshRef mesh, const char *data, size_t length) {
+  ObjReader reader = {mesh->path, data, data + length, 0, 0, 0, NULL, 0, 0, NULL};
+  posix_madvise((void*) data, length, POSIX_MADV_SEQUENTIAL);
+  bool ok = true;
+  char keyword[MAX_TOKEN_LEN + 1];
+  while(ok && reader.at < reader.end) {
+    reader.line++;
+    next_obj_token(&reader, keyword);
+    if(0 == strcmp(keyword, "v")) {
+      ok = read_obj_vertex(&reader);
+    } else if(0 == strcmp(keyword, "f")) {
+      ok = read_obj_face(&reader);
+    }
+    skip_obj_line(&reader);
+  }
+
+  mesh->vertex_count = reader.vertex_count;
+  mesh->triangle_count = reader.triangle_count;
+  mesh->owned_vertices = reader.vertices;
+  mesh->vertices = (const float (*)[3]) reader.vertices;
+  ok = ok && build_mesh(mesh, reader.triangles);
+  free(reader.triangles);
+  return ok;
+}
+
+
+/* Reads the position of a "v" line; any fourth coordinate is ignored. */
+static bool read_obj_vertex(ObjReader *reader) {
+  if(reader->vertex_count == reader->vertex_capacity) {
+    if(INT_MAX / 2 < reader->vertex_capacity) {
+      set_error(RC_ERR_SCENE, "Mesh file \"%s\" has too many vertices", reader->path);
+      return false;
+    }
+    int capacity = 0 == reader->vertex_capacity ? 1024 : 2 * reader->vertex_capacity;
+    float (*grown)[3] = realloc(reader->vertices, sizeof(*grown) * capacity);
+    if(NULL == grown) {
+      set_error(RC_ERR_NO_MEMORY, "Out of memory reading mesh file \"%s\"", reader->path);
+      return false;
+    }
+    reader->vertices = grown;
+    reader->vertex_capacity = capacity;
+  }
+
+  char token[MAX_TOKEN_LEN + 1];
+  for(int a = 0; a < 3; a++) {
+    int token_length = next_obj_token(reader, token);
+    char *end = NULL;
+    double coordinate = strtod(token, &end);
+    if(0 == token_length || token_length > MAX_TOKEN_LEN || '\0' != *end || !isfinite(coordinate)) {
+      set_error(RC_ERR_SCENE, "Mesh file \"%s\" line %d: Expected three numbers after 'v'", reader->path,
+		reader->line);
+      return false;
+    }
+    reader->vertices[reader->vertex_count][a] = coordinate;
+  }
+  reader->vertex_count++;
+  return true;
+}
+
+
+/* Reads an "f" line of vertex references, each a 1-based index, or a negative one counting back from
+ * the last vertex read, optionally followed by texture and normal indices after slashes. Indices
+ * are checked against the vertex count once the whole file has been read. */
+static bool read_obj_face(ObjReader *reader) {
+  char token[MAX_TOKEN_LEN + 1];
+  uint32_t corners[3];
+  int corner_count = 0;
+  int token_length;
+  while(0 != (token_length = next_obj_token(reader, token))) {
+    char *end = NULL;
+    long index = strtol(token, &end, 10);
+    if(token_length > MAX_TOKEN_LEN || end == token || ('\0' != *end && '/' != *end) || 0 == index ||
+       index > UINT32_MAX || index < -(long) reader->vertex_count) {
+      set_error(RC_ERR_SCENE, "Mesh file \"%s\" line %d: Invalid vertex reference '%s'", reader->path,
+		reader->line, token);
+      return false;
+    }
+    uint32_t vertex = index > 0 ? (uint32_t) (index - 1) : (uint32_t) (reader->vertex_count + index);
+    if(corner_count < 3) {
+      corners[corner_count++] = vertex;
+      if(3 == corner_count && !add_obj_triangle(reader, corners[0], corners[1], corners[2])) return false;
+    } else {
+      // Further corners make a fan around the first
+      corners[1] = corners[2];
+      corners[2] = vertex;
+      if(!add_obj_triangle(reader, corners[0], corners[1], corners[2])) return false;
+    }
+  }
+  if(corner_count < 3) {
+    set_error(RC_ERR_SCENE, "Mesh file \"%s\" line %d: A face needs at least three vertices", reader->path,
+	      reader->line);
+    return false;
+  }
+  return true;
+}
+
+
+/* Copies the next token on the current line into token, truncated to MAX_TOKEN_LEN characters, and
+ * returns its full length; 0 at the end of the line. */
+static int next_obj_token(ObjReader *reader, char *token) {
+  while(reader->at < reader->end && (' ' == *reader->at || '\t' == *reader->at || '\r' == *reader->at)) {
+    reader->at++;
+  }
+  int length = 0;
+  while(reader->at < reader->end && ' ' != *reader->at && '\t' != *reader->at && '\r' != *reader->at &&
+	'\n' != *reader->at) {
+    if(length < MAX_TOKEN_LEN) token[length] = *reader->at;
+    length++;
+    reader->at++;
+  }
+  token[length < MAX_TOKEN_LEN ? length : MAX_TOKEN_LEN] = '\0';
+  return length;
+}
+
+
+/* Moves past the end of the current line. */
+static void skip_obj_line(ObjReader *reader) {
+  const char *newline = memchr(reader->at, '\n', reader->end - reader->at);
+  reader->at = NULL == newline ? reader->end : newline + 1;
+}
+
+
+static bool add_obj_triangle(ObjReader *reader, uint32_t a, uint32_t b, uint32_t c) {
+  if(reader->triangle_count == reader->triangle_capacity) {
+    if(INT_MAX / 2 < reader->triangle_capacity) {
+      set_error(RC_ERR_SCENE, "Mesh file \"%s\" has too many triangles", reader->path);
+      return false;
+    }
+    int capacity = 0 == reader->triangle_capacity ? 1024 : 2 * reader->triangle_capacity;
+    uint32_t (*grown)[3] = realloc(reader->triangles, sizeof(*grown) * capacity);
+    if(NULL == grown) {
+      set_error(RC_ERR_NO_MEMORY, "Out of memory reading mesh file \"%s\"", reader->path);
+      return false;
+    }
+    reader->triangles = grown;
+    reader->triangle_capacity = capacity;
+  }
+  uint32_t *triangle = reader->triangles[reader->triangle_count++];
+  triangle[0] = a;
+  triangle[1] = b;
+  triangle[2] = c;
+  return true;
+}
+
+
+/* Checks the mesh's vertices and the triangles it has been read with, then builds the tree over the
+ * triangles and stores them in the order of its leaves. The triangles are left to the caller. */
+static bool build_mesh(MeshRef mesh, uint32_t (*triangles)[3]) {
+  if(0 == mesh->triangle_count) {
+    set_error(RC_ERR_SCENE, "Mesh file \"%s\" has no triangles", mesh->path);
+    return false;
+  }
+  for(int v = 0; v < mesh->vertex_count; v++) {
+    const float *vertex = mesh->vertices[v];
+    if(!isfinite(vertex[X]) || !isfinite(vertex[Y]) || !isfinite(vertex[Z])) {
+      set_error(RC_ERR_SCENE, "Mesh file \"%s\" has a vertex that is not a finite number", mesh->path);
+      return false;
+    }
+  }
+
+  BoxEntry *entries = checked_malloc(sizeof(*entries) * mesh->triangle_count);
+  mesh->triangles = checked_malloc(sizeof(*mesh->triangles) * mesh->triangle_count);
+  if(NULL == entries || NULL == mesh->triangles) {
+    free(entries);
+    return false;
+  }
+  for(int i = 0; i < mesh->triangle_count; i++) {
+    Point lo = {INFINITY, INFINITY, INFINITY};
+    Point hi = {-INFINITY, -INFINITY, -INFINITY};
+    for(int c = 0; c < 3; c++) {
+      if(triangles[i][c] >= (uint32_t) mesh->vertex_count) {
+	set_error(RC_ERR_SCENE, "Mesh file \"%s\" has a triangle with a vertex index past its last vertex",
+		  mesh->path);
+	free(entries);
+	return false;
+      }
+      const float *vertex = mesh->vertices[triangles[i][c]];
+      for(int a = 0; a < 3; a++) {
+	if(vertex[a] < lo[a]) lo[a] = vertex[a];
+	if(vertex[a] > hi[a]) hi[a] = vertex[a];
+      }
+    }
+    for(int a = 0; a < 3; a++) {
+      double margin = BOUNDS_MARGIN * (1.0 + fmax(fabs(lo[a]), fabs(hi[a])));
+      lo[a] -= margin;
+      hi[a] += margin;
+    }
+    set_box_entry(&entries[i], lo, hi, i);
+  }
+  mesh->tree = new_box_tree(entries, mesh->triangle_count);
+  if(NULL == mesh->tree) {
+    free(entries);
+    return false;
+  }
+  for(int i = 0; i < mesh->triangle_count; i++) {
+    memcpy(mesh->triangles[i], triangles[entries[i].item], sizeof(*mesh->triangles));
+  }
+  free(entries);
+  return true;
+}
+
+
+/* The watertight test of Woop, Benthin and Wald: in the ray's sheared frame, the signs of the
+ * triangle's edge functions at the origin decide whether it is met. A shared edge gets the same
+ * function, negated, in both of its triangles, so a ray through it meets at least one of them.
+ * Triangles are met from either side. */
+static double triangle_intersection(void *data, int i, RayRef ray) {
+  MeshSearch *search = data;
+  double x[3];
+  double y[3];
+  double z[3];
+  for(int c = 0; c < 3; c++) {
+    const float *vertex = search->mesh->vertices[search->mesh->triangles[i][c]];
+    double relative[3] = {vertex[X] - ray->origin[X], vertex[Y] - ray->origin[Y], vertex[Z] - ray->origin[Z]};
+    x[c] = relative[search->kx] - search->shear[X] * relative[search->kz];
+    y[c] = relative[search->ky] - search->shear[Y] * relative[search->kz];
+    z[c] = search->shear[Z] * relative[search->kz];
+  }
+  double u = x[2] * y[1] - y[2] * x[1];
+  double v = x[0] * y[2] - y[0] * x[2];
+  double w = x[1] * y[0] - y[1] * x[0];
+  if((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0)) return MISS;
+  double det = u + v + w;
+  if(0 == det) return MISS;
+  double t = (u * z[0] + v * z[1] + w * z[2]) / det;
+  return t > search->min_t ? t : MISS;
+}
+
+
+static void visit_triangle(void *data, int i, double *point) {
+  MeshSearch *search = data;
+  double distance = triangle_distance(search->mesh, i, point);
+  if(distance < search->distance) {
+    search->distance = distance;
+    search->nearest = i;
+  }
+}
+
+
+/* The triangle nearest the point among those whose bounds hold it, storing its distance in distance;
+ * -1, and a distance of infinity, if there are none. */
+static int triangle_at(MeshRef mesh, double *point, double *distance) {
+  MeshSearch search = {0};
+  search.mesh = mesh;
+  search.nearest = -1;
+  search.distance = INFINITY;
+  box_tree_visit_containing(mesh->tree, point, visit_triangle, &search);
+  *distance = search.distance;
+  return search.nearest;
+}
+
+
+/* How far the point is from the nearest point of the triangle, found by which of the triangle's
+ * corners, edges or face it lies nearest to, as in Ericson's Real-Time Collision Detection. */
+static double triangle_distance(MeshRef mesh, int i, double *point) {
+  Vec4 corners[3];
+  triangle_corners(mesh, i, corners);
+  Vec4 a = corners[0];
+  Vec4 b = corners[1];
+  Vec4 c = corners[2];
+  Vec4 p = v4_load(point);
+  Vec4 ab = v4_sub(b, a);
+  Vec4 ac = v4_sub(c, a);
+  Vec4 ap = v4_sub(p, a);
+  double d1 = v4_dot(ab, ap);
+  double d2 = v4_dot(ac, ap);
+  if(d1 <= 0 && d2 <= 0) return v4_distance(p, a);
+
+  Vec4 bp = v4_sub(p, b);
+  double d3 = v4_dot(ab, bp);
+  double d4 = v4_dot(ac, bp);
+  if(d3 >= 0 && d4 <= d3) return v4_distance(p, b);
+  double vc = d1 * d4 - d3 * d2;
+  if(vc <= 0 && d1 >= 0 && d3 <= 0) return v4_distance(p, v4_add(a, v4_scale(ab, d1 / (d1 - d3))));
+
+  Vec4 cp = v4_sub(p, c);
+  double d5 = v4_dot(ab, cp);
+  double d6 = v4_dot(ac, cp);
+  if(d6 >= 0 && d5 <= d6) return v4_distance(p, c);
+  double vb = d5 * d2 - d1 * d6;
+  if(vb <= 0 && d2 >= 0 && d6 <= 0) return v4_distance(p, v4_add(a, v4_scale(ac, d2 / (d2 - d6))));
+  double va = d3 * d6 - d5 * d4;
+  if(va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0) {
+    return v4_distance(p, v4_add(b, v4_scale(v4_sub(c, b), (d4 - d3) / ((d4 - d3) + (d5 - d6)))));
+  }
+
+  double scale = 1.0 / (va + vb + vc);
+  return v4_distance(p, v4_add(a, v4_add(v4_scale(ab, vb * scale), v4_scale(ac, vc * scale))));
+}
+
+
+static void triangle_corners(MeshRef mesh, int i, Vec4 *out) {
+  for(int c = 0; c < 3; c++) {
+    const float *vertex = mesh->vertices[mesh->triangles[i][c]];
+    out[c] = v4_make(vertex[X], vertex[Y], vertex[Z]);
+  }
+}
@@ -0,0 +1,40 @@
+#ifndef MESH_HEADER
+#define MESH_HEADER 1
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "vecmath.h"
+
+/* A triangle mesh read from an OBJ file or a raw binary file, both mapped into memory to be read.
+ * Vertices are stored once as floats and triangles as three vertex indices each; there is nothing
+ * else per triangle but its leaf in a bounding volume hierarchy. Rays are met with a watertight
+ * test, so none slip through the edges shared by neighbouring triangles.
+ *
+ * A raw file holds, in the machine's byte order, the header below followed by vertex_count vertices
+ * of three floats and triangle_count triangles of three uint32_t indices counted from 0. Its
+ * vertices are used straight from the mapping, so a mesh of millions of triangles loads in the time
+ * it takes to build its hierarchy. */
+#define RAW_MESH_MAGIC "RAYMESH1"
+
+struct RawMeshHeader {
+  char magic[8];  // RAW_MESH_MAGIC, without its terminating '\0'
+  uint32_t vertex_count;
+  uint32_t triangle_count;
+};
+
+typedef struct RawMeshHeader RawMeshHeader;
+
+typedef struct Mesh* MeshRef;
+
+MeshRef load_mesh(const char*);
+const char* mesh_path(MeshRef);
+int mesh_triangle_count(MeshRef);
+double mesh_intersection(MeshRef, RayRef, bool);
+void get_mesh_surface_normal(MeshRef, double*, double*);
+double mesh_surface_offset(MeshRef, double*);
+void mesh_bounds(MeshRef, double*, double*);
+bool mesh_file_stamp(const char*, uint64_t*);
+bool meshes_equal(MeshRef, MeshRef);
+void destroy_mesh(MeshRef);
+
+#endif
@@ -1,13 +1,22 @@
 #include <float.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include "object.h"
+#include "instance.h"
+#include "mesh.h"
 #include "spec.h"
 #include "vecmath.h"
+#include "vec4.h"
 #include "util.h"
 
-#define MAX_OBJECTS 128
+// Slack, relative to the distances involved, given to object_could_shadow() so that rounding in the
+// hit points it reasons about can never make it wrongly rule out a shadow
+#define SHADOW_MARGIN 1e-6
+// Hits on a quadric this close to where a ray leaves it, relative to the size of the ray's origin
+// coordinates, are taken to be the point the ray starts from
+#define SELF_HIT_EPSILON 1e-9
 
 #define A 0
 #define B 1
@@ -21,57 +30,158 @@
 #define J 9
 
 //////////////////// Forward Declarations ////////////////////
-static ObjectRef get_next_plane_from_scene(Scene);
-static void validate_plane(ObjectRef);
-static ObjectRef get_next_sphere_from_scene(Scene);
-static void validate_sphere(ObjectRef);
-static ObjectRef get_next_quadric_from_scene(Scene);
-static void validate_quadric(ObjectRef);
+static bool get_next_plane_from_scene(Scene, ObjectRef*);
+static bool validate_plane(ObjectRef);
+static bool get_next_sphere_from_scene(Scene, ObjectRef*);
+static bool validate_sphere(ObjectRef);
+static bool get_next_quadric_from_scene(Scene, ObjectRef*);
+static bool validate_quadric(ObjectRef);
+static bool get_next_mesh_from_scene(Scene, ObjectRef*);
+static bool get_instances_from_scene(Scene, InstanceSetRef*, int*);
+static InstanceSetRef find_instance_set(InstanceSetRef*, int, int);
+static bool add_prototype(InstanceSetRef*, int, ObjectRef);
+static ObjectRef new_instances_object(InstanceSetRef);
+static void destroy_instance_sets(InstanceSetRef*, int);
+static bool is_prototype_number(double);
 static ObjectRef new_object_from_spec(SpecRef);
+static int get_prototype_from_spec(SpecRef);
 static double* get_diffuse_color_from_spec(SpecRef);
 static double* get_specular_color_from_spec(SpecRef);
 static double get_ns(SpecRef);
 static double get_reflectivity_from_spec(SpecRef);
 static double get_refractivity_from_spec(SpecRef);
 static double get_ior_from_spec(SpecRef);
-static void validate_object(ObjectRef);
+static bool validate_object(ObjectRef);
+static enum MaterialKind classify_material(ObjectRef);
 static double plane_intersection(RayRef, ObjectRef);
 static double sphere_intersection(RayRef, ObjectRef);
 static double quadric_intersection(RayRef, ObjectRef);
+static double sphere_intersection_from(RayRef, ObjectRef, OriginTermsRef);
+static double plane_intersection_from(RayRef, ObjectRef, OriginTermsRef);
+static double nearest_quadric_root(double, double, double);
+static void get_quadric_coefficients(RayRef, ObjectRef, double*);
+static void get_quadric_ray_coefficients(RayRef, ObjectRef, double*);
+static double get_quadric_origin_coefficient(double*, ObjectRef);
+static double quadric_intersection_leaving(RayRef, ObjectRef);
+static void plane_lanes_intersection(RayLanesRef, int, ObjectRef, double*);
+static void sphere_lanes_intersection(RayLanesRef, int, ObjectRef, double*);
 static void get_quadric_surface_normal(ObjectRef, double *, double *);
+static Vec4 quadric_gradient(ObjectRef, double*);
 static void get_sphere_surface_normal(ObjectRef, double *, double *);
 static void get_plane_surface_normal(ObjectRef, double *);
+static bool vectors_equal(double*, double*, int);
+static bool plane_could_shadow(ObjectRef, ObjectRef, double*);
+static bool sphere_could_shadow(ObjectRef, ObjectRef, double*);
+static double angle_between(Vec4, Vec4);
+static bool quadric_bounds(ObjectRef, double*, double*);
+static bool plane_crosses_box(ObjectRef, double*, double*);
+static bool plane_in_view(ObjectRef, Vec4, Vec4*);
 
 
 //////////////////// Public Functions ////////////////////
+/* Returns a NULL terminated array of the scene's objects, or NULL if any object is invalid or there
+ * are more than MAX_OBJECTS of them, counting each set of instances as one. The
+ * instances are read first, as there may be very many of them and each is then found at the front
+ * of the scene. Each set of instances becomes one object, after the others, once its prototype has
+ * been read. */
 ObjectRef* get_objects_from_scene(Scene scene) {
   ObjectRef* objects = checked_malloc((MAX_OBJECTS + 1) * sizeof(*objects));
-  ObjectRef last_got_o;
-  int i = 0;
-  last_got_o = get_next_plane_from_scene(scene);
-  while(NULL != last_got_o && i < MAX_OBJECTS) {
-    objects[i] = last_got_o;
-    last_got_o = get_next_plane_from_scene(scene);
-    i++;
-  }
-  last_got_o = get_next_sphere_from_scene(scene);
-  while(NULL != last_got_o && i < MAX_OBJECTS) {
-    objects[i] = last_got_o;
-    last_got_o = get_next_sphere_from_scene(scene);
-    i++;
-  }
-  last_got_o = get_next_quadric_from_scene(scene);
-  while(NULL != last_got_o && i < MAX_OBJECTS) {
-    objects[i] = last_got_o;
-    last_got_o = get_next_quadric_from_scene(scene);
-    i++;
+  if(NULL == objects) return NULL;
+  InstanceSetRef sets[MAX_OBJECTS];
+  int set_count = 0;
+  if(!get_instances_from_scene(scene, sets, &set_count)) {
+    destroy_instance_sets(sets, set_count);
+    free(objects);
+    return NULL;
   }
+  bool (*getters[])(Scene, ObjectRef*) = {
+    get_next_plane_from_scene, get_next_sphere_from_scene, get_next_quadric_from_scene, get_next_mesh_from_scene
+  };
+  int i = 0;
   objects[i] = NULL;
+  for(size_t g = 0; g < sizeof(getters) / sizeof(*getters); g++) {
+    ObjectRef last_got_o;
+    bool ok = getters[g](scene, &last_got_o);
+    while(ok && NULL != last_got_o) {
+      if(last_got_o->prototype >= 0) {
+	ok = add_prototype(sets, set_count, last_got_o);
+      } else if(MAX_OBJECTS == i) {
+	destroy_object(last_got_o);
+	set_error(RC_ERR_SCENE, "Scene has more than %d objects", MAX_OBJECTS);
+	ok = false;
+      } else {
+	last_got_o->id = i;
+	objects[i] = last_got_o;
+	objects[++i] = NULL;
+      }
+      if(ok) ok = getters[g](scene, &last_got_o);
+    }
+    if(!ok) {
+      destroy_objects(objects);
+      destroy_instance_sets(sets, set_count);
+      return NULL;
+    }
+  }
 
+  for(int s = 0; s < set_count; s++) {
+    if(NULL == instance_set_prototype(sets[s])) {
+      set_error(RC_ERR_SCENE, "Instances name prototype %d, which is not in the scene",
+		instance_set_prototype_number(sets[s]));
+      destroy_objects(objects);
+      destroy_instance_sets(sets, set_count);
+      return NULL;
+    }
+  }
+  for(int s = 0; s < set_count; s++) {
+    if(MAX_OBJECTS == i) set_error(RC_ERR_SCENE, "Scene has more than %d objects", MAX_OBJECTS);
+    ObjectRef o = MAX_OBJECTS == i ? NULL : new_instances_object(sets[s]);
+    if(NULL == o) {
+      // Sets already made into objects are destroyed with them
+      destroy_objects(objects);
+      destroy_instance_sets(sets + s, set_count - s);
+      return NULL;
+    }
+    o->id = i;
+    objects[i] = o;
+    objects[++i] = NULL;
+  }
   return objects;
 }
 
 
+/* Returns a malloc'd key for caching what is rendered from the scene: its canonical text followed by
+ * the stamp of each mesh file it names (see mesh_file_stamp()), so that writing or replacing a mesh
+ * file changes the key even though the scene file is untouched. It must be taken before the objects are read, which consumes
+ * the specs. Returns NULL if a mesh file cannot be found or memory runs out. */
+char* scene_cache_key(Scene scene, size_t *len_out) {
+  int mesh_count = 0;
+  const char **mesh_files = scene_mesh_files(scene, &mesh_count);
+  size_t text_len = 0;
+  char *text = NULL == mesh_files ? NULL : scene_canonical_text(scene, &text_len);
+  char *key = NULL;
+  FILE *out = NULL == text ? NULL : open_memstream(&key, len_out);
+  bool ok = NULL != out;
+  if(ok) fwrite(text, 1, text_len, out);
+  for(int m = 0; ok && m < mesh_count; m++) {
+    uint64_t stamp = 0;
+    ok = mesh_file_stamp(mesh_files[m], &stamp);
+    if(ok) fprintf(out, "mesh %d %016llx\n", m, (unsigned long long) stamp);
+  }
+  if(NULL != out && 0 != fclose(out) && ok) {
+    ok = false;
+    set_error(RC_ERR_NO_MEMORY, "Could not allocate memory");
+  }
+  if(NULL == out && NULL != text) set_error(RC_ERR_NO_MEMORY, "Could not allocate memory");
+  free(text);
+  free(mesh_files);
+  if(!ok) {
+    free(key);
+    return NULL;
+  }
+  return key;
+}
+
+
 const double* get_diffuse_color(ObjectRef o) {
   return o->diffuse_color; 
 }
@@ -85,14 +195,136 @@ double has_intersection(RayRef ray, ObjectRef o) {
     return sphere_intersection(ray, o);
   case Quadric:
     return quadric_intersection(ray, o);
+  case Instances:
+    return instance_set_intersection(o->instances.set, ray, false);
+  case Mesh:
+    return mesh_intersection(o->mesh.data, ray, false);
+  case NoObjKind:
+    set_error(RC_ERR_INTERNAL, "Tried to check for intersection with unknown object type");
+    return MISS;
+  }
+  set_error(RC_ERR_INTERNAL, "INSANITY: The impossible has occurred!");
+  return MISS;
+}
+
+
+/* has_intersection() for a ray starting from a point on the object's own surface, leaving out that
+ * point. A plane cannot be met again, and a sphere only at the far end of a chord through it. Of a
+ * set of instances, only the one the ray starts on is treated so, and a mesh is met only beyond a
+ * small distance from the point. */
+double has_intersection_leaving(RayRef ray, ObjectRef o) {
+  switch(o->kind) {
+  case Plane:
+    return MISS;
+  case Sphere: {
+    Vec4 dir = v4_load(ray->dir);
+    double t = 2 * v4_dot(dir, v4_sub(v4_load(o->sphere.position), v4_load(ray->origin))) / v4_dot(dir, dir);
+    return t > 0 ? t : MISS;
+  }
+  case Quadric:
+    return quadric_intersection_leaving(ray, o);
+  case Instances:
+    return instance_set_intersection(o->instances.set, ray, true);
+  case Mesh:
+    return mesh_intersection(o->mesh.data, ray, true);
+  case NoObjKind:
+    break;
+  }
+  return has_intersection(ray, o);
+}
+
+
+/* has_intersection() for the rays in the first lane_count lanes, storing the results in t_out. Planes and spheres are
+ * worked out for all the lanes together with the same arithmetic as for a single ray, so each lane
+ * gets exactly the value has_intersection() would give. */
+void lanes_intersection(RayLanesRef lanes, int lane_count, ObjectRef o, double *t_out) {
+  if(Plane == o->kind) {
+    plane_lanes_intersection(lanes, lane_count, o, t_out);
+    return;
+  }
+  if(Sphere == o->kind) {
+    sphere_lanes_intersection(lanes, lane_count, o, t_out);
+    return;
+  }
+  for(int i = 0; i < lane_count; i++) {
+    Ray r = {{lanes->origin[X][i], lanes->origin[Y][i], lanes->origin[Z][i]},
+	     {lanes->dir[X][i], lanes->dir[Y][i], lanes->dir[Z][i]}};
+    t_out[i] = has_intersection(&r, o);
+  }
+}
+
+
+void get_origin_terms(ObjectRef o, double *origin, OriginTermsRef out) {
+  OriginTerms zero_terms = {{0.0}, false, 0.0};
+  *out = zero_terms;
+  switch(o->kind) {
+  case Plane:
+    out->offset = v4_dot(v4_load(o->plane.normal), v4_sub(v4_load(origin), v4_load(o->plane.position)));
+    break;
+  case Sphere:
+    v4_store(v4_sub(v4_load(o->sphere.position), v4_load(origin)), out->to_center);
+    out->inside = v4_distance(v4_load(origin), v4_load(o->sphere.position)) < o->sphere.radius;
+    break;
+  case Quadric:
+    out->offset = get_quadric_origin_coefficient(origin, o);
+    break;
+  case Instances:
+  case Mesh:
   case NoObjKind:
-    fprintf(stderr, "ERROR: Tried to check for intersection with unknown object type\n");
-    exit(EXIT_FAILURE);
+    break;
   }
-  fprintf(stderr, "INSANITY: The impossible has occurred!\n");
-  exit(EXIT_FAILURE);
 }
 
+
+/* has_intersection() for a ray starting where the terms were worked out from, with the same result. */
+double has_intersection_from(RayRef ray, ObjectRef o, OriginTermsRef terms) {
+  switch(o->kind) {
+  case Plane:
+    return plane_intersection_from(ray, o, terms);
+  case Sphere:
+    return sphere_intersection_from(ray, o, terms);
+  case Quadric: {
+    double coefficients[2];
+    get_quadric_ray_coefficients(ray, o, coefficients);
+    return nearest_quadric_root(coefficients[0], coefficients[1], terms->offset);
+  }
+  case Instances:
+  case Mesh:
+  case NoObjKind:
+    break;
+  }
+  return has_intersection(ray, o);
+}
+
+
+/* False only if no ray from eye through the convex quadrilateral with the given corners, listed in
+ * order around it, can meet the object: it lies wholly outside one of the sides of the pyramid they
+ * make, or for a plane, every such ray runs away from it. Unbounded quadrics are always in view. */
+bool object_in_view(ObjectRef o, double *eye, double (*corners)[3]) {
+  Vec4 e = v4_load(eye);
+  Vec4 edges[4];
+  for(int i = 0; i < 4; i++) {
+    edges[i] = v4_sub(v4_load(corners[i]), e);
+  }
+  if(Plane == o->kind) return plane_in_view(o, e, edges);
+
+  double lo[3] = {0.0};
+  double hi[3] = {0.0};
+  if(!object_bounds(o, lo, hi)) return true;
+  for(int i = 0; i < 4; i++) {
+    Vec4 inward = v4_cross(edges[i], edges[(i + 1) % 4]);
+    if(v4_dot(inward, edges[(i + 2) % 4]) < 0) inward = v4_scale(inward, -1.0);
+    bool outside = true;
+    for(int c = 0; c < 8 && outside; c++) {
+      Vec4 box_corner = v4_make(c & 1 ? hi[X] : lo[X], c & 2 ? hi[Y] : lo[Y], c & 4 ? hi[Z] : lo[Z]);
+      outside = v4_dot(inward, v4_sub(box_corner, e)) < 0;
+    }
+    if(outside) return false;
+  }
+  return true;
+}
+
+
 void get_surface_normal(ObjectRef o, double *point, double *out) {
   switch(o->kind) {
   case Plane:
@@ -104,12 +336,168 @@ void get_surface_normal(ObjectRef o, double *point, double *out) {
   case Quadric:
     get_quadric_surface_normal(o, point, out);
     return;
+  case Instances:
+    get_instance_surface_normal(o->instances.set, point, out);
+    return;
+  case Mesh:
+    get_mesh_surface_normal(o->mesh.data, point, out);
+    return;
   case NoObjKind:
-    fprintf(stderr, "ERROR: Tried to get surface normal of an unknown object type\n");
-    exit(EXIT_FAILURE);
+    set_error(RC_ERR_INTERNAL, "Tried to get surface normal of an unknown object type");
+    break;
   }
-  fprintf(stderr, "INSANITY: The impossible has occurred!\n");
-  exit(EXIT_FAILURE);
+  out[X] = 0.0;
+  out[Y] = 0.0;
+  out[Z] = 0.0;
+}
+
+
+/* Roughly how far the point is from the object's surface: exactly for planes, spheres and meshes,
+ * and to first order for quadrics. Sets of instances are taken to be infinitely far away. */
+double surface_offset(ObjectRef o, double *point) {
+  Vec4 p = v4_load(point);
+  switch(o->kind) {
+  case Plane: {
+    Vec4 normal = v4_load(o->plane.normal);
+    return fabs(v4_dot(normal, v4_sub(p, v4_load(o->plane.position)))) / v4_length(normal);
+  }
+  case Sphere:
+    return fabs(v4_distance(p, v4_load(o->sphere.position)) - o->sphere.radius);
+  case Quadric:
+    return fabs(get_quadric_origin_coefficient(point, o)) / v4_length(quadric_gradient(o, point));
+  case Mesh:
+    return mesh_surface_offset(o->mesh.data, point);
+  case Instances:
+  case NoObjKind:
+    break;
+  }
+  return INFINITY;
+}
+
+
+/* True if the two objects have the same shape and place, so that every ray meets them alike. */
+bool object_geometry_equals(ObjectRef a, ObjectRef b) {
+  if(a->kind != b->kind) return false;
+  switch(a->kind) {
+  case Plane:
+    return vectors_equal(a->plane.position, b->plane.position, 3) &&
+      vectors_equal(a->plane.normal, b->plane.normal, 3);
+  case Sphere:
+    return vectors_equal(a->sphere.position, b->sphere.position, 3) && a->sphere.radius == b->sphere.radius;
+  case Quadric:
+    return vectors_equal(a->quadric.parts, b->quadric.parts, 10);
+  case Instances:
+    return instance_sets_equal(a->instances.set, b->instances.set);
+  case Mesh:
+    return meshes_equal(a->mesh.data, b->mesh.data);
+  case NoObjKind:
+    break;
+  }
+  return true;
+}
+
+
+bool object_material_equals(ObjectRef a, ObjectRef b) {
+  return vectors_equal(a->diffuse_color, b->diffuse_color, 3) &&
+    vectors_equal(a->specular_color, b->specular_color, 3) && a->ns == b->ns &&
+    a->reflectivity == b->reflectivity && a->refractivity == b->refractivity && a->ior == b->ior;
+}
+
+
+/* False only if no segment from a point on the receiver to the light can meet the occluder, so that
+ * the occluder never needs testing when shading the receiver. Whether an object can shadow itself is
+ * not considered. Quadrics may be unbounded, so they are taken to shadow and be shadowed by all, and
+ * so are sets of instances and meshes. */
+bool object_could_shadow(ObjectRef occluder, ObjectRef receiver, double *light_position) {
+  if(Quadric == receiver->kind || Instances == receiver->kind || Mesh == receiver->kind) return true;
+  switch(occluder->kind) {
+  case Plane:
+    return plane_could_shadow(occluder, receiver, light_position);
+  case Sphere:
+    return sphere_could_shadow(occluder, receiver, light_position);
+  case Quadric:
+  case Instances:
+  case Mesh:
+  case NoObjKind:
+    break;
+  }
+  return true;
+}
+
+
+/* True if the object itself blocks the light from a point on its surface: the point is on the far
+ * side of a sphere from a light outside it. Points near the boundary count as unblocked, so this
+ * never claims a shadow that the shadow ray would not find. */
+bool object_shadows_itself(ObjectRef o, double *point, double *light_position) {
+  if(Sphere != o->kind) return false;
+  Vec4 center = v4_load(o->sphere.position);
+  Vec4 light = v4_load(light_position);
+  Vec4 center_to_point = v4_sub(v4_load(point), center);
+  Vec4 point_to_light = v4_sub(light, v4_load(point));
+  if(v4_distance(light, center) <= o->sphere.radius * (1.0 + SHADOW_MARGIN)) return false;
+  return v4_dot(center_to_point, point_to_light) < -SHADOW_MARGIN * o->sphere.radius * v4_length(point_to_light);
+}
+
+
+/* True if the object is closed and nothing else among objects reaches into the box around it, so
+ * that a ray starting inside it meets nothing but its own surface on the way out. */
+bool object_is_sealed(ObjectRef o, ObjectRef *objects) {
+  Point lo = {0.0};
+  Point hi = {0.0};
+  if(!object_bounds(o, lo, hi)) return false;
+  for(; NULL != *objects; objects++) {
+    ObjectRef other = *objects;
+    if(other == o) continue;
+    if(Plane == other->kind) {
+      if(plane_crosses_box(other, lo, hi)) return false;
+      continue;
+    }
+    Point other_lo = {0.0};
+    Point other_hi = {0.0};
+    if(!object_bounds(other, other_lo, other_hi)) return false;
+    for(int a = 0; a < 3; a++) {
+      if(other_lo[a] > hi[a] || other_hi[a] < lo[a]) break;
+      if(2 == a) return false;
+    }
+  }
+  return true;
+}
+
+
+void destroy_objects(ObjectRef* objects) {
+  for(ObjectRef *iter = objects; NULL != *iter; iter++) {
+    destroy_object(*iter);
+  }
+  free(objects);
+}
+
+
+void destroy_object(ObjectRef o) {
+  switch(o->kind) {
+  case Plane:
+    free(o->plane.position);
+    free(o->plane.normal);
+    break;
+  case Sphere:
+    free(o->sphere.position);
+    break;
+  case Quadric:
+    free(o->quadric.parts);
+    break;
+  case Instances:
+    // The colors belong to the prototype, which the set destroys
+    destroy_instance_set(o->instances.set);
+    free(o);
+    return;
+  case Mesh:
+    destroy_mesh(o->mesh.data);
+    break;
+  case NoObjKind:
+    break;
+  }
+  free(o->diffuse_color);
+  free(o->specular_color);
+  free(o);
 }
 
 
@@ -141,6 +529,13 @@ void print_object(ObjectRef o) {
 	     o->quadric.parts[6], o->quadric.parts[7], o->quadric.parts[8],
 	     o->quadric.parts[9]); 
       break;
+    case Instances:
+      printf("Instances:\n\tPrototype: %d\n\tCount: %d\n\n", instance_set_prototype_number(o->instances.set),
+	     instance_count(o->instances.set));
+      break;
+    case Mesh:
+      printf("Mesh:\n\tFile: %s\n\tTriangles: %d\n\n", mesh_path(o->mesh.data), mesh_triangle_count(o->mesh.data));
+      break;
     case NoObjKind:
       printf("Uh oh!\n");
       break;
@@ -152,76 +547,108 @@ void print_object(ObjectRef o) {
 }
 //////////////////////////////////////////////////////////
 
-static ObjectRef get_next_plane_from_scene(Scene scene) {
+/* Each get_next_*_from_scene() stores the next object of its kind in out, or NULL if there are no
+ * more, and returns false if the object's spec is invalid. */
+static bool get_next_plane_from_scene(Scene scene, ObjectRef *out) {
+  *out = NULL;
   SpecRef spec = next_spec_declaring_kind(scene, "plane");
   if(NULL == spec) {
-    return NULL;
+    return true;
   }
 
   ObjectRef p = new_object_from_spec(spec);
+  if(NULL == p) {
+    destroy_spec(spec);
+    return false;
+  }
   p->kind = Plane;
   p->plane.position = next_vector_field_value_with_name(spec, "position");
   p->plane.normal = next_vector_field_value_with_name(spec, "normal");
 
-  validate_plane(p);
   destroy_spec(spec);
+  if(!validate_plane(p)) {
+    destroy_object(p);
+    return false;
+  }
 
-  return p;
+  *out = p;
+  return true;
 }
 
-static void validate_plane(ObjectRef p) {
+static bool validate_plane(ObjectRef p) {
   if(Plane != p->kind) {
-    fprintf(stderr, "Error: Plane was somehow... not... a plane...\n");
-    exit(EXIT_FAILURE);
+    set_error(RC_ERR_SCENE, "Plane was somehow... not... a plane...");
+    return false;
   }
   if(NULL == p->plane.position) {
-    fprintf(stderr, "Error: Plane has no position\n");
-    exit(EXIT_FAILURE);
+    set_error(RC_ERR_SCENE, "Plane has no position");
+    return false;
   }
   if(NULL == p->plane.normal) {
-    fprintf(stderr, "Error: Plane has no normal\n");
-    exit(EXIT_FAILURE);
+    set_error(RC_ERR_SCENE, "Plane has no normal");
+    return false;
   }
+  return true;
 }
 
 
-static ObjectRef get_next_sphere_from_scene(Scene scene) {
+static bool get_next_sphere_from_scene(Scene scene, ObjectRef *out) {
+  *out = NULL;
   SpecRef spec = next_spec_declaring_kind(scene, "sphere");
-  if(NULL == spec) return NULL;
+  if(NULL == spec) return true;
 
   ObjectRef s = new_object_from_spec(spec);
+  if(NULL == s) {
+    destroy_spec(spec);
+    return false;
+  }
   s->kind = Sphere;
   s->sphere.position = next_vector_field_value_with_name(spec, "position");
   s->sphere.radius = next_scalar_field_value_with_name(spec, "radius");
 
-  validate_sphere(s);
   destroy_spec(spec);
+  if(!validate_sphere(s)) {
+    destroy_object(s);
+    return false;
+  }
 
-  return s;
+  *out = s;
+  return true;
 }
 
-static void validate_sphere(ObjectRef s) {
+static bool validate_sphere(ObjectRef s) {
   if(Sphere != s->kind) {
-    fprintf(stderr, "Error: Sphere was somehow... not... a sphere...\n");
-    exit(EXIT_FAILURE);
+    set_error(RC_ERR_SCENE, "Sphere was somehow... not... a sphere...");
+    return false;
   }
   if(NULL == s->sphere.position) {
-    fprintf(stderr, "Error: Sphere has no position\n");
-    exit(EXIT_FAILURE);
+    set_error(RC_ERR_SCENE, "Sphere has no position");
+    return false;
   }
   if(NO_SCALAR == s->sphere.radius) {
-    fprintf(stderr, "Error: Sphere has no radius\n");
-    exit(EXIT_FAILURE);
+    set_error(RC_ERR_SCENE, "Sphere has no radius");
+    return false;
   }
+  return true;
 }
 
-static ObjectRef get_next_quadric_from_scene(Scene scene) {
+static bool get_next_quadric_from_scene(Scene scene, ObjectRef *out) {
+  *out = NULL;
   SpecRef spec = next_spec_declaring_kind(scene, "quadric");
-  if(NULL == spec) return NULL;
+  if(NULL == spec) return true;
 
   ObjectRef q = new_object_from_spec(spec);
+  if(NULL == q) {
+    destroy_spec(spec);
+    return false;
+  }
   q->kind = Quadric;
   q->quadric.parts = checked_malloc(10 * sizeof(*(q->quadric.parts)));
+  if(NULL == q->quadric.parts) {
+    destroy_object(q);
+    destroy_spec(spec);
+    return false;
+  }
   q->quadric.parts[0] = next_scalar_field_value_with_name(spec, "A");
   q->quadric.parts[1] = next_scalar_field_value_with_name(spec, "B");
   q->quadric.parts[2] = next_scalar_field_value_with_name(spec, "C");
@@ -233,16 +660,20 @@ static ObjectRef get_next_quadric_from_scene(Scene scene) {
   q->quadric.parts[8] = next_scalar_field_value_with_name(spec, "I");
   q->quadric.parts[9] = next_scalar_field_value_with_name(spec, "J");
 
-  validate_quadric(q);
   destroy_spec(spec);
+  if(!validate_quadric(q)) {
+    destroy_object(q);
+    return false;
+  }
 
-  return q;
+  *out = q;
+  return true;
 }
 
-static void validate_quadric(ObjectRef q) {
+static bool validate_quadric(ObjectRef q) {
   if(Quadric != q->kind) {
-    fprintf(stderr, "Error: Quadric was somehow... not... a quadric...\n");
-    exit(EXIT_FAILURE);
+    set_error(RC_ERR_SCENE, "Quadric was somehow... not... a quadric...");
+    return false;
   }
 
   for(int i = 0; i < 10; i++) {
@@ -254,12 +685,131 @@ static void validate_quadric(ObjectRef q) {
       q->quadric.parts[i] = 0;
     }
   }
+  return true;
 }
 
 
+/* A mesh's triangles are read from the file its "file" field names, which the parser has already
+ * made relative to the scene file's directory. */
+static bool get_next_mesh_from_scene(Scene scene, ObjectRef *out) {
+  *out = NULL;
+  SpecRef spec = next_spec_declaring_kind(scene, "mesh");
+  if(NULL == spec) return true;
+
+  ObjectRef m = new_object_from_spec(spec);
+  if(NULL == m) {
+    destroy_spec(spec);
+    return false;
+  }
+  char *path = next_string_field_value_with_name(spec, "file");
+  destroy_spec(spec);
+  if(NULL == path) {
+    set_error(RC_ERR_SCENE, "Mesh has no file");
+    destroy_object(m);
+    return false;
+  }
+  m->mesh.data = load_mesh(path);
+  free(path);
+  if(NULL == m->mesh.data) {
+    destroy_object(m);
+    return false;
+  }
+  m->kind = Mesh;
+
+  *out = m;
+  return true;
+}
+
+
+/* Reads every instance in the scene into sets, one for each prototype number they name. Returns
+ * false if an instance is invalid, leaving the sets read so far in sets. */
+static bool get_instances_from_scene(Scene scene, InstanceSetRef *sets, int *set_count) {
+  SpecRef spec;
+  while(NULL != (spec = next_spec_declaring_kind(scene, "instance"))) {
+    double number = next_scalar_field_value_with_name(spec, "prototype");
+    double *position = next_vector_field_value_with_name(spec, "position");
+    double *rotation = next_vector_field_value_with_name(spec, "rotation");
+    double *scale = next_vector_field_value_with_name(spec, "scale");
+    destroy_spec(spec);
+
+    bool ok = false;
+    InstanceSetRef set = NULL;
+    if(NO_SCALAR == number) {
+      set_error(RC_ERR_SCENE, "Instance has no prototype");
+    } else if(!is_prototype_number(number)) {
+      set_error(RC_ERR_SCENE, "Instance prototype must be a whole number from 0");
+    } else if(NULL == position) {
+      set_error(RC_ERR_SCENE, "Instance has no position");
+    } else if(NULL != (set = find_instance_set(sets, *set_count, (int) number))) {
+      ok = true;
+    } else if(MAX_OBJECTS == *set_count) {
+      set_error(RC_ERR_SCENE, "Instances name more than %d prototypes", MAX_OBJECTS);
+    } else if(NULL != (set = new_instance_set((int) number))) {
+      sets[(*set_count)++] = set;
+      ok = true;
+    }
+    ok = ok && add_instance(set, position, rotation, scale);
+    free(position);
+    free(rotation);
+    free(scale);
+    if(!ok) return false;
+  }
+  return true;
+}
+
+static InstanceSetRef find_instance_set(InstanceSetRef *sets, int set_count, int number) {
+  for(int s = 0; s < set_count; s++) {
+    if(instance_set_prototype_number(sets[s]) == number) return sets[s];
+  }
+  return NULL;
+}
+
+/* Gives the prototype to the set of instances that names it, or destroys it if none do. Returns
+ * false if it cannot be a prototype. */
+static bool add_prototype(InstanceSetRef *sets, int set_count, ObjectRef o) {
+  InstanceSetRef set = find_instance_set(sets, set_count, o->prototype);
+  if(Plane == o->kind) {
+    set_error(RC_ERR_SCENE, "Planes cannot be prototypes");
+  } else if(NULL != set && NULL != instance_set_prototype(set)) {
+    set_error(RC_ERR_SCENE, "More than one object is prototype %d", o->prototype);
+  } else if(NULL == set) {
+    destroy_object(o);
+    return true;
+  } else {
+    return build_instance_set(set, o);
+  }
+  destroy_object(o);
+  return false;
+}
+
+/* The object standing for the set, which it takes over. Its material is the prototype's. */
+static ObjectRef new_instances_object(InstanceSetRef set) {
+  ObjectRef o = checked_malloc(sizeof(*o));
+  if(NULL == o) return NULL;
+  *o = *instance_set_prototype(set);
+  o->kind = Instances;
+  o->prototype = -1;
+  o->instances.set = set;
+  return o;
+}
+
+static void destroy_instance_sets(InstanceSetRef *sets, int set_count) {
+  for(int s = 0; s < set_count; s++) {
+    destroy_instance_set(sets[s]);
+  }
+}
+
+static bool is_prototype_number(double number) {
+  return number >= 0 && number <= INT_MAX && number == floor(number);
+}
+
+
+/* Returns NULL if the material fields of the spec are invalid. The kind is left as NoObjKind for
+ * the caller to fill in along with the geometry. */
 static ObjectRef new_object_from_spec(SpecRef osr) {
   Object zero_object = {0};
   ObjectRef o = checked_malloc(sizeof(*o));
+  if(NULL == o) return NULL;
   *o = zero_object;
   o->diffuse_color = get_diffuse_color_from_spec(osr);
   o->specular_color = get_specular_color_from_spec(osr);
@@ -267,8 +817,13 @@ static ObjectRef new_object_from_spec(SpecRef osr) {
   o->reflectivity = get_reflectivity_from_spec(osr);
   o->refractivity = get_refractivity_from_spec(osr);
   o->ior = get_ior_from_spec(osr);
+  o->prototype = get_prototype_from_spec(osr);
 
-  validate_object(o);
+  if(!validate_object(o)) {
+    destroy_object(o);
+    return NULL;
+  }
+  o->material = classify_material(o);
  
   return o;
 }
@@ -279,8 +834,7 @@ static double* get_diffuse_color_from_spec(SpecRef osr) {
   if(NULL == dc) {
     dc = next_vector_field_value_with_name(osr, "color");
     if(NULL == dc) {
-      fprintf(stderr, "Error: Neither 'color' nor 'diffuse_color' was specified for object\n");
-      exit(EXIT_FAILURE);
+      set_error(RC_ERR_SCENE, "Neither 'color' nor 'diffuse_color' was specified for object");
     }
   }
 
@@ -295,6 +849,7 @@ static double* get_specular_color_from_spec(SpecRef osr) {
     fprintf(stderr, "NOTICE: Assigning default of (0, 0, 0)\n");
     #endif
     sc = checked_malloc(3 * sizeof(*sc));
+    if(NULL == sc) return NULL;
     sc[0] = 0;
     sc[1] = 0;
     sc[2] = 0;
@@ -345,6 +900,13 @@ static double get_refractivity_from_spec(SpecRef osr) {
 }
 
 
+/* -1 if the spec has no prototype number, or -2 if it is not a valid one. */
+static int get_prototype_from_spec(SpecRef osr) {
+  double number = next_scalar_field_value_with_name(osr, "prototype");
+  if(NO_SCALAR == number) return -1;
+  return is_prototype_number(number) ? (int) number : -2;
+}
+
 static double get_ior_from_spec(SpecRef osr) {
   double ior = next_scalar_field_value_with_name(osr, "ior");
 
@@ -359,91 +921,211 @@ static double get_ior_from_spec(SpecRef osr) {
   return ior;
 }
 
-static void validate_object(ObjectRef o) {
+static bool validate_object(ObjectRef o) {
   if(NULL == o->specular_color) {
-    fprintf(stderr, "Error: No specular color for object\n");
-    exit(EXIT_FAILURE);
+    set_error(RC_ERR_SCENE, "No specular color for object");
+    return false;
   }
   if(NULL == o->diffuse_color) {
-    fprintf(stderr, "Error: No diffuse color for object\n");
-    exit(EXIT_FAILURE);
+    set_error(RC_ERR_SCENE, "No diffuse color for object");
+    return false;
   }
   if(NO_SCALAR == o->ns) {
-    fprintf(stderr, "Error: No ns for object\n");
-    exit(EXIT_FAILURE);
+    set_error(RC_ERR_SCENE, "No ns for object");
+    return false;
   }
   if(NO_SCALAR == o->reflectivity) {
-    fprintf(stderr, "Error: No reflectivity for object\n");
-    exit(EXIT_FAILURE);
+    set_error(RC_ERR_SCENE, "No reflectivity for object");
+    return false;
   }
   if(NO_SCALAR == o->refractivity) {
-    fprintf(stderr, "Error: No refractivity for object\n");
-    exit(EXIT_FAILURE);
+    set_error(RC_ERR_SCENE, "No refractivity for object");
+    return false;
   }
   if(o->reflectivity + o->refractivity > 1.0) {
-    fprintf(stderr, "Error: Sum of object reflectivity and refractivity exceeds 1.0\n");
-    exit(EXIT_FAILURE);
+    set_error(RC_ERR_SCENE, "Sum of object reflectivity and refractivity exceeds 1.0");
+    return false;
   }
   if(NO_SCALAR == o->ior) {
-    fprintf(stderr, "Error: No ior for object\n");
-    exit(EXIT_FAILURE);
+    set_error(RC_ERR_SCENE, "No ior for object");
+    return false;
+  }
+  if(o->prototype < -1) {
+    set_error(RC_ERR_SCENE, "Object prototype must be a whole number from 0");
+    return false;
   }
+  return true;
+}
+
+
+static enum MaterialKind classify_material(ObjectRef o) {
+  if(0 != o->reflectivity && 0 != o->refractivity) return Mixed;
+  if(0 != o->reflectivity) return Mirror;
+  if(0 != o->refractivity) return Glass;
+  double *sc = o->specular_color;
+  return 0 == sc[0] && 0 == sc[1] && 0 == sc[2] ? DiffuseOnly : DiffuseSpecular;
 }
 
 
 static double plane_intersection(RayRef ray, ObjectRef p) {
-  double p_norm_dot_r_dir = vec_dot(p->plane.normal, ray->dir);
+  Vec4 normal = v4_load(p->plane.normal);
+  double p_norm_dot_r_dir = v4_dot(normal, v4_load(ray->dir));
   if(0 == p_norm_dot_r_dir) return MISS;
-  double r_origin_sub_p_pos[3];
-  vec_subtract(ray->origin, p->plane.position, r_origin_sub_p_pos);
-  double p_norm_dot_r_origin_sub_p_pos = vec_dot(p->plane.normal, r_origin_sub_p_pos);
+  double p_norm_dot_r_origin_sub_p_pos = v4_dot(normal, v4_sub(v4_load(ray->origin), v4_load(p->plane.position)));
   double t_for_intersection = -1 * (p_norm_dot_r_origin_sub_p_pos / p_norm_dot_r_dir);
   return t_for_intersection > 0 ? t_for_intersection : MISS;
 }
 
 
+static double plane_intersection_from(RayRef ray, ObjectRef p, OriginTermsRef terms) {
+  double p_norm_dot_r_dir = v4_dot(v4_load(p->plane.normal), v4_load(ray->dir));
+  if(0 == p_norm_dot_r_dir) return MISS;
+  double t_for_intersection = -1 * (terms->offset / p_norm_dot_r_dir);
+  return t_for_intersection > 0 ? t_for_intersection : MISS;
+}
+
+
 static double sphere_intersection(RayRef r, ObjectRef s) {
   // First, see if there is any intersection at all
-  double s_center_sub_r_origin[3];
-  vec_subtract(s->sphere.position, r->origin, s_center_sub_r_origin);
-  double closest_t_to_s_center = vec_dot(r->dir, s_center_sub_r_origin);
+  Vec4 origin = v4_load(r->origin);
+  Vec4 dir = v4_load(r->dir);
+  Vec4 center = v4_load(s->sphere.position);
+  double radius = s->sphere.radius;
+  double closest_t_to_s_center = v4_dot(dir, v4_sub(center, origin));
   if(closest_t_to_s_center <= 0) return MISS;
   
-  double closest_point_to_s_center_on_r[3];
-  point_on_ray_at_t(r, closest_t_to_s_center, closest_point_to_s_center_on_r);
-  double dist_closest_point_to_center = point_distance(closest_point_to_s_center_on_r, s->sphere.position);
-  if(dist_closest_point_to_center > s->sphere.radius) return MISS;
-  if(dist_closest_point_to_center == s->sphere.radius) return dist_closest_point_to_center;
-  if(point_distance(r->origin, s->sphere.position) < s->sphere.radius) {
-    return closest_t_to_s_center + sqrt(pow(s->sphere.radius, 2) - pow(dist_closest_point_to_center, 2));
+  double dist_closest_point_to_center = v4_distance(v4_ray_point(origin, dir, closest_t_to_s_center), center);
+  if(dist_closest_point_to_center > radius) return MISS;
+  if(dist_closest_point_to_center == radius) return dist_closest_point_to_center;
+  double half_chord = sqrt(radius * radius - dist_closest_point_to_center * dist_closest_point_to_center);
+  if(v4_distance(origin, center) < radius) {
+    return closest_t_to_s_center + half_chord;
   } else {
-    return closest_t_to_s_center - sqrt(pow(s->sphere.radius, 2) - pow(dist_closest_point_to_center, 2));
+    return closest_t_to_s_center - half_chord;
   }
 }
 
 
-double quadric_intersection(RayRef ray, ObjectRef or) {
+static double sphere_intersection_from(RayRef r, ObjectRef s, OriginTermsRef terms) {
+  Vec4 origin = v4_load(r->origin);
+  Vec4 dir = v4_load(r->dir);
+  Vec4 center = v4_load(s->sphere.position);
+  double radius = s->sphere.radius;
+  double closest_t_to_s_center = v4_dot(dir, v4_load(terms->to_center));
+  if(closest_t_to_s_center <= 0) return MISS;
+
+  double dist_closest_point_to_center = v4_distance(v4_ray_point(origin, dir, closest_t_to_s_center), center);
+  if(dist_closest_point_to_center > radius) return MISS;
+  if(dist_closest_point_to_center == radius) return dist_closest_point_to_center;
+  double half_chord = sqrt(radius * radius - dist_closest_point_to_center * dist_closest_point_to_center);
+  return terms->inside ? closest_t_to_s_center + half_chord : closest_t_to_s_center - half_chord;
+}
+
+
+/* plane_intersection() for each lane, choosing rather than branching so the loop vectorizes. */
+static void plane_lanes_intersection(RayLanesRef lanes, int lane_count, ObjectRef p, double *t_out) {
+  double *n = p->plane.normal;
+  double *pos = p->plane.position;
+  for(int i = 0; i < lane_count; i++) {
+    double p_norm_dot_r_dir = (n[X]*lanes->dir[X][i]) + (n[Y]*lanes->dir[Y][i]) + (n[Z]*lanes->dir[Z][i]);
+    double p_norm_dot_r_origin_sub_p_pos = (n[X]*(lanes->origin[X][i] - pos[X])) +
+      (n[Y]*(lanes->origin[Y][i] - pos[Y])) + (n[Z]*(lanes->origin[Z][i] - pos[Z]));
+    double t_for_intersection = -1 * (p_norm_dot_r_origin_sub_p_pos / p_norm_dot_r_dir);
+    t_out[i] = 0 != p_norm_dot_r_dir && t_for_intersection > 0 ? t_for_intersection : MISS;
+  }
+}
+
+
+/* sphere_intersection() for each lane, in the same steps and order so the results match exactly. */
+static void sphere_lanes_intersection(RayLanesRef lanes, int lane_count, ObjectRef s, double *t_out) {
+  double *c = s->sphere.position;
+  double radius = s->sphere.radius;
+  for(int i = 0; i < lane_count; i++) {
+    double to_center[3] = {c[X] - lanes->origin[X][i], c[Y] - lanes->origin[Y][i], c[Z] - lanes->origin[Z][i]};
+    double closest_t_to_s_center = (lanes->dir[X][i]*to_center[X]) + (lanes->dir[Y][i]*to_center[Y]) +
+      (lanes->dir[Z][i]*to_center[Z]);
+    double closest_offset[3];
+    for(int a = 0; a < 3; a++) {
+      closest_offset[a] = (lanes->origin[a][i] + closest_t_to_s_center * lanes->dir[a][i]) - c[a];
+    }
+    double dist_closest_point_to_center = sqrt(closest_offset[X] * closest_offset[X] +
+					       closest_offset[Y] * closest_offset[Y] + closest_offset[Z] * closest_offset[Z]);
+    bool inside = sqrt(to_center[X] * to_center[X] + to_center[Y] * to_center[Y] + to_center[Z] * to_center[Z]) < radius;
+    double half_chord = sqrt(radius * radius - dist_closest_point_to_center * dist_closest_point_to_center);
+    double t = inside ? closest_t_to_s_center + half_chord : closest_t_to_s_center - half_chord;
+    if(dist_closest_point_to_center == radius) t = dist_closest_point_to_center;
+    if(closest_t_to_s_center <= 0 || dist_closest_point_to_center > radius) t = MISS;
+    t_out[i] = t;
+  }
+}
+
+
+static double quadric_intersection(RayRef ray, ObjectRef or) {
+  double coefficients[3];
+  get_quadric_coefficients(ray, or, coefficients);
+  return nearest_quadric_root(coefficients[0], coefficients[1], coefficients[2]);
+}
+
+
+/* The nearest positive root of Aq t^2 + Bq t + Cq, or the root of Bq t + Cq, whatever its sign, if
+ * Aq is 0. */
+static double nearest_quadric_root(double Aq, double Bq, double Cq) {
+  if(0 == Aq) {
+    if(Bq == 0.0) { return MISS; }
+    return -Cq / Bq;
+  }
+
+  double discriminant = Bq * Bq - 4 * Aq * Cq;
+  if(discriminant < 0.0) {
+    return MISS;
+  }
+
+  double sqrt_discriminant = sqrt(discriminant);
+  double t0 = (-Bq - sqrt_discriminant) / (2 * Aq);
+  if(t0 > 0.0) { return t0; }
+  double t1 = (-Bq + sqrt_discriminant) / (2 * Aq);
+  if(t1 > 0.0) { return t1; }
+
+  return MISS;
+}
+
+
+/* The coefficients of t^2, t and 1 in the quadric's equation along the ray. */
+static void get_quadric_coefficients(RayRef ray, ObjectRef or, double *out) {
+  get_quadric_ray_coefficients(ray, or, out);
+  out[2] = get_quadric_origin_coefficient(ray->origin, or);
+}
+
+
+/* The coefficients of t^2 and t. */
+static void get_quadric_ray_coefficients(RayRef ray, ObjectRef or, double *out) {
   double* q = or->quadric.parts;
   double* o = ray->origin;
   double* d = ray->dir;
-  double Aq = q[A] * pow(d[X], 2) +
-    q[B] * pow(d[Y], 2) +
-    q[C] * pow(d[Z], 2) +
+  out[0] = q[A] * (d[X] * d[X]) +
+    q[B] * (d[Y] * d[Y]) +
+    q[C] * (d[Z] * d[Z]) +
     q[D] * d[X] * d[Y] +
     q[E] * d[X] * d[Z] +
     q[F] * d[Y] * d[Z];
-  double Bq = 2 * q[A] * o[X] * d[X] +
+  out[1] = 2 * q[A] * o[X] * d[X] +
     2 * q[B] * o[Y] * d[Y] +
     2 * q[C] * o[Z] * d[Z] +
     q[D] * (o[X] * d[Y] + o[Y] * d[X]) +
     q[E] * (o[X] * d[Z] + o[Z] * d[X]) +
-    q[F] * (o[Y] * d[Z] + o[Y] * d[Z]) +
+    q[F] * (o[Y] * d[Z] + o[Z] * d[Y]) +
     q[G] * d[X] +
     q[H] * d[Y] +
     q[I] * d[Z];
-  double Cq = q[A] * pow(o[X], 2) +
-    q[B] * pow(o[Y], 2) +
-    q[C] * pow(o[Z], 2) +
+}
+
+
+/* The constant coefficient, which depends only on where the ray starts. */
+static double get_quadric_origin_coefficient(double *o, ObjectRef or) {
+  double* q = or->quadric.parts;
+  return q[A] * (o[X] * o[X]) +
+    q[B] * (o[Y] * o[Y]) +
+    q[C] * (o[Z] * o[Z]) +
     q[D] * o[X] * o[Y] +
     q[E] * o[X] * o[Z] +
     q[F] * o[Y] * o[Z] +
@@ -451,43 +1133,242 @@ double quadric_intersection(RayRef ray, ObjectRef or) {
     q[H] * o[Y] +
     q[I] * o[Z] +
     q[J];
+}
 
-  if(0 == Aq) {
-    if(Bq == 0.0) { return MISS; }
-    return -Cq / Bq;
-  }
 
-  double discriminant = pow(Bq, 2) - 4 * Aq * Cq;
-  if(discriminant < 0.0) {
-    return MISS;
-  }
+/* The ray starts on the quadric, so one root is at or near 0 and is skipped; the nearest root
+ * beyond a distance scaled to the ray's origin is the one the ray meets. */
+static double quadric_intersection_leaving(RayRef ray, ObjectRef or) {
+  double coefficients[3];
+  get_quadric_coefficients(ray, or, coefficients);
+  double Aq = coefficients[0];
+  double Bq = coefficients[1];
+  double Cq = coefficients[2];
+  double epsilon = SELF_HIT_EPSILON * (1.0 + fmax(fabs(ray->origin[X]), fmax(fabs(ray->origin[Y]), fabs(ray->origin[Z]))));
 
+  if(0 == Aq) {
+    if(0 == Bq) return MISS;
+    double t = -Cq / Bq;
+    return t > epsilon ? t : MISS;
+  }
+  double discriminant = Bq * Bq - 4 * Aq * Cq;
+  if(discriminant < 0.0) return MISS;
   double sqrt_discriminant = sqrt(discriminant);
   double t0 = (-Bq - sqrt_discriminant) / (2 * Aq);
-  if(t0 > 0.0) { return t0; }
   double t1 = (-Bq + sqrt_discriminant) / (2 * Aq);
-  if(t1 > 0.0) { return t1; }
-
+  double near_t = fmin(t0, t1);
+  double far_t = fmax(t0, t1);
+  if(near_t > epsilon) return near_t;
+  if(far_t > epsilon) return far_t;
   return MISS;
 }
 
 
 static void get_plane_surface_normal(ObjectRef p, double *out) {
-  vec_copy(p->plane.normal, out);
+  v4_store(v4_load(p->plane.normal), out);
 }
 
 
 static void get_sphere_surface_normal(ObjectRef s, double *point, double *out) {
-  double intermediate[] = {0.0, 0.0, 0.0};
-  vec_subtract(point, s->sphere.position, intermediate);
-  vec_normalize(intermediate, out);
+  v4_store(v4_normalize(v4_sub(v4_load(point), v4_load(s->sphere.position))), out);
 }
 
 
 static void get_quadric_surface_normal(ObjectRef quadric, double *point, double *out) {
+  v4_store(v4_normalize(quadric_gradient(quadric, point)), out);
+}
+
+
+static Vec4 quadric_gradient(ObjectRef quadric, double *point) {
   double *q = quadric->quadric.parts;
-  out[X] = (2 * q[A] * point[X]) + (q[D] * point[Y]) + (q[E] * point[Z]) + q[G];
-  out[Y] = (2 * q[B] * point[Y]) + (q[D] * point[X]) + (q[F] * point[Z]) + q[H];
-  out[Z] = (2 * q[C] * point[Z]) + (q[E] * point[X]) + (q[F] * point[Y]) + q[I];
-  vec_normalize(out, out);
+  return v4_make((2 * q[A] * point[X]) + (q[D] * point[Y]) + (q[E] * point[Z]) + q[G],
+		 (2 * q[B] * point[Y]) + (q[D] * point[X]) + (q[F] * point[Z]) + q[H],
+		 (2 * q[C] * point[Z]) + (q[E] * point[X]) + (q[F] * point[Y]) + q[I]);
+}
+
+
+static bool vectors_equal(double *a, double *b, int len) {
+  for(int i = 0; i < len; i++) {
+    if(a[i] != b[i]) return false;
+  }
+  return true;
+}
+
+
+/* A plane can only shadow what lies at least partly on its far side from the light. */
+static bool plane_could_shadow(ObjectRef plane, ObjectRef receiver, double *light_position) {
+  Vec4 normal = v4_load(plane->plane.normal);
+  Vec4 position = v4_load(plane->plane.position);
+  double normal_length = v4_length(normal);
+  Vec4 plane_to_light = v4_sub(v4_load(light_position), position);
+  double light_height = v4_dot(plane_to_light, normal) / normal_length;
+  double margin = SHADOW_MARGIN * (1.0 + v4_length(plane_to_light));
+  if(fabs(light_height) <= margin) return true;
+  double side = light_height > 0 ? 1.0 : -1.0;
+
+  switch(receiver->kind) {
+  case Sphere:
+    return side * v4_dot(v4_sub(v4_load(receiver->sphere.position), position), normal) / normal_length <=
+      receiver->sphere.radius + margin;
+  case Plane: {
+    // Only a parallel plane can lie wholly on one side
+    Vec4 receiver_normal = v4_load(receiver->plane.normal);
+    double cross_length = v4_length(v4_cross(normal, receiver_normal));
+    if(cross_length > SHADOW_MARGIN * normal_length * v4_length(receiver_normal)) return true;
+    return side * v4_dot(v4_sub(v4_load(receiver->plane.position), position), normal) / normal_length <= margin;
+  }
+  case Quadric:
+  case Instances:
+  case Mesh:
+  case NoObjKind:
+    break;
+  }
+  return true;
+}
+
+
+/* Seen from outside, a sphere shadows only the cone of directions it fills, and only beyond its near
+ * side. From inside it shadows everything. */
+static bool sphere_could_shadow(ObjectRef sphere, ObjectRef receiver, double *light_position) {
+  Vec4 light = v4_load(light_position);
+  Vec4 light_to_sphere = v4_sub(v4_load(sphere->sphere.position), light);
+  double sphere_distance = v4_length(light_to_sphere);
+  double margin = SHADOW_MARGIN * (1.0 + sphere_distance);
+  if(sphere_distance <= sphere->sphere.radius + margin) return true;
+  double cone_angle = asin(sphere->sphere.radius / sphere_distance);
+
+  switch(receiver->kind) {
+  case Sphere: {
+    Vec4 light_to_receiver = v4_sub(v4_load(receiver->sphere.position), light);
+    double receiver_distance = v4_length(light_to_receiver);
+    if(receiver_distance <= receiver->sphere.radius + margin) return true;
+    if(receiver_distance + receiver->sphere.radius < sphere_distance - sphere->sphere.radius - margin) return false;
+    double receiver_angle = asin(receiver->sphere.radius / receiver_distance);
+    return angle_between(light_to_sphere, light_to_receiver) <= cone_angle + receiver_angle + SHADOW_MARGIN;
+  }
+  case Plane: {
+    // Some direction in the cone must head towards the plane
+    Vec4 normal = v4_load(receiver->plane.normal);
+    double light_height = v4_dot(v4_sub(light, v4_load(receiver->plane.position)), normal) / v4_length(normal);
+    if(fabs(light_height) <= margin) return true;
+    Vec4 toward_plane = v4_scale(normal, light_height > 0 ? -1.0 : 1.0);
+    return angle_between(light_to_sphere, toward_plane) < acos(0.0) + cone_angle + SHADOW_MARGIN;
+  }
+  case Quadric:
+  case Instances:
+  case Mesh:
+  case NoObjKind:
+    break;
+  }
+  return true;
+}
+
+
+static double angle_between(Vec4 a, Vec4 b) {
+  double cos_angle = v4_dot(a, b) / (v4_length(a) * v4_length(b));
+  return acos(fmax(-1.0, fmin(1.0, cos_angle)));
+}
+
+
+/* Stores the corners of a box around the object, widened by a small margin, and returns true if the
+ * object is closed. Planes and quadrics other than ellipsoids are unbounded, as are instances of them. */
+bool object_bounds(ObjectRef o, double *lo, double *hi) {
+  switch(o->kind) {
+  case Sphere:
+    for(int a = 0; a < 3; a++) {
+      lo[a] = o->sphere.position[a] - fabs(o->sphere.radius);
+      hi[a] = o->sphere.position[a] + fabs(o->sphere.radius);
+    }
+    break;
+  case Quadric:
+    if(!quadric_bounds(o, lo, hi)) return false;
+    break;
+  case Instances:
+    if(!instance_set_bounds(o->instances.set, lo, hi)) return false;
+    break;
+  case Mesh:
+    mesh_bounds(o->mesh.data, lo, hi);
+    break;
+  case Plane:
+  case NoObjKind:
+    return false;
+  }
+  for(int a = 0; a < 3; a++) {
+    double margin = SHADOW_MARGIN * (1.0 + fmax(fabs(lo[a]), fabs(hi[a])));
+    lo[a] -= margin;
+    hi[a] += margin;
+  }
+  return true;
+}
+
+
+/* Writing the quadric as x.Mx + g.x + j, it is an ellipsoid when M is definite, taken here as
+ * positive after flipping every sign if need be, and the surface is not empty. The ellipsoid is
+ * centered on -M^-1 g / 2 and reaches sqrt(k (M^-1)ii) from it along axis i, where k is the value
+ * x.Mx at the center less j. */
+static bool quadric_bounds(ObjectRef quadric, double *lo, double *hi) {
+  double *q = quadric->quadric.parts;
+  double sign = q[A] < 0 ? -1.0 : 1.0;
+  double m[3][3] = {
+    {sign * q[A], sign * q[D] / 2, sign * q[E] / 2},
+    {sign * q[D] / 2, sign * q[B], sign * q[F] / 2},
+    {sign * q[E] / 2, sign * q[F] / 2, sign * q[C]}
+  };
+  double g[3] = {sign * q[G], sign * q[H], sign * q[I]};
+  double minor = m[0][0] * m[1][1] - m[0][1] * m[1][0];
+  double inverse[3][3];
+  inverse[0][0] = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+  inverse[0][1] = m[0][2] * m[2][1] - m[0][1] * m[2][2];
+  inverse[0][2] = m[0][1] * m[1][2] - m[0][2] * m[1][1];
+  inverse[1][1] = m[0][0] * m[2][2] - m[0][2] * m[2][0];
+  inverse[1][2] = m[0][2] * m[1][0] - m[0][0] * m[1][2];
+  inverse[2][2] = minor;
+  double det = m[0][0] * inverse[0][0] + m[0][1] * (m[1][2] * m[2][0] - m[1][0] * m[2][2]) +
+    m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+  if(!(m[0][0] > 0 && minor > 0 && det > 0)) return false;
+  inverse[1][0] = inverse[0][1];
+  inverse[2][0] = inverse[0][2];
+  inverse[2][1] = inverse[1][2];
+
+  double center[3] = {0.0};
+  for(int a = 0; a < 3; a++) {
+    center[a] = -(inverse[a][0] * g[0] + inverse[a][1] * g[1] + inverse[a][2] * g[2]) / (2 * det);
+  }
+  double k = -sign * q[J];
+  for(int a = 0; a < 3; a++) {
+    k += center[a] * (m[a][0] * center[0] + m[a][1] * center[1] + m[a][2] * center[2]);
+  }
+  if(!(k > 0)) return false;
+  for(int a = 0; a < 3; a++) {
+    double reach = sqrt(k * inverse[a][a] / det);
+    lo[a] = center[a] - reach;
+    hi[a] = center[a] + reach;
+  }
+  return true;
+}
+
+
+static bool plane_crosses_box(ObjectRef plane, double *lo, double *hi) {
+  double *n = plane->plane.normal;
+  double height = 0.0;
+  double reach = 0.0;
+  for(int a = 0; a < 3; a++) {
+    height += n[a] * ((lo[a] + hi[a]) / 2 - plane->plane.position[a]);
+    reach += fabs(n[a]) * (hi[a] - lo[a]) / 2;
+  }
+  return fabs(height) <= reach;
+}
+
+
+/* Some ray through the edges must head toward the plane, with slack for rounding in the rays
+ * between them. An eye on the plane sees none of it. */
+static bool plane_in_view(ObjectRef plane, Vec4 eye, Vec4 *edges) {
+  Vec4 normal = v4_load(plane->plane.normal);
+  double height = v4_dot(normal, v4_sub(eye, v4_load(plane->plane.position)));
+  if(0 == height) return false;
+  for(int i = 0; i < 4; i++) {
+    double slack = SHADOW_MARGIN * fabs(height) * v4_length(normal) * v4_length(edges[i]);
+    if(height * v4_dot(normal, edges[i]) <= slack) return true;
+  }
+  return false;
 }
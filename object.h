@@ -2,15 +2,30 @@
 #define OBJECT_HEADER 1
 
 #include <math.h>
+#include <stdbool.h>
 #include "spec.h"
 #include "vecmath.h"
 
 #define MISS INFINITY
+#define RAY_LANES 8
+// The most objects a scene may have; a set of instances counts as one
+#define MAX_OBJECTS 128
 
-enum ObjectKind { NoObjKind, Plane, Sphere, Quadric };
+/* Instances is a set of transformed copies of one sphere, quadric or mesh, which is called its
+ * prototype and is not drawn itself; see instance.h. A mesh is a triangle mesh read from a file; see
+ * mesh.h. */
+enum ObjectKind { NoObjKind, Plane, Sphere, Quadric, Instances, Mesh };
+
+/* Which parts of shading a material needs, decided when the object is loaded. DiffuseOnly has a
+ * black specular color; Mirror reflects, Glass refracts and Mixed does both. */
+enum MaterialKind { DiffuseOnly, DiffuseSpecular, Mirror, Glass, Mixed };
 
 struct Object {
   enum ObjectKind kind;
+  enum MaterialKind material;
+  int id;  // Position in the scene's object list
+  int prototype;  // The number instances name this object by, or -1 if it is drawn itself
+
   double *diffuse_color;
   double *specular_color;
   double ns;
@@ -29,15 +44,57 @@ struct Object {
     struct {
       double *parts;
     } quadric;
+    struct {
+      struct InstanceSet *set;  // Holds the prototype, whose colors the object shares
+    } instances;
+    struct {
+      struct Mesh *data;
+    } mesh;
   };
 };
 
 typedef struct Object Object;
 typedef struct Object* ObjectRef;
 
+/* Up to RAY_LANES rays stored coordinate by coordinate, so that one object can be tested against
+ * all of them in a loop the compiler can vectorize. */
+struct RayLanes {
+  double origin[3][RAY_LANES];
+  double dir[3][RAY_LANES];
+};
+
+typedef struct RayLanes RayLanes;
+typedef struct RayLanes* RayLanesRef;
+
+/* The parts of an object's intersection test that depend only on where the ray starts, for testing
+ * many rays that share an origin. */
+struct OriginTerms {
+  double to_center[3];  // Spheres: the center less the origin
+  bool inside;          // Spheres: whether the origin is inside
+  double offset;        // Planes: the origin's height along the normal; quadrics: the constant coefficient
+};
+
+typedef struct OriginTerms OriginTerms;
+typedef struct OriginTerms* OriginTermsRef;
+
 ObjectRef* get_objects_from_scene(Scene);
+char* scene_cache_key(Scene, size_t*);
 double has_intersection(RayRef, ObjectRef);
+double has_intersection_leaving(RayRef, ObjectRef);
+void lanes_intersection(RayLanesRef, int, ObjectRef, double*);
+void get_origin_terms(ObjectRef, double*, OriginTermsRef);
+double has_intersection_from(RayRef, ObjectRef, OriginTermsRef);
+bool object_in_view(ObjectRef, double*, double (*)[3]);
 void get_surface_normal(ObjectRef, double*, double*);
+double surface_offset(ObjectRef, double*);
+bool object_bounds(ObjectRef, double*, double*);
+bool object_geometry_equals(ObjectRef, ObjectRef);
+bool object_material_equals(ObjectRef, ObjectRef);
+bool object_could_shadow(ObjectRef, ObjectRef, double*);
+bool object_shadows_itself(ObjectRef, double*, double*);
+bool object_is_sealed(ObjectRef, ObjectRef*);
+void destroy_objects(ObjectRef*);
+void destroy_object(ObjectRef);
 void print_objects(ObjectRef*);
 void print_object(ObjectRef);
 
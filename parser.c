@@ -7,84 +7,139 @@
 #include "parser.h"
 #include "util.h"
 
+/* Parsing state. Once `failed` is set every helper becomes a no-op that returns a harmless value,
+ * so a failure deep in the descent unwinds without any further reads and only the first error is
+ * reported. */
+struct Parser {
+  FILE* file;
+  int line_num;
+  bool failed;
+};
+
+typedef struct Parser Parser;
+typedef struct Parser* ParserRef;
 
 static FILE* open_scene_file(const char*);
-static void ensure_non_empty_object_list(FILE*);
-static Scene parse_scene(FILE*);
+static Scene parse_scene_file(FILE*, const char*);
+static void ensure_non_empty_object_list(ParserRef);
+static Scene parse_scene(ParserRef);
 static void close_scene_file(FILE*);
-static SpecRef next_spec(FILE*);
-static SpecFieldRef next_spec_field(FILE*); 
-static void next_key(FILE*, SpecFieldRef);
-static void next_value(FILE*, SpecFieldRef);
-static char* next_string(FILE*);
-static void error_on_excessive_string_length(int);
-static void error_on_invalid_char(char);
-static double* next_vector(FILE*);
-static double next_double(FILE*);
-static void skip_ws(FILE*); 
-static void consume_next_c_on_match_or_err(FILE*, char, const char*);
-static void consume_next_c_on_match(FILE*, char);
-static bool next_c_matches(FILE*, char);
-static char next_c(FILE*);
-static void report_error(const char*);
-
-static int line_num = 0;
+static SpecRef next_spec(ParserRef);
+static SpecFieldRef next_spec_field(ParserRef); 
+static void next_key(ParserRef, SpecFieldRef);
+static void next_value(ParserRef, SpecFieldRef);
+static char* next_string(ParserRef, int);
+static void error_on_excessive_string_length(ParserRef, int, int);
+static void error_on_invalid_char(ParserRef, char);
+static double* next_vector(ParserRef);
+static double next_double(ParserRef);
+static void skip_ws(ParserRef); 
+static void consume_next_c_on_match_or_err(ParserRef, char, const char*);
+static void consume_next_c_on_match(ParserRef, char);
+static bool next_c_matches(ParserRef, char);
+static char next_c(ParserRef);
+static void report_error(ParserRef, const char*);
 
 #define DEBUG 1
 
-/* Parse scene from file */
+/* Parse scene from file. Returns NULL if the file cannot be read or is not a valid scene. Mesh files
+ * named by relative paths are found in the scene file's directory. */
 Scene parse_scene_from_file(char* filename) {
   DEBUG_LOG("Entering parse_scene_from_file");
-  FILE* scene_file = open_scene_file(filename);
-  ensure_non_empty_object_list(scene_file);
-  Scene scene = parse_scene(scene_file);
-  close_scene_file(scene_file);
+  char* base_dir = scene_directory(filename);
+  FILE* scene_file = NULL == base_dir ? NULL : open_scene_file(filename);
+  Scene scene = NULL == scene_file ? NULL : parse_scene_file(scene_file, base_dir);
+  free(base_dir);
   return scene;
 }
 
 
+/* Parse scene from the len bytes of scene JSON at buf, which need not be NUL terminated. Relative
+ * mesh file paths are taken from base_dir, or rejected if it is NULL. */
+Scene parse_scene_from_buffer(char* buf, size_t len, const char* base_dir) {
+  DEBUG_LOG("Entering parse_scene_from_buffer");
+  FILE* scene_file = fmemopen(buf, len, "r");
+  if(NULL == scene_file) {
+    set_error(RC_ERR_IO, "Could not read the scene from memory");
+    return NULL;
+  }
+  return parse_scene_file(scene_file, base_dir);
+}
+
+
+/* Returns a malloc'd copy of the directory part of the path, or "." if it has none. */
+char* scene_directory(const char* path) {
+  const char* slash = strrchr(path, '/');
+  size_t len = NULL == slash ? 1 : (slash == path ? 1 : (size_t) (slash - path));
+  char* dir = checked_malloc(len + 1);
+  if(NULL == dir) return NULL;
+  memcpy(dir, NULL == slash ? "." : path, len);
+  dir[len] = '\0';
+  return dir;
+}
+
+
 /* Wraps fopen to provide error checking */
 static FILE* open_scene_file(const char* filename) {
   DEBUG_LOG("Entering open_scene_file");
   FILE* scene_file = fopen(filename, "r");
 
   if (scene_file == NULL) {
-    fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
-    exit(EXIT_FAILURE);
+    set_error(RC_ERR_IO, "Could not open file \"%s\"", filename);
   }
 
   return scene_file;
 }
 
 
-static void ensure_non_empty_object_list(FILE* scene_file) {
+static Scene parse_scene_file(FILE* scene_file, const char* base_dir) {
+  Parser parser = {scene_file, 0, false};
+  ensure_non_empty_object_list(&parser);
+  Scene scene = parse_scene(&parser);
+  close_scene_file(scene_file);
+  if(parser.failed || !resolve_mesh_file_paths(scene, base_dir)) {
+    destroy_scene(scene);
+    return NULL;
+  }
+  return scene;
+}
+
+
+static void ensure_non_empty_object_list(ParserRef p) {
   DEBUG_LOG("Entering ensure_non_empty_object_list");
-  skip_ws(scene_file);
-  consume_next_c_on_match_or_err(scene_file, '[', "Expected opening of object list (missing '[')");
-  skip_ws(scene_file);
-  if(next_c_matches(scene_file, ']')) report_error("This scene file is empty; expected object definitions");
+  skip_ws(p);
+  consume_next_c_on_match_or_err(p, '[', "Expected opening of object list (missing '[')");
+  skip_ws(p);
+  if(next_c_matches(p, ']')) report_error(p, "This scene file is empty; expected object definitions");
 }
 
 
 /* Parses ObjSpecs from the scene file until a ']' is encountered, i.e., the close of the object
  * list. As ObjSpecs are parsed, they are wrapped in a SceneNode and those nodes are linked
  * sequentially. Returns a pointer to the head of the SceneNode list. */
-static Scene parse_scene(FILE* scene_file) {
+static Scene parse_scene(ParserRef p) {
   DEBUG_LOG("Entering parse_scene");
+  if(p->failed) return NULL;
   Scene scene = new_scene();
-  SpecRef current_spec = next_spec(scene_file);
+  if(NULL == scene) {
+    p->failed = true;
+    return NULL;
+  }
+  SpecRef current_spec = next_spec(p);
   if(NULL == current_spec) {
-    report_error("Expected an object definition");
-    exit(EXIT_FAILURE);
+    report_error(p, "Expected an object definition");
+    return scene;
   }
   add_spec_to_scene(scene, current_spec);
 
   // As long as another ObjSpec can be parsed from the file, keep doing so.
-  while(NULL != (current_spec = next_spec(scene_file))) {
-    add_spec_to_scene(scene, current_spec);
+  SpecRef last_spec = current_spec;
+  while(NULL != (current_spec = next_spec(p))) {
+    add_spec_after(last_spec, current_spec);
+    last_spec = current_spec;
   }
-  skip_ws(scene_file);
-  consume_next_c_on_match_or_err(scene_file, ']', "Expected end of object list (missing ']')");
+  skip_ws(p);
+  consume_next_c_on_match_or_err(p, ']', "Expected end of object list (missing ']')");
 
   return scene;
 }
@@ -94,208 +149,251 @@ static Scene parse_scene(FILE* scene_file) {
 static void close_scene_file(FILE* scene_file) {
   DEBUG_LOG("Entering close_scene_file");
   if(EOF == fclose(scene_file)) {
-    fprintf(stderr, "Error: Something went horribly wrong.\n");
-    fprintf(stderr, "Error: The scene file could not be closed.\n");
+    set_error(RC_ERR_IO, "The scene file could not be closed");
   }
 }
 
 
 /* Parses the next object definition in the scene file. Works by parsing FieldSpecs from the scene
  * file until a '}' is encountered, i.e., the closing of the object definition. Returns NULL when
- * the next non-whitespace char is nota '{', i.e., the opening of a new object definition. */
-static SpecRef next_spec(FILE* scene_file) {
+ * the next non-whitespace char is nota '{', i.e., the opening of a new object definition, or when
+ * parsing fails. */
+static SpecRef next_spec(ParserRef p) {
   DEBUG_LOG("Entering next_spec");
-  skip_ws(scene_file);
+  skip_ws(p);
 
   
-  if(!next_c_matches(scene_file, '{')) {
+  if(!next_c_matches(p, '{')) {
     return NULL;
   } else {
-    next_c(scene_file);
+    next_c(p);
   }
   
   SpecRef out_spec = new_spec();
-  while(!next_c_matches(scene_file, '}')) {
-    add_spec_field_to_spec(next_spec_field(scene_file), out_spec);
+  if(NULL == out_spec) {
+    p->failed = true;
+    return NULL;
   }
-  next_c(scene_file); // Consume the '}'
-
-  skip_ws(scene_file);
-  consume_next_c_on_match(scene_file, ',');
+  while(!p->failed && !next_c_matches(p, '}')) {
+    SpecFieldRef field = next_spec_field(p);
+    if(!p->failed && !add_spec_field_to_spec(field, out_spec)) {
+      p->failed = true;
+    }
+    if(p->failed) destroy_spec_field(field);
+  }
+  next_c(p); // Consume the '}'
 
+  skip_ws(p);
+  consume_next_c_on_match(p, ',');
 
+  if(p->failed) {
+    destroy_spec(out_spec);
+    return NULL;
+  }
   return out_spec;
 }
 
-/* Parses the next FieldSpec in the scene file. This either returns a FieldSpec or encounters a
- * failure such that exit() is called. Works by parsing the next string (field name), a colon
- * (separator), and the next string (for a "type" field), vector (for "position", "normal", etc.
- * fields), or a double (for "radius", "height", quadric component, etc. fields). */
-static SpecFieldRef next_spec_field(FILE* scene_file) {
+/* Parses the next FieldSpec in the scene file. Works by parsing the next string (field name), a
+ * colon (separator), and the next string (for a "type" field), vector (for "position", "normal",
+ * etc. fields), or a double (for "radius", "height", quadric component, etc. fields). On failure
+ * the partially built field is still returned so that the caller can free it. */
+static SpecFieldRef next_spec_field(ParserRef p) {
   DEBUG_LOG("Entering next_spec_field");
 
   SpecFieldRef f_spec = new_spec_field();
-  next_key(scene_file, f_spec);
-  skip_ws(scene_file);
-  consume_next_c_on_match_or_err(scene_file, ':', "Expecting key-value pair (missing ':')");
-  next_value(scene_file, f_spec);
-  skip_ws(scene_file);
-  consume_next_c_on_match(scene_file, ',');
+  if(NULL == f_spec) {
+    p->failed = true;
+    return NULL;
+  }
+  next_key(p, f_spec);
+  skip_ws(p);
+  consume_next_c_on_match_or_err(p, ':', "Expecting key-value pair (missing ':')");
+  next_value(p, f_spec);
+  skip_ws(p);
+  consume_next_c_on_match(p, ',');
 
   return f_spec;
 }
 
 
-static void next_key(FILE* scene_file, SpecFieldRef out_spec) {
+static void next_key(ParserRef p, SpecFieldRef out_spec) {
   DEBUG_LOG("Entering next_key");
-  skip_ws(scene_file);
-  spec_field_set_name(out_spec, next_string(scene_file));
+  skip_ws(p);
+  spec_field_set_name(out_spec, next_string(p, MAX_SPEC_STR_LEN));
 }
 
 
 /* See the comment for next_spec_field. */
-static void next_value(FILE* scene_file, SpecFieldRef out_spec) {
+static void next_value(ParserRef p, SpecFieldRef out_spec) {
   DEBUG_LOG("Entering next_value");
-  skip_ws(scene_file);
-  if(next_c_matches(scene_file, '"')) {
-    spec_field_solidify_to_type_decl(out_spec, next_string(scene_file));
-  } else if(next_c_matches(scene_file, '[')) {
-    spec_field_solidify_to_vector(out_spec, next_vector(scene_file));
+  skip_ws(p);
+  if(p->failed) return;
+  if(next_c_matches(p, '"')) {
+    char* type_str = next_string(p, MAX_SPEC_VALUE_LEN);
+    if(NULL != type_str) spec_field_solidify_to_type_decl(out_spec, type_str);
+  } else if(next_c_matches(p, '[')) {
+    double* vector = next_vector(p);
+    if(NULL != vector) spec_field_solidify_to_vector(out_spec, vector);
   } else {
-    spec_field_solidify_to_scalar(out_spec, next_double(scene_file));
+    spec_field_solidify_to_scalar(out_spec, next_double(p));
   }
 }
 
 
-/* Gets the next string from the file handle. Emits an error and exits if no string is found. */
-static char* next_string(FILE* scene_file) {
+/* Gets the next string from the file handle. Reports an error and returns NULL if no string is
+ * found or it is too long: max_length is MAX_SPEC_STR_LEN for names and MAX_SPEC_VALUE_LEN for
+ * values. */
+static char* next_string(ParserRef p, int max_length) {
   DEBUG_LOG("Entering next_string");
 
   //handle string opening
-  skip_ws(scene_file);
-  consume_next_c_on_match_or_err(scene_file, '"', "Expected opening of string (missing \")");
+  skip_ws(p);
+  consume_next_c_on_match_or_err(p, '"', "Expected opening of string (missing \")");
 
-  char buffer[MAX_SPEC_STR_LEN + 1];
+  char buffer[MAX_SPEC_VALUE_LEN + 1];
   int i = 0;
-  for(char c = next_c(scene_file); c != '"'; c = next_c(scene_file)) {
-    error_on_excessive_string_length(i);
-    error_on_invalid_char(c);
+  for(char c = next_c(p); !p->failed && c != '"'; c = next_c(p)) {
+    error_on_excessive_string_length(p, i, max_length);
+    error_on_invalid_char(p, c);
+    if(p->failed) break;
     buffer[i] = c;
     i++;
   } // Note that the closing '"' is discarded when the loop ends
+  if(p->failed) return NULL;
   
   buffer[i] = '\0';
-  return strdup(buffer);
+  char* ret = strdup(buffer);
+  if(NULL == ret) {
+    set_error(RC_ERR_NO_MEMORY, "NULL result from strdup");
+    p->failed = true;
+  }
+  return ret;
 }
 
-static void error_on_excessive_string_length(int string_length) {
-    if (string_length >= MAX_SPEC_STR_LEN - 1) {
-      fprintf(stderr, "Error: Strings longer than %d characters are not supported.\n", MAX_SPEC_STR_LEN);
-      report_error("Parsing ended unexpectedly");
-      exit(EXIT_FAILURE);      
+static void error_on_excessive_string_length(ParserRef p, int string_length, int max_length) {
+    if (string_length >= max_length - 1) {
+      char message[64];
+      snprintf(message, sizeof(message), "Strings longer than %d characters are not supported", max_length);
+      report_error(p, message);
     }
 }
 
 
-static void error_on_invalid_char(char c) {
+static void error_on_invalid_char(ParserRef p, char c) {
     if (c == '\\') {
-      report_error("Strings with escape codes are not supported");
-      exit(EXIT_FAILURE);      
+      report_error(p, "Strings with escape codes are not supported");
     }
     if (c < 32 || c > 126) {
-      report_error("Strings may contain only alpha-numeric characters");
-      exit(EXIT_FAILURE);
+      report_error(p, "Strings may contain only alpha-numeric characters");
     }
 }
 
 
-/* Gets the next vector from the file handle. Emits an error and exits if no vector is found. */
-static double* next_vector(FILE* scene_file) {
+/* Gets the next vector from the file handle. Reports an error and returns NULL if no vector is
+ * found. */
+static double* next_vector(ParserRef p) {
   DEBUG_LOG("Entering next_vector");
-  skip_ws(scene_file);
-  consume_next_c_on_match_or_err(scene_file, '[', "Expected the opening of a vector (missing '[')");
+  skip_ws(p);
+  consume_next_c_on_match_or_err(p, '[', "Expected the opening of a vector (missing '[')");
+  if(p->failed) return NULL;
 
   double* v = checked_malloc(3 * sizeof(double));
+  if(NULL == v) {
+    p->failed = true;
+    return NULL;
+  }
   for(int i = 0; i < 3; i++) {
-    skip_ws(scene_file);
-    v[i] = next_double(scene_file);
-    skip_ws(scene_file);
+    skip_ws(p);
+    v[i] = next_double(p);
+    skip_ws(p);
     if(i != 2) {
-      consume_next_c_on_match_or_err(scene_file, ',', "Expected the continuation of a vector (missing ',')");
+      consume_next_c_on_match_or_err(p, ',', "Expected the continuation of a vector (missing ',')");
     }
   }
-  consume_next_c_on_match_or_err(scene_file, ']', "Expected the closing of a vector (missing ']')");
+  consume_next_c_on_match_or_err(p, ']', "Expected the closing of a vector (missing ']')");
+  if(p->failed) {
+    free(v);
+    return NULL;
+  }
   return v;
 }
 
 
-/* Gets the next double from the file handle. Emits an error and exits if no double is found. */
-static double next_double(FILE* scene_file) {
+/* Gets the next double from the file handle. Reports an error if no double is found. */
+static double next_double(ParserRef p) {
   DEBUG_LOG("Entering next_double");
-  skip_ws(scene_file);
-  double value;
-  if(EOF == fscanf(scene_file, "%lf", &value)) {
-    report_error("Parsing ended unexpectedly when a double was expected");
-    exit(EXIT_FAILURE);
+  skip_ws(p);
+  double value = 0.0;
+  if(p->failed) return value;
+  if(EOF == fscanf(p->file, "%lf", &value)) {
+    report_error(p, "Parsing ended unexpectedly when a double was expected");
   }
   return value;
 }
 
 
 /* Skips the next run of white space in the file. Line number maintenance is deferred to next_c(). */
-static void skip_ws(FILE* scene_file) {
+static void skip_ws(ParserRef p) {
   DEBUG_LOG("Entering skip_ws");
-  char c = next_c(scene_file);
-  while(isspace(c)) {
-    c = next_c(scene_file);
+  if(p->failed) return;
+  char c = next_c(p);
+  while(!p->failed && isspace(c)) {
+    c = next_c(p);
   }
-  ungetc(c, scene_file);
+  if(!p->failed) ungetc(c, p->file);
   DEBUG_LOG("Leaving skip_ws");
 }
 
 
-static void consume_next_c_on_match(FILE *scene_file, char c) {
-  if(next_c_matches(scene_file, c)) next_c(scene_file);
+static void consume_next_c_on_match(ParserRef p, char c) {
+  if(next_c_matches(p, c)) next_c(p);
 }
 
 
-static void consume_next_c_on_match_or_err(FILE* scene_file, char c, const char* err) {
+static void consume_next_c_on_match_or_err(ParserRef p, char c, const char* err) {
   DEBUG_LOG("Entering consume_next_c_on_match_or_err");
-  if(c == next_c(scene_file)) return;
+  if(p->failed) return;
+  if(c == next_c(p)) return;
   else {
-    report_error(err);
-    exit(EXIT_FAILURE);
+    report_error(p, err);
   }
 }
 
 
 /* Returns true if the next char in the file is 'c', and false otherwise. Does not advance the
  * file's read index. */
-static bool next_c_matches(FILE* scene_file, char c) {
+static bool next_c_matches(ParserRef p, char c) {
   DEBUG_LOG("Entering next_c_matches");
-  char d = next_c(scene_file);
-  ungetc(d, scene_file);
+  if(p->failed) return false;
+  char d = next_c(p);
+  if(p->failed) return false;
+  ungetc(d, p->file);
   if(c == d) return true;
   else return false;
 }
 
 
-/* Wraps fgetc() providing error checking and line number maintenance. */
-static char next_c(FILE* scene_file) {
+/* Wraps fgetc() providing error checking and line number maintenance. Returns '\0' once parsing
+ * has failed. */
+static char next_c(ParserRef p) {
   DEBUG_LOG("Entering next_c");
-  int c = fgetc(scene_file);
+  if(p->failed) return '\0';
+  int c = fgetc(p->file);
   if (c == '\n') {
-    line_num += 1;
+    p->line_num += 1;
   }
   if (c == EOF) {
-    report_error("Unexpected end of file");
-    exit(EXIT_FAILURE);
+    report_error(p, "Unexpected end of file");
+    return '\0';
   }
   return c;
 }
 
 
-/* Reports errors in a standard format with the line number. */
-static void report_error(const char* error_msg) {
-  fprintf(stderr, "Error: %s on line %d\n", error_msg, line_num);
+/* Records errors in a standard format with the line number and marks the parse as failed. */
+static void report_error(ParserRef p, const char* error_msg) {
+  if(!p->failed) {
+    set_error(RC_ERR_PARSE, "%s on line %d", error_msg, p->line_num);
+  }
+  p->failed = true;
 }
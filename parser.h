@@ -2,6 +2,10 @@
 #define PARSER_HEADER 1
 
 #include "spec.h"
+#include <stddef.h>
+
 Scene parse_scene_from_file(char*);
+Scene parse_scene_from_buffer(char*, size_t, const char*);
+char* scene_directory(const char*);
 
 #endif
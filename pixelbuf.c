@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <string.h>
 #include <math.h>
 #include "pixelbuf.h"
@@ -10,6 +11,7 @@
 struct PixelBuf {
   int width;
   int height;
+  bool owns_buf;
   uint8_t *buf;
 };
 
@@ -19,17 +21,34 @@ static uint8_t scale_double(double);
 
 PixelBufRef new_pixel_buf(int width, int height) {
   PixelBufRef pbr = checked_malloc(sizeof(*pbr));
+  if(NULL == pbr) return NULL;
   pbr->width = width;
   pbr->height = height;
+  pbr->owns_buf = true;
   pbr->buf = checked_malloc((sizeof(*(pbr->buf)) * 3) * width * height);
+  if(NULL == pbr->buf) {
+    free(pbr);
+    return NULL;
+  }
+  return pbr;
+}
+
+/* Wraps a caller-owned buffer of at least width * height * 3 bytes, which outlives the PixelBuf. */
+PixelBufRef new_pixel_buf_over(uint8_t *buf, int width, int height) {
+  PixelBufRef pbr = checked_malloc(sizeof(*pbr));
+  if(NULL == pbr) return NULL;
+  pbr->width = width;
+  pbr->height = height;
+  pbr->owns_buf = false;
+  pbr->buf = buf;
   return pbr;
 }
 
 void color_pixel(PixelBufRef pbr, double *color, int row, int col) {
-  if(row < 0 || col < 0 || row > pbr->height || col > pbr->width) {
-    fprintf(stderr, "Error: Illegal coordinates passed to color_pixel:\n");
-    fprintf(stderr, "Error: \t\trow: %d  col: %d\t\t max_row: %d  max_col: %d\n", row, col, pbr->height, pbr->width);
-    exit(EXIT_FAILURE);
+  if(row < 0 || col < 0 || row >= pbr->height || col >= pbr->width) {
+    set_error(RC_ERR_INTERNAL, "Illegal coordinates passed to color_pixel: row: %d  col: %d  max_row: %d  max_col: %d",
+	      row, col, pbr->height, pbr->width);
+    return;
   }
   int row_offset = (pbr->height - 1 - row) * pbr->width * 3;
   int col_offset = col * 3;
@@ -42,10 +61,17 @@ void color_pixel(PixelBufRef pbr, double *color, int row, int col) {
 uint8_t* get_byte_array(PixelBufRef pbr) {
   size_t buf_len = pbr->width * pbr->height * 3;
   uint8_t *out_arr = checked_malloc(sizeof(*(pbr->buf)) * buf_len);
+  if(NULL == out_arr) return NULL;
   memcpy(out_arr, pbr->buf, buf_len);
   return out_arr;
 }
 
+void destroy_pixel_buf(PixelBufRef pbr) {
+  if(NULL == pbr) return;
+  if(pbr->owns_buf) free(pbr->buf);
+  free(pbr);
+}
+
 static uint8_t scale_double(double d) {
   d = d <= 1.0 ? d : 1.0;
   double intermediate = floor(d * 255.0);
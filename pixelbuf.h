@@ -1,8 +1,15 @@
+#ifndef PIXELBUF_HEADER
+#define PIXELBUF_HEADER 1
+
 #include <stddef.h>
+#include <stdint.h>
 
 typedef struct PixelBuf* PixelBufRef;
 
 PixelBufRef new_pixel_buf(int, int);
+PixelBufRef new_pixel_buf_over(uint8_t*, int, int);
 void color_pixel(PixelBufRef, double*, int, int);
 uint8_t* get_byte_array(PixelBufRef);
+void destroy_pixel_buf(PixelBufRef);
 
+#endif
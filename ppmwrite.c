@@ -1,47 +1,150 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include "ppmwrite.h"
+#include "util.h"
 
-void ppm_write(char* outfile_name, char format_flag, uint8_t *buf, int width, int height) {
+struct PpmWriter {
+  FILE *file;
+  char format_flag;
+  int width;
+  size_t bytes_written;
+};
+
+typedef struct PpmWriter PpmWriter;
+
+static PpmWriterRef open_writer(char*, const char*, char, int, int);
+static PpmWriterRef new_writer(FILE*, char, int, int);
+static bool valid_format_flag(char);
+static bool write_whole_image(PpmWriterRef, uint8_t*, int, int);
+
+/* Returns false if the file could not be written. */
+bool ppm_write(char* outfile_name, char format_flag, uint8_t *buf, int width, int height) {
   if(NULL == buf) {
-    fprintf(stderr, "ERROR: The buffer passed to ppm_write was NULL\n");
-    exit(EXIT_FAILURE);
+    set_error(RC_ERR_ARGUMENT, "The buffer passed to ppm_write was NULL");
+    return false;
   }
+  return write_whole_image(ppm_open(outfile_name, format_flag, width, height), buf, width, height);
+}
 
-  FILE *output_file = fopen(outfile_name, "w");
-  if(NULL == output_file) {
-    fprintf(stderr, "ERROR: Output file could not be opened for writing\n");
-    exit(EXIT_FAILURE);
-  }
 
-  if(format_flag != '3' && format_flag != '6') {
-    fprintf(stderr, "ERROR: The format flag passed to ppm_write must be '3' or '6'\n");
-    exit(EXIT_FAILURE);
+/* As ppm_write(), but adds the image to the end of the file, so that a sequence of frames can be
+ * written as one concatenated stream. */
+bool ppm_append(char* outfile_name, char format_flag, uint8_t *buf, int width, int height) {
+  if(NULL == buf) {
+    set_error(RC_ERR_ARGUMENT, "The buffer passed to ppm_append was NULL");
+    return false;
   }
+  return write_whole_image(open_writer(outfile_name, "a", format_flag, width, height), buf, width, height);
+}
 
-  if(0 > fprintf(output_file, "P%c\n%d %d\n255\n", format_flag, width, height)) {
-    fprintf(stderr, "ERROR: An error occurred while writing to the output file 1\n");
-    exit(EXIT_FAILURE);
+
+/* The bytes ppm_write() would write, in a malloc'd buffer whose length is stored in len_out. Returns
+ * NULL if memory runs out. */
+char* ppm_encode(char format_flag, uint8_t *buf, int width, int height, size_t *len_out) {
+  if(NULL == buf) {
+    set_error(RC_ERR_ARGUMENT, "The buffer passed to ppm_encode was NULL");
+    return NULL;
+  }
+  if(!valid_format_flag(format_flag)) return NULL;
+  char *text = NULL;
+  FILE *stream = open_memstream(&text, len_out);
+  if(NULL == stream) {
+    set_error(RC_ERR_NO_MEMORY, "Could not allocate memory");
+    return NULL;
+  }
+  if(!write_whole_image(new_writer(stream, format_flag, width, height), buf, width, height)) {
+    free(text);
+    return NULL;
   }
+  return text;
+}
+
 
-  int buf_len = sizeof(uint8_t) * width * height * 3;
-  if(format_flag == '3') {
-    for(int i = 0; i < buf_len; i++) {
-      if(i % width == 0 && 0 > fprintf(output_file, "\n")) {
-	fprintf(stderr, "ERROR: An error occurred while writing to the output file 2\n");
-	exit(EXIT_FAILURE);
+/* Opens a PPM for incremental writing. The pixel bytes may then be supplied in any number of
+ * chunks via ppm_write_bytes(); the output is identical to a single call to ppm_write(). Returns
+ * NULL if the file cannot be created. */
+PpmWriterRef ppm_open(char* outfile_name, char format_flag, int width, int height) {
+  return open_writer(outfile_name, "w", format_flag, width, height);
+}
+
+
+bool ppm_write_bytes(PpmWriterRef writer, uint8_t *buf, size_t buf_len) {
+  if(writer->format_flag == '3') {
+    for(size_t i = 0; i < buf_len; i++) {
+      // Line breaks are placed by the offset into the whole image, not into this chunk
+      if((writer->bytes_written + i) % writer->width == 0 && 0 > fprintf(writer->file, "\n")) {
+	set_error(RC_ERR_IO, "An error occurred while writing to the output file 2");
+	return false;
       }
-      if(0 > fprintf(output_file, "%u ", buf[i])) {
-	fprintf(stderr, "ERROR: An error occurred while writing to the output file 3\n");
-	exit(EXIT_FAILURE);
+      if(0 > fprintf(writer->file, "%u ", buf[i])) {
+	set_error(RC_ERR_IO, "An error occurred while writing to the output file 3");
+	return false;
       }
     }
   }
-  if(format_flag == '6' && !((size_t) buf_len == fwrite(buf, sizeof(uint8_t), buf_len, output_file))) {
-    fprintf(stderr, "ERROR: An error occurred while writing to the output file 4\n");
-    exit(EXIT_FAILURE);
+  if(writer->format_flag == '6' && !(buf_len == fwrite(buf, sizeof(uint8_t), buf_len, writer->file))) {
+    set_error(RC_ERR_IO, "An error occurred while writing to the output file 4");
+    return false;
+  }
+  writer->bytes_written += buf_len;
+  return true;
+}
+
+
+bool ppm_close(PpmWriterRef writer) {
+  bool ok = 0 == fclose(writer->file);
+  if(!ok) set_error(RC_ERR_IO, "An error occurred while closing the output file");
+  free(writer);
+  return ok;
+}
+
+
+static PpmWriterRef open_writer(char* outfile_name, const char* mode, char format_flag, int width, int height) {
+  if(!valid_format_flag(format_flag)) return NULL;
+
+  FILE *output_file = fopen(outfile_name, mode);
+  if(NULL == output_file) {
+    set_error(RC_ERR_IO, "Output file \"%s\" could not be opened for writing", outfile_name);
+    return NULL;
+  }
+  return new_writer(output_file, format_flag, width, height);
+}
+
+
+/* Writes the header to output_file, which the writer then owns, or closes it on failure. */
+static PpmWriterRef new_writer(FILE *output_file, char format_flag, int width, int height) {
+  if(0 > fprintf(output_file, "P%c\n%d %d\n255\n", format_flag, width, height)) {
+    set_error(RC_ERR_IO, "An error occurred while writing to the output file 1");
+    fclose(output_file);
+    return NULL;
+  }
+
+  PpmWriterRef writer = checked_malloc(sizeof(*writer));
+  if(NULL == writer) {
+    fclose(output_file);
+    return NULL;
+  }
+  writer->file = output_file;
+  writer->format_flag = format_flag;
+  writer->width = width;
+  writer->bytes_written = 0;
+  return writer;
+}
+
+
+static bool valid_format_flag(char format_flag) {
+  if(format_flag != '3' && format_flag != '6') {
+    set_error(RC_ERR_ARGUMENT, "The format flag passed to ppm_write must be '3' or '6'");
+    return false;
   }
+  return true;
+}
+
 
-  fclose(output_file);
-  return;
+static bool write_whole_image(PpmWriterRef writer, uint8_t *buf, int width, int height) {
+  if(NULL == writer) return false;
+  bool ok = ppm_write_bytes(writer, buf, sizeof(uint8_t) * width * height * 3);
+  return ppm_close(writer) && ok;
 }
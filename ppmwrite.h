@@ -1,10 +1,17 @@
 #ifndef PPMWRITE_HEADER
 #define PPMWRITE_HEADER 1
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
-void ppm_write(char*, char, uint8_t*, int, int);
-
-#endif
+typedef struct PpmWriter* PpmWriterRef;
 
+bool ppm_write(char*, char, uint8_t*, int, int);
+bool ppm_append(char*, char, uint8_t*, int, int);
+char* ppm_encode(char, uint8_t*, int, int, size_t*);
+PpmWriterRef ppm_open(char*, char, int, int);
+bool ppm_write_bytes(PpmWriterRef, uint8_t*, size_t);
+bool ppm_close(PpmWriterRef);
 
+#endif
@@ -3,170 +3,1425 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <math.h>
+#include <pthread.h>
 #include "raycast.h"
 #include "camera.h"
 #include "object.h"
 #include "light.h"
+#include "lighttree.h"
+#include "floatgeom.h"
 #include "pixelbuf.h"
 #include "vecmath.h"
+#include "vec4.h"
+#include "workpool.h"
+#include "util.h"
 
 #define RECURSIVE_DEPTH 7
+// Shading is reused only from within this many pixel footprints of the new hit point, and when the
+// view direction has turned by less than about 0.8 degrees
+#define REUSE_MAX_FOOTPRINTS 1.0
+#define REUSE_MIN_VIEW_COS 0.9999
+// A refracted ray still trapped inside an object after this many total internal reflections is dropped
+#define MAX_INTERNAL_REFLECTIONS 8
 
-static PixelBufRef s_raycast(void);
-static ObjectRef shoot(RayRef, double*);
-static void shade(double*, ObjectRef, double*, int, double*);
+struct PrimaryHit {
+  ObjectRef object;
+  Point point;
+  Vec view_n;
+  double color[3];
+};
+
+typedef struct PrimaryHit PrimaryHit;
+
+/* One light's contribution at a primary hit, as computed by get_direct_contrib(). */
+struct LightSample {
+  double diffuse[3];
+  double specular[3];
+  bool lit;
+};
+
+typedef struct LightSample LightSample;
+
+/* samples holds light_count LightSamples for each pixel. lights are copies of the lights last
+ * rendered, against which the next render's lights are compared. */
+struct RelightCache {
+  int width;
+  int rows;
+  bool has_hits;
+  PrimaryHit *hits;
+  LightSample *samples;
+  LightRef *lights;
+  int light_count;
+  bool *light_changed;
+  bool any_light_changed;
+};
+
+typedef struct RelightCache RelightCache;
+
+struct PixelTouch {
+  Point point;
+  bool hit;
+  bool has_secondary;
+};
+
+typedef struct PixelTouch PixelTouch;
+
+/* words_per_pixel 64-bit words of object bits for each pixel, then the pixel's primary hit. */
+struct TouchBuffer {
+  int width;
+  int rows;
+  int object_count;
+  int words_per_pixel;
+  uint64_t *bits;
+  PixelTouch *pixels;
+};
+
+typedef struct TouchBuffer TouchBuffer;
+
+/* Shadow rays from one point toward up to RAY_LANES lights, traced together. Each lane walks its
+ * light's shadow candidates with a cursor; an object is tested against every lane at once, and
+ * counts only for the lanes that have it as a candidate or are leaving it. */
+struct ShadowPacket {
+  int count;
+  int light[RAY_LANES];
+  double weight[RAY_LANES];
+  double dist_to_light[RAY_LANES];
+  RayLanes rays;
+  const int *candidate[RAY_LANES];
+  double best_t[RAY_LANES];
+  ObjectRef blocker[RAY_LANES];
+  bool done[RAY_LANES];
+  bool shadowed[RAY_LANES];
+};
+
+typedef struct ShadowPacket ShadowPacket;
+
+/* Per-render state shared by every thread working on the render. Each row is rendered with its own
+ * copy, whose pixel_touches follows the pixel being rendered and whose counts are added to stats
+ * once the row is done. */
+struct RenderContext {
+  CameraRef camera;
+  ObjectRef *objects;
+  LightRef *lights;
+  int width;
+  int height;
+  int lowest_row;
+  int rows;
+  PixelBufRef pb;
+  HitBufferRef hits_out;
+  HitBufferRef reuse_from;
+  RelightCacheRef relight;
+  TouchBufferRef touches;
+  const bool *dirty;
+  uint64_t *pixel_touches;
+  int object_count;
+  int light_count;
+  int last_quadric_id;
+  int *shadow_candidates;
+  bool *sealed;
+  int *visible_ids;
+  OriginTerms *camera_terms;
+  double *column_offsets;
+  bool single_precision;
+  FloatSceneRef float_scene;
+  double light_cutoff;
+  double *light_radii;
+  int light_budget;
+  LightTreeRef light_tree;
+  uint64_t random_state;
+  RenderStatsRef stats;
+  RenderStats counts;
+  pthread_mutex_t stats_lock;
+  double c_width;
+  double c_height;
+  double pix_width;
+  double pix_height;
+  Point c_pos;
+  Vec vpc;
+  Vec vpx_u;
+  Vec vpy_u;
+  Vec vpz_u;
+};
+
+typedef struct RenderContext RenderContext;
+typedef struct RenderContext* RenderContextRef;
+
+/* The views of a render of several views. View v's rows are the tasks from first_tasks[v] up to
+ * first_tasks[v + 1]. */
+struct ViewSet {
+  RenderContext *views;
+  int *first_tasks;
+  int count;
+};
+
+typedef struct ViewSet ViewSet;
+typedef struct ViewSet* ViewSetRef;
+
+static void init_render_context(RenderContextRef, RenderJob*, PixelBufRef);
+static bool prepare_render(RenderContextRef);
+static bool prepare_lighting(RenderContextRef);
+static bool prepare_view(RenderContextRef);
+static bool prepare_shared_view(RenderContextRef, RenderContextRef);
+static bool find_shadow_candidates(RenderContextRef, int);
+static bool prepare_primary_rays(RenderContextRef);
+static void release_render(RenderContextRef);
+static void release_lighting(RenderContextRef);
+static void release_view(RenderContextRef);
+static void add_row_counts(RenderContextRef, RenderContextRef);
+static void seed_pixel_random(RenderContextRef, int, int);
+static double next_random(RenderContextRef);
+static void render_row(void*, int);
+static void render_view_row(void*, int);
+static void get_primary_ray(RenderContextRef, int, int, RayRef);
+static void begin_pixel_touches(RenderContextRef, size_t, ObjectRef, double*);
+static void touch_object(RenderContextRef, ObjectRef);
+static bool touches_any(TouchBufferRef, size_t, const bool*);
+static bool meets_changed_geometry(RenderContextRef, int, int, PixelTouch*, const bool*);
+static bool update_relight_lights(RelightCacheRef, LightRef*);
+static void relight_row(void*, int);
+static void relight_pixel(RenderContextRef, PrimaryHit*, LightSample*, double*);
+static bool reuse_shading(RenderContextRef, int, int, ObjectRef, double*, double*, PixelHit*);
+static void record_hit(RenderContextRef, int, int, ObjectRef, double*, double*, double*, PixelHit*);
+static bool shading_is_reusable(ObjectRef);
+static ObjectRef shoot(RenderContextRef, RayRef, ObjectRef, double*);
+static ObjectRef shoot_primary(RenderContextRef, RayRef, double*);
+static ObjectRef shoot_toward_light(RenderContextRef, RayRef, int, ObjectRef, double*);
+static void nearer_hit(RenderContextRef, RayRef, FloatRayRef, ObjectRef, ObjectRef, double*, ObjectRef*);
+static bool tested_in_float(RenderContextRef, ObjectRef);
+static double hit_distance(RenderContextRef, RayRef, FloatRayRef, ObjectRef, bool);
+static void shade(RenderContextRef, double*, ObjectRef, double*, int, double*);
+static void shade_diffuse(RenderContextRef, double*, ObjectRef, double*, int, double*);
+static void shade_glossy(RenderContextRef, double*, ObjectRef, double*, int, double*);
+static void shade_mirror(RenderContextRef, double*, ObjectRef, double*, int, double*);
+static void shade_glass(RenderContextRef, double*, ObjectRef, double*, int, double*);
+static void shade_mixed(RenderContextRef, double*, ObjectRef, double*, int, double*);
+static inline void shade_material(RenderContextRef, double*, ObjectRef, double*, int, double*, bool, bool, bool);
+static int pick_sampled_light(RenderContextRef, double*, int, double*);
+static void add_shadow_lane(RenderContextRef, ShadowPacket*, double*, ObjectRef, int, double);
+static void trace_shadow_packet(RenderContextRef, ShadowPacket*, ObjectRef);
+static bool lane_is_shadowed(ShadowPacket*, int);
+static void add_packet_contribs(RenderContextRef, ShadowPacket*, ObjectRef, double*, double*, bool, Vec4*, Vec4*);
 static void get_lightward_ray(double*, LightRef, RayRef);
-static bool ray_intersects_objects(RayRef, double);
-static void get_cameraward_normal(double*, double*);
-static void get_reflective_contrib(double*, ObjectRef, double*, double*, int, double*);
-static void get_refractive_contrib(double*, ObjectRef, double*, double*, int, double*);
-static void get_refractive_ray(RayRef, double*, double*, double*, double);
-static CameraRef camera;
-static ObjectRef *objects;
-static LightRef *lights;
-static int width;
-static int height;
+static bool light_is_culled(RenderContextRef, double*, ObjectRef, int, double, double*);
+static bool ray_intersects_objects(RenderContextRef, RayRef, double, int, ObjectRef);
+static void get_cameraward_normal(RenderContextRef, double*, double*);
+static bool get_direct_contrib(RenderContextRef, double*, ObjectRef, double*, int, double*, double*, double*);
+static bool aim_shadow_ray(RenderContextRef, double*, ObjectRef, int, RayRef, double*);
+static void get_light_contrib(RenderContextRef, ObjectRef, double*, int, double*, double, double*, bool, double*,
+			      double*);
+static void face_normal_toward_light(double*, double*);
+static void add_indirect_contrib(RenderContextRef, double*, ObjectRef, double*, double*, int, bool, bool, double*);
+static void get_reflective_contrib(RenderContextRef, double*, ObjectRef, double*, double*, int, double*);
+static void get_refractive_contrib(RenderContextRef, double*, ObjectRef, double*, double*, int, double*);
+static bool get_refractive_ray(RayRef, double*, double*, double*, double);
+static ObjectRef shoot_from_inside(RenderContextRef, RayRef, ObjectRef, double*);
 static double bg_color[3] = {0.5, 0.5, 0.5};
+// Indexed by MaterialKind
+static void (*shade_kernels[])(RenderContextRef, double*, ObjectRef, double*, int, double*) = {
+  shade_diffuse, shade_glossy, shade_mirror, shade_glass, shade_mixed
+};
+
+/* Returns NULL if the scene's camera, objects or lights are invalid. */
+RenderSceneRef new_render_scene(Scene scene) {
+  RenderSceneRef rs = checked_malloc(sizeof(*rs));
+  if(NULL == rs) return NULL;
+  rs->camera = get_camera_from_scene(scene);
+  rs->objects = NULL == rs->camera ? NULL : get_objects_from_scene(scene);
+  rs->lights = NULL == rs->objects ? NULL : get_lights_from_scene(scene);
+  if(NULL == rs->lights) {
+    destroy_render_scene(rs);
+    return NULL;
+  }
+  return rs;
+}
+
+
+void destroy_render_scene(RenderSceneRef rs) {
+  if(NULL == rs) return;
+  destroy_camera(rs->camera);
+  if(NULL != rs->objects) destroy_objects(rs->objects);
+  if(NULL != rs->lights) destroy_lights(rs->lights);
+  free(rs);
+}
+
 
 PixelBufRef raycast(CameraRef c, ObjectRef *os, LightRef *ls, int w, int h) {
-  camera = c;
-  objects = os;
-  lights = ls;
-  width = w;
-  height = h;
-  return s_raycast();
-}
-
-static PixelBufRef s_raycast() {
-  PixelBufRef pb = new_pixel_buf(width, height);
-  double c_width = get_camera_width(camera);
-  double c_height = get_camera_height(camera);
-  double pix_width = c_width / (double) width;
-  double pix_height = c_height / (double) height;
-  Point c_pos = {0.0};
-  get_camera_position(camera, c_pos);
-  Vec vpc = {0.0};
-  get_viewplane_center(camera, vpc);
-  Vec vpx_u = {0.0};
-  Vec vpy_u = {0.0};
-  Vec vpz_u = {0.0};
-  get_viewplane_unit_vectors(camera, vpx_u, vpy_u, vpz_u);
-  Vec vp_x_to_pixel = {0.0};
-  Vec vp_y_to_pixel = {0.0};
-  Point vp_xy_to_pixel = {0.0};
-  Vec camera_to_pixel_center = {0.0};
-  RayRef r = new_ray();
-  vec_copy(c_pos, r->origin);
+  return raycast_rows(c, os, ls, w, h, 0, h);
+}
+
+
+/* Renders only the band of `n` image rows starting at image row `first` (counted from the top, as
+ * in the written PPM). The returned buffer is w by n pixels. */
+PixelBufRef raycast_rows(CameraRef c, ObjectRef *os, LightRef *ls, int w, int h, int first, int n) {
+  RenderScene rs = {c, os, ls};
+  RenderJob job = {.scene = &rs, .width = w, .height = h, .first_row = first, .rows = n};
+  return raycast_job(&job, NULL);
+}
+
+
+/* Renders the job, spreading its rows over the pool. A NULL pool renders on the calling thread.
+ * Returns NULL if the pixel buffer cannot be allocated or the render cannot be set up. */
+PixelBufRef raycast_job(RenderJob *job, WorkPoolRef pool) {
+  PixelBufRef pb = new_pixel_buf(job->width, job->rows);
+  if(NULL == pb) return NULL;
+  if(!raycast_job_into(job, pool, pb)) {
+    destroy_pixel_buf(pb);
+    return NULL;
+  }
+  return pb;
+}
+
+
+/* As raycast_job(), but renders into pb, which must be job->width by job->rows pixels. Returns
+ * false, leaving pb unrendered, if the render cannot be set up. */
+bool raycast_job_into(RenderJob *job, WorkPoolRef pool, PixelBufRef pb) {
+  RenderContext ctx;
+  init_render_context(&ctx, job, pb);
+  if(!prepare_render(&ctx)) return false;
+  work_pool_run(pool, render_row, &ctx, ctx.rows);
+  release_render(&ctx);
+  return true;
+}
+
+
+/* Renders several views of one scene, job v into pbs[v], spreading the rows of every view over the
+ * pool in a single run so that no thread waits for one view to finish before starting the next. The
+ * jobs' scenes must share their objects and lights, and may differ only in camera; the jobs may
+ * differ in image size and rows, but not in how lights are cut off or sampled, and each needs its
+ * own stats if any. What depends only on the objects and lights, such as what can shadow each
+ * light, is worked out once for all the views. Returns false, leaving the views unrendered, if the
+ * render cannot be set up. */
+bool raycast_views(RenderJob *jobs, int count, WorkPoolRef pool, PixelBufRef *pbs) {
+  ViewSet set = {0};
+  set.views = checked_malloc(sizeof(*set.views) * count);
+  set.first_tasks = checked_malloc(sizeof(*set.first_tasks) * (count + 1));
+  bool ok = NULL != set.views && NULL != set.first_tasks;
+  for(; ok && set.count < count; set.count++) {
+    RenderContextRef view = &set.views[set.count];
+    init_render_context(view, &jobs[set.count], pbs[set.count]);
+    ok = 0 == set.count ? prepare_render(view) : prepare_shared_view(&set.views[0], view);
+    if(!ok) break;
+  }
+  if(ok) {
+    set.first_tasks[0] = 0;
+    for(int v = 0; v < count; v++) {
+      set.first_tasks[v + 1] = set.first_tasks[v] + set.views[v].rows;
+    }
+    work_pool_run(pool, render_view_row, &set, set.first_tasks[count]);
+  }
+  for(int v = set.count - 1; v > 0; v--) {
+    pthread_mutex_destroy(&set.views[v].stats_lock);
+    release_view(&set.views[v]);
+  }
+  if(set.count > 0) release_render(&set.views[0]);
+  free(set.views);
+  free(set.first_tasks);
+  return ok;
+}
+
+
+/* Returns a malloc'd array holding, for each of the scene's lights, the number of objects its shadow
+ * rays are tested against besides the object being shaded, or NULL if memory runs out. */
+int* count_shadow_candidates(RenderSceneRef scene) {
+  RenderJob job = {.scene = scene, .width = 1, .height = 1, .rows = 1};
+  RenderContext ctx;
+  init_render_context(&ctx, &job, NULL);
+  if(!prepare_render(&ctx)) return NULL;
+  int *counts = checked_malloc(sizeof(*counts) * (ctx.light_count + 1));
+  for(int l = 0; NULL != counts && l < ctx.light_count; l++) {
+    int *ids = &ctx.shadow_candidates[l * (ctx.object_count + 1)];
+    for(counts[l] = 0; ids[counts[l]] >= 0; counts[l]++);
+  }
+  release_render(&ctx);
+  return counts;
+}
+
+
+static void init_render_context(RenderContextRef ctx, RenderJob *job, PixelBufRef pb) {
+  ctx->camera = job->scene->camera;
+  ctx->objects = job->scene->objects;
+  ctx->lights = job->scene->lights;
+  ctx->width = job->width;
+  ctx->height = job->height;
+  // Ray rows count up from the bottom of the image while job rows count down from the top
+  ctx->lowest_row = job->height - job->first_row - job->rows;
+  ctx->rows = job->rows;
+  ctx->pb = pb;
+  ctx->hits_out = job->hits_out;
+  ctx->reuse_from = job->reuse_from;
+  ctx->relight = NULL;
+  ctx->touches = NULL;
+  ctx->dirty = NULL;
+  ctx->pixel_touches = NULL;
+  ctx->object_count = 0;
+  ctx->last_quadric_id = -1;
+  for(; NULL != ctx->objects[ctx->object_count]; ctx->object_count++) {
+    if(Quadric == ctx->objects[ctx->object_count]->kind) ctx->last_quadric_id = ctx->object_count;
+  }
+  ctx->light_count = 0;
+  while(NULL != ctx->lights[ctx->light_count]) ctx->light_count++;
+  ctx->shadow_candidates = NULL;
+  ctx->sealed = NULL;
+  ctx->visible_ids = NULL;
+  ctx->camera_terms = NULL;
+  ctx->column_offsets = NULL;
+  ctx->single_precision = job->single_precision;
+  ctx->float_scene = NULL;
+  ctx->light_cutoff = job->light_cutoff;
+  ctx->light_radii = NULL;
+  ctx->light_budget = job->light_budget;
+  ctx->light_tree = NULL;
+  ctx->random_state = 0;
+  ctx->stats = job->stats;
+  RenderStats zero_counts = {0};
+  ctx->counts = zero_counts;
+  ctx->c_width = get_camera_width(ctx->camera);
+  ctx->c_height = get_camera_height(ctx->camera);
+  ctx->pix_width = ctx->c_width / (double) ctx->width;
+  ctx->pix_height = ctx->c_height / (double) ctx->height;
+  get_camera_position(ctx->camera, ctx->c_pos);
+  get_viewplane_center(ctx->camera, ctx->vpc);
+  get_viewplane_unit_vectors(ctx->camera, ctx->vpx_u, ctx->vpy_u, ctx->vpz_u);
+}
+
+
+/* Prepares both what the render's objects and lights call for and what its camera does. A render
+ * that is prepared must be released. */
+static bool prepare_render(RenderContextRef ctx) {
+  if(!prepare_lighting(ctx)) return false;
+  if(!prepare_view(ctx)) {
+    release_lighting(ctx);
+    return false;
+  }
+  pthread_mutex_init(&ctx->stats_lock, NULL);
+  return true;
+}
+
+
+/* Works out, for each light, what can shadow it and how far its light reaches, and for each object
+ * whether refracted rays can cross it without a scene query. Builds the light tree if there are more
+ * lights than the budget. None of this depends on the camera. */
+static bool prepare_lighting(RenderContextRef ctx) {
+  int light_count = ctx->light_count;
+  ctx->light_radii = checked_malloc(sizeof(*(ctx->light_radii)) * (light_count + 1));
+  ctx->sealed = checked_malloc(sizeof(*(ctx->sealed)) * (ctx->object_count + 1));
+  bool sampling = ctx->light_budget > 0 && light_count > ctx->light_budget;
+  ctx->light_tree = NULL == ctx->light_radii || !sampling ? NULL : new_light_tree(ctx->lights);
+  if(NULL == ctx->light_radii || NULL == ctx->sealed || (sampling && NULL == ctx->light_tree) ||
+     !find_shadow_candidates(ctx, light_count)) {
+    release_lighting(ctx);
+    return false;
+  }
+  for(int o = 0; o < ctx->object_count; o++) {
+    ctx->sealed[o] = object_is_sealed(ctx->objects[o], ctx->objects);
+  }
+  for(int l = 0; l < light_count; l++) {
+    ctx->light_radii[l] = light_influence_radius(ctx->lights[l], ctx->light_cutoff);
+  }
+  return true;
+}
+
+
+/* Builds the camera-relative float copies of the objects for a single precision render, and sets up
+ * the primary rays. */
+static bool prepare_view(RenderContextRef ctx) {
+  ctx->float_scene = ctx->single_precision ? new_float_scene(ctx->objects, ctx->c_pos) : NULL;
+  if((ctx->single_precision && NULL == ctx->float_scene) || !prepare_primary_rays(ctx)) {
+    release_view(ctx);
+    return false;
+  }
+  return true;
+}
+
+
+/* Prepares ctx, another view of the objects and lights of the prepared render shared, borrowing what
+ * prepare_lighting() worked out for shared. ctx is released with release_view() alone, and before
+ * shared is released. */
+static bool prepare_shared_view(RenderContextRef shared, RenderContextRef ctx) {
+  ctx->shadow_candidates = shared->shadow_candidates;
+  ctx->sealed = shared->sealed;
+  ctx->light_radii = shared->light_radii;
+  ctx->light_tree = shared->light_tree;
+  if(!prepare_view(ctx)) return false;
+  pthread_mutex_init(&ctx->stats_lock, NULL);
+  return true;
+}
+
+
+/* For each light, lists the ids of the objects that could shadow some other object from it, in
+ * ascending order and ending with -1. Shadow rays toward the light need test only these and the
+ * object being shaded: planes with everything on the light's side of them and spheres whose shadows
+ * fall on nothing drop out. */
+static bool find_shadow_candidates(RenderContextRef ctx, int light_count) {
+  int stride = ctx->object_count + 1;
+  ctx->shadow_candidates = checked_malloc(sizeof(*(ctx->shadow_candidates)) * (light_count * stride + 1));
+  if(NULL == ctx->shadow_candidates) return false;
+
+  for(int l = 0; l < light_count; l++) {
+    int *ids = &ctx->shadow_candidates[l * stride];
+    int count = 0;
+    for(int o = 0; o < ctx->object_count; o++) {
+      for(int r = 0; r < ctx->object_count; r++) {
+	if(r != o && object_could_shadow(ctx->objects[o], ctx->objects[r], ctx->lights[l]->position)) {
+	  ids[count++] = o;
+	  break;
+	}
+      }
+    }
+    ids[count] = -1;
+  }
+  return true;
+}
+
+
+/* Lists the objects that primary rays for the job's rows can meet, in ascending order and ending with
+ * -1, and works out the parts of their intersection tests that depend only on the camera. Every row
+ * shares the offset across the viewplane of each column, so those are worked out once too. */
+static bool prepare_primary_rays(RenderContextRef ctx) {
+  ctx->visible_ids = checked_malloc(sizeof(*(ctx->visible_ids)) * (ctx->object_count + 1));
+  ctx->camera_terms = checked_malloc(sizeof(*(ctx->camera_terms)) * (ctx->object_count + 1));
+  ctx->column_offsets = checked_malloc(sizeof(*(ctx->column_offsets)) * 3 * (ctx->width + 1));
+  if(NULL == ctx->visible_ids || NULL == ctx->camera_terms || NULL == ctx->column_offsets) return false;
+
+  Vec4 vpx_u = v4_load(ctx->vpx_u);
+  Vec4 vpy_u = v4_load(ctx->vpy_u);
+  for(int col = 0; col < ctx->width; col++) {
+    double col_scale = (-ctx->c_width / 2.0) + (ctx->pix_width * (col + 0.5));
+    v4_store(v4_scale(vpx_u, col_scale), &ctx->column_offsets[3 * col]);
+  }
+
+  // The corners of the band of the viewplane that the rows cover
+  double left = -ctx->c_width / 2.0;
+  double right = ctx->c_width / 2.0;
+  double bottom = (-ctx->c_height / 2.0) + (ctx->pix_height * ctx->lowest_row);
+  double top = (-ctx->c_height / 2.0) + (ctx->pix_height * (ctx->lowest_row + ctx->rows));
+  double corner_x[4] = {left, right, right, left};
+  double corner_y[4] = {bottom, bottom, top, top};
+  double corners[4][3];
+  for(int i = 0; i < 4; i++) {
+    Vec4 offset = v4_add(v4_scale(vpx_u, corner_x[i]), v4_scale(vpy_u, corner_y[i]));
+    v4_store(v4_add(v4_load(ctx->vpc), offset), corners[i]);
+  }
+
+  int count = 0;
+  for(int o = 0; o < ctx->object_count; o++) {
+    get_origin_terms(ctx->objects[o], ctx->c_pos, &ctx->camera_terms[o]);
+    if(object_in_view(ctx->objects[o], ctx->c_pos, corners)) ctx->visible_ids[count++] = o;
+  }
+  ctx->visible_ids[count] = -1;
+  return true;
+}
+
+
+static void release_render(RenderContextRef ctx) {
+  pthread_mutex_destroy(&ctx->stats_lock);
+  release_view(ctx);
+  release_lighting(ctx);
+}
+
+
+static void release_lighting(RenderContextRef ctx) {
+  free(ctx->shadow_candidates);
+  free(ctx->sealed);
+  free(ctx->light_radii);
+  destroy_light_tree(ctx->light_tree);
+}
+
+
+static void release_view(RenderContextRef ctx) {
+  free(ctx->visible_ids);
+  free(ctx->camera_terms);
+  free(ctx->column_offsets);
+  destroy_float_scene(ctx->float_scene);
+}
+
+
+static void add_row_counts(RenderContextRef shared, RenderContextRef row) {
+  if(NULL == shared->stats) return;
+  pthread_mutex_lock(&shared->stats_lock);
+  shared->stats->shadow_rays_traced += row->counts.shadow_rays_traced;
+  shared->stats->culled_by_distance += row->counts.culled_by_distance;
+  shared->stats->culled_by_cone += row->counts.culled_by_cone;
+  shared->stats->culled_by_facing += row->counts.culled_by_facing;
+  shared->stats->primary_rays_traced += row->counts.primary_rays_traced;
+  shared->stats->reflected_rays_traced += row->counts.reflected_rays_traced;
+  shared->stats->refracted_rays_traced += row->counts.refracted_rays_traced;
+  pthread_mutex_unlock(&shared->stats_lock);
+}
+
+
+/* Light sampling draws from a sequence that depends only on the pixel's place in the image, so the
+ * image is the same however its rows are split among threads or shards. */
+static void seed_pixel_random(RenderContextRef ctx, int task, int col) {
+  ctx->random_state = ((uint64_t) (ctx->lowest_row + task) * ctx->width + col) * 0x9E3779B97F4A7C15ULL;
+}
+
+
+/* A uniform double in [0, 1), from the splitmix64 generator. */
+static double next_random(RenderContextRef ctx) {
+  uint64_t z = (ctx->random_state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  z ^= z >> 31;
+  return (z >> 11) * 0x1.0p-53;
+}
+
+
+static void render_row(void *arg, int task) {
+  RenderContext row_ctx = *(RenderContextRef) arg;
+  RenderContextRef ctx = &row_ctx;
+  Ray r = {{0.0}, {0.0}};
   Point intersection_point = {0.0};
-  for(int row = 0; row < height; row++) {
-    double row_scale = (-c_height / 2.0) + (pix_height * (row + 0.5));
-    vec_scale(vpy_u, row_scale, vp_y_to_pixel);
-
-    for(int col = 0; col < width; col++) {
-      double col_scale = (-c_width / 2.0) + (pix_width * (col + 0.5));
-      vec_scale(vpx_u, col_scale, vp_x_to_pixel);
-
-      Vec intermediate = {0.0};
-      vec_add(vp_x_to_pixel, vp_y_to_pixel, intermediate);
-      vec_add(vpc, intermediate, vp_xy_to_pixel);
-      vec_subtract(vp_xy_to_pixel, c_pos, camera_to_pixel_center);
-      vec_normalize(camera_to_pixel_center, r->dir);
-      ObjectRef intersected_obj = shoot(r, intersection_point);
-      if(NULL != intersected_obj) {
-	double view_n[3] = {0.0};
-	get_cameraward_normal(intersection_point, view_n);
-	vec_scale(view_n, -1.0, view_n);
-	double color_at_point[3] = {0.0};
-	shade(intersection_point, intersected_obj, view_n, RECURSIVE_DEPTH, color_at_point);
-	color_pixel(pb, color_at_point, row, col);
+
+  for(int col = 0; col < ctx->width; col++) {
+    size_t pixel = (size_t) (ctx->rows - 1 - task) * ctx->width + col;
+    if(NULL != ctx->dirty && !ctx->dirty[pixel]) continue;
+    get_primary_ray(ctx, task, col, &r);
+    seed_pixel_random(ctx, task, col);
+    ObjectRef intersected_obj = shoot_primary(ctx, &r, intersection_point);
+    ctx->counts.primary_rays_traced++;
+    begin_pixel_touches(ctx, pixel, intersected_obj, intersection_point);
+    if(NULL != intersected_obj) {
+      double view_n[3] = {0.0};
+      get_cameraward_normal(ctx, intersection_point, view_n);
+      v4_store(v4_scale(v4_load(view_n), -1.0), view_n);
+      double color_at_point[3] = {0.0};
+      PixelHit reused = {0};
+      if(reuse_shading(ctx, task, col, intersected_obj, intersection_point, r.dir, &reused)) {
+	v4_store(v4_load(reused.color), color_at_point);
       } else {
-	color_pixel(pb, bg_color, row, col);
+	shade(ctx, intersection_point, intersected_obj, view_n, RECURSIVE_DEPTH, color_at_point);
       }
+      color_pixel(ctx->pb, color_at_point, task, col);
+      record_hit(ctx, task, col, intersected_obj, intersection_point, r.dir, color_at_point, &reused);
+    } else {
+      color_pixel(ctx->pb, bg_color, task, col);
+      record_hit(ctx, task, col, NULL, intersection_point, r.dir, bg_color, NULL);
     }
   }
-  return pb;
+  add_row_counts(arg, ctx);
+}
+
+
+static void render_view_row(void *arg, int task) {
+  ViewSetRef set = arg;
+  int v = 0;
+  while(task >= set->first_tasks[v + 1]) v++;
+  render_row(&set->views[v], task - set->first_tasks[v]);
+}
+
+
+/* Takes the column's offset from those prepare_primary_rays() worked out, if the render has them. */
+static void get_primary_ray(RenderContextRef ctx, int task, int col, RayRef r) {
+  int row = ctx->lowest_row + task;
+  Vec4 c_pos = v4_load(ctx->c_pos);
+  double row_scale = (-ctx->c_height / 2.0) + (ctx->pix_height * (row + 0.5));
+  Vec4 vp_y_to_pixel = v4_scale(v4_load(ctx->vpy_u), row_scale);
+  Vec4 vp_x_to_pixel;
+  if(NULL != ctx->column_offsets) {
+    vp_x_to_pixel = v4_load(&ctx->column_offsets[3 * col]);
+  } else {
+    double col_scale = (-ctx->c_width / 2.0) + (ctx->pix_width * (col + 0.5));
+    vp_x_to_pixel = v4_scale(v4_load(ctx->vpx_u), col_scale);
+  }
+
+  Vec4 vp_xy_to_pixel = v4_add(v4_load(ctx->vpc), v4_add(vp_x_to_pixel, vp_y_to_pixel));
+  v4_store(c_pos, r->origin);
+  v4_store(v4_normalize(v4_sub(vp_xy_to_pixel, c_pos)), r->dir);
+}
+
+
+TouchBufferRef new_touch_buffer(int width, int rows, int object_count) {
+  TouchBufferRef tb = checked_malloc(sizeof(*tb));
+  if(NULL == tb) return NULL;
+  tb->width = width;
+  tb->rows = rows;
+  tb->object_count = object_count;
+  tb->words_per_pixel = (object_count + 63) / 64;
+  tb->bits = checked_malloc(sizeof(*(tb->bits)) * ((size_t) width * rows * tb->words_per_pixel + 1));
+  tb->pixels = checked_malloc(sizeof(*(tb->pixels)) * width * rows);
+  if(NULL == tb->bits || NULL == tb->pixels) {
+    destroy_touch_buffer(tb);
+    return NULL;
+  }
+  return tb;
+}
+
+
+void destroy_touch_buffer(TouchBufferRef tb) {
+  if(NULL == tb) return;
+  free(tb->bits);
+  free(tb->pixels);
+  free(tb);
+}
+
+
+/* Renders only the pixels flagged in dirty, or every pixel if dirty is NULL, leaving the rest of pb
+ * alone, and records what each rendered pixel touched. touches must be job->width by job->rows and
+ * sized for the scene's objects. */
+void raycast_dirty(RenderJob *job, WorkPoolRef pool, PixelBufRef pb, TouchBufferRef touches, const bool *dirty) {
+  RenderContext ctx;
+  init_render_context(&ctx, job, pb);
+  ctx.touches = touches;
+  ctx.dirty = dirty;
+  if(!prepare_render(&ctx)) return;
+  work_pool_run(pool, render_row, &ctx, ctx.rows);
+  release_render(&ctx);
+}
+
+
+/* Flags in dirty, and counts, the pixels whose color an edit can have changed. The job holds the
+ * edited scene, whose objects must have the same ids as those of the render that filled touches;
+ * material_changed and geometry_changed are indexed by object id. A pixel is dirty if its ray tree
+ * touched a changed object, or if an object that changed shape or place now meets its primary ray or
+ * one of the shadow rays from its primary hit. Pixels with reflected or refracted light are dirty
+ * after any change of geometry, since their secondary rays were not kept. */
+int find_dirty_pixels(RenderJob *job, TouchBufferRef touches, const bool *material_changed,
+		      const bool *geometry_changed, bool *dirty) {
+  RenderContext ctx;
+  init_render_context(&ctx, job, NULL);
+  bool *changed = checked_malloc(sizeof(*changed) * (touches->object_count + 1));
+  if(NULL == changed) return -1;
+  bool any_geometry_changed = false;
+  for(int i = 0; i < touches->object_count; i++) {
+    changed[i] = material_changed[i] || geometry_changed[i];
+    if(geometry_changed[i]) any_geometry_changed = true;
+  }
+
+  int dirty_count = 0;
+  for(int task = 0; task < touches->rows; task++) {
+    for(int col = 0; col < touches->width; col++) {
+      size_t pixel = (size_t) (touches->rows - 1 - task) * touches->width + col;
+      PixelTouch *touch = &touches->pixels[pixel];
+      dirty[pixel] = touches_any(touches, pixel, changed) ||
+	(any_geometry_changed && (touch->has_secondary ||
+				  meets_changed_geometry(&ctx, task, col, touch, geometry_changed)));
+      if(dirty[pixel]) dirty_count++;
+    }
+  }
+  free(changed);
+  return dirty_count;
+}
+
+
+static void begin_pixel_touches(RenderContextRef ctx, size_t pixel, ObjectRef obj, double *point) {
+  if(NULL == ctx->touches) return;
+  ctx->pixel_touches = &ctx->touches->bits[pixel * ctx->touches->words_per_pixel];
+  for(int w = 0; w < ctx->touches->words_per_pixel; w++) {
+    ctx->pixel_touches[w] = 0;
+  }
+  PixelTouch *touch = &ctx->touches->pixels[pixel];
+  touch->hit = NULL != obj;
+  touch->has_secondary = NULL != obj && (0 != obj->reflectivity || 0 != obj->refractivity);
+  v4_store(v4_load(point), touch->point);
+  touch_object(ctx, obj);
+}
+
+
+static void touch_object(RenderContextRef ctx, ObjectRef obj) {
+  if(NULL == ctx->pixel_touches || NULL == obj) return;
+  ctx->pixel_touches[obj->id / 64] |= 1ULL << (obj->id % 64);
+}
+
+
+static bool touches_any(TouchBufferRef touches, size_t pixel, const bool *changed) {
+  uint64_t *bits = &touches->bits[pixel * touches->words_per_pixel];
+  for(int id = 0; id < touches->object_count; id++) {
+    if(changed[id] && (bits[id / 64] & (1ULL << (id % 64)))) return true;
+  }
+  return false;
+}
+
+
+static bool meets_changed_geometry(RenderContextRef ctx, int task, int col, PixelTouch *touch,
+				   const bool *geometry_changed) {
+  Ray primary_r = {{0.0}, {0.0}};
+  get_primary_ray(ctx, task, col, &primary_r);
+  for(ObjectRef *objects_iter = ctx->objects; NULL != *objects_iter; objects_iter++) {
+    ObjectRef obj = *objects_iter;
+    if(!geometry_changed[obj->id]) continue;
+    if(MISS != has_intersection(&primary_r, obj)) return true;
+    if(!touch->hit) continue;
+    for(LightRef *lights_iter = ctx->lights; NULL != *lights_iter; lights_iter++) {
+      Ray lightward_r = {{0.0}, {0.0}};
+      get_lightward_ray(touch->point, *lights_iter, &lightward_r);
+      double t = has_intersection(&lightward_r, obj);
+      if(MISS == t) continue;
+      Vec4 origin = v4_load(lightward_r.origin);
+      Vec4 blocker = v4_ray_point(origin, v4_load(lightward_r.dir), t);
+      if(v4_distance(origin, blocker) <= v4_distance(v4_load(touch->point), v4_load((*lights_iter)->position))) {
+	return true;
+      }
+    }
+  }
+  return false;
+}
+
+
+RelightCacheRef new_relight_cache(int width, int rows) {
+  RelightCacheRef cache = checked_malloc(sizeof(*cache));
+  if(NULL == cache) return NULL;
+  RelightCache zero_cache = {0};
+  *cache = zero_cache;
+  cache->width = width;
+  cache->rows = rows;
+  cache->light_count = -1;
+  cache->hits = checked_malloc(sizeof(*(cache->hits)) * width * rows);
+  if(NULL == cache->hits) {
+    destroy_relight_cache(cache);
+    return NULL;
+  }
+  return cache;
+}
+
+
+void destroy_relight_cache(RelightCacheRef cache) {
+  if(NULL == cache) return;
+  free(cache->hits);
+  free(cache->samples);
+  if(NULL != cache->lights) destroy_lights(cache->lights);
+  free(cache->light_changed);
+  free(cache);
+}
+
+
+/* Renders the job as raycast_job_into() does, but through the cache, which must be job->width by
+ * job->rows and must only ever see one scene geometry and camera. The first render traces primary
+ * rays and fills the cache; later ones start from the cached hits and recompute only the lights
+ * that differ from the previous render's, plus the reflected and refracted light if any differ. */
+void raycast_relight(RenderJob *job, WorkPoolRef pool, PixelBufRef pb, RelightCacheRef cache) {
+  if(cache->width != job->width || cache->rows != job->rows) {
+    set_error(RC_ERR_ARGUMENT, "The relight cache does not match the size of the render");
+    return;
+  }
+  if(!update_relight_lights(cache, job->scene->lights)) return;
+
+  RenderContext ctx;
+  init_render_context(&ctx, job, pb);
+  ctx.relight = cache;
+  if(!prepare_render(&ctx)) return;
+  work_pool_run(pool, relight_row, &ctx, ctx.rows);
+  release_render(&ctx);
+  cache->has_hits = true;
+}
+
+
+/* Works out which lights differ from the previous render's and keeps copies of the new ones. A
+ * change in the number of lights invalidates every sample. */
+static bool update_relight_lights(RelightCacheRef cache, LightRef *lights) {
+  int light_count = 0;
+  while(NULL != lights[light_count]) light_count++;
+  LightRef *copies = copy_lights(lights);
+  if(NULL == copies) return false;
+
+  bool all_changed = !cache->has_hits || light_count != cache->light_count;
+  if(light_count != cache->light_count) {
+    free(cache->samples);
+    free(cache->light_changed);
+    cache->samples = checked_malloc(sizeof(*(cache->samples)) * cache->width * cache->rows * (light_count + 1));
+    cache->light_changed = checked_malloc(sizeof(*(cache->light_changed)) * (light_count + 1));
+    cache->light_count = NULL == cache->samples || NULL == cache->light_changed ? -1 : light_count;
+    if(cache->light_count < 0) {
+      destroy_lights(copies);
+      return false;
+    }
+  }
+
+  cache->any_light_changed = all_changed;
+  for(int l = 0; l < light_count; l++) {
+    cache->light_changed[l] = all_changed || !light_equals(cache->lights[l], lights[l]);
+    if(cache->light_changed[l]) cache->any_light_changed = true;
+  }
+  if(NULL != cache->lights) destroy_lights(cache->lights);
+  cache->lights = copies;
+  return true;
+}
+
+
+static void relight_row(void *arg, int task) {
+  RenderContext row_ctx = *(RenderContextRef) arg;
+  RenderContextRef ctx = &row_ctx;
+  RelightCacheRef cache = ctx->relight;
+  for(int col = 0; col < ctx->width; col++) {
+    size_t pixel = (size_t) (ctx->rows - 1 - task) * ctx->width + col;
+    PrimaryHit *hit = &cache->hits[pixel];
+    if(!cache->has_hits) {
+      Ray r = {{0.0}, {0.0}};
+      get_primary_ray(ctx, task, col, &r);
+      hit->object = shoot_primary(ctx, &r, hit->point);
+      ctx->counts.primary_rays_traced++;
+      if(NULL != hit->object) {
+	get_cameraward_normal(ctx, hit->point, hit->view_n);
+	v4_store(v4_scale(v4_load(hit->view_n), -1.0), hit->view_n);
+      }
+    }
+
+    if(NULL == hit->object) {
+      color_pixel(ctx->pb, bg_color, task, col);
+      continue;
+    }
+    double color_at_point[3] = {0.0};
+    relight_pixel(ctx, hit, &cache->samples[pixel * cache->light_count], color_at_point);
+    color_pixel(ctx->pb, color_at_point, task, col);
+  }
+  add_row_counts(arg, ctx);
+}
+
+
+/* shade() for a primary hit, taking unchanged lights' contributions from the cache. Their surface
+ * normal flips are replayed so that each light sees the normal shade() would have given it. */
+static void relight_pixel(RenderContextRef ctx, PrimaryHit *hit, LightSample *samples, double *color_out) {
+  RelightCacheRef cache = ctx->relight;
+  if(!cache->any_light_changed) {
+    v4_store(v4_load(hit->color), color_out);
+    return;
+  }
+
+  ObjectRef obj = hit->object;
+  Vec4 total_diffuse = v4_make(0.0, 0.0, 0.0);
+  Vec4 total_specular = v4_make(0.0, 0.0, 0.0);
+  double surface_n[3] = {0.0};
+  get_surface_normal(obj, hit->point, surface_n);
+
+  for(int l = 0; l < cache->light_count; l++) {
+    LightSample *sample = &samples[l];
+    if(cache->light_changed[l]) {
+      LightSample zero_sample = {{0.0}, {0.0}, false};
+      *sample = zero_sample;
+      sample->lit = get_direct_contrib(ctx, hit->point, obj, hit->view_n, l, surface_n,
+				       sample->diffuse, sample->specular);
+    } else if(sample->lit) {
+      Ray lightward_r = {{0.0}, {0.0}};
+      get_lightward_ray(hit->point, ctx->lights[l], &lightward_r);
+      double intersectward_n[3] = {0.0};
+      v4_store(v4_scale(v4_load(lightward_r.dir), -1.0), intersectward_n);
+      face_normal_toward_light(intersectward_n, surface_n);
+    }
+    if(sample->lit) {
+      total_diffuse = v4_add(v4_load(sample->diffuse), total_diffuse);
+      total_specular = v4_add(v4_load(sample->specular), total_specular);
+    }
+  }
+
+  Vec4 direct = v4_add(total_diffuse, total_specular);
+  v4_store(v4_scale(direct, (1.0 - (obj->reflectivity + obj->refractivity))), color_out);
+  add_indirect_contrib(ctx, hit->point, obj, hit->view_n, surface_n, RECURSIVE_DEPTH, 0 != obj->reflectivity,
+		       0 != obj->refractivity, color_out);
+  v4_store(v4_load(color_out), hit->color);
+}
+
+
+HitBufferRef new_hit_buffer(int width, int rows) {
+  HitBufferRef hb = checked_malloc(sizeof(*hb));
+  if(NULL == hb) return NULL;
+  hb->width = width;
+  hb->rows = rows;
+  hb->hits = checked_malloc(sizeof(*(hb->hits)) * width * rows);
+  if(NULL == hb->hits) {
+    free(hb);
+    return NULL;
+  }
+  return hb;
+}
+
+
+void destroy_hit_buffer(HitBufferRef hb) {
+  if(NULL == hb) return;
+  free(hb->hits);
+  free(hb);
+}
+
+
+/* Projects the reusable hits of an earlier render into the job's camera, keeping the nearest hit
+ * that lands on each pixel. Pixels that nothing lands on, such as newly disoccluded ones, are left
+ * with no object. out must be job->width by job->rows. */
+void reproject_hits(HitBufferRef previous, RenderJob *job, HitBufferRef out) {
+  RenderContext ctx;
+  init_render_context(&ctx, job, NULL);
+  size_t out_count = (size_t) out->width * out->rows;
+  for(size_t i = 0; i < out_count; i++) {
+    out->hits[i].object = NULL;
+    out->hits[i].depth = INFINITY;
+  }
+
+  size_t previous_count = (size_t) previous->width * previous->rows;
+  for(size_t i = 0; i < previous_count; i++) {
+    PixelHit *hit = &previous->hits[i];
+    if(NULL == hit->object || !shading_is_reusable(hit->object)) continue;
+    Vec4 to_hit = v4_sub(v4_load(hit->point), v4_load(ctx.c_pos));
+    double depth = -v4_dot(to_hit, v4_load(ctx.vpz_u));
+    if(depth <= 0) continue;
+    double scale = ctx.camera->focal_length / depth;
+    double x = v4_dot(to_hit, v4_load(ctx.vpx_u)) * scale;
+    double y = v4_dot(to_hit, v4_load(ctx.vpy_u)) * scale;
+    int col = (int) floor((x + ctx.c_width / 2.0) / ctx.pix_width);
+    int task = (int) floor((y + ctx.c_height / 2.0) / ctx.pix_height) - ctx.lowest_row;
+    if(col < 0 || col >= out->width || task < 0 || task >= out->rows) continue;
+    PixelHit *target = &out->hits[(size_t) (out->rows - 1 - task) * out->width + col];
+    if(depth < target->depth) {
+      *target = *hit;
+      target->depth = depth;
+    }
+  }
+}
+
+
+/* Fills reused with the reprojected hit for the pixel if its shading can stand in for shading the
+ * new hit: the same object, nearly the same point and nearly the same view direction. */
+static bool reuse_shading(RenderContextRef ctx, int task, int col, ObjectRef obj, double *point,
+			  double *view, PixelHit *reused) {
+  if(NULL == ctx->reuse_from) return false;
+  PixelHit *candidate = &ctx->reuse_from->hits[(size_t) (ctx->rows - 1 - task) * ctx->width + col];
+  if(candidate->object != obj || !shading_is_reusable(obj)) return false;
+  Vec4 point_v = v4_load(point);
+  double footprint = ctx->pix_width * v4_distance(v4_load(ctx->c_pos), point_v) / ctx->camera->focal_length;
+  if(v4_distance(v4_load(candidate->point), point_v) > REUSE_MAX_FOOTPRINTS * footprint ||
+     v4_dot(v4_load(candidate->view), v4_load(view)) < REUSE_MIN_VIEW_COS) {
+    return false;
+  }
+  *reused = *candidate;
+  return true;
+}
+
+
+/* A reused pixel keeps the point and view its color was shaded from, so that error cannot build up
+ * over a run of frames. */
+static void record_hit(RenderContextRef ctx, int task, int col, ObjectRef obj, double *point, double *view,
+		       double *color, PixelHit *reused) {
+  if(NULL == ctx->hits_out) return;
+  PixelHit *hit = &ctx->hits_out->hits[(size_t) (ctx->rows - 1 - task) * ctx->width + col];
+  if(NULL != reused && NULL != reused->object) {
+    *hit = *reused;
+    hit->reused = true;
+    return;
+  }
+  hit->object = obj;
+  v4_store(v4_load(point), hit->point);
+  v4_store(v4_load(view), hit->view);
+  v4_store(v4_load(color), hit->color);
+  hit->depth = INFINITY;
+  hit->reused = false;
+}
+
+
+/* Reflection and refraction follow the view direction too closely for reuse to be safe. */
+static bool shading_is_reusable(ObjectRef obj) {
+  return DiffuseOnly == obj->material || DiffuseSpecular == obj->material;
 }
 
 
-static ObjectRef shoot(RayRef r, Point intersection) {
+/* Finds the nearest object the ray meets. A ray leaving the surface of the object from is not taken
+ * to meet it where it starts; from is NULL for rays from the camera. */
+static ObjectRef shoot(RenderContextRef ctx, RayRef r, ObjectRef from, double *intersection) {
   ObjectRef best_t_obj = NULL;
   double best_t = INFINITY; 
-  double current_t = INFINITY;
-  for(int obj_offset = 0; NULL != objects[obj_offset] ;obj_offset++) {
-    current_t = has_intersection(r, objects[obj_offset]);
-    if(current_t < best_t) {
-      best_t = current_t;
-      best_t_obj = objects[obj_offset];
+  FloatRay float_r;
+  if(NULL != ctx->float_scene) get_float_ray(ctx->float_scene, r, &float_r);
+  for(int obj_offset = 0; NULL != ctx->objects[obj_offset] ;obj_offset++) {
+    nearer_hit(ctx, r, &float_r, ctx->objects[obj_offset], from, &best_t, &best_t_obj);
+  }
+  v4_store(v4_ray_at(r, best_t), intersection);
+  return best_t_obj;
+}
+
+
+/* shoot() for a ray from the camera. Only the objects in view are tested, in the same order as
+ * shoot() would; in double precision their tests start from the terms worked out for the camera. */
+static ObjectRef shoot_primary(RenderContextRef ctx, RayRef r, double *intersection) {
+  ObjectRef best_t_obj = NULL;
+  double best_t = INFINITY;
+  FloatRay float_r;
+  if(NULL != ctx->float_scene) get_float_ray(ctx->float_scene, r, &float_r);
+  for(int *ids = ctx->visible_ids; *ids >= 0; ids++) {
+    ObjectRef obj = ctx->objects[*ids];
+    double t = tested_in_float(ctx, obj) ? float_intersection(ctx->float_scene, &float_r, obj) :
+      has_intersection_from(r, obj, &ctx->camera_terms[*ids]);
+    if(t < best_t) {
+      best_t = t;
+      best_t_obj = obj;
+    }
+  }
+  v4_store(v4_ray_at(r, best_t), intersection);
+  return best_t_obj;
+}
+
+
+/* shoot() for a shadow ray from a point on receiver, testing only the light's shadow candidates and
+ * the receiver itself. They are tested in the same order as shoot() would, so ties go the same way. */
+static ObjectRef shoot_toward_light(RenderContextRef ctx, RayRef r, int light_index, ObjectRef receiver,
+				    double *intersection) {
+  int *ids = &ctx->shadow_candidates[light_index * (ctx->object_count + 1)];
+  ObjectRef best_t_obj = NULL;
+  double best_t = INFINITY;
+  FloatRay float_r;
+  if(NULL != ctx->float_scene) get_float_ray(ctx->float_scene, r, &float_r);
+  bool receiver_tested = false;
+  for(; ; ids++) {
+    if(!receiver_tested && (*ids < 0 || *ids >= receiver->id)) {
+      nearer_hit(ctx, r, &float_r, receiver, receiver, &best_t, &best_t_obj);
+      receiver_tested = true;
+      if(*ids == receiver->id) continue;
     }
+    if(*ids < 0) break;
+    nearer_hit(ctx, r, &float_r, ctx->objects[*ids], receiver, &best_t, &best_t_obj);
   }
-  point_on_ray_at_t(r, best_t, intersection);
+  v4_store(v4_ray_at(r, best_t), intersection);
   return best_t_obj;
 }
 
 
- static void shade(double *intersect, ObjectRef intersected_obj, double *view_n, int r_level,
-		   double *color_out) {
-  double total_diffuse[3] = {0.0};
-  double total_specular[3] = {0.0};
+/* float_r is r in the frame of the render's float scene, and is only used if it has one. */
+static void nearer_hit(RenderContextRef ctx, RayRef r, FloatRayRef float_r, ObjectRef obj, ObjectRef from,
+		       double *best_t, ObjectRef *best_t_obj) {
+  double current_t = hit_distance(ctx, r, float_r, obj, obj == from);
+  if(current_t < *best_t) {
+    *best_t = current_t;
+    *best_t_obj = obj;
+  }
+}
+
+
+/* has_intersection(), or has_intersection_leaving() for a ray leaving obj, in the render's precision. */
+static double hit_distance(RenderContextRef ctx, RayRef r, FloatRayRef float_r, ObjectRef obj, bool leaving) {
+  if(tested_in_float(ctx, obj)) {
+    return leaving ? float_intersection_leaving(ctx->float_scene, float_r, obj) :
+      float_intersection(ctx->float_scene, float_r, obj);
+  }
+  return leaving ? has_intersection_leaving(r, obj) : has_intersection(r, obj);
+}
+
+
+/* Sets of instances and meshes have no single precision copies, so they are always tested in double. */
+static bool tested_in_float(RenderContextRef ctx, ObjectRef obj) {
+  return NULL != ctx->float_scene && Instances != obj->kind && Mesh != obj->kind;
+}
+
+
+/* Shades the point with the kernel chosen for the object's material when it was loaded. */
+static void shade(RenderContextRef ctx, double *intersect, ObjectRef intersected_obj, double *view_n,
+		  int r_level, double *color_out) {
+  shade_kernels[intersected_obj->material](ctx, intersect, intersected_obj, view_n, r_level, color_out);
+}
+
+
+static void shade_diffuse(RenderContextRef ctx, double *intersect, ObjectRef intersected_obj, double *view_n,
+			  int r_level, double *color_out) {
+  shade_material(ctx, intersect, intersected_obj, view_n, r_level, color_out, false, false, false);
+}
+
+
+static void shade_glossy(RenderContextRef ctx, double *intersect, ObjectRef intersected_obj, double *view_n,
+			 int r_level, double *color_out) {
+  shade_material(ctx, intersect, intersected_obj, view_n, r_level, color_out, true, false, false);
+}
+
+
+/* Reflective and refractive materials keep the specular term whatever their specular color, since
+ * it costs little beside the rays they trace. */
+static void shade_mirror(RenderContextRef ctx, double *intersect, ObjectRef intersected_obj, double *view_n,
+			 int r_level, double *color_out) {
+  shade_material(ctx, intersect, intersected_obj, view_n, r_level, color_out, true, true, false);
+}
+
+
+static void shade_glass(RenderContextRef ctx, double *intersect, ObjectRef intersected_obj, double *view_n,
+			int r_level, double *color_out) {
+  shade_material(ctx, intersect, intersected_obj, view_n, r_level, color_out, true, false, true);
+}
+
+
+static void shade_mixed(RenderContextRef ctx, double *intersect, ObjectRef intersected_obj, double *view_n,
+			int r_level, double *color_out) {
+  shade_material(ctx, intersect, intersected_obj, view_n, r_level, color_out, true, true, true);
+}
+
+
+/* The body of every shading kernel. Each passes constant flags, so the compiler builds a copy of this
+ * for each without the specular term, the scaling for indirect light or the secondary rays the
+ * material does not need. Skipped terms would have added zero, so results match shading them all. */
+static inline void shade_material(RenderContextRef ctx, double *intersect, ObjectRef intersected_obj,
+				  double *view_n, int r_level, double *color_out, bool specular, bool reflective,
+				  bool refractive) {
+  Vec4 total_diffuse = v4_make(0.0, 0.0, 0.0);
+  Vec4 total_specular = v4_make(0.0, 0.0, 0.0);
   double surface_n[3] = {0.0};
   get_surface_normal(intersected_obj, intersect, surface_n);
 
-  for(LightRef *lights_iter = lights; NULL != *lights_iter; lights_iter++) {
-    LightRef light = *lights_iter;
-    Ray lightward_r = {{0.0}, {0.0}};
-    get_lightward_ray(intersect, light, &lightward_r);
-    double intersectward_n[3] = {0.0};
-    vec_scale(lightward_r.dir, -1.0, intersectward_n);
+  ShadowPacket packet;
+  packet.count = 0;
+  int picks = NULL == ctx->light_tree ? ctx->light_count : ctx->light_budget;
+  for(int pick = 0; pick < picks; pick++) {
+    double weight = 1.0;
+    int l = NULL == ctx->light_tree ? pick : pick_sampled_light(ctx, intersect, pick, &weight);
+    add_shadow_lane(ctx, &packet, intersect, intersected_obj, l, weight);
+    if(RAY_LANES == packet.count || (pick == picks - 1 && packet.count > 0)) {
+      trace_shadow_packet(ctx, &packet, intersected_obj);
+      add_packet_contribs(ctx, &packet, intersected_obj, view_n, surface_n, specular, &total_diffuse,
+			  &total_specular);
+      packet.count = 0;
+    }
+  }
 
-    double dist_to_light = point_distance(intersect, light->position);
-    if(ray_intersects_objects(&lightward_r, dist_to_light) || !light_is_contributing(light, intersectward_n)) {
-      continue;
+  Vec4 direct = specular ? v4_add(total_diffuse, total_specular) : total_diffuse;
+  if(!reflective && !refractive) {
+    v4_store(direct, color_out);
+    return;
+  }
+  v4_store(v4_scale(direct, (1.0 - (intersected_obj->reflectivity + intersected_obj->refractivity))), color_out);
+
+  if(r_level <= 0)
+    return;
+  add_indirect_contrib(ctx, intersect, intersected_obj, view_n, surface_n, r_level, reflective, refractive,
+		       color_out);
+}
+
+
+/* Light sampling estimates the light arriving from every light by tracing only light_budget shadow
+ * rays, toward lights picked from the light tree by their importance at the point. The picks are
+ * stratified, and each is weighted by the inverse of its probability, so the estimate averages to
+ * the sum over all the lights. Returns the light for the given pick, storing its weight. */
+static int pick_sampled_light(RenderContextRef ctx, double *intersect, int pick, double *weight_out) {
+  double u = (pick + next_random(ctx)) / ctx->light_budget;
+  double pdf = 1.0;
+  int l = sample_light_tree(ctx->light_tree, intersect, u, &pdf);
+  *weight_out = 1.0 / (pdf * ctx->light_budget);
+  return l;
+}
+
+
+/* Adds a lane for the light to the packet unless light_is_culled() skips it. */
+static void add_shadow_lane(RenderContextRef ctx, ShadowPacket *packet, double *intersect, ObjectRef intersected_obj,
+			    int light_index, double weight) {
+  Ray lightward_r = {{0.0}, {0.0}};
+  double dist_to_light = 0.0;
+  if(!aim_shadow_ray(ctx, intersect, intersected_obj, light_index, &lightward_r, &dist_to_light)) return;
+  int lane = packet->count++;
+  packet->light[lane] = light_index;
+  packet->weight[lane] = weight;
+  packet->dist_to_light[lane] = dist_to_light;
+  for(int a = 0; a < 3; a++) {
+    packet->rays.origin[a][lane] = lightward_r.origin[a];
+    packet->rays.dir[a][lane] = lightward_r.dir[a];
+  }
+}
+
+
+/* ray_intersects_objects() for every lane of the packet, storing the answers in shadowed. The
+ * objects are visited in ascending order, the union of the lanes' candidates and the receiver, so
+ * each lane's nearest hit is the one shoot_toward_light() would find. A lane drops out as soon as it
+ * is known to be shadowed, except while a quadric is still to come: a quadric can report a negative
+ * distance, which as the nearest hit would leave the light unblocked. */
+static void trace_shadow_packet(RenderContextRef ctx, ShadowPacket *packet, ObjectRef receiver) {
+  int live = packet->count;
+  for(int lane = 0; lane < packet->count; lane++) {
+    packet->candidate[lane] = &ctx->shadow_candidates[packet->light[lane] * (ctx->object_count + 1)];
+    packet->best_t[lane] = INFINITY;
+    packet->blocker[lane] = NULL;
+    packet->done[lane] = false;
+  }
+
+  FloatRayLanes float_rays;
+  if(NULL != ctx->float_scene) get_float_lanes(ctx->float_scene, &packet->rays, packet->count, &float_rays);
+  double t[RAY_LANES];
+  int next_receiver_id = receiver->id;
+  bool past_quadrics = false;
+  while(live > 0) {
+    int o = next_receiver_id < 0 ? ctx->object_count : next_receiver_id;
+    for(int lane = 0; lane < packet->count; lane++) {
+      int id = *packet->candidate[lane];
+      if(!packet->done[lane] && id >= 0 && id < o) o = id;
     }
+    if(o >= ctx->object_count) break;
 
-    if(vec_dot(surface_n, intersectward_n) > 0) {
-      vec_scale(surface_n, -1.0, surface_n);
+    ObjectRef obj = ctx->objects[o];
+    if(obj == receiver) {
+      for(int lane = 0; lane < packet->count; lane++) {
+	Ray lightward_r = {{packet->rays.origin[X][lane], packet->rays.origin[Y][lane], packet->rays.origin[Z][lane]},
+			   {packet->rays.dir[X][lane], packet->rays.dir[Y][lane], packet->rays.dir[Z][lane]}};
+	FloatRay float_r;
+	if(NULL != ctx->float_scene) get_float_ray(ctx->float_scene, &lightward_r, &float_r);
+	t[lane] = hit_distance(ctx, &lightward_r, &float_r, obj, true);
+      }
+    } else if(tested_in_float(ctx, obj)) {
+      float_lanes_intersection(ctx->float_scene, &float_rays, packet->count, obj, t);
+    } else {
+      lanes_intersection(&packet->rays, packet->count, obj, t);
     }
+    // Lanes already blocked before the last quadric are checked again once it is behind them
+    bool just_past_quadrics = o >= ctx->last_quadric_id && !past_quadrics;
+    past_quadrics = o >= ctx->last_quadric_id;
+    for(int lane = 0; lane < packet->count; lane++) {
+      if(packet->done[lane]) continue;
+      bool nearer = false;
+      bool tested = o == receiver->id;
+      if(o == *packet->candidate[lane]) {
+	tested = true;
+	packet->candidate[lane]++;
+      }
+      if(tested && t[lane] < packet->best_t[lane]) {
+	packet->best_t[lane] = t[lane];
+	packet->blocker[lane] = obj;
+	nearer = true;
+      }
+      if(past_quadrics && (nearer || just_past_quadrics) && lane_is_shadowed(packet, lane)) {
+	packet->done[lane] = true;
+	packet->shadowed[lane] = true;
+	live--;
+      }
+    }
+    if(o == receiver->id) next_receiver_id = -1;
+  }
 
+  for(int lane = 0; lane < packet->count; lane++) {
+    if(!packet->done[lane]) packet->shadowed[lane] = lane_is_shadowed(packet, lane);
+    if(packet->shadowed[lane]) touch_object(ctx, packet->blocker[lane]);
+  }
+}
+
+
+static bool lane_is_shadowed(ShadowPacket *packet, int lane) {
+  if(NULL == packet->blocker[lane]) return false;
+  Vec4 origin = v4_make(packet->rays.origin[X][lane], packet->rays.origin[Y][lane], packet->rays.origin[Z][lane]);
+  Vec4 dir = v4_make(packet->rays.dir[X][lane], packet->rays.dir[Y][lane], packet->rays.dir[Z][lane]);
+  Vec4 point_intersected = v4_ray_point(origin, dir, packet->best_t[lane]);
+  return packet->dist_to_light[lane] >= v4_distance(origin, point_intersected);
+}
+
+
+/* Adds the weighted contributions of the packet's unshadowed lights in lane order, which is the
+ * order shade() picked them in. */
+static void add_packet_contribs(RenderContextRef ctx, ShadowPacket *packet, ObjectRef intersected_obj,
+				double *view_n, double *surface_n, bool specular, Vec4 *total_diffuse,
+				Vec4 *total_specular) {
+  for(int lane = 0; lane < packet->count; lane++) {
+    if(packet->shadowed[lane]) continue;
+    double lightward_dir[3] = {packet->rays.dir[X][lane], packet->rays.dir[Y][lane], packet->rays.dir[Z][lane]};
     double diffuse_contrib[3] = {0.0};
-    get_diffuse_contrib(light, intersectward_n, surface_n, diffuse_contrib);
+    double specular_contrib[3] = {0.0};
+    get_light_contrib(ctx, intersected_obj, view_n, packet->light[lane], lightward_dir,
+		      packet->dist_to_light[lane], surface_n, specular, diffuse_contrib, specular_contrib);
+    *total_diffuse = v4_add(v4_scale(v4_load(diffuse_contrib), packet->weight[lane]), *total_diffuse);
+    if(specular) {
+      *total_specular = v4_add(v4_scale(v4_load(specular_contrib), packet->weight[lane]), *total_specular);
+    }
+  }
+}
+
+
+/* Computes one light's diffuse and specular contributions at the point, tracing its shadow ray on
+ * its own. Returns false, leaving the outputs alone, if the light is shadowed or pointed away. */
+static bool get_direct_contrib(RenderContextRef ctx, double *intersect, ObjectRef intersected_obj,
+			       double *view_n, int light_index, double *surface_n, double *diffuse_contrib,
+			       double *specular_contrib) {
+  Ray lightward_r = {{0.0}, {0.0}};
+  double dist_to_light = 0.0;
+  if(!aim_shadow_ray(ctx, intersect, intersected_obj, light_index, &lightward_r, &dist_to_light)) return false;
+  if(ray_intersects_objects(ctx, &lightward_r, dist_to_light, light_index, intersected_obj)) return false;
+  get_light_contrib(ctx, intersected_obj, view_n, light_index, lightward_r.dir, dist_to_light, surface_n,
+		    DiffuseOnly != intersected_obj->material, diffuse_contrib, specular_contrib);
+  return true;
+}
+
+
+/* Sets up the shadow ray from the point toward the light and its distance, returning false if
+ * light_is_culled() skips the light. */
+static bool aim_shadow_ray(RenderContextRef ctx, double *intersect, ObjectRef intersected_obj, int light_index,
+			   RayRef lightward_r, double *dist_out) {
+  LightRef light = ctx->lights[light_index];
+  get_lightward_ray(intersect, light, lightward_r);
+  double intersectward_n[3] = {0.0};
+  v4_store(v4_scale(v4_load(lightward_r->dir), -1.0), intersectward_n);
 
+  *dist_out = v4_distance(v4_load(intersect), v4_load(light->position));
+  if(light_is_culled(ctx, intersect, intersected_obj, light_index, *dist_out, intersectward_n)) return false;
+  ctx->counts.shadow_rays_traced++;
+  return true;
+}
+
+
+/* The contributions of a light found to reach the point along lightward_dir. surface_n is first
+ * turned to face the light; shade() carries that orientation from one light to the next. Without
+ * specular, specular_contrib is left alone. */
+static void get_light_contrib(RenderContextRef ctx, ObjectRef intersected_obj, double *view_n, int light_index,
+			      double *lightward_dir, double dist_to_light, double *surface_n, bool specular,
+			      double *diffuse_contrib, double *specular_contrib) {
+  LightRef light = ctx->lights[light_index];
+  double intersectward_n[3] = {0.0};
+  v4_store(v4_scale(v4_load(lightward_dir), -1.0), intersectward_n);
+  face_normal_toward_light(intersectward_n, surface_n);
+
+  get_diffuse_contrib(light, intersectward_n, surface_n, diffuse_contrib);
+
+  if(specular) {
     double inv_view_n[3] = {0.0};
-    vec_scale(view_n, -1.0, inv_view_n);
-    double specular_contrib[3] = {0.0};
+    v4_store(v4_scale(v4_load(view_n), -1.0), inv_view_n);
     get_specular_contrib(light, intersectward_n, surface_n, inv_view_n, intersected_obj->ns, specular_contrib);
+  }
+
+  attenuate_radially(light, dist_to_light, diffuse_contrib, specular_contrib);
 
-    attenuate_radially(light, dist_to_light, diffuse_contrib, specular_contrib);
+  v4_store(v4_mul(v4_load(intersected_obj->diffuse_color), v4_load(diffuse_contrib)), diffuse_contrib);
+  if(specular) {
+    v4_store(v4_mul(v4_load(intersected_obj->specular_color), v4_load(specular_contrib)), specular_contrib);
+  }
+}
 
-    vec_mult(intersected_obj->diffuse_color, diffuse_contrib, diffuse_contrib);
-    vec_mult(intersected_obj->specular_color, specular_contrib, specular_contrib);
 
-    vec_add(diffuse_contrib, total_diffuse, total_diffuse);
-    vec_add(specular_contrib, total_specular, total_specular);
+/* True if the light can be skipped at the point without tracing a shadow ray: it is too far away
+ * to matter, the point is outside its cone, or the object being shaded stands in its way. */
+static bool light_is_culled(RenderContextRef ctx, double *intersect, ObjectRef intersected_obj, int light_index,
+			    double dist_to_light, double *intersectward_n) {
+  LightRef light = ctx->lights[light_index];
+  if(dist_to_light > ctx->light_radii[light_index]) {
+    ctx->counts.culled_by_distance++;
+  } else if(!light_is_contributing(light, intersectward_n)) {
+    ctx->counts.culled_by_cone++;
+  } else if(object_shadows_itself(intersected_obj, intersect, light->position)) {
+    ctx->counts.culled_by_facing++;
+  } else {
+    return false;
   }
+  return true;
+}
 
-  vec_add(total_diffuse, total_specular, color_out);
-  vec_scale(color_out, (1.0 - (intersected_obj->reflectivity + intersected_obj->refractivity)), color_out);
 
-  if(r_level <= 0)
-    return;
-  double reflective_contrib[3] = {0};
-  get_reflective_contrib(intersect, intersected_obj, view_n, surface_n, r_level, reflective_contrib);
-  double refractive_contrib[3] = {0};
-  get_refractive_contrib(intersect, intersected_obj, view_n, surface_n, r_level, refractive_contrib);
+static void face_normal_toward_light(double *intersectward_n, double *surface_n) {
+  Vec4 normal = v4_load(surface_n);
+  if(v4_dot(normal, v4_load(intersectward_n)) > 0) {
+    v4_store(v4_scale(normal, -1.0), surface_n);
+  }
+}
+
 
-  vec_add(reflective_contrib, color_out, color_out);
-  vec_add(refractive_contrib, color_out, color_out);
- }
+/* Adds the reflected and refracted light arriving at the point to color_out. Only the rays asked for
+ * are traced; the caller leaves out those whose contribution would be scaled to nothing. */
+static void add_indirect_contrib(RenderContextRef ctx, double *intersect, ObjectRef intersected_obj,
+				 double *view_n, double *surface_n, int r_level, bool reflective, bool refractive,
+				 double *color_out) {
+  Vec4 color = v4_load(color_out);
+  if(reflective) {
+    double reflective_contrib[3] = {0};
+    get_reflective_contrib(ctx, intersect, intersected_obj, view_n, surface_n, r_level, reflective_contrib);
+    color = v4_add(v4_load(reflective_contrib), color);
+  }
+  if(refractive) {
+    double refractive_contrib[3] = {0};
+    get_refractive_contrib(ctx, intersect, intersected_obj, view_n, surface_n, r_level, refractive_contrib);
+    color = v4_add(v4_load(refractive_contrib), color);
+  }
+  v4_store(color, color_out);
+}
 
 
-static void get_reflective_contrib(double *intersect, ObjectRef intersected_obj, double *view_n,
-				   double *surface_n, int r_level, double *reflective_contrib) {
+static void get_reflective_contrib(RenderContextRef ctx, double *intersect, ObjectRef intersected_obj,
+				   double *view_n, double *surface_n, int r_level, double *reflective_contrib) {
   Ray refl_ray = {{intersect[X], intersect[Y], intersect[Z]}, {0.0}};
-  vec_reflect(view_n, surface_n, refl_ray.dir);
-  scooch_ray_origin(&refl_ray);
+  v4_store(v4_reflect(v4_load(view_n), v4_load(surface_n)), refl_ray.dir);
 
   double refl_intersect[3] = {0.0};
-  ObjectRef refl_obj = shoot(&refl_ray, refl_intersect);
+  ObjectRef refl_obj = shoot(ctx, &refl_ray, intersected_obj, refl_intersect);
+  ctx->counts.reflected_rays_traced++;
+  touch_object(ctx, refl_obj);
   if(NULL == refl_obj) {
     reflective_contrib[X] = 0.0;
     reflective_contrib[Y] = 0.0;
@@ -174,25 +1429,38 @@ static void get_reflective_contrib(double *intersect, ObjectRef intersected_obj,
     return;
   }
 
-  shade(refl_intersect, refl_obj, refl_ray.dir, r_level - 1, reflective_contrib);
-  vec_scale(reflective_contrib, intersected_obj->reflectivity, reflective_contrib);
+  shade(ctx, refl_intersect, refl_obj, refl_ray.dir, r_level - 1, reflective_contrib);
+  v4_store(v4_scale(v4_load(reflective_contrib), intersected_obj->reflectivity), reflective_contrib);
 }
 
 
-static void get_refractive_contrib(double *intersect, ObjectRef intersected_obj, double *view_n,
-				   double *surface_n, int r_level, double *refractive_contrib) {
+/* A ray that enters the object passes out through its far side, being reflected back inside as long
+ * as it meets the surface too obliquely to leave. */
+static void get_refractive_contrib(RenderContextRef ctx, double *intersect, ObjectRef intersected_obj,
+				   double *view_n, double *surface_n, int r_level, double *refractive_contrib) {
   Ray refr_ray = {{0.0}, {0.0}};
-  get_refractive_ray(&refr_ray, view_n, surface_n, intersect, intersected_obj->ior);
+  bool entered = get_refractive_ray(&refr_ray, view_n, surface_n, intersect, intersected_obj->ior);
   double refr_intersect[3] = {0.0};
-  ObjectRef maybe_surrounding_obj = shoot(&refr_ray, refr_intersect);
-  if(maybe_surrounding_obj == intersected_obj) {
+  ObjectRef refr_obj = entered ? shoot_from_inside(ctx, &refr_ray, intersected_obj, refr_intersect) :
+    shoot(ctx, &refr_ray, intersected_obj, refr_intersect);
+  ctx->counts.refracted_rays_traced++;
+  touch_object(ctx, refr_obj);
+  for(int reflections = 0; entered && refr_obj == intersected_obj; reflections++) {
     double internal_surface_n[3] = {0.0};
     get_surface_normal(intersected_obj, refr_intersect, internal_surface_n);
-    vec_scale(internal_surface_n, -1.0, internal_surface_n);
-    get_refractive_ray(&refr_ray, refr_ray.dir, internal_surface_n, refr_intersect, 1/intersected_obj->ior);
-  } 
+    v4_store(v4_scale(v4_load(internal_surface_n), -1.0), internal_surface_n);
+    entered = !get_refractive_ray(&refr_ray, refr_ray.dir, internal_surface_n, refr_intersect,
+				  1/intersected_obj->ior);
+    if(entered && MAX_INTERNAL_REFLECTIONS == reflections) {
+      refr_obj = NULL;
+      break;
+    }
+    refr_obj = entered ? shoot_from_inside(ctx, &refr_ray, intersected_obj, refr_intersect) :
+      shoot(ctx, &refr_ray, intersected_obj, refr_intersect);
+    ctx->counts.refracted_rays_traced++;
+    touch_object(ctx, refr_obj);
+  }
 
-  ObjectRef refr_obj = shoot(&refr_ray, refr_intersect);
   if(NULL == refr_obj) {
     refractive_contrib[X] = 0.0;
     refractive_contrib[Y] = 0.0;
@@ -200,58 +1468,72 @@ static void get_refractive_contrib(double *intersect, ObjectRef intersected_obj,
     return;
   }
 
-  shade(refr_intersect, refr_obj, refr_ray.dir, r_level - 1, refractive_contrib);
-  vec_scale(refractive_contrib, intersected_obj->refractivity, refractive_contrib);
+  shade(ctx, refr_intersect, refr_obj, refr_ray.dir, r_level - 1, refractive_contrib);
+  v4_store(v4_scale(v4_load(refractive_contrib), intersected_obj->refractivity), refractive_contrib);
+}
+
+
+/* shoot() for a ray that has just gone into obj. If obj is sealed the ray can only leave through
+ * obj's own surface, so that is the only intersection worked out. */
+static ObjectRef shoot_from_inside(RenderContextRef ctx, RayRef r, ObjectRef obj, double *intersection) {
+  if(!ctx->sealed[obj->id]) return shoot(ctx, r, obj, intersection);
+  FloatRay float_r;
+  if(NULL != ctx->float_scene) get_float_ray(ctx->float_scene, r, &float_r);
+  double t = hit_distance(ctx, r, &float_r, obj, true);
+  if(MISS == t) return shoot(ctx, r, obj, intersection);
+  v4_store(v4_ray_at(r, t), intersection);
+  return obj;
 }
 
 
-static void get_refractive_ray(RayRef refr_ray, double *view_n, double *surface_n, double *intersect,
+/* Bends the ray crossing the surface at intersect by the ratio ior and returns true, or returns
+ * false if it is totally internally reflected, leaving refr_ray as the reflected ray. A ray meeting
+ * the surface head on goes straight through. */
+static bool get_refractive_ray(RayRef refr_ray, double *view_n, double *surface_n, double *intersect,
 			       double ior) {
-  vec_copy(intersect, refr_ray->origin);
-  double a[3] = {0.0};
-  vec_cross(surface_n, view_n, a);
-  vec_normalize(a, a);
-  double b[3] = {0.0};
-  vec_cross(a, surface_n, b);
-  double sin_phi = (1.0/ior) * vec_dot(view_n, b);
-  double cos_phi = sqrt(1 - pow(sin_phi, 2));
-  double scaled_surface_n[3] = {0.0};
-  vec_scale(surface_n, -cos_phi, scaled_surface_n);
-  double scaled_b_n[3] = {0.0};
-  vec_scale(b, sin_phi, scaled_b_n);
-  vec_add(scaled_surface_n, scaled_b_n, refr_ray->dir);
-  scooch_ray_origin(refr_ray);
+  Vec4 view = v4_load(view_n);
+  Vec4 normal = v4_load(surface_n);
+  v4_store(v4_load(intersect), refr_ray->origin);
+  Vec4 a = v4_cross(normal, view);
+  if(0 == v4_length(a)) {
+    v4_store(view, refr_ray->dir);
+    return true;
+  }
+  Vec4 b = v4_cross(v4_normalize(a), normal);
+  double sin_phi = (1.0/ior) * v4_dot(view, b);
+  double cos_phi_squared = 1 - sin_phi * sin_phi;
+  if(cos_phi_squared < 0) {
+    v4_store(v4_reflect(view, normal), refr_ray->dir);
+    return false;
+  }
+  double cos_phi = sqrt(cos_phi_squared);
+  v4_store(v4_add(v4_scale(normal, -cos_phi), v4_scale(b, sin_phi)), refr_ray->dir);
+  return true;
 }
 
 
 static void get_lightward_ray(double *point, LightRef light, RayRef out) {
-  out->origin[X] = point[X];
-  out->origin[Y] = point[Y];
-  out->origin[Z] = point[Z];
-  
-  get_inter_point_normal_vector(point, light->position, out->dir);
-
-  Point scooched_point = {0.0};
-  get_next_point_along_ray(out, scooched_point);
-  out->origin[X] = scooched_point[X];
-  out->origin[Y] = scooched_point[Y];
-  out->origin[Z] = scooched_point[Z];
+  Vec4 origin = v4_load(point);
+  v4_store(origin, out->origin);
+  v4_store(v4_normalize(v4_sub(v4_load(light->position), origin)), out->dir);
 }
 
 
-static bool ray_intersects_objects(RayRef lightward_r, double distance_to_light) {
+static bool ray_intersects_objects(RenderContextRef ctx, RayRef lightward_r, double distance_to_light,
+				   int light_index, ObjectRef receiver) {
   Point point_intersected = {0.0};
-  ObjectRef object_intersected = shoot(lightward_r, point_intersected);
+  ObjectRef object_intersected = shoot_toward_light(ctx, lightward_r, light_index, receiver, point_intersected);
   if(NULL == object_intersected) {
     return false;
   } else {
-    double distance_to_intersection = point_distance(lightward_r->origin, point_intersected);
-    return distance_to_light >= distance_to_intersection;
+    double distance_to_intersection = v4_distance(v4_load(lightward_r->origin), v4_load(point_intersected));
+    if(!(distance_to_light >= distance_to_intersection)) return false;
+    touch_object(ctx, object_intersected);
+    return true;
   }
 }
 
 
-static void get_cameraward_normal(double *from_point, double *out) {
-  vec_subtract(camera->position, from_point, out);
-  vec_normalize(out, out);
+static void get_cameraward_normal(RenderContextRef ctx, double *from_point, double *out) {
+  v4_store(v4_normalize(v4_sub(v4_load(ctx->camera->position), v4_load(from_point))), out);
 }
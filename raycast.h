@@ -1,11 +1,116 @@
 #ifndef RAYCAST_HEADER
 #define RAYCAST_HEADER 1
 
+#include <stdbool.h>
 #include "pixelbuf.h"
 #include "camera.h"
 #include "object.h"
 #include "light.h"
+#include "spec.h"
+#include "workpool.h"
 
+/* Everything built from a parsed scene file that rendering needs. */
+struct RenderScene {
+  CameraRef camera;
+  ObjectRef *objects;
+  LightRef *lights;
+};
+
+typedef struct RenderScene RenderScene;
+typedef struct RenderScene* RenderSceneRef;
+
+/* What one pixel's primary ray hit, kept so that a later render can reuse its shading. point and
+ * view are where and from which direction color was shaded, which for a reused pixel is an earlier
+ * frame's. depth is only used while reprojecting. */
+struct PixelHit {
+  ObjectRef object;
+  Point point;
+  Vec view;
+  double color[3];
+  double depth;
+  bool reused;
+};
+
+typedef struct PixelHit PixelHit;
+
+/* A width by rows grid of PixelHits, top row first. object is NULL where the ray missed. */
+struct HitBuffer {
+  int width;
+  int rows;
+  PixelHit *hits;
+};
+
+typedef struct HitBuffer HitBuffer;
+typedef struct HitBuffer* HitBufferRef;
+
+/* Per-pixel primary hits and per-light shading kept between renders of the same geometry from the
+ * same camera, so that a render with changed lights skips the primary rays and redoes only the
+ * shading for the lights that changed. */
+typedef struct RelightCache* RelightCacheRef;
+
+/* For each pixel, its primary hit and the objects, by id, that the rays of its ray tree which carry
+ * any weight ran into, shadow rays included. Lets a render after an edit redo only the pixels the
+ * edit can reach. */
+typedef struct TouchBuffer* TouchBufferRef;
+
+/* What happened to the shadow rays of a render: how many were traced, and how many were skipped
+ * because the point was beyond the light's influence radius, outside its spotlight cone, or on the
+ * far side of a sphere from it. Also how many primary, reflected and refracted rays were traced,
+ * each internal reflection of a refracted ray counting as one more. */
+struct RenderStats {
+  long shadow_rays_traced;
+  long culled_by_distance;
+  long culled_by_cone;
+  long culled_by_facing;
+  long primary_rays_traced;
+  long reflected_rays_traced;
+  long refracted_rays_traced;
+};
+
+typedef struct RenderStats RenderStats;
+typedef struct RenderStats* RenderStatsRef;
+
+/* One render request: the image size and the band of image rows (counted from the top, as in the
+ * written PPM) to produce. Fill one in with designated initializers: every field left out is zero,
+ * which is its default, so adding a field never touches existing requests. */
+struct RenderJob {
+  RenderSceneRef scene;
+  int width;
+  int height;
+  int first_row;
+  int rows;
+  // Optional: where to record each pixel's primary hit, and reprojected hits to reuse shading from
+  HitBufferRef hits_out;
+  HitBufferRef reuse_from;
+  // Lights dimmer than this after radial attenuation are skipped; 0 skips none
+  double light_cutoff;
+  // With more lights than this, each point is lit by this many lights sampled by importance; 0 never samples
+  int light_budget;
+  // Optional: where to add up the render's shadow ray counts
+  RenderStatsRef stats;
+  // Find ray hits in single precision, relative to the camera, instead of double
+  bool single_precision;
+};
+
+typedef struct RenderJob RenderJob;
+
+RenderSceneRef new_render_scene(Scene);
+void destroy_render_scene(RenderSceneRef);
+PixelBufRef raycast_job(RenderJob*, WorkPoolRef);
+bool raycast_job_into(RenderJob*, WorkPoolRef, PixelBufRef);
+bool raycast_views(RenderJob*, int, WorkPoolRef, PixelBufRef*);
+int* count_shadow_candidates(RenderSceneRef);
+HitBufferRef new_hit_buffer(int, int);
+void destroy_hit_buffer(HitBufferRef);
+void reproject_hits(HitBufferRef, RenderJob*, HitBufferRef);
+RelightCacheRef new_relight_cache(int, int);
+void destroy_relight_cache(RelightCacheRef);
+void raycast_relight(RenderJob*, WorkPoolRef, PixelBufRef, RelightCacheRef);
+TouchBufferRef new_touch_buffer(int, int, int);
+void destroy_touch_buffer(TouchBufferRef);
+void raycast_dirty(RenderJob*, WorkPoolRef, PixelBufRef, TouchBufferRef, const bool*);
+int find_dirty_pixels(RenderJob*, TouchBufferRef, const bool*, const bool*, bool*);
 PixelBufRef raycast(CameraRef, ObjectRef*, LightRef*, int, int);
+PixelBufRef raycast_rows(CameraRef, ObjectRef*, LightRef*, int, int, int, int);
 
 #endif
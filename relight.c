@@ -0,0 +1,122 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include "relight.h"
+#include "parser.h"
+#include "spec.h"
+#include "light.h"
+#include "raycast.h"
+#include "workpool.h"
+#include "pixelbuf.h"
+#include "ppmwrite.h"
+#include "util.h"
+
+#define MAX_OUTPUT_PATH_LEN 4096
+
+static bool swap_in_lights(RenderSceneRef, char*);
+static int count_changed_lights(LightRef*, LightRef*);
+static bool write_render(RelightRequest*, int, uint8_t*);
+
+/* Returns EXIT_FAILURE after reporting the first failure. */
+int run_relight(RelightRequest *req) {
+  clear_error();
+  RenderSceneRef render_scene = NULL;
+  WorkPoolRef pool = NULL;
+  uint8_t *byte_buf = NULL;
+  PixelBufRef pixel_buf = NULL;
+  RelightCacheRef cache = NULL;
+  LightRef *previous_lights = NULL;
+
+  Scene scene = parse_scene_from_file(req->scene_path);
+  if(NULL != scene) {
+    render_scene = new_render_scene(scene);
+    destroy_scene(scene);
+  }
+  bool ok = NULL != render_scene;
+  if(ok && req->light_path_count > 0 && !path_has_frame_number(req->output_path)) {
+    set_error(RC_ERR_ARGUMENT, "The output path needs one frame number conversion, such as %%02d");
+    ok = false;
+  }
+  if(ok) {
+    pool = new_work_pool(req->thread_count);
+    byte_buf = checked_malloc((size_t) req->width * req->height * 3);
+    pixel_buf = NULL == byte_buf ? NULL : new_pixel_buf_over(byte_buf, req->width, req->height);
+    cache = new_relight_cache(req->width, req->height);
+    ok = NULL != pool && NULL != pixel_buf && NULL != cache;
+  }
+
+  for(int i = 0; ok && i <= req->light_path_count; i++) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if(i > 0) {
+      previous_lights = copy_lights(render_scene->lights);
+      ok = NULL != previous_lights && swap_in_lights(render_scene, req->light_paths[i - 1]);
+      if(!ok) break;
+    }
+
+    RenderJob job = {.scene = render_scene, .width = req->width, .height = req->height, .rows = req->height};
+    raycast_relight(&job, pool, pixel_buf, cache);
+    ok = !error_occurred() && write_render(req, i, byte_buf);
+    if(ok) {
+      int light_count = 0;
+      while(NULL != render_scene->lights[light_count]) light_count++;
+      int changed_count = NULL == previous_lights ? light_count :
+	count_changed_lights(previous_lights, render_scene->lights);
+      fprintf(stderr, "NOTICE: Render %d reshaded %d of %d lights in %.3f ms\n", i, changed_count, light_count,
+	      elapsed_ms(&start));
+    }
+    if(NULL != previous_lights) destroy_lights(previous_lights);
+    previous_lights = NULL;
+  }
+
+  if(!ok) fprintf(stderr, "Error: %s\n", last_error_message());
+  if(NULL != previous_lights) destroy_lights(previous_lights);
+  destroy_relight_cache(cache);
+  destroy_pixel_buf(pixel_buf);
+  free(byte_buf);
+  destroy_work_pool(pool);
+  destroy_render_scene(render_scene);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+static bool swap_in_lights(RenderSceneRef render_scene, char *light_path) {
+  Scene light_scene = parse_scene_from_file(light_path);
+  if(NULL == light_scene) return false;
+  LightRef *lights = get_lights_from_scene(light_scene);
+  destroy_scene(light_scene);
+  if(NULL == lights) return false;
+  destroy_lights(render_scene->lights);
+  render_scene->lights = lights;
+  return true;
+}
+
+
+/* Matches raycast_relight(): a change in the number of lights counts as every light changing. */
+static int count_changed_lights(LightRef *before, LightRef *after) {
+  int before_count = 0;
+  int after_count = 0;
+  while(NULL != before[before_count]) before_count++;
+  while(NULL != after[after_count]) after_count++;
+  if(before_count != after_count) return after_count;
+  int changed_count = 0;
+  for(int i = 0; i < after_count; i++) {
+    if(!light_equals(before[i], after[i])) changed_count++;
+  }
+  return changed_count;
+}
+
+
+static bool write_render(RelightRequest *req, int index, uint8_t *byte_buf) {
+  if(!path_has_frame_number(req->output_path)) {
+    return ppm_write(req->output_path, '3', byte_buf, req->width, req->height);
+  }
+  char path[MAX_OUTPUT_PATH_LEN];
+  if((int) sizeof(path) <= snprintf(path, sizeof(path), req->output_path, index)) {
+    set_error(RC_ERR_ARGUMENT, "The output path is too long");
+    return false;
+  }
+  return ppm_write(path, '3', byte_buf, req->width, req->height);
+}
@@ -0,0 +1,23 @@
+#ifndef RELIGHT_HEADER
+#define RELIGHT_HEADER 1
+
+/* Renders the scene with its own lights, then again for each light file with that file's lights in
+ * place of the scene's. A light file uses the scene file syntax; anything but lights is ignored.
+ * Geometry and camera stay fixed, so every render after the first reuses the primary hits, and only
+ * the lights that differ from the previous render are reshaded. Render i is written to the output
+ * path with i in place of its frame number conversion, such as %02d. */
+struct RelightRequest {
+  char *scene_path;
+  char *output_path;
+  char **light_paths;
+  int light_path_count;
+  int width;
+  int height;
+  int thread_count;
+};
+
+typedef struct RelightRequest RelightRequest;
+
+int run_relight(RelightRequest*);
+
+#endif
@@ -0,0 +1,313 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "rendercache.h"
+#include "util.h"
+
+#define ENTRY_SUFFIX ".entry"
+#define ENTRY_MAGIC "raycast-cache"
+
+/* Each entry is one file named for the hash of its key, holding a header line with the key's
+ * length, the key itself and then the output file's bytes. Keeping the key means a hash collision
+ * is a miss rather than a wrong image, and keeping everything in one file means an entry appears
+ * with a single rename, so a reader never sees half of one. The modification time records when an
+ * entry was last used; eviction removes the least recently used entries first. */
+struct RenderCache {
+  char *dir;
+  long long max_bytes;
+  long long total_bytes;
+  int hits;
+  int misses;
+  pthread_mutex_t lock;
+};
+
+typedef struct RenderCache RenderCache;
+
+struct CacheFile {
+  char *name;
+  long long size;
+  struct timespec used;
+};
+
+typedef struct CacheFile CacheFile;
+
+static char* entry_path(RenderCacheRef, const char*, size_t);
+static bool read_entry_key(FILE*, const char*, size_t);
+static bool copy_stream(FILE*, FILE*);
+static long long file_size(const char*);
+static void count_lookup(RenderCacheRef, bool);
+static int scan_entries(RenderCacheRef, CacheFile**);
+static void evict_to_limit(RenderCacheRef);
+static int compare_use_times(const void*, const void*);
+static void free_cache_files(CacheFile*, int);
+
+/* Creates the directory if needed. Entries already in it count towards the size limit. */
+RenderCacheRef open_render_cache(char *dir, long long max_bytes) {
+  if(0 != mkdir(dir, 0777) && EEXIST != errno) {
+    set_error(RC_ERR_IO, "Could not create cache directory \"%s\"", dir);
+    return NULL;
+  }
+  RenderCacheRef cache = checked_malloc(sizeof(*cache));
+  if(NULL == cache) return NULL;
+  cache->dir = strdup(dir);
+  if(NULL == cache->dir) {
+    free(cache);
+    set_error(RC_ERR_NO_MEMORY, "Could not allocate memory");
+    return NULL;
+  }
+  cache->max_bytes = max_bytes;
+  cache->total_bytes = 0;
+  cache->hits = 0;
+  cache->misses = 0;
+  pthread_mutex_init(&cache->lock, NULL);
+
+  CacheFile *files = NULL;
+  int file_count = scan_entries(cache, &files);
+  for(int i = 0; i < file_count; i++) {
+    cache->total_bytes += files[i].size;
+  }
+  free_cache_files(files, file_count);
+  evict_to_limit(cache);
+  return cache;
+}
+
+
+/* Returns a malloc'd key for rendering the given rows of a width by height image of the scene into
+ * the given format, or NULL if memory runs out. */
+char* render_cache_key(const char *scene_key, size_t scene_key_len, int width, int height, int first_row,
+		       int rows, char *format, size_t *len_out) {
+  char *key = NULL;
+  FILE *out = open_memstream(&key, len_out);
+  if(NULL == out) {
+    set_error(RC_ERR_NO_MEMORY, "Could not allocate memory");
+    return NULL;
+  }
+  fwrite(scene_key, 1, scene_key_len, out);
+  fprintf(out, "render %d %d %d %d %s version %d\n", width, height, first_row, rows, format,
+	  RENDER_CACHE_VERSION);
+  if(0 != fclose(out)) {
+    free(key);
+    set_error(RC_ERR_NO_MEMORY, "Could not allocate memory");
+    return NULL;
+  }
+  return key;
+}
+
+
+/* Writes the cached output for the key to output_path and returns true, or returns false if there
+ * is none. A problem with the cache is treated as a miss and never sets the error state. */
+bool render_cache_fetch(RenderCacheRef cache, const char *key, size_t key_len, char *output_path) {
+  char *path = entry_path(cache, key, key_len);
+  FILE *entry = NULL == path ? NULL : fopen(path, "rb");
+  bool hit = NULL != entry && read_entry_key(entry, key, key_len);
+  if(hit) {
+    FILE *out = fopen(output_path, "wb");
+    hit = NULL != out && copy_stream(entry, out);
+    if(NULL != out && 0 != fclose(out)) hit = false;
+    if(!hit) remove(output_path);
+  }
+  if(NULL != entry) fclose(entry);
+  if(hit) utimensat(AT_FDCWD, path, NULL, 0);
+  free(path);
+  count_lookup(cache, hit);
+  return hit;
+}
+
+
+/* Adds the finished output file to the cache under the key, evicting older entries if the cache has
+ * grown past its limit. Failure only means the next render of it will not be a hit. */
+void render_cache_store(RenderCacheRef cache, const char *key, size_t key_len, char *output_path) {
+  char *path = entry_path(cache, key, key_len);
+  size_t dir_len = strlen(cache->dir);
+  char *temp_path = NULL == path ? NULL : malloc(dir_len + sizeof("/.tmp-XXXXXX"));
+  FILE *in = NULL == temp_path ? NULL : fopen(output_path, "rb");
+  if(NULL == in) {
+    free(temp_path);
+    free(path);
+    return;
+  }
+  memcpy(temp_path, cache->dir, dir_len);
+  strcpy(temp_path + dir_len, "/.tmp-XXXXXX");
+
+  int fd = mkstemp(temp_path);
+  FILE *out = fd < 0 ? NULL : fdopen(fd, "wb");
+  bool ok = NULL != out;
+  if(ok) {
+    fprintf(out, "%s %zu\n", ENTRY_MAGIC, key_len);
+    ok = key_len == fwrite(key, 1, key_len, out) && copy_stream(in, out);
+    if(0 != fclose(out)) ok = false;
+  } else if(fd >= 0) {
+    close(fd);
+  }
+  fclose(in);
+
+  long long old_size = file_size(path);
+  if(ok && 0 == rename(temp_path, path)) {
+    pthread_mutex_lock(&cache->lock);
+    cache->total_bytes += file_size(path) - (old_size < 0 ? 0 : old_size);
+    pthread_mutex_unlock(&cache->lock);
+    evict_to_limit(cache);
+  } else if(fd >= 0) {
+    remove(temp_path);
+  }
+  free(temp_path);
+  free(path);
+}
+
+
+void report_render_cache(RenderCacheRef cache) {
+  pthread_mutex_lock(&cache->lock);
+  int lookups = cache->hits + cache->misses;
+  printf("Render cache: %d hits, %d misses, %.1f%% hit rate\n", cache->hits, cache->misses,
+	 0 == lookups ? 0.0 : 100.0 * cache->hits / lookups);
+  pthread_mutex_unlock(&cache->lock);
+  fflush(stdout);
+}
+
+
+void close_render_cache(RenderCacheRef cache) {
+  if(NULL == cache) return;
+  pthread_mutex_destroy(&cache->lock);
+  free(cache->dir);
+  free(cache);
+}
+
+
+static char* entry_path(RenderCacheRef cache, const char *key, size_t key_len) {
+  size_t len = strlen(cache->dir) + 1 + 16 + sizeof(ENTRY_SUFFIX);
+  char *path = malloc(len);
+  if(NULL == path) return NULL;
+  snprintf(path, len, "%s/%016llx%s", cache->dir, (unsigned long long) hash_bytes(key, key_len), ENTRY_SUFFIX);
+  return path;
+}
+
+
+/* Reads the entry's header and key, leaving the stream at the start of the output bytes. */
+static bool read_entry_key(FILE *entry, const char *key, size_t key_len) {
+  size_t stored_len = 0;
+  if(1 != fscanf(entry, ENTRY_MAGIC " %zu", &stored_len) || '\n' != fgetc(entry)) return false;
+  if(stored_len != key_len) return false;
+  char buf[4096];
+  for(size_t done = 0; done < key_len;) {
+    size_t want = key_len - done < sizeof(buf) ? key_len - done : sizeof(buf);
+    if(want != fread(buf, 1, want, entry) || 0 != memcmp(buf, key + done, want)) return false;
+    done += want;
+  }
+  return true;
+}
+
+
+static bool copy_stream(FILE *in, FILE *out) {
+  char buf[65536];
+  size_t count;
+  while(0 < (count = fread(buf, 1, sizeof(buf), in))) {
+    if(count != fwrite(buf, 1, count, out)) return false;
+  }
+  return !ferror(in);
+}
+
+
+/* Returns -1 if the file does not exist. */
+static long long file_size(const char *path) {
+  struct stat st;
+  if(NULL == path || 0 != stat(path, &st)) return -1;
+  return (long long) st.st_size;
+}
+
+
+static void count_lookup(RenderCacheRef cache, bool hit) {
+  pthread_mutex_lock(&cache->lock);
+  if(hit) {
+    cache->hits++;
+  } else {
+    cache->misses++;
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+
+/* Returns the number of entries found, filling files with a malloc'd array of them. */
+static int scan_entries(RenderCacheRef cache, CacheFile **files_out) {
+  *files_out = NULL;
+  DIR *dir = opendir(cache->dir);
+  if(NULL == dir) return 0;
+
+  CacheFile *files = NULL;
+  int count = 0;
+  size_t dir_len = strlen(cache->dir);
+  size_t suffix_len = strlen(ENTRY_SUFFIX);
+  struct dirent *dirent;
+  while(NULL != (dirent = readdir(dir))) {
+    size_t name_len = strlen(dirent->d_name);
+    if(name_len <= suffix_len || 0 != strcmp(dirent->d_name + name_len - suffix_len, ENTRY_SUFFIX)) continue;
+    char *path = malloc(dir_len + 1 + name_len + 1);
+    if(NULL == path) break;
+    sprintf(path, "%s/%s", cache->dir, dirent->d_name);
+    struct stat st;
+    if(0 != stat(path, &st)) {
+      free(path);
+      continue;
+    }
+    if(0 == (count & (count - 1))) {
+      CacheFile *grown = realloc(files, (0 == count ? 1 : count * 2) * sizeof(*files));
+      if(NULL == grown) {
+	free(path);
+	break;
+      }
+      files = grown;
+    }
+    files[count].name = path;
+    files[count].size = (long long) st.st_size;
+    files[count].used = st.st_mtim;
+    count++;
+  }
+  closedir(dir);
+  *files_out = files;
+  return count;
+}
+
+
+/* Rescans the directory so entries added by other processes are counted too. */
+static void evict_to_limit(RenderCacheRef cache) {
+  pthread_mutex_lock(&cache->lock);
+  if(cache->total_bytes > cache->max_bytes) {
+    CacheFile *files = NULL;
+    int file_count = scan_entries(cache, &files);
+    long long total = 0;
+    for(int i = 0; i < file_count; i++) {
+      total += files[i].size;
+    }
+    qsort(files, file_count, sizeof(*files), compare_use_times);
+    for(int i = 0; i < file_count && total > cache->max_bytes; i++) {
+      if(0 == remove(files[i].name)) total -= files[i].size;
+    }
+    cache->total_bytes = total;
+    free_cache_files(files, file_count);
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+
+static int compare_use_times(const void *a, const void *b) {
+  const struct timespec *ta = &((const CacheFile*) a)->used;
+  const struct timespec *tb = &((const CacheFile*) b)->used;
+  if(ta->tv_sec != tb->tv_sec) return ta->tv_sec < tb->tv_sec ? -1 : 1;
+  if(ta->tv_nsec != tb->tv_nsec) return ta->tv_nsec < tb->tv_nsec ? -1 : 1;
+  return 0;
+}
+
+
+static void free_cache_files(CacheFile *files, int count) {
+  for(int i = 0; i < count; i++) {
+    free(files[i].name);
+  }
+  free(files);
+}
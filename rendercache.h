@@ -0,0 +1,22 @@
+#ifndef RENDERCACHE_HEADER
+#define RENDERCACHE_HEADER 1
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Finished output files kept on disk under the hash of a key describing everything that decides
+ * their contents: the canonical scene text and its mesh file stamps, the resolution, the rows
+ * rendered and the output format. Bump the version whenever the renderer's output changes so stale entries stop matching. */
+#define RENDER_CACHE_VERSION 2
+#define RENDER_CACHE_DEFAULT_MB 1024
+
+typedef struct RenderCache* RenderCacheRef;
+
+RenderCacheRef open_render_cache(char*, long long);
+char* render_cache_key(const char*, size_t, int, int, int, int, char*, size_t*);
+bool render_cache_fetch(RenderCacheRef, const char*, size_t, char*);
+void render_cache_store(RenderCacheRef, const char*, size_t, char*);
+void report_render_cache(RenderCacheRef);
+void close_render_cache(RenderCacheRef);
+
+#endif
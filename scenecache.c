@@ -0,0 +1,195 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "scenecache.h"
+#include "parser.h"
+#include "raycast.h"
+#include "mesh.h"
+#include "util.h"
+
+/* Built scenes keyed by the hash of the scene JSON they came from and the directory its relative
+ * mesh paths were taken from. The JSON itself is kept too so that a hash collision can never hand
+ * back the wrong scene, and so are the stamps of the mesh files (their identity, size and times, see
+ * mesh_file_stamp()), so that a scene whose mesh has been written or replaced is built again. When full, the least recently used entry is evicted. */
+struct SceneCacheEntry {
+  uint64_t hash;
+  size_t len;
+  char *content;
+  char *base_dir;
+  int mesh_count;
+  char **mesh_files;
+  uint64_t *mesh_stamps;
+  RenderSceneRef scene;
+  unsigned long last_used;
+};
+
+typedef struct SceneCacheEntry SceneCacheEntry;
+
+struct SceneCache {
+  int capacity;
+  int count;
+  unsigned long clock;
+  SceneCacheEntry *entries;
+};
+
+typedef struct SceneCache SceneCache;
+
+static SceneCacheEntry* find_entry(SceneCacheRef, uint64_t, char*, size_t, const char*);
+static bool build_entry(SceneCacheEntry*, char*, size_t, const char*);
+static bool record_mesh_files(SceneCacheEntry*, Scene);
+static bool mesh_files_unchanged(SceneCacheEntry*);
+static void remove_entry(SceneCacheRef, SceneCacheEntry*);
+static void release_entry(SceneCacheEntry*);
+static SceneCacheEntry* claim_entry(SceneCacheRef);
+
+SceneCacheRef new_scene_cache(int capacity) {
+  SceneCacheRef cache = checked_malloc(sizeof(*cache));
+  if(NULL == cache) return NULL;
+  cache->capacity = capacity > 0 ? capacity : 1;
+  cache->count = 0;
+  cache->clock = 0;
+  cache->entries = checked_malloc(cache->capacity * sizeof(*(cache->entries)));
+  if(NULL == cache->entries) {
+    free(cache);
+    return NULL;
+  }
+  return cache;
+}
+
+
+/* Returns the scene built from the given JSON, parsing and building it only if it is not already
+ * cached or a mesh file it names has changed since it was. Relative mesh paths are taken from
+ * base_dir, as by parse_scene_from_buffer(). The cache keeps ownership of the returned scene.
+ * Returns NULL if the JSON is not a valid scene; failures are not cached. */
+RenderSceneRef scene_cache_get(SceneCacheRef cache, char *content, size_t len, const char *base_dir,
+			       bool *was_cached) {
+  uint64_t hash = hash_bytes(content, len);
+  SceneCacheEntry *entry = find_entry(cache, hash, content, len, base_dir);
+  if(NULL != entry && !mesh_files_unchanged(entry)) {
+    remove_entry(cache, entry);
+    entry = NULL;
+  }
+  *was_cached = (NULL != entry);
+  if(NULL == entry) {
+    SceneCacheEntry fresh = {0};
+    if(!build_entry(&fresh, content, len, base_dir)) {
+      release_entry(&fresh);
+      return NULL;
+    }
+    fresh.hash = hash;
+    entry = claim_entry(cache);
+    *entry = fresh;
+  }
+  entry->last_used = ++cache->clock;
+  return entry->scene;
+}
+
+
+void destroy_scene_cache(SceneCacheRef cache) {
+  for(int i = 0; i < cache->count; i++) {
+    release_entry(&cache->entries[i]);
+  }
+  free(cache->entries);
+  free(cache);
+}
+
+
+static SceneCacheEntry* find_entry(SceneCacheRef cache, uint64_t hash, char *content, size_t len,
+				   const char *base_dir) {
+  for(int i = 0; i < cache->count; i++) {
+    SceneCacheEntry *entry = &cache->entries[i];
+    bool same_dir = NULL == base_dir ? NULL == entry->base_dir :
+      NULL != entry->base_dir && 0 == strcmp(entry->base_dir, base_dir);
+    if(entry->hash == hash && entry->len == len && same_dir && 0 == memcmp(entry->content, content, len)) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+
+/* Parses and builds the scene into the entry, keeping copies of what it was built from. Returns
+ * false if the scene is invalid or memory runs out, leaving what was made for release_entry(). */
+static bool build_entry(SceneCacheEntry *entry, char *content, size_t len, const char *base_dir) {
+  Scene scene = parse_scene_from_buffer(content, len, base_dir);
+  if(NULL == scene) return false;
+  // The mesh files must be recorded first: building the render scene consumes the specs
+  if(record_mesh_files(entry, scene)) entry->scene = new_render_scene(scene);
+  destroy_scene(scene);
+  entry->content = NULL == entry->scene ? NULL : checked_malloc(len);
+  if(NULL == entry->content) return false;
+  memcpy(entry->content, content, len);
+  entry->len = len;
+  if(NULL == base_dir) return true;
+  entry->base_dir = strdup(base_dir);
+  if(NULL == entry->base_dir) set_error(RC_ERR_NO_MEMORY, "Could not allocate memory");
+  return NULL != entry->base_dir;
+}
+
+
+static bool record_mesh_files(SceneCacheEntry *entry, Scene scene) {
+  int count = 0;
+  const char **paths = scene_mesh_files(scene, &count);
+  if(NULL == paths) return false;
+  entry->mesh_files = checked_malloc(sizeof(*entry->mesh_files) * (count + 1));
+  entry->mesh_stamps = checked_malloc(sizeof(*entry->mesh_stamps) * (count + 1));
+  bool ok = NULL != entry->mesh_files && NULL != entry->mesh_stamps;
+  for(int m = 0; ok && m < count; m++) {
+    entry->mesh_files[m] = strdup(paths[m]);
+    entry->mesh_count = m + 1;
+    if(NULL == entry->mesh_files[m]) {
+      set_error(RC_ERR_NO_MEMORY, "Could not allocate memory");
+      ok = false;
+    } else {
+      ok = mesh_file_stamp(paths[m], &entry->mesh_stamps[m]);
+    }
+  }
+  free(paths);
+  return ok;
+}
+
+
+static bool mesh_files_unchanged(SceneCacheEntry *entry) {
+  for(int m = 0; m < entry->mesh_count; m++) {
+    uint64_t stamp = 0;
+    if(!mesh_file_stamp(entry->mesh_files[m], &stamp) || stamp != entry->mesh_stamps[m]) return false;
+  }
+  return true;
+}
+
+
+static void remove_entry(SceneCacheRef cache, SceneCacheEntry *entry) {
+  release_entry(entry);
+  *entry = cache->entries[--cache->count];
+}
+
+
+static void release_entry(SceneCacheEntry *entry) {
+  free(entry->content);
+  free(entry->base_dir);
+  for(int m = 0; m < entry->mesh_count; m++) {
+    free(entry->mesh_files[m]);
+  }
+  free(entry->mesh_files);
+  free(entry->mesh_stamps);
+  destroy_render_scene(entry->scene);
+}
+
+
+/* Returns a free slot, evicting the least recently used scene if there is none. */
+static SceneCacheEntry* claim_entry(SceneCacheRef cache) {
+  if(cache->count < cache->capacity) {
+    return &cache->entries[cache->count++];
+  }
+
+  SceneCacheEntry *oldest = &cache->entries[0];
+  for(int i = 1; i < cache->count; i++) {
+    if(cache->entries[i].last_used < oldest->last_used) {
+      oldest = &cache->entries[i];
+    }
+  }
+  release_entry(oldest);
+  return oldest;
+}
@@ -0,0 +1,14 @@
+#ifndef SCENECACHE_HEADER
+#define SCENECACHE_HEADER 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "raycast.h"
+
+typedef struct SceneCache* SceneCacheRef;
+
+SceneCacheRef new_scene_cache(int);
+RenderSceneRef scene_cache_get(SceneCacheRef, char*, size_t, const char*, bool*);
+void destroy_scene_cache(SceneCacheRef);
+
+#endif
@@ -0,0 +1,79 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "shard.h"
+#include "util.h"
+
+#define SHARD_MAGIC "RCSHARD1"
+
+static void validate_shard_info(ShardInfo*, char*);
+
+/* Splits height rows into shard_count bands as evenly as possible and fills in the band with the
+ * given index. The earlier bands get the extra rows when the split is uneven. */
+void shard_rows_for_index(int index, int shard_count, int height, ShardInfo *out) {
+  int base = height / shard_count;
+  int extra = height % shard_count;
+  out->height = height;
+  out->first_row = index * base + (index < extra ? index : extra);
+  out->rows = base + (index < extra ? 1 : 0);
+}
+
+
+/* Writes a shard file: a short text header carrying the placement metadata followed by the raw
+ * RGB bytes of the band. */
+void shard_write(char *filename, ShardInfo *info, uint8_t *buf) {
+  FILE *shard_file = fopen(filename, "wb");
+  if(NULL == shard_file) {
+    fprintf(stderr, "Error: Shard file \"%s\" could not be opened for writing\n", filename);
+    exit(EXIT_FAILURE);
+  }
+
+  size_t buf_len = (size_t) info->width * info->rows * 3;
+  if(0 > fprintf(shard_file, SHARD_MAGIC "\n%d %d %d %d\n", info->width, info->height,
+		 info->first_row, info->rows) ||
+     buf_len != fwrite(buf, sizeof(uint8_t), buf_len, shard_file)) {
+    fprintf(stderr, "Error: An error occurred while writing shard file \"%s\"\n", filename);
+    exit(EXIT_FAILURE);
+  }
+
+  fclose(shard_file);
+}
+
+
+/* Opens a shard file and reads its header. The returned handle is positioned at the first row. */
+FILE* shard_open(char *filename, ShardInfo *out) {
+  FILE *shard_file = fopen(filename, "rb");
+  if(NULL == shard_file) {
+    fprintf(stderr, "Error: Could not open shard file \"%s\"\n", filename);
+    exit(EXIT_FAILURE);
+  }
+
+  char magic[sizeof(SHARD_MAGIC)] = {0};
+  if(1 != fscanf(shard_file, "%8s", magic) || 0 != strcmp(magic, SHARD_MAGIC) ||
+     4 != fscanf(shard_file, "%d %d %d %d", &out->width, &out->height, &out->first_row, &out->rows) ||
+     '\n' != fgetc(shard_file)) {
+    fprintf(stderr, "Error: \"%s\" is not a shard file\n", filename);
+    exit(EXIT_FAILURE);
+  }
+  validate_shard_info(out, filename);
+
+  return shard_file;
+}
+
+
+void shard_read_row(FILE *shard_file, ShardInfo *info, uint8_t *out) {
+  size_t row_len = (size_t) info->width * 3;
+  if(row_len != fread(out, sizeof(uint8_t), row_len, shard_file)) {
+    report_error_and_exit("Shard file ended before all of its rows were read");
+  }
+}
+
+
+static void validate_shard_info(ShardInfo *info, char *filename) {
+  if(info->width <= 0 || info->height <= 0 || info->rows <= 0 || info->first_row < 0 ||
+     info->first_row + info->rows > info->height) {
+    fprintf(stderr, "Error: Shard file \"%s\" has invalid placement metadata\n", filename);
+    exit(EXIT_FAILURE);
+  }
+}
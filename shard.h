@@ -0,0 +1,23 @@
+#ifndef SHARD_HEADER
+#define SHARD_HEADER 1
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* A shard is a horizontal band of rows from a larger image. The rows are numbered top to bottom,
+ * the same order in which they appear in the final PPM. */
+struct ShardInfo {
+  int width;
+  int height;
+  int first_row;
+  int rows;
+};
+
+typedef struct ShardInfo ShardInfo;
+
+void shard_rows_for_index(int, int, int, ShardInfo*);
+void shard_write(char*, ShardInfo*, uint8_t*);
+FILE* shard_open(char*, ShardInfo*);
+void shard_read_row(FILE*, ShardInfo*, uint8_t*);
+
+#endif
@@ -35,6 +35,8 @@ typedef struct Spec SceneNode;
 // static void print_spec(SpecRef);
 // static void print_spec_field(SpecFieldRef);
 static bool spec_declares_kind(SpecRef, char*); 
+static bool write_canonical_spec(FILE*, SpecRef);
+static void write_canonical_field(FILE*, SpecFieldRef);
 //////////////////////////////////////////////////////////////
 
 
@@ -42,7 +44,7 @@ static bool spec_declares_kind(SpecRef, char*);
 SpecFieldRef new_spec_field() {
   SpecField zero_spec_field = {0};
   SpecFieldRef ret = checked_malloc(sizeof(*ret));
-  *ret = zero_spec_field;
+  if(NULL != ret) *ret = zero_spec_field;
   return ret;
 }
 
@@ -90,13 +92,8 @@ void print_spec_field(SpecFieldRef fsr) {
     printf("%f", fsr->scalar_value);
     break;
   case NoFieldKind:
-    fprintf(stderr, "Error: Trying to print unsolidified field spec.\n");
-    exit(EXIT_FAILURE);
-    break;
   default:
-    fprintf(stderr, "Error: Something has gone horribly wrong.\n");
-    fprintf(stderr, "Error: When printing a field spec the default kind case was reached.\n");
-    exit(EXIT_FAILURE);
+    printf("<unsolidified>");
     break;
   }
   printf(",\n");
@@ -104,6 +101,7 @@ void print_spec_field(SpecFieldRef fsr) {
 
 
 void destroy_spec_field(SpecFieldRef f) {
+  if(NULL == f) return;
   free(f->name);
   switch(f->kind) {
   case TypeDecl:
@@ -125,31 +123,31 @@ void destroy_spec_field(SpecFieldRef f) {
 SpecRef new_spec() {
   Spec zero_spec = {0};
   SpecRef ret = checked_malloc(sizeof(*ret));
-  *ret = zero_spec;
+  if(NULL != ret) *ret = zero_spec;
   return ret;
 }
 
 
-void add_spec_field_to_spec(SpecFieldRef f, SpecRef o) {
+/* Returns false without taking ownership of the field if it cannot be added. */
+bool add_spec_field_to_spec(SpecFieldRef f, SpecRef o) {
   if(NULL == o) {
-    fprintf(stderr, "Error: Null ObjectSpecRef passed to add_spec_field_to_spec\n");
-    exit(EXIT_FAILURE);
+    set_error(RC_ERR_INTERNAL, "Null ObjectSpecRef passed to add_spec_field_to_spec");
+    return false;
   }
 
   if(NULL == f) {
-    fprintf(stderr, "Error: Null SpecFieldRef passed to add_spec_field_to_spec\n");
-    exit(EXIT_FAILURE);
+    set_error(RC_ERR_INTERNAL, "Null SpecFieldRef passed to add_spec_field_to_spec");
+    return false;
   }
 
   SpecFieldRef current = o->first_field;
   if(NULL == current) {
     if(0 == strcmp(f->name, "type") && TypeDecl == f->kind) {
       o->first_field = f;
-      return;
+      return true;
     } else {
-      fprintf(stderr, "f->name is %s\n", f->name);
-      print_spec_field(f);
-      report_error_and_exit("The first SpecField added to an ObjectSpec must be named 'type'.");
+      set_error(RC_ERR_PARSE, "The first field of an object must be named 'type' (found '%s')", f->name);
+      return false;
     }
   }
   
@@ -157,6 +155,7 @@ void add_spec_field_to_spec(SpecFieldRef f, SpecRef o) {
     current = current->next;
   }
   current->next = f;
+  return true;
 }
 
 
@@ -165,7 +164,10 @@ void print_spec(SpecRef o) {
   printf("DEBUG: Entering print_spec\n");
 #endif
 
-  if(NULL == o) { report_error_and_exit("Null SpecRef passed to print_spec"); }
+  if(NULL == o) {
+    printf("\tNULL,\n");
+    return;
+  }
 
   printf("\t{\n");
   SpecFieldRef current = o->first_field;
@@ -178,7 +180,7 @@ void print_spec(SpecRef o) {
 
 static bool spec_declares_kind(SpecRef osr, char* kind) {
   if(NULL == osr) {
-    report_error_and_exit("Null SpecRef passed to spec_declares_kind");
+    return false;
   }
 
   if(NULL != osr->first_field) {
@@ -194,13 +196,21 @@ static bool spec_declares_kind(SpecRef osr, char* kind) {
 
 double* next_vector_field_value_with_name(SpecRef osr, char* name) {
   if(NULL == osr) {
-    report_error_and_exit("Null SpecRef passed to next_vector_field_value_with_name");
+    set_error(RC_ERR_INTERNAL, "Null SpecRef passed to next_vector_field_value_with_name");
+    return NULL;
   }
 
-  double* ret = checked_malloc(3 * sizeof(*ret));
   SpecFieldRef current = osr->first_field;
+  if(NULL == current) {
+    return NULL;
+  }
 
-  if(NULL != current && Vector == current->kind && 0 == strcmp(current->name, name)) {
+  double* ret = checked_malloc(3 * sizeof(*ret));
+  if(NULL == ret) {
+    return NULL;
+  }
+
+  if(Vector == current->kind && 0 == strcmp(current->name, name)) {
     ret[0] = current->vector_value[0];
     ret[1] = current->vector_value[1];
     ret[2] = current->vector_value[2];
@@ -223,7 +233,8 @@ double* next_vector_field_value_with_name(SpecRef osr, char* name) {
     prev = current;
     current = current->next;
   }
-  
+
+  free(ret);
   return NULL;
 }
 
@@ -231,7 +242,10 @@ double* next_vector_field_value_with_name(SpecRef osr, char* name) {
 double next_scalar_field_value_with_name(SpecRef osr, char* name) {
   double ret;
   SpecFieldRef current = osr->first_field;
-  if(NULL != current && Scalar == current->kind && 0 == strcmp(current->name, name)) {
+  if(NULL == current) {
+    return NO_SCALAR;
+  }
+  if(Scalar == current->kind && 0 == strcmp(current->name, name)) {
     ret = current->scalar_value;
     osr->first_field = current->next;
     destroy_spec_field(current);
@@ -255,7 +269,29 @@ double next_scalar_field_value_with_name(SpecRef osr, char* name) {
 }
 
 
+/* Returns the string value of the named field, which the caller then owns, or NULL if there is none. */
+char* next_string_field_value_with_name(SpecRef osr, char* name) {
+  SpecFieldRef prev = NULL;
+  for(SpecFieldRef current = osr->first_field; NULL != current; current = current->next) {
+    if(TypeDecl == current->kind && 0 == strcmp(current->name, name)) {
+      char *ret = current->type_str;
+      current->type_str = NULL;
+      if(NULL == prev) {
+	osr->first_field = current->next;
+      } else {
+	prev->next = current->next;
+      }
+      destroy_spec_field(current);
+      return ret;
+    }
+    prev = current;
+  }
+  return NULL;
+}
+
+
 void destroy_spec(SpecRef osr) {
+  if(NULL == osr) return;
   SpecFieldRef temp = osr->first_field;
   SpecFieldRef next = NULL;
   while(NULL != temp) {
@@ -271,12 +307,16 @@ void destroy_spec(SpecRef osr) {
 //////////////////// Scene Functions ////////////////////
 Scene new_scene() {
   SpecRef *ret = checked_malloc(sizeof(*ret));
+  if(NULL != ret) *ret = NULL;
   return (Scene) ret;
 }
 
 
 void add_spec_to_scene(Scene scene, SpecRef osr) {
-  if(NULL == osr) { report_error_and_exit("Null SpecRef passed to add_spec_to_scene"); }
+  if(NULL == osr) {
+    set_error(RC_ERR_INTERNAL, "Null SpecRef passed to add_spec_to_scene");
+    return;
+  }
 
   if(NULL == *scene) {
     *scene = osr;
@@ -291,6 +331,14 @@ void add_spec_to_scene(Scene scene, SpecRef osr) {
 }
 
 
+/* Links osr into a scene straight after prev, which must already be in it, so that a long scene
+ * can be built in order without walking it for every spec added. */
+void add_spec_after(SpecRef prev, SpecRef osr) {
+  osr->next = prev->next;
+  prev->next = osr;
+}
+
+
 SpecRef next_spec_declaring_kind(Scene scene, char *kind) {
   SpecRef current = *scene;
   if(NULL == current) {
@@ -331,7 +379,80 @@ void print_scene(Scene scene) {
 }
 
 
+/* Returns a malloc'd description of the scene that is the same for any two scene files which parse
+ * to the same specs: whitespace, number formatting and the order of the fields within an object
+ * make no difference, though the order of the objects does. Returns NULL if memory runs out. */
+char* scene_canonical_text(Scene scene, size_t *len_out) {
+  char *text = NULL;
+  FILE *out = open_memstream(&text, len_out);
+  if(NULL == out) {
+    set_error(RC_ERR_NO_MEMORY, "Could not allocate memory");
+    return NULL;
+  }
+  bool ok = true;
+  for(SpecRef current = *scene; ok && NULL != current; current = current->next) {
+    ok = write_canonical_spec(out, current);
+  }
+  if(0 != fclose(out) || !ok) {
+    free(text);
+    set_error(RC_ERR_NO_MEMORY, "Could not allocate memory");
+    return NULL;
+  }
+  return text;
+}
+
+
+/* Returns a malloc'd array of the "file" paths of the scene's meshes, which still belong to the
+ * scene, and stores how many there are in count_out. Returns NULL if memory runs out. */
+const char** scene_mesh_files(Scene scene, int *count_out) {
+  int count = 0;
+  for(SpecRef spec = *scene; NULL != spec; spec = spec->next) {
+    if(spec_declares_kind(spec, "mesh")) count++;
+  }
+  const char **paths = checked_malloc(sizeof(*paths) * (count + 1));
+  if(NULL == paths) return NULL;
+  *count_out = 0;
+  for(SpecRef spec = *scene; NULL != spec; spec = spec->next) {
+    if(!spec_declares_kind(spec, "mesh")) continue;
+    for(SpecFieldRef f = spec->first_field; NULL != f; f = f->next) {
+      if(TypeDecl == f->kind && 0 == strcmp(f->name, "file")) {
+	paths[(*count_out)++] = f->type_str;
+	break;
+      }
+    }
+  }
+  return paths;
+}
+
+
+/* Makes each mesh's "file" relative to base_dir, the directory of the scene file, rather than to the
+ * working directory. With no base_dir, as for a scene read from memory, the paths must be absolute.
+ * Returns false if one is not, or if memory runs out. */
+bool resolve_mesh_file_paths(Scene scene, const char *base_dir) {
+  for(SpecRef spec = *scene; NULL != spec; spec = spec->next) {
+    if(!spec_declares_kind(spec, "mesh")) continue;
+    for(SpecFieldRef f = spec->first_field; NULL != f; f = f->next) {
+      if(TypeDecl != f->kind || 0 != strcmp(f->name, "file") || '/' == f->type_str[0]) continue;
+      if(NULL == base_dir) {
+	set_error(RC_ERR_SCENE, "Mesh file \"%s\" must be an absolute path in a scene not read from a file",
+		  f->type_str);
+	return false;
+      }
+      if(0 == strcmp(base_dir, ".")) continue;
+      size_t len = strlen(base_dir) + strlen(f->type_str) + 2;
+      char *path = checked_malloc(len);
+      if(NULL == path) return false;
+      snprintf(path, len, "%s/%s", base_dir, f->type_str);
+      free(f->type_str);
+      f->type_str = path;
+    }
+  }
+  return true;
+}
+
+
 void destroy_scene(Scene scene) {
+  if(NULL == scene) return;
   SpecRef temp = *scene;
   SpecRef next = temp;
   while(NULL != temp) {
@@ -342,3 +463,49 @@ void destroy_scene(Scene scene) {
   free(scene);
 }
 //////////////////////////////////////////////////////////////
+
+
+/* Writes the spec's fields sorted by name. The sort is stable, so repeated names keep their order,
+ * which decides which of them is used. */
+static bool write_canonical_spec(FILE *out, SpecRef spec) {
+  size_t field_count = 0;
+  for(SpecFieldRef f = spec->first_field; NULL != f; f = f->next) field_count++;
+  SpecFieldRef *fields = checked_malloc(sizeof(*fields) * (field_count + 1));
+  if(NULL == fields) return false;
+  size_t i = 0;
+  for(SpecFieldRef f = spec->first_field; NULL != f; f = f->next, i++) {
+    size_t j = i;
+    for(; j > 0 && strcmp(fields[j - 1]->name, f->name) > 0; j--) {
+      fields[j] = fields[j - 1];
+    }
+    fields[j] = f;
+  }
+
+  fputs("{", out);
+  for(i = 0; i < field_count; i++) {
+    write_canonical_field(out, fields[i]);
+  }
+  fputs("}\n", out);
+  free(fields);
+  return true;
+}
+
+
+/* Numbers are written in hexadecimal floating point, which is exact. */
+static void write_canonical_field(FILE *out, SpecFieldRef f) {
+  fprintf(out, "\"%s\":", f->name);
+  switch(f->kind) {
+  case TypeDecl:
+    fprintf(out, "\"%s\";", f->type_str);
+    break;
+  case Vector:
+    fprintf(out, "[%a,%a,%a];", f->vector_value[0], f->vector_value[1], f->vector_value[2]);
+    break;
+  case Scalar:
+    fprintf(out, "%a;", f->scalar_value);
+    break;
+  case NoFieldKind:
+    fputs("?;", out);
+    break;
+  }
+}
@@ -2,7 +2,11 @@
 #define SCENE_SPEC_HEADER 1
 
 #include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
 #define MAX_SPEC_STR_LEN 16
+// String values, such as a mesh's file path, may be longer than names
+#define MAX_SPEC_VALUE_LEN 4096
 #define NO_SCALAR -INFINITY
 
 //////////////////// Structs and Typedefs ////////////////////
@@ -21,17 +25,22 @@ void print_spec_field(SpecFieldRef);
 void destroy_spec_field(SpecFieldRef);
 
 SpecRef new_spec(void);
-void add_spec_field_to_spec(SpecFieldRef, SpecRef);
+bool add_spec_field_to_spec(SpecFieldRef, SpecRef);
 double* next_vector_field_value_with_name(SpecRef, char*);
 double next_scalar_field_value_with_name(SpecRef, char*);
+char* next_string_field_value_with_name(SpecRef, char*);
 void print_spec(SpecRef);
 void destroy_spec(SpecRef);
 
 
 Scene new_scene(void);
 void add_spec_to_scene(Scene, SpecRef);
+void add_spec_after(SpecRef, SpecRef);
 SpecRef next_spec_declaring_kind(Scene, char*);
 void print_scene(Scene);
+char* scene_canonical_text(Scene, size_t*);
+bool resolve_mesh_file_paths(Scene, const char*);
+const char** scene_mesh_files(Scene, int*);
 void destroy_scene(Scene);
 SpecRef next_spec_declaring_kind(Scene, char*);
 #endif
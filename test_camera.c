@@ -3,10 +3,19 @@
 #include "parser.h"
 #include "spec.h"
 #include "camera.h"
+#include "util.h"
 
-int main(int argc, char* argv[]) {
-  Scene scene = parse_scene_from_file("test_data/inputs/sphere_and_plane.json");
+int main(void) {
+  Scene scene = parse_scene_from_file("test_data/sphere_and_plane.json");
+  if(NULL == scene) {
+    fprintf(stderr, "Error: %s\n", last_error_message());
+    exit(EXIT_FAILURE);
+  }
   CameraRef camera = get_camera_from_scene(scene);
+  if(NULL == camera) {
+    fprintf(stderr, "Error: %s\n", last_error_message());
+    exit(EXIT_FAILURE);
+  }
   print_camera(camera);
   exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include "libraycast.h"
+
+#define WIDTH 32
+#define HEIGHT 24
+// Threads rendering on one renderer at once
+#define SHARING_THREADS 4
+
+/* Exercises the public interface the way an embedding program would: every failure must come back
+ * as a status and a message, with the process still running to see it. Exits with failure if any
+ * check does not hold. */
+
+static void expect_load_failure(const char*, const char*, int);
+static void test_load_failures(void);
+static void test_render_into_buffer(void);
+static void test_shared_renderer(void);
+static void* render_shared(void*);
+static void check(bool, const char*);
+
+/* One thread's render on a renderer shared with others. */
+struct SharedRender {
+  RcRenderer *renderer;
+  RcScene *scene;
+  int status;
+  uint8_t rgb[WIDTH * HEIGHT * 3];
+};
+
+typedef struct SharedRender SharedRender;
+
+static int failures = 0;
+
+int main(void) {
+  test_load_failures();
+  test_render_into_buffer();
+  test_shared_renderer();
+  if(0 != failures) {
+    printf("%d checks failed\n", failures);
+    exit(EXIT_FAILURE);
+  }
+  printf("All checks passed\n");
+  exit(EXIT_SUCCESS);
+}
+
+
+static void expect_load_failure(const char *what, const char *json, int status) {
+  RcScene *scene = NULL;
+  int got = rc_scene_load_buffer(json, strlen(json), &scene);
+  printf("%s -> %s: %s\n", what, rc_status_string(got), rc_last_error());
+  check(status == got, what);
+  check('\0' != rc_last_error()[0], "a failed load leaves a message");
+  rc_scene_free(scene);
+}
+
+
+static void test_load_failures(void) {
+  expect_load_failure("unterminated object list", "[{\"type\": \"camera\", \"width\": 1, \"height\": 1}",
+		      RC_ERR_PARSE);
+  expect_load_failure("not JSON", "camera", RC_ERR_PARSE);
+  expect_load_failure("sphere without a radius", "[{\"type\": \"camera\", \"width\": 1, \"height\": 1},"
+		      "{\"type\": \"sphere\", \"position\": [0, 0, 5], \"diffuse_color\": [1, 1, 1]}]", RC_ERR_SCENE);
+  expect_load_failure("relative mesh path in a buffer", "[{\"type\": \"camera\", \"width\": 1, \"height\": 1},"
+		      "{\"type\": \"mesh\", \"file\": \"cube.obj\", \"diffuse_color\": [1, 1, 1]}]", RC_ERR_SCENE);
+
+  RcScene *scene = NULL;
+  int got = rc_scene_load_file("test_data/no_such_scene.json", &scene);
+  printf("missing file -> %s: %s\n", rc_status_string(got), rc_last_error());
+  check(RC_ERR_IO == got, "missing file");
+  got = rc_scene_load_buffer(NULL, 0, &scene);
+  check(RC_ERR_ARGUMENT == got, "NULL buffer");
+}
+
+
+/* The same image must come out with and without a renderer, and when rendered a band of rows at a
+ * time. */
+static void test_render_into_buffer(void) {
+  RcScene *scene = NULL;
+  RcRenderer *renderer = NULL;
+  check(RC_OK == rc_scene_load_file("test_data/sphere_and_plane.json", &scene), "load a scene file");
+  check(RC_OK == rc_renderer_new(3, &renderer), "create a renderer");
+  if(NULL == scene || NULL == renderer) {
+    printf("Cannot render: %s\n", rc_last_error());
+    rc_scene_free(scene);
+    rc_renderer_free(renderer);
+    return;
+  }
+
+  static uint8_t pooled[WIDTH * HEIGHT * 3];
+  static uint8_t alone[WIDTH * HEIGHT * 3];
+  static uint8_t banded[WIDTH * HEIGHT * 3];
+  check(RC_OK == rc_render(renderer, scene, WIDTH, HEIGHT, pooled, sizeof(pooled)), "render with a renderer");
+  check(RC_OK == rc_render(NULL, scene, WIDTH, HEIGHT, alone, sizeof(alone)), "render without a renderer");
+  check(RC_OK == rc_render_rows(renderer, scene, WIDTH, HEIGHT, 0, 10, banded, sizeof(banded)), "render rows");
+  check(RC_OK == rc_render_rows(renderer, scene, WIDTH, HEIGHT, 10, HEIGHT - 10, banded + WIDTH * 10 * 3,
+				sizeof(banded) - WIDTH * 10 * 3), "render the remaining rows");
+  check(0 == memcmp(pooled, alone, sizeof(pooled)), "renders with and without a renderer match");
+  check(0 == memcmp(pooled, banded, sizeof(pooled)), "renders whole and in bands match");
+
+  bool lit = false;
+  for(size_t i = 0; i < sizeof(pooled); i++) {
+    if(0 != pooled[i]) lit = true;
+  }
+  check(lit, "the image is not black");
+
+  int got = rc_render(renderer, scene, WIDTH, HEIGHT, pooled, sizeof(pooled) - 1);
+  printf("short buffer -> %s: %s\n", rc_status_string(got), rc_last_error());
+  check(RC_ERR_ARGUMENT == got, "short buffer");
+  check(RC_ERR_ARGUMENT == rc_render(renderer, scene, 0, HEIGHT, pooled, sizeof(pooled)), "zero width");
+  check(RC_ERR_ARGUMENT == rc_render(renderer, NULL, WIDTH, HEIGHT, pooled, sizeof(pooled)), "NULL scene");
+
+  rc_renderer_free(renderer);
+  rc_scene_free(scene);
+}
+
+
+/* Renders from several threads on the same renderer must take turns rather than trample on each
+ * other, and so all come out the same. */
+static void test_shared_renderer(void) {
+  RcScene *scene = NULL;
+  RcRenderer *renderer = NULL;
+  check(RC_OK == rc_scene_load_file("test_data/reflect.json", &scene), "load a scene file to share");
+  check(RC_OK == rc_renderer_new(2, &renderer), "create a renderer to share");
+  static SharedRender renders[SHARING_THREADS];
+  pthread_t threads[SHARING_THREADS];
+  int started = 0;
+  for(; NULL != scene && NULL != renderer && started < SHARING_THREADS; started++) {
+    renders[started].renderer = renderer;
+    renders[started].scene = scene;
+    if(0 != pthread_create(&threads[started], NULL, render_shared, &renders[started])) break;
+  }
+  for(int t = 0; t < started; t++) {
+    pthread_join(threads[t], NULL);
+    check(RC_OK == renders[t].status, "render on a shared renderer");
+    check(0 == memcmp(renders[0].rgb, renders[t].rgb, sizeof(renders[t].rgb)), "renders on a shared renderer match");
+  }
+  check(SHARING_THREADS == started, "start the sharing threads");
+  rc_renderer_free(renderer);
+  rc_scene_free(scene);
+}
+
+
+static void* render_shared(void *arg) {
+  SharedRender *render = arg;
+  render->status = rc_render(render->renderer, render->scene, WIDTH, HEIGHT, render->rgb, sizeof(render->rgb));
+  return NULL;
+}
+
+
+static void check(bool holds, const char *what) {
+  if(holds) return;
+  printf("FAILED: %s\n", what);
+  failures++;
+}
@@ -3,10 +3,19 @@
 #include "spec.h"
 #include "parser.h"
 #include "light.h"
+#include "util.h"
 
-int main(int argc, char* argv[]) {
-  Scene scene = parse_scene_from_file("test_data/inputs/sphere_and_plane_and_light.json");
+int main(void) {
+  Scene scene = parse_scene_from_file("test_data/sphere_and_plane.json");
+  if(NULL == scene) {
+    fprintf(stderr, "Error: %s\n", last_error_message());
+    exit(EXIT_FAILURE);
+  }
   LightRef *lights = get_lights_from_scene(scene);
+  if(NULL == lights) {
+    fprintf(stderr, "Error: %s\n", last_error_message());
+    exit(EXIT_FAILURE);
+  }
   print_lights(lights);
   exit(EXIT_SUCCESS);
 }
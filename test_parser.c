@@ -2,9 +2,14 @@
 #include <stdlib.h>
 #include "spec.h"
 #include "parser.h"
+#include "util.h"
 
-int main(int argc, char* argv[]) {
-  Scene scene = parse_scene_from_file("test_data/inputs/sphere_and_plane.json");
+int main(void) {
+  Scene scene = parse_scene_from_file("test_data/sphere_and_plane.json");
+  if(NULL == scene) {
+    fprintf(stderr, "Error: %s\n", last_error_message());
+    exit(EXIT_FAILURE);
+  }
   print_scene(scene);
   exit(EXIT_SUCCESS);
   return 0;
@@ -25,7 +25,7 @@ void test_in_place_normalize() {
 }
 
 
-int main(int argc, char* argv[]) {
+int main(void) {
   test_in_place_add();
   test_in_place_normalize();
   exit(EXIT_SUCCESS);
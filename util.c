@@ -1,18 +1,124 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
 #include "util.h"
 
+#define MAX_ERROR_MESSAGE_LEN 512
+
+// The first error recorded since the last clear_error() on each thread. Later errors are usually
+// consequences of the first, so they are not allowed to overwrite it.
+static _Thread_local int error_status = RC_OK;
+static _Thread_local char error_message[MAX_ERROR_MESSAGE_LEN];
+
 void secret_DEBUG_LOG(char *message) {
   fprintf(stderr, "DEBUG: %s\n", message);
 }
 
 void* checked_malloc(size_t size) {
   void* ret = malloc(size);
-  if(NULL == ret && size != 0) { report_error_and_exit("NULL result from malloc on non-zero input"); }
+  if(NULL == ret && size != 0) { set_error(RC_ERR_NO_MEMORY, "NULL result from malloc on non-zero input"); }
   return ret;
 }
 
-void report_error_and_exit(char *error_msg) {
+/* Only for the command line tools; library code reports errors with set_error() instead. */
+void report_error_and_exit(const char *error_msg) {
   fprintf(stderr, "Error: %s\n", error_msg);
   exit(EXIT_FAILURE);
 }
+
+/* Records an error for the calling thread unless one is already recorded. Returns the status so
+ * that callers can `return set_error(...)`. */
+int set_error(int status, const char *format, ...) {
+  if(RC_OK == error_status) {
+    error_status = status;
+    va_list args;
+    va_start(args, format);
+    vsnprintf(error_message, sizeof(error_message), format, args);
+    va_end(args);
+  }
+  return status;
+}
+
+bool error_occurred() {
+  return RC_OK != error_status;
+}
+
+int last_error_status() {
+  return error_status;
+}
+
+const char* last_error_message() {
+  return RC_OK == error_status ? "No error" : error_message;
+}
+
+void clear_error() {
+  error_status = RC_OK;
+  error_message[0] = '\0';
+}
+
+/* Reads the whole file into a freshly allocated buffer and stores its length in len_out. Returns
+ * NULL if the file cannot be read. */
+char* read_whole_file(char *filename, size_t *len_out) {
+  FILE *file = fopen(filename, "rb");
+  if(NULL == file) {
+    set_error(RC_ERR_IO, "Could not open file \"%s\"", filename);
+    return NULL;
+  }
+
+  size_t capacity = 4096;
+  size_t len = 0;
+  char *buf = checked_malloc(capacity);
+  size_t got;
+  while(NULL != buf && 0 < (got = fread(buf + len, 1, capacity - len, file))) {
+    len += got;
+    if(len == capacity) {
+      capacity *= 2;
+      char *grown = realloc(buf, capacity);
+      if(NULL == grown) {
+	set_error(RC_ERR_NO_MEMORY, "NULL result from realloc on non-zero input");
+	free(buf);
+      }
+      buf = grown;
+    }
+  }
+  if(NULL != buf && ferror(file)) {
+    set_error(RC_ERR_IO, "Could not read file \"%s\"", filename);
+    free(buf);
+    buf = NULL;
+  }
+  fclose(file);
+
+  *len_out = len;
+  return buf;
+}
+
+/* 64-bit FNV-1a */
+uint64_t hash_bytes(const void *data, size_t len) {
+  const unsigned char *bytes = data;
+  uint64_t hash = 14695981039346656037ULL;
+  for(size_t i = 0; i < len; i++) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+
+/* True if the output path holds exactly one conversion of the form %d or %0<width>d. */
+bool path_has_frame_number(const char *output_path) {
+  const char *percent = strchr(output_path, '%');
+  if(NULL == percent || NULL != strchr(percent + 1, '%')) return false;
+  const char *c = percent + 1;
+  while(isdigit((unsigned char) *c)) c++;
+  return 'd' == *c;
+}
+
+
+/* Milliseconds on the monotonic clock since start, which was taken from it. */
+double elapsed_ms(struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
@@ -1,3 +1,6 @@
+#ifndef UTIL_HEADER
+#define UTIL_HEADER 1
+
 #ifdef DEBUG
     void secret_DEBUG_LOG(char *);
     #define DEBUG_LOG(msg) secret_DEBUG_LOG(msg)
@@ -5,6 +8,22 @@
     #define DEBUG_LOG(ignore) ((void) 0)
 #endif
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "libraycast.h"
 
 void* checked_malloc(size_t);
-void report_error_and_exit(char*);
+void report_error_and_exit(const char*);
+int set_error(int, const char*, ...);
+bool error_occurred(void);
+int last_error_status(void);
+const char* last_error_message(void);
+void clear_error(void);
+char* read_whole_file(char*, size_t*);
+uint64_t hash_bytes(const void*, size_t);
+bool path_has_frame_number(const char*);
+double elapsed_ms(struct timespec*);
+
+#endif
@@ -0,0 +1,241 @@
+#ifndef VEC4_HEADER
+#define VEC4_HEADER 1
+
+#include <math.h>
+#include "vecmath.h"
+
+/* Three-component vectors passed and returned by value, padded to four lanes so that they fill SIMD
+ * registers: one AVX register, two SSE2 registers, or a plain array where neither is available.
+ * Everything here is static inline, so the vectors stay in registers across calls. The fourth lane
+ * is always 0.
+ *
+ * Each function does the same IEEE operations, in the same order, as the matching vecmath.h
+ * function, so moving code from one to the other never changes a result: dot products add x, y and
+ * z from left to right, and normalizing multiplies by the reciprocal of the length. */
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define V4_INSTRUCTION_SET "AVX"
+
+typedef __m256d Vec4;
+
+static inline Vec4 v4_make(double x, double y, double z) {
+  return _mm256_set_pd(0.0, z, y, x);
+}
+
+static inline double v4_x(Vec4 v) {
+  return _mm256_cvtsd_f64(v);
+}
+
+static inline double v4_y(Vec4 v) {
+  __m128d xy = _mm256_castpd256_pd128(v);
+  return _mm_cvtsd_f64(_mm_unpackhi_pd(xy, xy));
+}
+
+static inline double v4_z(Vec4 v) {
+  return _mm_cvtsd_f64(_mm256_extractf128_pd(v, 1));
+}
+
+static inline void v4_store(Vec4 v, double *out) {
+  _mm_storeu_pd(out, _mm256_castpd256_pd128(v));
+  _mm_store_sd(out + 2, _mm256_extractf128_pd(v, 1));
+}
+
+static inline Vec4 v4_add(Vec4 a, Vec4 b) {
+  return _mm256_add_pd(a, b);
+}
+
+static inline Vec4 v4_sub(Vec4 a, Vec4 b) {
+  return _mm256_sub_pd(a, b);
+}
+
+static inline Vec4 v4_mul(Vec4 a, Vec4 b) {
+  return _mm256_mul_pd(a, b);
+}
+
+static inline Vec4 v4_scale(Vec4 a, double s) {
+  return _mm256_mul_pd(_mm256_set1_pd(s), a);
+}
+
+static inline double v4_dot(Vec4 a, Vec4 b) {
+  Vec4 products = _mm256_mul_pd(a, b);
+  return (v4_x(products) + v4_y(products)) + v4_z(products);
+}
+
+// (y, z, x) and (z, x, y), built from in-lane shuffles of the vector and its halves swapped
+static inline Vec4 v4_cross(Vec4 a, Vec4 b) {
+  Vec4 a_swapped = _mm256_permute2f128_pd(a, a, 0x01);
+  Vec4 b_swapped = _mm256_permute2f128_pd(b, b, 0x01);
+  Vec4 a_yzx = _mm256_permute_pd(_mm256_shuffle_pd(a, a_swapped, 0x5), 0x6);
+  Vec4 b_yzx = _mm256_permute_pd(_mm256_shuffle_pd(b, b_swapped, 0x5), 0x6);
+  Vec4 a_zxy = _mm256_shuffle_pd(a_swapped, a, 0xc);
+  Vec4 b_zxy = _mm256_shuffle_pd(b_swapped, b, 0xc);
+  return _mm256_sub_pd(_mm256_mul_pd(a_yzx, b_zxy), _mm256_mul_pd(a_zxy, b_yzx));
+}
+
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define V4_INSTRUCTION_SET "SSE2"
+
+typedef struct Vec4 {
+  __m128d xy;
+  __m128d zw;
+} Vec4;
+
+static inline Vec4 v4_make(double x, double y, double z) {
+  Vec4 v = {_mm_set_pd(y, x), _mm_set_sd(z)};
+  return v;
+}
+
+static inline double v4_x(Vec4 v) {
+  return _mm_cvtsd_f64(v.xy);
+}
+
+static inline double v4_y(Vec4 v) {
+  return _mm_cvtsd_f64(_mm_unpackhi_pd(v.xy, v.xy));
+}
+
+static inline double v4_z(Vec4 v) {
+  return _mm_cvtsd_f64(v.zw);
+}
+
+static inline void v4_store(Vec4 v, double *out) {
+  _mm_storeu_pd(out, v.xy);
+  _mm_store_sd(out + 2, v.zw);
+}
+
+static inline Vec4 v4_add(Vec4 a, Vec4 b) {
+  Vec4 v = {_mm_add_pd(a.xy, b.xy), _mm_add_pd(a.zw, b.zw)};
+  return v;
+}
+
+static inline Vec4 v4_sub(Vec4 a, Vec4 b) {
+  Vec4 v = {_mm_sub_pd(a.xy, b.xy), _mm_sub_pd(a.zw, b.zw)};
+  return v;
+}
+
+static inline Vec4 v4_mul(Vec4 a, Vec4 b) {
+  Vec4 v = {_mm_mul_pd(a.xy, b.xy), _mm_mul_pd(a.zw, b.zw)};
+  return v;
+}
+
+static inline Vec4 v4_scale(Vec4 a, double s) {
+  __m128d ss = _mm_set1_pd(s);
+  Vec4 v = {_mm_mul_pd(ss, a.xy), _mm_mul_pd(ss, a.zw)};
+  return v;
+}
+
+static inline double v4_dot(Vec4 a, Vec4 b) {
+  Vec4 products = v4_mul(a, b);
+  return (v4_x(products) + v4_y(products)) + v4_z(products);
+}
+
+static inline Vec4 v4_cross(Vec4 a, Vec4 b) {
+  __m128d zero = _mm_setzero_pd();
+  Vec4 a_yzx = {_mm_shuffle_pd(a.xy, a.zw, 1), _mm_unpacklo_pd(a.xy, zero)};
+  Vec4 b_yzx = {_mm_shuffle_pd(b.xy, b.zw, 1), _mm_unpacklo_pd(b.xy, zero)};
+  Vec4 a_zxy = {_mm_unpacklo_pd(a.zw, a.xy), _mm_unpackhi_pd(a.xy, zero)};
+  Vec4 b_zxy = {_mm_unpacklo_pd(b.zw, b.xy), _mm_unpackhi_pd(b.xy, zero)};
+  return v4_sub(v4_mul(a_yzx, b_zxy), v4_mul(a_zxy, b_yzx));
+}
+
+#else
+#define V4_INSTRUCTION_SET "none"
+
+typedef struct Vec4 {
+  double lane[4];
+} Vec4;
+
+static inline Vec4 v4_make(double x, double y, double z) {
+  Vec4 v = {{x, y, z, 0.0}};
+  return v;
+}
+
+static inline double v4_x(Vec4 v) {
+  return v.lane[X];
+}
+
+static inline double v4_y(Vec4 v) {
+  return v.lane[Y];
+}
+
+static inline double v4_z(Vec4 v) {
+  return v.lane[Z];
+}
+
+static inline void v4_store(Vec4 v, double *out) {
+  out[X] = v.lane[X];
+  out[Y] = v.lane[Y];
+  out[Z] = v.lane[Z];
+}
+
+static inline Vec4 v4_add(Vec4 a, Vec4 b) {
+  Vec4 v = {{a.lane[0] + b.lane[0], a.lane[1] + b.lane[1], a.lane[2] + b.lane[2], 0.0}};
+  return v;
+}
+
+static inline Vec4 v4_sub(Vec4 a, Vec4 b) {
+  Vec4 v = {{a.lane[0] - b.lane[0], a.lane[1] - b.lane[1], a.lane[2] - b.lane[2], 0.0}};
+  return v;
+}
+
+static inline Vec4 v4_mul(Vec4 a, Vec4 b) {
+  Vec4 v = {{a.lane[0] * b.lane[0], a.lane[1] * b.lane[1], a.lane[2] * b.lane[2], 0.0}};
+  return v;
+}
+
+static inline Vec4 v4_scale(Vec4 a, double s) {
+  Vec4 v = {{s * a.lane[0], s * a.lane[1], s * a.lane[2], 0.0}};
+  return v;
+}
+
+static inline double v4_dot(Vec4 a, Vec4 b) {
+  return (a.lane[X]*b.lane[X]) + (a.lane[Y]*b.lane[Y]) + (a.lane[Z]*b.lane[Z]);
+}
+
+static inline Vec4 v4_cross(Vec4 a, Vec4 b) {
+  return v4_make(a.lane[Y]*b.lane[Z] - a.lane[Z]*b.lane[Y], a.lane[Z]*b.lane[X] - a.lane[X]*b.lane[Z],
+		 a.lane[X]*b.lane[Y] - a.lane[Y]*b.lane[X]);
+}
+
+#endif
+
+/* The rest is built on the functions above and is the same for every instruction set. */
+
+static inline Vec4 v4_load(const double *p) {
+  return v4_make(p[X], p[Y], p[Z]);
+}
+
+/* Exactly 1 / sqrt(x), on purpose. The approximate _mm_rsqrt_ps, even with a Newton step, is
+ * off in the last bits, and normalizing with it would change every image from the samples. */
+static inline double v4_rsqrt(double x) {
+  return 1.0 / sqrt(x);
+}
+
+static inline double v4_length(Vec4 a) {
+  return sqrt(v4_dot(a, a));
+}
+
+static inline double v4_distance(Vec4 a, Vec4 b) {
+  return v4_length(v4_sub(a, b));
+}
+
+static inline Vec4 v4_normalize(Vec4 a) {
+  return v4_scale(a, v4_rsqrt(v4_dot(a, a)));
+}
+
+/* a reflected about the surface with normal n. */
+static inline Vec4 v4_reflect(Vec4 a, Vec4 n) {
+  return v4_sub(a, v4_scale(n, 2 * v4_dot(n, a)));
+}
+
+/* The point t along the ray from origin in direction dir. */
+static inline Vec4 v4_ray_point(Vec4 origin, Vec4 dir, double t) {
+  return v4_add(origin, v4_scale(dir, t));
+}
+
+static inline Vec4 v4_ray_at(RayRef r, double t) {
+  return v4_ray_point(v4_load(r->origin), v4_load(r->dir), t);
+}
+
+#endif
@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include "views.h"
+#include "parser.h"
+#include "spec.h"
+#include "camera.h"
+#include "object.h"
+#include "light.h"
+#include "raycast.h"
+#include "workpool.h"
+#include "pixelbuf.h"
+#include "ppmwrite.h"
+#include "util.h"
+
+#define MAX_OUTPUT_PATH_LEN 4096
+
+static bool load_views(char*, CameraRef**, ObjectRef**, LightRef**);
+static bool write_view(ViewsRequest*, int, int, uint8_t*);
+
+/* Returns EXIT_FAILURE after reporting the first failure. */
+int run_views(ViewsRequest *req) {
+  clear_error();
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  CameraRef *cameras = NULL;
+  ObjectRef *objects = NULL;
+  LightRef *lights = NULL;
+  RenderScene *scenes = NULL;
+  RenderJob *jobs = NULL;
+  PixelBufRef *pixel_bufs = NULL;
+  uint8_t *byte_buf = NULL;
+  WorkPoolRef pool = NULL;
+  int view_count = 0;
+  size_t view_bytes = (size_t) req->width * req->height * 3;
+
+  bool ok = load_views(req->scene_path, &cameras, &objects, &lights);
+  while(ok && NULL != cameras[view_count]) view_count++;
+  if(ok && view_count > 1 && !path_has_frame_number(req->output_path)) {
+    set_error(RC_ERR_ARGUMENT, "The output path needs one frame number conversion, such as %%02d");
+    ok = false;
+  }
+  if(ok) {
+    scenes = checked_malloc(sizeof(*scenes) * view_count);
+    jobs = checked_malloc(sizeof(*jobs) * view_count);
+    pixel_bufs = checked_malloc(sizeof(*pixel_bufs) * view_count);
+    for(int v = 0; NULL != pixel_bufs && v < view_count; v++) {
+      pixel_bufs[v] = NULL;
+    }
+    byte_buf = checked_malloc(view_bytes * view_count);
+    pool = new_work_pool(req->thread_count);
+    ok = NULL != scenes && NULL != jobs && NULL != pixel_bufs && NULL != byte_buf && NULL != pool;
+  }
+  for(int v = 0; ok && v < view_count; v++) {
+    RenderScene scene = {cameras[v], objects, lights};
+    RenderJob job = {.scene = &scenes[v], .width = req->width, .height = req->height, .rows = req->height};
+    scenes[v] = scene;
+    jobs[v] = job;
+    pixel_bufs[v] = new_pixel_buf_over(&byte_buf[view_bytes * v], req->width, req->height);
+    ok = NULL != pixel_bufs[v];
+  }
+  double load_ms = elapsed_ms(&start);
+
+  if(ok) {
+    ok = raycast_views(jobs, view_count, pool, pixel_bufs);
+  }
+  for(int v = 0; ok && v < view_count; v++) {
+    ok = write_view(req, view_count, v, &byte_buf[view_bytes * v]);
+  }
+  if(ok) {
+    fprintf(stderr, "NOTICE: Rendered %d views in %.3f ms, %.3f ms of it loading the scene\n", view_count,
+	    elapsed_ms(&start), load_ms);
+  }
+
+  if(!ok) fprintf(stderr, "Error: %s\n", last_error_message());
+  for(int v = 0; NULL != pixel_bufs && v < view_count; v++) {
+    destroy_pixel_buf(pixel_bufs[v]);
+  }
+  destroy_work_pool(pool);
+  free(byte_buf);
+  free(pixel_bufs);
+  free(jobs);
+  free(scenes);
+  if(NULL != lights) destroy_lights(lights);
+  if(NULL != objects) destroy_objects(objects);
+  if(NULL != cameras) destroy_cameras(cameras);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+/* Fills in the scene's views, objects and lights, or leaves NULL whatever could not be loaded. */
+static bool load_views(char *scene_path, CameraRef **cameras, ObjectRef **objects, LightRef **lights) {
+  Scene scene = parse_scene_from_file(scene_path);
+  if(NULL == scene) return false;
+  *cameras = get_cameras_from_scene(scene);
+  *objects = NULL == *cameras ? NULL : get_objects_from_scene(scene);
+  *lights = NULL == *objects ? NULL : get_lights_from_scene(scene);
+  destroy_scene(scene);
+  return NULL != *lights;
+}
+
+
+static bool write_view(ViewsRequest *req, int view_count, int index, uint8_t *byte_buf) {
+  if(1 == view_count && !path_has_frame_number(req->output_path)) {
+    return ppm_write(req->output_path, '3', byte_buf, req->width, req->height);
+  }
+  char path[MAX_OUTPUT_PATH_LEN];
+  if((int) sizeof(path) <= snprintf(path, sizeof(path), req->output_path, index)) {
+    set_error(RC_ERR_ARGUMENT, "The output path is too long");
+    return false;
+  }
+  return ppm_write(path, '3', byte_buf, req->width, req->height);
+}
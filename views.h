@@ -0,0 +1,20 @@
+#ifndef VIEWS_HEADER
+#define VIEWS_HEADER 1
+
+/* Renders every view that the scene's cameras call for, stereo pairs and cubemap faces included, in
+ * one pass: the objects and lights are loaded once, and the rows of all the views share one pool of
+ * threads. View i is written to the output path with i in place of its frame number conversion, such
+ * as %02d, which a scene with a single view may leave out. */
+struct ViewsRequest {
+  char *scene_path;
+  char *output_path;
+  int width;
+  int height;
+  int thread_count;
+};
+
+typedef struct ViewsRequest ViewsRequest;
+
+int run_views(ViewsRequest*);
+
+#endif
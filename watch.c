@@ -0,0 +1,264 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include "watch.h"
+#include "parser.h"
+#include "spec.h"
+#include "camera.h"
+#include "object.h"
+#include "light.h"
+#include "raycast.h"
+#include "workpool.h"
+#include "pixelbuf.h"
+#include "ppmwrite.h"
+#include "util.h"
+
+#define EVENT_BUF_LEN (64 * (sizeof(struct inotify_event) + 256))
+
+/* A file followed through a watch on its directory. */
+struct WatchedFile {
+  int wd;
+  char *name;
+};
+
+typedef struct WatchedFile WatchedFile;
+
+/* Everything kept from one render to the next. The scene file and every mesh file any version of
+ * the scene has named are watched. */
+struct WatchState {
+  WatchRequest *req;
+  int inotify_fd;
+  WatchedFile *watched;
+  int watched_count;
+  WorkPoolRef pool;
+  uint8_t *byte_buf;
+  PixelBufRef pixel_buf;
+  RenderSceneRef scene;
+  TouchBufferRef touches;
+  bool *dirty;
+  bool *material_changed;
+  bool *geometry_changed;
+};
+
+typedef struct WatchState WatchState;
+typedef struct WatchState* WatchStateRef;
+
+static bool watch_file(WatchStateRef, const char*);
+static bool wait_for_change(WatchStateRef);
+static void render_scene_version(WatchStateRef);
+static RenderSceneRef load_scene(WatchStateRef);
+static bool needs_full_render(RenderSceneRef, RenderSceneRef);
+static int count_objects(ObjectRef*);
+static bool prepare_full_render(WatchStateRef, int);
+
+/* Runs until the process is killed. Returns EXIT_FAILURE only if watching cannot begin. */
+int run_watch(WatchRequest *req) {
+  WatchState state = {0};
+  state.req = req;
+  state.pool = new_work_pool(req->thread_count);
+  state.byte_buf = checked_malloc((size_t) req->width * req->height * 3);
+  state.pixel_buf = NULL == state.byte_buf ? NULL : new_pixel_buf_over(state.byte_buf, req->width, req->height);
+  state.dirty = checked_malloc(sizeof(*(state.dirty)) * req->width * req->height);
+  state.inotify_fd = -1;
+  if(NULL != state.pool && NULL != state.pixel_buf && NULL != state.dirty) {
+    state.inotify_fd = inotify_init();
+    if(state.inotify_fd < 0) set_error(RC_ERR_IO, "Could not watch \"%s\" for changes", req->scene_path);
+  }
+  if(state.inotify_fd < 0 || !watch_file(&state, req->scene_path)) {
+    fprintf(stderr, "Error: %s\n", last_error_message());
+    return EXIT_FAILURE;
+  }
+
+  fprintf(stderr, "NOTICE: Watching %s\n", req->scene_path);
+  render_scene_version(&state);
+  while(wait_for_change(&state)) {
+    render_scene_version(&state);
+  }
+
+  fprintf(stderr, "Error: Could not read file change events\n");
+  close(state.inotify_fd);
+  for(int w = 0; w < state.watched_count; w++) {
+    free(state.watched[w].name);
+  }
+  free(state.watched);
+  free(state.material_changed);
+  free(state.geometry_changed);
+  free(state.dirty);
+  destroy_touch_buffer(state.touches);
+  destroy_render_scene(state.scene);
+  destroy_pixel_buf(state.pixel_buf);
+  free(state.byte_buf);
+  destroy_work_pool(state.pool);
+  return EXIT_FAILURE;
+}
+
+
+/* Watches the file's directory rather than the file, so that editors which save by replacing the
+ * file are followed too. Watching a file twice is harmless. */
+static bool watch_file(WatchStateRef state, const char *path) {
+  char *dir_copy = strdup(path);
+  char *file_copy = strdup(path);
+  WatchedFile *watched = realloc(state->watched, sizeof(*watched) * (state->watched_count + 1));
+  if(NULL != watched) state->watched = watched;
+  char *name = NULL == file_copy ? NULL : strdup(basename(file_copy));
+  if(NULL == dir_copy || NULL == name || NULL == watched) {
+    free(dir_copy);
+    free(file_copy);
+    free(name);
+    set_error(RC_ERR_NO_MEMORY, "Could not allocate memory");
+    return false;
+  }
+  free(file_copy);
+
+  int wd = inotify_add_watch(state->inotify_fd, dirname(dir_copy), IN_CLOSE_WRITE | IN_MOVED_TO);
+  free(dir_copy);
+  if(wd < 0) {
+    free(name);
+    set_error(RC_ERR_IO, "Could not watch \"%s\" for changes", path);
+    return false;
+  }
+  for(int w = 0; w < state->watched_count; w++) {
+    if(wd == watched[w].wd && 0 == strcmp(name, watched[w].name)) {
+      free(name);
+      return true;
+    }
+  }
+  watched[state->watched_count].wd = wd;
+  watched[state->watched_count++].name = name;
+  return true;
+}
+
+
+/* Blocks until one of the watched files has been written or replaced. Returns false if the events
+ * cannot be read. */
+static bool wait_for_change(WatchStateRef state) {
+  _Alignas(struct inotify_event) char buf[EVENT_BUF_LEN];
+  for(;;) {
+    ssize_t len = read(state->inotify_fd, buf, sizeof(buf));
+    if(len <= 0) return false;
+    bool changed = false;
+    for(char *p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event*) p)->len) {
+      struct inotify_event *event = (struct inotify_event*) p;
+      for(int w = 0; event->len > 0 && w < state->watched_count; w++) {
+	if(event->wd == state->watched[w].wd && 0 == strcmp(event->name, state->watched[w].name)) changed = true;
+      }
+    }
+    if(changed) return true;
+  }
+}
+
+
+static void render_scene_version(WatchStateRef state) {
+  WatchRequest *req = state->req;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  clear_error();
+  RenderSceneRef scene = load_scene(state);
+  if(NULL == scene) {
+    fprintf(stderr, "Error: %s\n", last_error_message());
+    return;
+  }
+
+  int object_count = count_objects(scene->objects);
+  int pixel_count = req->width * req->height;
+  RenderJob job = {.scene = scene, .width = req->width, .height = req->height, .rows = req->height};
+  int dirty_count = pixel_count;
+  const bool *dirty = NULL;
+  if(NULL == state->scene || needs_full_render(state->scene, scene)) {
+    if(!prepare_full_render(state, object_count)) {
+      fprintf(stderr, "Error: %s\n", last_error_message());
+      destroy_render_scene(scene);
+      return;
+    }
+  } else {
+    for(int i = 0; i < object_count; i++) {
+      state->geometry_changed[i] = !object_geometry_equals(state->scene->objects[i], scene->objects[i]);
+      state->material_changed[i] = !object_material_equals(state->scene->objects[i], scene->objects[i]);
+    }
+    dirty_count = find_dirty_pixels(&job, state->touches, state->material_changed, state->geometry_changed,
+				    state->dirty);
+    dirty = state->dirty;
+  }
+  if(dirty_count < 0) {
+    fprintf(stderr, "Error: %s\n", last_error_message());
+    destroy_render_scene(scene);
+    return;
+  }
+
+  raycast_dirty(&job, state->pool, state->pixel_buf, state->touches, dirty);
+  destroy_render_scene(state->scene);
+  state->scene = scene;
+  if(!error_occurred()) {
+    ppm_write(req->output_path, '3', state->byte_buf, req->width, req->height);
+  }
+  if(error_occurred()) {
+    fprintf(stderr, "Error: %s\n", last_error_message());
+    return;
+  }
+  fprintf(stderr, "NOTICE: Re-traced %d of %d pixels (%.1f%%) in %.3f ms\n", dirty_count, pixel_count,
+	  100.0 * dirty_count / pixel_count, elapsed_ms(&start));
+}
+
+
+/* The mesh files the scene names are watched before it is built, so that one which is missing or
+ * broken is picked up again once fixed. */
+static RenderSceneRef load_scene(WatchStateRef state) {
+  Scene scene = parse_scene_from_file(state->req->scene_path);
+  if(NULL == scene) return NULL;
+  int mesh_count = 0;
+  const char **mesh_files = scene_mesh_files(scene, &mesh_count);
+  bool ok = NULL != mesh_files;
+  for(int m = 0; ok && m < mesh_count; m++) {
+    ok = watch_file(state, mesh_files[m]);
+  }
+  free(mesh_files);
+  RenderSceneRef render_scene = ok ? new_render_scene(scene) : NULL;
+  destroy_scene(scene);
+  return render_scene;
+}
+
+
+/* Object ids are only comparable while the same kinds of object appear in the same order. */
+static bool needs_full_render(RenderSceneRef before, RenderSceneRef after) {
+  if(!camera_equals(before->camera, after->camera)) return true;
+
+  int object_count = count_objects(after->objects);
+  if(count_objects(before->objects) != object_count) return true;
+  for(int i = 0; i < object_count; i++) {
+    if(before->objects[i]->kind != after->objects[i]->kind) return true;
+  }
+
+  int l = 0;
+  for(; NULL != before->lights[l] && NULL != after->lights[l]; l++) {
+    if(!light_equals(before->lights[l], after->lights[l])) return true;
+  }
+  return before->lights[l] != after->lights[l];
+}
+
+
+static int count_objects(ObjectRef *objects) {
+  int count = 0;
+  while(NULL != objects[count]) count++;
+  return count;
+}
+
+
+/* Sizes the per-object buffers for the new scene when its object count differs. */
+static bool prepare_full_render(WatchStateRef state, int object_count) {
+  if(NULL != state->touches && (NULL == state->scene || count_objects(state->scene->objects) == object_count)) {
+    return true;
+  }
+  destroy_touch_buffer(state->touches);
+  free(state->material_changed);
+  free(state->geometry_changed);
+  state->touches = new_touch_buffer(state->req->width, state->req->height, object_count);
+  state->material_changed = checked_malloc(sizeof(*(state->material_changed)) * (object_count + 1));
+  state->geometry_changed = checked_malloc(sizeof(*(state->geometry_changed)) * (object_count + 1));
+  return NULL != state->touches && NULL != state->material_changed && NULL != state->geometry_changed;
+}
@@ -0,0 +1,21 @@
+#ifndef WATCH_HEADER
+#define WATCH_HEADER 1
+
+/* Renders the scene, then stays resident and renders it again each time the scene file, or a mesh
+ * file it names, is written or replaced. Each new version is compared with the last one that rendered: edits to the camera or
+ * the lights, or objects being added or removed, mean a full render; edits to individual objects
+ * re-trace only the pixels that those objects can reach. A scene that fails to load is reported and
+ * the previous output is kept. */
+struct WatchRequest {
+  char *scene_path;
+  char *output_path;
+  int width;
+  int height;
+  int thread_count;
+};
+
+typedef struct WatchRequest WatchRequest;
+
+int run_watch(WatchRequest*);
+
+#endif
@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "workpool.h"
+#include "util.h"
+
+/* A fixed set of threads kept warm between runs. A run hands out task numbers 0..task_count-1 one
+ * at a time; the thread calling work_pool_run() takes tasks too, so a pool of size 1 has no
+ * background threads at all. */
+struct WorkPool {
+  int size;
+  pthread_t *threads;
+  pthread_mutex_t lock;
+  pthread_cond_t work_ready;
+  pthread_cond_t work_done;
+  unsigned long generation;
+  bool shutting_down;
+  WorkFn fn;
+  void *arg;
+  int task_count;
+  int next_task;
+  int busy_threads;
+};
+
+typedef struct WorkPool WorkPool;
+
+static void* worker_main(void*);
+static void take_tasks(WorkPoolRef);
+
+/* A size of 0 or less picks one thread per online processor. Returns NULL if the threads cannot be
+ * started. */
+WorkPoolRef new_work_pool(int size) {
+  if(size <= 0) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    size = online > 0 ? (int) online : 1;
+  }
+
+  WorkPoolRef pool = checked_malloc(sizeof(*pool));
+  if(NULL == pool) return NULL;
+  WorkPool zero_pool = {0};
+  *pool = zero_pool;
+  pool->size = 1;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work_ready, NULL);
+  pthread_cond_init(&pool->work_done, NULL);
+  pool->threads = checked_malloc(size * sizeof(*(pool->threads)));
+  if(NULL == pool->threads) {
+    destroy_work_pool(pool);
+    return NULL;
+  }
+  // size counts the threads started so far, plus the caller, so a failure can be unwound
+  for(int i = 0; i < size - 1; i++, pool->size++) {
+    if(0 != pthread_create(&pool->threads[i], NULL, worker_main, pool)) {
+      set_error(RC_ERR_INTERNAL, "Could not start a render thread");
+      destroy_work_pool(pool);
+      return NULL;
+    }
+  }
+  return pool;
+}
+
+
+int work_pool_size(WorkPoolRef pool) {
+  return NULL == pool ? 1 : pool->size;
+}
+
+
+/* Runs fn(arg, task) for every task in 0..task_count-1 and returns once all of them are done. A
+ * NULL pool runs the tasks in order on the calling thread. */
+void work_pool_run(WorkPoolRef pool, WorkFn fn, void *arg, int task_count) {
+  if(NULL == pool || pool->size == 1) {
+    for(int task = 0; task < task_count; task++) {
+      fn(arg, task);
+    }
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->fn = fn;
+  pool->arg = arg;
+  pool->task_count = task_count;
+  pool->next_task = 0;
+  pool->busy_threads = pool->size - 1;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->work_ready);
+  pthread_mutex_unlock(&pool->lock);
+
+  take_tasks(pool);
+
+  pthread_mutex_lock(&pool->lock);
+  while(pool->busy_threads > 0) {
+    pthread_cond_wait(&pool->work_done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+
+void destroy_work_pool(WorkPoolRef pool) {
+  if(NULL == pool) return;
+  pthread_mutex_lock(&pool->lock);
+  pool->shutting_down = true;
+  pthread_cond_broadcast(&pool->work_ready);
+  pthread_mutex_unlock(&pool->lock);
+  for(int i = 0; i < pool->size - 1; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->work_ready);
+  pthread_cond_destroy(&pool->work_done);
+  free(pool->threads);
+  free(pool);
+}
+
+
+static void* worker_main(void *arg) {
+  WorkPoolRef pool = arg;
+  unsigned long seen_generation = 0;
+  for(;;) {
+    pthread_mutex_lock(&pool->lock);
+    while(!pool->shutting_down && seen_generation == pool->generation) {
+      pthread_cond_wait(&pool->work_ready, &pool->lock);
+    }
+    if(pool->shutting_down) {
+      pthread_mutex_unlock(&pool->lock);
+      return NULL;
+    }
+    seen_generation = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+
+    take_tasks(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->busy_threads--;
+    if(0 == pool->busy_threads) {
+      pthread_cond_signal(&pool->work_done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+
+static void take_tasks(WorkPoolRef pool) {
+  for(;;) {
+    pthread_mutex_lock(&pool->lock);
+    int task = pool->next_task < pool->task_count ? pool->next_task++ : -1;
+    WorkFn fn = pool->fn;
+    void *arg = pool->arg;
+    pthread_mutex_unlock(&pool->lock);
+    if(task < 0) return;
+    fn(arg, task);
+  }
+}
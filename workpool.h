@@ -0,0 +1,12 @@
+#ifndef WORKPOOL_HEADER
+#define WORKPOOL_HEADER 1
+
+typedef struct WorkPool* WorkPoolRef;
+typedef void (*WorkFn)(void*, int);
+
+WorkPoolRef new_work_pool(int);
+int work_pool_size(WorkPoolRef);
+void work_pool_run(WorkPoolRef, WorkFn, void*, int);
+void destroy_work_pool(WorkPoolRef);
+
+#endif